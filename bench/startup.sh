@@ -0,0 +1,40 @@
+#!/bin/sh
+# Startup regression check: run `byteshell --startup-profile -c true` RUNS
+# times and fail if the median total is over BUDGET microseconds. The median
+# keeps one slow run (a cold page cache, a busy machine) from failing it.
+#
+#   bench/startup.sh [BUDGET_US] [RUNS] [BYTESHELL]
+#
+# BYTESHELL defaults to ./byteshell, built with `gcc -o byteshell byteshell.c`.
+
+budget=${1:-2000}
+runs=${2:-21}
+shell=${3:-./byteshell}
+
+case $budget$runs in
+    *[!0-9]*|'') echo "usage: $0 [BUDGET_US] [RUNS] [BYTESHELL]" >&2; exit 2 ;;
+esac
+if [ ! -x "$shell" ]; then
+    echo "$0: $shell: not found; build it with gcc -o byteshell byteshell.c" >&2
+    exit 2
+fi
+
+# One run first so the compiled-script cache and the PATH index exist
+"$shell" --startup-profile -c true 2>/dev/null
+
+totals=$(
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        "$shell" --startup-profile -c true 2>&1 >/dev/null | awk '$1 == "total" { print $2 }'
+        i=$((i + 1))
+    done | sort -n
+)
+median=$(printf '%s\n' "$totals" | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }')
+min=$(printf '%s\n' "$totals" | head -n 1)
+max=$(printf '%s\n' "$totals" | tail -n 1)
+
+echo "startup over $runs runs: median $median us, min $min us, max $max us, budget $budget us"
+if [ "$median" -gt "$budget" ]; then
+    echo "startup got slower: median $median us is over the budget of $budget us" >&2
+    exit 1
+fi
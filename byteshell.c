@@ -1,17 +1,47 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <signal.h>
 #include <pwd.h>
 #include <termios.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <elf.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define SHELL_MAX_INPUT 1024
 #define MAX_ARGS 64
 #define MAX_HISTORY 100
 #define BYTESHELL_VERSION "1.0"
+#define PATTERN_CACHE_SIZE 256
+#define PATTERN_CACHE_MAX 1024
+#define ARENA_BLOCK_SIZE 8192
+#define ARITH_STACK_MAX 128
+#define MAX_FUNC_DEPTH 1000
+#define SAVED_FD_BASE 10
+#define CACHE_MAGIC 0x31435342u  // "BSC1"
+#define ALIAS_DEPTH_MAX 16
 
 // Color codes
 #define COLOR_RESET "\033[0m"
@@ -29,15 +59,75 @@ char* get_from_history(int offset);
 char* read_input_with_history(void);
 void sigint_handler(int sig);
 void cleanup_history(void);
+void startup_mark(const char *phase);
+void prefetch_typed(const char *line);
+void prefetch_forget(void);
+void zdb_visit(const char *dir);
+const char* dir_cwd_hold(void);
+
+// Word expansion declarations
+typedef struct strbuf strbuf_t;
+typedef struct pattern pattern_t;
+void sb_append(strbuf_t *sb, const char *s, size_t n);
+void sb_putc(strbuf_t *sb, char c);
+pattern_t* pattern_get(const char *src, size_t n);
+int pattern_match(const pattern_t *pat, const char *s, size_t n);
+
+// Parser, compiler and VM declarations
+typedef struct chunk chunk_t;
+typedef struct node node_t;
+chunk_t* compile_text(const char *text, size_t len, const char *name, int *incomplete);
+void chunk_unref(chunk_t *ch);
+int vm_exec(chunk_t *ch, uint32_t pc);
+int run_text(const char *text, size_t len, const char *name);
+int run_file(const char *path);
+chunk_t* compile_file(const char *path, int *status);
+void run_program(chunk_t *ch, int status);
+void state_note_input(const char *path, const struct stat *st);
+void state_note_env(const char *name);
+void path_index_rebuild(const char *path, const char *file, int force);
+void path_index_poll(void);
+void path_watch_close(void);
+int execute_command(char **args, int tail);
+char* var_getenv(const char *name);
 
 // Built-in command function declarations
 int byteshell_cd(char **args);
 int byteshell_exit(char **args);
+int byteshell_exec(char **args);
 int byteshell_help(char **args);
 int byteshell_clear(char **args);
 int byteshell_pwd(char **args);
 int byteshell_echo(char **args);
 int byteshell_history(char **args);
+int byteshell_true(char **args);
+int byteshell_false(char **args);
+int byteshell_test(char **args);
+int byteshell_export(char **args);
+int byteshell_unset(char **args);
+int byteshell_set(char **args);
+int byteshell_shift(char **args);
+int byteshell_local(char **args);
+int byteshell_declare(char **args);
+int byteshell_return(char **args);
+int byteshell_break(char **args);
+int byteshell_continue(char **args);
+int byteshell_eval(char **args);
+int byteshell_source(char **args);
+int byteshell_wait(char **args);
+int byteshell_autoload(char **args);
+int byteshell_alias(char **args);
+int byteshell_unalias(char **args);
+int byteshell_read(char **args);
+int byteshell_mapfile(char **args);
+int byteshell_cat(char **args);
+int byteshell_wc(char **args);
+int byteshell_grep(char **args);
+int byteshell_sort(char **args);
+int byteshell_pushd(char **args);
+int byteshell_popd(char **args);
+int byteshell_dirs(char **args);
+int byteshell_z(char **args);
 
 // Built-in commands structure
 typedef struct {
@@ -48,6 +138,18 @@ typedef struct {
 
 // Terminal settings
 struct termios orig_termios;
+int have_termios = 0;
+int raw_mode = 0;
+
+// Startup profile (--startup-profile): time spent in each phase before the
+// first command runs, and an optional budget for the total
+#define STARTUP_PHASES_MAX 16
+int startup_profile = 0;
+long startup_budget = 0;
+struct timespec startup_t0;
+const char *startup_phase[STARTUP_PHASES_MAX];
+long startup_us[STARTUP_PHASES_MAX];
+int startup_phases = 0;
 
 // History storage
 char *history[MAX_HISTORY];
@@ -63,16 +165,76 @@ builtin_t builtins[] = {
     {"cd", byteshell_cd, "Change directory"},
     {"exit", byteshell_exit, "Exit ByteShell"},
     {"quit", byteshell_exit, "Exit ByteShell"},
+    {"exec", byteshell_exec, "Replace the shell with a command"},
     {"help", byteshell_help, "Show this help message"},
     {"clear", byteshell_clear, "Clear the screen"},
     {"pwd", byteshell_pwd, "Print working directory"},
     {"echo", byteshell_echo, "Print arguments"},
     {"history", byteshell_history, "Show command history"},
+    {":", byteshell_true, "Do nothing, successfully"},
+    {"true", byteshell_true, "Return success"},
+    {"false", byteshell_false, "Return failure"},
+    {"test", byteshell_test, "Evaluate a conditional expression"},
+    {"[", byteshell_test, "Evaluate a conditional expression"},
+    {"export", byteshell_export, "Export variables to commands"},
+    {"unset", byteshell_unset, "Remove variables or functions"},
+    {"set", byteshell_set, "Set options and positional parameters"},
+    {"shift", byteshell_shift, "Shift positional parameters"},
+    {"local", byteshell_local, "Declare function-local variables"},
+    {"declare", byteshell_declare, "Declare variables and their attributes"},
+    {"typeset", byteshell_declare, "Declare variables and their attributes"},
+    {"return", byteshell_return, "Return from a function"},
+    {"break", byteshell_break, "Leave a loop"},
+    {"continue", byteshell_continue, "Start the next loop iteration"},
+    {"eval", byteshell_eval, "Run arguments as a command"},
+    {"source", byteshell_source, "Run commands from a file"},
+    {".", byteshell_source, "Run commands from a file"},
+    {"wait", byteshell_wait, "Wait for background commands"},
+    {"autoload", byteshell_autoload, "Load functions from FPATH on first use"},
+    {"alias", byteshell_alias, "Define or list aliases"},
+    {"unalias", byteshell_unalias, "Remove aliases"},
+    {"read", byteshell_read, "Read a line into variables"},
+    {"mapfile", byteshell_mapfile, "Read lines into an array"},
+    {"readarray", byteshell_mapfile, "Read lines into an array"},
+    {"cat", byteshell_cat, "Copy files to standard output"},
+    {"wc", byteshell_wc, "Count lines, words and bytes"},
+    {"grep", byteshell_grep, "Print lines that match patterns"},
+    {"sort", byteshell_sort, "Sort lines of text"},
+    {"pushd", byteshell_pushd, "Change directory, saving the current one on a stack"},
+    {"popd", byteshell_popd, "Return to the directory on top of the stack"},
+    {"dirs", byteshell_dirs, "List the directory stack"},
+    {"z", byteshell_z, "Jump to a frequently and recently used directory"},
     {NULL, NULL, NULL}
 };
 
+#define BUILTIN_COUNT ((int)(sizeof(builtins) / sizeof(builtins[0]) - 1))
+
+// Functions defined with a builtin's name take precedence over it
+unsigned char builtin_shadowed[BUILTIN_COUNT];
+
+// Shell state
+int interactive = 0;
+int last_status = 0;
+pid_t last_bg_pid = 0;
+char *shell_name = "byteshell";
+volatile sig_atomic_t interrupted = 0;
+
+// Option flags for set -e/-f/-u/-x and -o pipefail/prefetch
+int opt_errexit = 0;
+int opt_noglob = 0;
+int opt_nounset = 0;
+int opt_xtrace = 0;
+int opt_pipefail = 0;
+int opt_prefetch = 0;
+
+// Background jobs waiting to be reaped
+pid_t *jobs = NULL;
+int job_count = 0;
+int job_cap = 0;
 // Restore terminal settings
 void restore_terminal() {
+    if (!have_termios || !raw_mode) return;
+    raw_mode = 0;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
 }
 
@@ -80,8 +242,12 @@ void restore_terminal() {
 void enable_raw_mode() {
     struct termios raw;
     
-    tcgetattr(STDIN_FILENO, &orig_termios);
-    atexit(restore_terminal);
+    if (raw_mode) return;
+    if (!have_termios) {
+        if (tcgetattr(STDIN_FILENO, &orig_termios) != 0) return;
+        have_termios = 1;
+        atexit(restore_terminal);
+    }
     
     raw = orig_termios;
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
@@ -89,6 +255,37 @@ void enable_raw_mode() {
     raw.c_cc[VTIME] = 0;
     
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    raw_mode = 1;
+}
+
+// Record that a startup phase has finished
+void startup_mark(const char *phase) {
+    struct timespec now;
+    if (!startup_profile || startup_phases == STARTUP_PHASES_MAX) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup_phase[startup_phases] = phase;
+    startup_us[startup_phases++] = (now.tv_sec - startup_t0.tv_sec) * 1000000L +
+                                   (now.tv_nsec - startup_t0.tv_nsec) / 1000;
+}
+
+// Print the startup phases; returns non-zero when the total is over budget
+int startup_report(void) {
+    long prev = 0, total;
+    if (!startup_profile) return 0;
+    startup_profile = 0;
+    fprintf(stderr, "ByteShell startup profile (us):\n");
+    for (int i = 0; i < startup_phases; i++) {
+        fprintf(stderr, "  %-12s %8ld\n", startup_phase[i], startup_us[i] - prev);
+        prev = startup_us[i];
+    }
+    total = startup_phases ? startup_us[startup_phases - 1] : 0;
+    fprintf(stderr, "  %-12s %8ld\n", "total", total);
+    if (startup_budget > 0 && total > startup_budget) {
+        fprintf(stderr, "ByteShell: startup took %ld us, over the budget of %ld us\n",
+                total, startup_budget);
+        return 1;
+    }
+    return 0;
 }
 
 // Clear current line
@@ -99,15 +296,15 @@ void clear_line() {
 
 // Print prompt
 void print_prompt() {
-    char cwd[SHELL_MAX_INPUT];
+    const char *cwd = dir_cwd_hold();
+    if (!cwd) cwd = "?";
     char *username;
-    
-    getcwd(cwd, sizeof(cwd));
-    username = getenv("USER");
+
+    username = var_getenv("USER");
     if (!username) username = "user";
     
-    char *home = getenv("HOME");
-    if (home && strncmp(cwd, home, strlen(home)) == 0) {
+    char *home = var_getenv("HOME");
+    if (home && *home && strncmp(cwd, home, strlen(home)) == 0) {
         printf("%s%s%s:%s~%s%s $ ", 
                COLOR_USER, username, COLOR_RESET,
                COLOR_PATH, cwd + strlen(home), COLOR_RESET);
@@ -162,22 +359,20 @@ void redraw_line(char *buffer, int pos) {
     fflush(stdout);
 }
 
-// Signal handler
+// Signal handler: input runs in raw mode, so this only fires while
+// commands execute; loops poll the flag and unwind to the prompt
 void sigint_handler(int sig) {
-    printf("\n");
-    print_prompt();
-    fflush(stdout);
-    input_pos = 0;
-    current_input[0] = '\0';
+    interrupted = 1;
 }
 
 // Read input with arrow key support
 char* read_input_with_history() {
     static char buffer[SHELL_MAX_INPUT];  // Make static so we can return it
-    char c;
+    int c;
     int pos = 0;
     
     buffer[0] = '\0';
+    enable_raw_mode();
     
     while (1) {
         c = getchar();
@@ -198,7 +393,7 @@ char* read_input_with_history() {
                 fflush(stdout);
             }
         }
-        else if (c == 4) {
+        else if (c == 4 || c == EOF) {
             // Ctrl+D
             return NULL;
         }
@@ -244,191 +439,12270 @@ char* read_input_with_history() {
             buffer[pos++] = c;
             printf("%c", c);
             fflush(stdout);
+            // The command name is complete: start reading it in
+            if (c == ' ' && !memchr(buffer, ' ', pos - 1)) {
+                buffer[pos] = '\0';
+                prefetch_typed(buffer);
+            }
         }
     }
 }
 
-// Parse command
-int parse_command(char *line, char **args) {
-    int i = 0;
-    char *token = strtok(line, " ");
-    
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i] = token;
-        i++;
-        token = strtok(NULL, " ");
+// Growable string buffer used by word expansion
+struct strbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Make room for at least need more bytes
+void sb_reserve(strbuf_t *sb, size_t need) {
+    if (sb->len + need + 1 <= sb->cap) return;
+    size_t cap = sb->cap ? sb->cap * 2 : 64;
+    while (cap < sb->len + need + 1) cap *= 2;
+    sb->data = realloc(sb->data, cap);
+    if (!sb->data) {
+        perror("realloc");
+        exit(1);
     }
-    args[i] = NULL;
-    return i;
+    sb->cap = cap;
 }
 
-// Check if built-in
-int is_builtin(char *cmd) {
-    for (int i = 0; builtins[i].name != NULL; i++) {
-        if (strcmp(cmd, builtins[i].name) == 0) {
-            return 1;
-        }
+void sb_append(strbuf_t *sb, const char *s, size_t n) {
+    sb_reserve(sb, n);
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_putc(strbuf_t *sb, char c) {
+    sb_reserve(sb, 1);
+    sb->data[sb->len++] = c;
+    sb->data[sb->len] = '\0';
+}
+
+// Glob pattern compiled once and cached by its source text
+enum { PAT_LIT, PAT_ANY, PAT_STAR, PAT_CLASS };
+
+typedef struct {
+    unsigned char type;
+    uint32_t off;   // literal offset or class index
+    uint32_t len;   // literal length
+} pat_op_t;
+
+struct pattern {
+    char *src;
+    size_t srclen;
+    pat_op_t *ops;
+    int nops;
+    char *lits;
+    unsigned char (*classes)[32];
+    int nclasses;
+    size_t minlen;      // shortest string the pattern can match
+    int has_star;       // 0 means every match is exactly minlen bytes
+    int literal;        // no wildcards at all, lits holds the whole pattern
+    struct pattern *next;
+};
+
+// Expansion modes: plain text, or pattern text where quoted characters stay literal
+enum { EXP_PLAIN, EXP_PATTERN };
+
+// Error flag set by ${v:?msg}; the command is skipped when set
+int expand_error = 0;
+
+pattern_t *pattern_cache[PATTERN_CACHE_SIZE];
+int pattern_cache_count = 0;
+
+#define CLASS_HAS(cls, c) ((cls)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+// FNV-1a hash over a byte range
+uint32_t hash_bytes(const char *s, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
     }
+    return h;
+}
+
+// Match a POSIX character class name like "alpha" against c
+int posix_class_has(const char *name, size_t n, int c) {
+    if (n == 5 && strncmp(name, "alpha", 5) == 0) return isalpha(c);
+    if (n == 5 && strncmp(name, "digit", 5) == 0) return isdigit(c);
+    if (n == 5 && strncmp(name, "alnum", 5) == 0) return isalnum(c);
+    if (n == 5 && strncmp(name, "upper", 5) == 0) return isupper(c);
+    if (n == 5 && strncmp(name, "lower", 5) == 0) return islower(c);
+    if (n == 5 && strncmp(name, "space", 5) == 0) return isspace(c);
+    if (n == 5 && strncmp(name, "blank", 5) == 0) return c == ' ' || c == '\t';
+    if (n == 5 && strncmp(name, "punct", 5) == 0) return ispunct(c);
+    if (n == 5 && strncmp(name, "print", 5) == 0) return isprint(c);
+    if (n == 5 && strncmp(name, "graph", 5) == 0) return isgraph(c);
+    if (n == 5 && strncmp(name, "cntrl", 5) == 0) return iscntrl(c);
+    if (n == 6 && strncmp(name, "xdigit", 6) == 0) return isxdigit(c);
     return 0;
 }
 
-// Execute built-in
-int exec_builtin(char **args) {
-    for (int i = 0; builtins[i].name != NULL; i++) {
-        if (strcmp(args[0], builtins[i].name) == 0) {
-            return builtins[i].func(args);
+// Parse a bracket expression starting after '['; returns end or NULL if unterminated
+const char* pattern_parse_class(const char *p, const char *end, unsigned char *cls) {
+    int negate = 0;
+    memset(cls, 0, 32);
+    if (p < end && (*p == '!' || *p == '^')) {
+        negate = 1;
+        p++;
+    }
+    int first = 1;
+    while (p < end && (*p != ']' || first)) {
+        first = 0;
+        if (*p == '[' && p + 1 < end && p[1] == ':') {
+            const char *name = p + 2;
+            const char *close = name;
+            while (close + 1 < end && !(close[0] == ':' && close[1] == ']')) close++;
+            if (close + 1 < end) {
+                for (int c = 0; c < 256; c++) {
+                    if (posix_class_has(name, close - name, c)) cls[c >> 3] |= 1 << (c & 7);
+                }
+                p = close + 2;
+                continue;
+            }
         }
+        unsigned char lo = *p;
+        if (*p == '\\' && p + 1 < end) lo = *++p;
+        p++;
+        unsigned char hi = lo;
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            p++;
+            hi = *p;
+            if (*p == '\\' && p + 1 < end) hi = *++p;
+            p++;
+        }
+        for (int c = lo; c <= hi; c++) cls[c >> 3] |= 1 << (c & 7);
     }
-    return -1;
+    if (p >= end) return NULL;
+    if (negate) {
+        for (int i = 0; i < 32; i++) cls[i] = ~cls[i];
+    }
+    return p + 1;
 }
 
-// Built-in: cd
-int byteshell_cd(char **args) {
-    if (args[1] == NULL) {
-        chdir(getenv("HOME"));
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("cd");
+// Append a literal byte, merging it into the previous literal run
+void pattern_add_lit(pattern_t *pat, strbuf_t *lits, char c) {
+    pat_op_t *last = pat->nops ? &pat->ops[pat->nops - 1] : NULL;
+    if (!last || last->type != PAT_LIT) {
+        last = &pat->ops[pat->nops++];
+        last->type = PAT_LIT;
+        last->off = lits->len;
+        last->len = 0;
+    }
+    sb_putc(lits, c);
+    last->len++;
+    pat->minlen++;
+}
+
+// Compile glob source text into an op list
+pattern_t* pattern_compile(const char *src, size_t n) {
+    pattern_t *pat = calloc(1, sizeof(pattern_t));
+    strbuf_t lits = {0};
+    const char *p = src, *end = src + n;
+
+    pat->src = malloc(n + 1);
+    memcpy(pat->src, src, n);
+    pat->src[n] = '\0';
+    pat->srclen = n;
+    pat->ops = malloc((n + 1) * sizeof(pat_op_t));
+    pat->literal = 1;
+
+    while (p < end) {
+        if (*p == '*') {
+            while (p < end && *p == '*') p++;
+            pat->ops[pat->nops++].type = PAT_STAR;
+            pat->has_star = 1;
+            pat->literal = 0;
+        } else if (*p == '?') {
+            pat->ops[pat->nops++].type = PAT_ANY;
+            pat->minlen++;
+            pat->literal = 0;
+            p++;
+        } else if (*p == '[') {
+            unsigned char cls[32];
+            const char *next = pattern_parse_class(p + 1, end, cls);
+            if (!next) {
+                pattern_add_lit(pat, &lits, *p++);
+                continue;
+            }
+            pat->classes = realloc(pat->classes, (pat->nclasses + 1) * 32);
+            memcpy(pat->classes[pat->nclasses], cls, 32);
+            pat->ops[pat->nops].type = PAT_CLASS;
+            pat->ops[pat->nops++].off = pat->nclasses++;
+            pat->minlen++;
+            pat->literal = 0;
+            p = next;
+        } else {
+            if (*p == '\\' && p + 1 < end) p++;
+            pattern_add_lit(pat, &lits, *p++);
         }
     }
-    return 1;
+    pat->lits = lits.data ? lits.data : strdup("");
+    return pat;
 }
 
-// Built-in: exit
-int byteshell_exit(char **args) {
-    printf("Goodbye from ByteShell!\n");
-    exit(0);
-    return 0;
+void pattern_free(pattern_t *pat) {
+    free(pat->src);
+    free(pat->ops);
+    free(pat->lits);
+    free(pat->classes);
+    free(pat);
 }
 
-// Built-in: help
-int byteshell_help(char **args) {
-    printf("\nByteShell v%s - Commands:\n", BYTESHELL_VERSION);
-    printf("===========================\n");
-    for (int i = 0; builtins[i].name != NULL; i++) {
-        printf("  %-8s - %s\n", builtins[i].name, builtins[i].help);
+// Look up a compiled pattern, compiling it on first use
+pattern_t* pattern_get(const char *src, size_t n) {
+    uint32_t h = hash_bytes(src, n) % PATTERN_CACHE_SIZE;
+
+    for (pattern_t *pat = pattern_cache[h]; pat; pat = pat->next) {
+        if (pat->srclen == n && memcmp(pat->src, src, n) == 0) return pat;
     }
-    printf("  Ctrl+C: Cancel current line\n");
-    printf("  Ctrl+D: Exit ByteShell\n\n");
-    return 1;
+    if (pattern_cache_count >= PATTERN_CACHE_MAX) {
+        // Flush everything rather than tracking recency
+        for (int i = 0; i < PATTERN_CACHE_SIZE; i++) {
+            while (pattern_cache[i]) {
+                pattern_t *next = pattern_cache[i]->next;
+                pattern_free(pattern_cache[i]);
+                pattern_cache[i] = next;
+            }
+        }
+        pattern_cache_count = 0;
+    }
+    pattern_t *pat = pattern_compile(src, n);
+    pat->next = pattern_cache[h];
+    pattern_cache[h] = pat;
+    pattern_cache_count++;
+    return pat;
 }
 
-// Built-in: clear
-int byteshell_clear(char **args) {
-    printf("\033[2J\033[H");
-    return 1;
+// Does the pattern match all of s[0..n)?
+int pattern_match(const pattern_t *pat, const char *s, size_t n) {
+    if (n < pat->minlen || (!pat->has_star && n != pat->minlen)) return 0;
+    if (pat->literal) return memcmp(s, pat->lits, n) == 0;
+
+    int oi = 0, star_oi = -1;
+    size_t si = 0, star_si = 0;
+    while (1) {
+        if (oi < pat->nops) {
+            const pat_op_t *op = &pat->ops[oi];
+            if (op->type == PAT_STAR) {
+                if (oi + 1 == pat->nops) return 1;
+                star_oi = ++oi;
+                star_si = si;
+                continue;
+            }
+            if (op->type == PAT_LIT) {
+                if (n - si >= op->len && memcmp(s + si, pat->lits + op->off, op->len) == 0) {
+                    si += op->len;
+                    oi++;
+                    continue;
+                }
+            } else if (si < n && (op->type == PAT_ANY || CLASS_HAS(pat->classes[op->off], s[si]))) {
+                si++;
+                oi++;
+                continue;
+            }
+        } else if (si == n) {
+            return 1;
+        }
+        // Mismatch: let the most recent star absorb one more byte
+        if (star_oi < 0 || star_si >= n) return 0;
+        star_si++;
+        const pat_op_t *next = &pat->ops[star_oi];
+        if (next->type == PAT_LIT) {
+            const char *hit = memchr(s + star_si, pat->lits[next->off], n - star_si);
+            if (!hit) return 0;
+            star_si = hit - s;
+        }
+        si = star_si;
+        oi = star_oi;
+    }
 }
 
-// Built-in: pwd
-int byteshell_pwd(char **args) {
-    char cwd[SHELL_MAX_INPUT];
-    getcwd(cwd, sizeof(cwd));
-    printf("%s\n", cwd);
-    return 1;
+// Longest match anchored at s, or -1; only lengths >= min are considered
+long pattern_longest(const pattern_t *pat, const char *s, size_t n, size_t min) {
+    if (!pat->has_star) {
+        if (pat->minlen > n || pat->minlen < min) return -1;
+        return pattern_match(pat, s, pat->minlen) ? (long)pat->minlen : -1;
+    }
+    if (min < pat->minlen) min = pat->minlen;
+    for (size_t len = n + 1; len-- > min;) {
+        if (pattern_match(pat, s, len)) return len;
+    }
+    return -1;
 }
 
-// Built-in: echo
-int byteshell_echo(char **args) {
-    for (int i = 1; args[i] != NULL; i++) {
-        printf("%s ", args[i]);
+
+// Could glob text match anything but itself? A lone '[' with no ']' cannot
+int pattern_has_wildcard(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '\\') i++;
+        else if (s[i] == '*' || s[i] == '?') return 1;
+        else if (s[i] == '[' && memchr(s + i + 1, ']', n - i - 1)) return 1;
     }
-    printf("\n");
-    return 1;
+    return 0;
 }
 
-// Built-in: history
-int byteshell_history(char **args) {
-    printf("\nCommand History:\n");
-    printf("================\n");
-    for (int i = 0; i < history_count; i++) {
-        printf("%4d  %s\n", i + 1, history[i]);
+// Open-addressing map from strings to ints (variables, functions, builtins)
+typedef struct {
+    char **keys;
+    uint32_t *hashes;
+    int *vals;
+    size_t cap;
+    size_t used;    // live entries plus tombstones
+} strmap_t;
+
+#define STRMAP_TOMB ((char *)1)
+
+int strmap_find(const strmap_t *m, const char *key, size_t n, uint32_t h) {
+    if (!m->cap) return -1;
+    for (size_t i = h & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+        char *k = m->keys[i];
+        if (!k) return -1;
+        if (k != STRMAP_TOMB && m->hashes[i] == h && strncmp(k, key, n) == 0 && k[n] == '\0') {
+            return (int)i;
+        }
     }
-    printf("\n");
+}
+
+int strmap_get(const strmap_t *m, const char *key, size_t n) {
+    int i = strmap_find(m, key, n, hash_bytes(key, n));
+    return i < 0 ? -1 : m->vals[i];
+}
+
+void strmap_put(strmap_t *m, const char *key, size_t n, int val) {
+    uint32_t h = hash_bytes(key, n);
+    int found = strmap_find(m, key, n, h);
+    if (found >= 0) {
+        m->vals[found] = val;
+        return;
+    }
+    if ((m->used + 1) * 4 >= m->cap * 3) {
+        // Grow and drop tombstones
+        strmap_t grown = {0};
+        grown.cap = m->cap ? m->cap * 2 : 64;
+        grown.keys = calloc(grown.cap, sizeof(char *));
+        grown.hashes = malloc(grown.cap * sizeof(uint32_t));
+        grown.vals = malloc(grown.cap * sizeof(int));
+        for (size_t i = 0; i < m->cap; i++) {
+            if (!m->keys[i] || m->keys[i] == STRMAP_TOMB) continue;
+            size_t j = m->hashes[i] & (grown.cap - 1);
+            while (grown.keys[j]) j = (j + 1) & (grown.cap - 1);
+            grown.keys[j] = m->keys[i];
+            grown.hashes[j] = m->hashes[i];
+            grown.vals[j] = m->vals[i];
+            grown.used++;
+        }
+        free(m->keys);
+        free(m->hashes);
+        free(m->vals);
+        *m = grown;
+    }
+    size_t i = h & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != STRMAP_TOMB) i = (i + 1) & (m->cap - 1);
+    if (!m->keys[i]) m->used++;
+    m->keys[i] = malloc(n + 1);
+    memcpy(m->keys[i], key, n);
+    m->keys[i][n] = '\0';
+    m->hashes[i] = h;
+    m->vals[i] = val;
+}
+
+int strmap_del(strmap_t *m, const char *key, size_t n) {
+    int i = strmap_find(m, key, n, hash_bytes(key, n));
+    if (i < 0) return 0;
+    free(m->keys[i]);
+    m->keys[i] = STRMAP_TOMB;
     return 1;
 }
 
-// Execute external command
-int execute_command(char **args) {
-    pid_t pid = fork();
-    
-    if (pid == 0) {
-        execvp(args[0], args);
-        printf("ByteShell: command not found: %s\n", args[0]);
-        exit(1);
-    } else if (pid > 0) {
-        int status;
-        waitpid(pid, &status, 0);
-        return 1;
-    } else {
-        perror("fork");
-        return -1;
+void strmap_clear(strmap_t *m) {
+    for (size_t i = 0; i < m->cap; i++) {
+        if (m->keys[i] && m->keys[i] != STRMAP_TOMB) free(m->keys[i]);
     }
+    free(m->keys);
+    free(m->hashes);
+    free(m->vals);
+    memset(m, 0, sizeof(*m));
 }
 
-// Clean up history
-void cleanup_history() {
-    for (int i = 0; i < history_count; i++) {
-        free(history[i]);
+// Bump allocator with mark/release, used for the AST and for command arguments
+typedef struct arena_blk {
+    struct arena_blk *prev;
+    size_t used;
+    size_t cap;
+    char data[];
+} arena_blk_t;
+
+typedef struct {
+    arena_blk_t *top;
+    arena_blk_t *spare;
+} arena_t;
+
+typedef struct {
+    arena_blk_t *blk;
+    size_t used;
+} arena_mark_t;
+
+void* arena_alloc(arena_t *a, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    if (!a->top || a->top->used + n > a->top->cap) {
+        arena_blk_t *blk;
+        if (a->spare && n <= a->spare->cap) {
+            blk = a->spare;
+            a->spare = NULL;
+        } else {
+            size_t cap = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+            blk = malloc(sizeof(arena_blk_t) + cap);
+            if (!blk) {
+                perror("malloc");
+                exit(1);
+            }
+            blk->cap = cap;
+        }
+        blk->used = 0;
+        blk->prev = a->top;
+        a->top = blk;
     }
+    void *p = a->top->data + a->top->used;
+    a->top->used += n;
+    return p;
 }
 
-int main() {
-    char *input;
-    
-    // Set up signal handler
-    signal(SIGINT, sigint_handler);
-    
-    // Enable raw mode
-    enable_raw_mode();
-    
-    // Welcome message
-    printf("╔══════════════════════╗\n");
-    printf("║ByteShell v%s on Termux ║\n", BYTESHELL_VERSION);
-    printf("║                         ║\n");
-    printf("║                         ║\n");
-    printf("║                         ║\n");
-    printf("╚══════════════════════╝\n");
-    printf("Type 'help' for commands\n\n");
-    
-    // Main loop
-    while (1) {
-        print_prompt();
-        
-        // Read input with history navigation
-        input = read_input_with_history();
-        
-        if (!input) {  // Ctrl+D
-            printf("\n");
-            break;
+char* arena_strndup(arena_t *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+arena_mark_t arena_mark(arena_t *a) {
+    arena_mark_t m = {a->top, a->top ? a->top->used : 0};
+    return m;
+}
+
+// Drop everything allocated since the mark, keeping one block for reuse
+void arena_release(arena_t *a, arena_mark_t m) {
+    while (a->top != m.blk) {
+        arena_blk_t *prev = a->top->prev;
+        if (!a->spare || a->top->cap > a->spare->cap) {
+            free(a->spare);
+            a->spare = a->top;
+        } else {
+            free(a->top);
         }
-        
-        // Skip empty
-        if (strlen(input) == 0) {
+        a->top = prev;
+    }
+    if (a->top) a->top->used = m.used;
+}
+
+void arena_free(arena_t *a) {
+    arena_mark_t empty = {NULL, 0};
+    arena_release(a, empty);
+    free(a->spare);
+    a->spare = NULL;
+}
+// Find the first unquoted, unnested occurrence of c
+const char* find_unquoted(const char *p, const char *end, char c) {
+    int depth = 0, dq = 0;
+    while (p < end) {
+        if (*p == '\\' && p + 1 < end) {
+            p += 2;
             continue;
         }
-        
-        // Add to history
-        add_to_history(input);
-        
-        // Parse and execute
-        char *args[MAX_ARGS];
-        char *input_copy = strdup(input);  // Make a copy for parsing
-        int arg_count = parse_command(input_copy, args);
-        
-        if (arg_count > 0) {
-            if (is_builtin(args[0])) {
-                exec_builtin(args);
-            } else {
-                execute_command(args);
-            }
+        if (*p == '\'' && !dq) {
+            const char *q = memchr(p + 1, '\'', end - p - 1);
+            p = q ? q + 1 : end;
+            continue;
         }
-        
-        free(input_copy);
+        if (*p == '"') dq = !dq;
+        else if (*p == '{') depth++;
+        else if (*p == '}') depth--;
+        else if (*p == c && depth == 0 && !dq) return p;
+        p++;
+    }
+    return NULL;
+}
+
+// End of a [subscript] starting at s[i]; 0 if it is not closed
+size_t subscript_end(const char *s, size_t n, size_t i) {
+    int depth = 0;
+    for (; i < n; i++) {
+        if (s[i] == '\\') i++;
+        else if (s[i] == '[') depth++;
+        else if (s[i] == ']' && --depth == 0) return i + 1;
     }
-    
-    // Cleanup
-    restore_terminal();
-    cleanup_history();
-    
     return 0;
 }
+
+
+#define GROW(arr, n, cap) do { \
+    if ((n) >= (cap)) { \
+        (cap) = (cap) ? (cap) * 2 : 16; \
+        (arr) = realloc((arr), (cap) * sizeof(*(arr))); \
+    } \
+} while (0)
+
+// Indexed arrays: element strings are packed back to back in one buffer and
+// found through an offset table, so a million elements are two allocations
+#define ARRAY_HOLE ((size_t)-1)
+#define ARRAY_MAX_INDEX (1L << 31)
+
+typedef struct {
+    char *data;         // NUL-terminated element strings
+    size_t len;
+    size_t cap;
+    size_t *off;        // offset of each index in data, ARRAY_HOLE if unset
+    size_t count;       // highest index + 1
+    size_t off_cap;
+    size_t nset;        // number of set elements
+    size_t garbage;     // bytes held by overwritten values
+} array_t;
+
+array_t* array_new(void) {
+    return calloc(1, sizeof(array_t));
+}
+
+void array_free(array_t *a) {
+    if (!a) return;
+    free(a->data);
+    free(a->off);
+    free(a);
+}
+
+array_t* array_copy(const array_t *a) {
+    array_t *c = array_new();
+    *c = *a;
+    c->data = malloc(a->cap ? a->cap : 1);
+    memcpy(c->data, a->data, a->len);
+    c->off = malloc((a->off_cap ? a->off_cap : 1) * sizeof(size_t));
+    memcpy(c->off, a->off, a->count * sizeof(size_t));
+    return c;
+}
+
+const char* array_get(const array_t *a, long i, size_t *len) {
+    if (i < 0 || (size_t)i >= a->count || a->off[i] == ARRAY_HOLE) return NULL;
+    const char *v = a->data + a->off[i];
+    if (len) *len = strlen(v);
+    return v;
+}
+
+// Drop overwritten values once they make up half the buffer
+void array_compact(array_t *a) {
+    char *data = malloc(a->cap);
+    size_t len = 0;
+    for (size_t i = 0; i < a->count; i++) {
+        if (a->off[i] == ARRAY_HOLE) continue;
+        size_t n = strlen(a->data + a->off[i]) + 1;
+        memcpy(data + len, a->data + a->off[i], n);
+        a->off[i] = len;
+        len += n;
+    }
+    free(a->data);
+    a->data = data;
+    a->len = len;
+    a->garbage = 0;
+}
+
+void array_unset(array_t *a, long i) {
+    if (i < 0 || (size_t)i >= a->count || a->off[i] == ARRAY_HOLE) return;
+    a->garbage += strlen(a->data + a->off[i]) + 1;
+    a->off[i] = ARRAY_HOLE;
+    a->nset--;
+    while (a->count && a->off[a->count - 1] == ARRAY_HOLE) a->count--;
+}
+
+void array_set(array_t *a, long i, const char *s, size_t n) {
+    if ((size_t)i < a->count && a->off[i] != ARRAY_HOLE) {
+        size_t old = strlen(a->data + a->off[i]);
+        if (n <= old) {
+            // Shrinking in place keeps the buffer dense for counters and flags
+            memcpy(a->data + a->off[i], s, n);
+            a->data[a->off[i] + n] = '\0';
+            a->garbage += old - n;
+            return;
+        }
+        a->garbage += old + 1;
+        a->nset--;
+    }
+    if (a->garbage > 4096 && a->garbage > a->len / 2) array_compact(a);
+    if (a->len + n + 1 > a->cap) {
+        while (a->len + n + 1 > a->cap) a->cap = a->cap ? a->cap * 2 : 256;
+        a->data = realloc(a->data, a->cap);
+    }
+    if ((size_t)i >= a->off_cap) {
+        while ((size_t)i >= a->off_cap) a->off_cap = a->off_cap ? a->off_cap * 2 : 16;
+        a->off = realloc(a->off, a->off_cap * sizeof(size_t));
+    }
+    while (a->count <= (size_t)i) a->off[a->count++] = ARRAY_HOLE;
+    a->off[i] = a->len;
+    memcpy(a->data + a->len, s, n);
+    a->data[a->len + n] = '\0';
+    a->len += n + 1;
+    a->nset++;
+}
+
+void array_push(array_t *a, const char *s, size_t n) {
+    array_set(a, a->count, s, n);
+}
+
+// Associative arrays: a Swiss-style open-addressing table. Each slot has a
+// control byte holding 7 bits of its key's hash, so a probe compares a whole
+// group of 16 slots at once and only touches keys whose bits match. Slots hold
+// entry numbers; the keys and values themselves are packed into two indexed
+// arrays in insertion order, which is also the order of iteration
+#define ASSOC_GROUP 16
+#define ASSOC_EMPTY 0x80
+#define ASSOC_DELETED 0xfe
+
+typedef struct {
+    uint8_t *ctrl;      // cap + ASSOC_GROUP bytes; the tail mirrors the first group
+    uint32_t *slots;    // entry number of each full slot
+    size_t mask;        // cap - 1
+    size_t growth;      // empty slots left before the table must be rebuilt
+    uint32_t *hashes;   // hash of each entry's key
+    size_t hash_cap;
+    array_t *keys;      // by entry number; removed entries are holes
+    array_t *vals;
+} assoc_t;
+
+assoc_t* assoc_new(void) {
+    assoc_t *m = calloc(1, sizeof(assoc_t));
+    m->keys = array_new();
+    m->vals = array_new();
+    return m;
+}
+
+void assoc_free(assoc_t *m) {
+    if (!m) return;
+    free(m->ctrl);
+    free(m->slots);
+    free(m->hashes);
+    array_free(m->keys);
+    array_free(m->vals);
+    free(m);
+}
+
+assoc_t* assoc_copy(const assoc_t *m) {
+    assoc_t *c = calloc(1, sizeof(assoc_t));
+    *c = *m;
+    c->keys = array_copy(m->keys);
+    c->vals = array_copy(m->vals);
+    c->hashes = malloc((m->hash_cap ? m->hash_cap : 1) * sizeof(uint32_t));
+    memcpy(c->hashes, m->hashes, m->keys->count * sizeof(uint32_t));
+    if (m->ctrl) {
+        size_t cap = m->mask + 1;
+        c->ctrl = malloc(cap + ASSOC_GROUP);
+        memcpy(c->ctrl, m->ctrl, cap + ASSOC_GROUP);
+        c->slots = malloc(cap * sizeof(uint32_t));
+        memcpy(c->slots, m->slots, cap * sizeof(uint32_t));
+    }
+    return c;
+}
+
+// Bitmask of the slots in a group whose control byte is c
+unsigned assoc_match(const uint8_t *g, uint8_t c) {
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i *)g);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)c)));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < ASSOC_GROUP; i++) bits |= (unsigned)(g[i] == c) << i;
+    return bits;
+#endif
+}
+
+// Bitmask of the empty or deleted slots in a group: the ones with the top bit set
+unsigned assoc_free_slots(const uint8_t *g) {
+#ifdef __SSE2__
+    return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < ASSOC_GROUP; i++) bits |= (unsigned)(g[i] >> 7) << i;
+    return bits;
+#endif
+}
+
+void assoc_set_ctrl(assoc_t *m, size_t i, uint8_t c) {
+    m->ctrl[i] = c;
+    if (i < ASSOC_GROUP) m->ctrl[m->mask + 1 + i] = c;
+}
+
+// Slot holding key, or -1
+long assoc_find(const assoc_t *m, const char *key, size_t n, uint32_t h) {
+    if (!m->ctrl) return -1;
+    size_t pos = h & m->mask, step = 0;
+    while (1) {
+        const uint8_t *g = m->ctrl + pos;
+        for (unsigned bits = assoc_match(g, h >> 25); bits; bits &= bits - 1) {
+            size_t i = (pos + __builtin_ctz(bits)) & m->mask;
+            uint32_t e = m->slots[i];
+            const char *k = m->keys->data + m->keys->off[e];
+            if (m->hashes[e] == h && strncmp(k, key, n) == 0 && k[n] == '\0') return (long)i;
+        }
+        if (assoc_match(g, ASSOC_EMPTY)) return -1;
+        step += ASSOC_GROUP;
+        pos = (pos + step) & m->mask;
+    }
+}
+
+// First empty or deleted slot on h's probe sequence
+size_t assoc_free_slot(const assoc_t *m, uint32_t h) {
+    size_t pos = h & m->mask, step = 0;
+    unsigned bits;
+    while (!(bits = assoc_free_slots(m->ctrl + pos))) {
+        step += ASSOC_GROUP;
+        pos = (pos + step) & m->mask;
+    }
+    return (pos + __builtin_ctz(bits)) & m->mask;
+}
+
+// Rebuild the table with room to grow, dropping deleted slots and closing the
+// holes removed entries left in the key and value arrays
+void assoc_rehash(assoc_t *m) {
+    size_t live = m->keys->nset, cap = ASSOC_GROUP;
+    while (cap / 8 * 7 < live * 2 + 1) cap *= 2;
+    if (live < m->keys->count) {
+        array_t *keys = array_new(), *vals = array_new();
+        size_t k = 0;
+        for (size_t e = 0; e < m->keys->count; e++) {
+            if (m->keys->off[e] == ARRAY_HOLE) continue;
+            array_push(keys, m->keys->data + m->keys->off[e], strlen(m->keys->data + m->keys->off[e]));
+            array_push(vals, m->vals->data + m->vals->off[e], strlen(m->vals->data + m->vals->off[e]));
+            m->hashes[k++] = m->hashes[e];
+        }
+        array_free(m->keys);
+        array_free(m->vals);
+        m->keys = keys;
+        m->vals = vals;
+    }
+    free(m->ctrl);
+    free(m->slots);
+    m->ctrl = malloc(cap + ASSOC_GROUP);
+    memset(m->ctrl, ASSOC_EMPTY, cap + ASSOC_GROUP);
+    m->slots = malloc(cap * sizeof(uint32_t));
+    m->mask = cap - 1;
+    for (size_t e = 0; e < live; e++) {
+        size_t i = assoc_free_slot(m, m->hashes[e]);
+        assoc_set_ctrl(m, i, m->hashes[e] >> 25);
+        m->slots[i] = e;
+    }
+    m->growth = cap / 8 * 7 - live;
+}
+
+const char* assoc_get(const assoc_t *m, const char *key, size_t n, size_t *len) {
+    long i = assoc_find(m, key, n, hash_bytes(key, n));
+    return i < 0 ? NULL : array_get(m->vals, m->slots[i], len);
+}
+
+void assoc_set(assoc_t *m, const char *key, size_t n, const char *v, size_t vn) {
+    uint32_t h = hash_bytes(key, n);
+    long i = assoc_find(m, key, n, h);
+    if (i >= 0) {
+        array_set(m->vals, m->slots[i], v, vn);
+        return;
+    }
+    if (!m->growth) assoc_rehash(m);
+    i = assoc_free_slot(m, h);
+    if (m->ctrl[i] == ASSOC_EMPTY) m->growth--;
+    uint32_t e = m->keys->count;
+    assoc_set_ctrl(m, i, h >> 25);
+    m->slots[i] = e;
+    if (e >= m->hash_cap) {
+        m->hash_cap = m->hash_cap ? m->hash_cap * 2 : 16;
+        m->hashes = realloc(m->hashes, m->hash_cap * sizeof(uint32_t));
+    }
+    m->hashes[e] = h;
+    array_set(m->keys, e, key, n);
+    array_set(m->vals, e, v, vn);
+}
+
+int assoc_del(assoc_t *m, const char *key, size_t n) {
+    long i = assoc_find(m, key, n, hash_bytes(key, n));
+    if (i < 0) return 0;
+    uint32_t e = m->slots[i];
+    assoc_set_ctrl(m, i, ASSOC_DELETED);
+    array_unset(m->keys, e);
+    array_unset(m->vals, e);
+    return 1;
+}
+
+// Shell variables live in a slot table; compiled code refers to slots, not names
+#define VAR_EXPORT 1
+#define VAR_READONLY 2
+#define VAR_INTVALID 4
+
+typedef struct {
+    char *name;
+    char *value;      // NULL when unset
+    size_t len;
+    size_t cap;
+    long ival;        // cached integer for arithmetic when VAR_INTVALID
+    int flags;
+    unsigned gen;     // journal generation that last saved this variable
+    array_t *arr;     // indexed array; $name is element 0
+    assoc_t *map;     // associative array (declare -A); $name is key "0"
+} var_t;
+
+var_t *vars = NULL;
+int var_count = 0;
+int var_cap = 0;
+strmap_t var_index;
+
+// Set while ~/.byteshellrc runs for a state image, which then notes the
+// files the rc reads and the environment variables it looks at
+int state_recording = 0;
+
+// Exported variables are turned into an envp array only when one changes
+int env_dirty = 1;
+char **env_cache = NULL;
+
+// IFS classification: 0 = ordinary, 1 = IFS whitespace, 2 = other IFS character
+unsigned char ifs_table[256];
+int slot_IFS = -1;
+
+extern char **environ;
+
+// Positional parameters $1..$N; base is the allocation that owns them
+typedef struct {
+    char **base;
+    char **argv;
+    int argc;
+} posargs_t;
+
+posargs_t posargs = {NULL, NULL, 0};
+
+// Saved values restored when a function returns or a prefix assignment ends
+typedef struct {
+    int slot;
+    char *value;
+    size_t len;
+    int flags;
+    unsigned gen;
+    array_t *arr;
+    assoc_t *map;
+} var_save_t;
+
+var_save_t *var_saves = NULL;
+int var_save_count = 0;
+int var_save_cap = 0;
+int local_frame_base = -1;
+
+// While an in-process subshell runs, the first change to each variable records
+// its old value in the journal so the subshell can be undone
+unsigned journal_gen = 0;
+var_save_t *var_journal = NULL;
+int var_journal_count = 0;
+int var_journal_cap = 0;
+
+void var_journal_save(int slot);
+
+// Get or create the slot for a variable name
+int var_slot(const char *name, size_t n) {
+    int slot = strmap_get(&var_index, name, n);
+    if (slot >= 0) return slot;
+
+    GROW(vars, var_count, var_cap);
+    slot = var_count++;
+    memset(&vars[slot], 0, sizeof(var_t));
+    vars[slot].name = malloc(n + 1);
+    memcpy(vars[slot].name, name, n);
+    vars[slot].name[n] = '\0';
+    strmap_put(&var_index, name, n, slot);
+    return slot;
+}
+
+// Rebuild the IFS classification table from the current IFS value
+void ifs_update(const char *ifs, size_t n) {
+    memset(ifs_table, 0, sizeof(ifs_table));
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = ifs[i];
+        ifs_table[c] = (c == ' ' || c == '\t' || c == '\n') ? 1 : 2;
+    }
+}
+
+int var_set(int slot, const char *value, size_t n) {
+    var_t *v = &vars[slot];
+    if (v->flags & VAR_READONLY) {
+        fprintf(stderr, "ByteShell: %s: readonly variable\n", v->name);
+        return -1;
+    }
+    if (journal_gen && v->gen != journal_gen) var_journal_save(slot);
+    if (v->arr) {
+        array_set(v->arr, 0, value, n);
+        return 0;
+    }
+    if (v->map) {
+        assoc_set(v->map, "0", 1, value, n);
+        return 0;
+    }
+    if (!v->value || v->cap < n + 1) {
+        size_t cap = n + 1 < 16 ? 16 : n + 1;
+        free(v->value);
+        v->value = malloc(cap);
+        v->cap = cap;
+    }
+    memcpy(v->value, value, n);
+    v->value[n] = '\0';
+    v->len = n;
+    v->flags &= ~VAR_INTVALID;
+    if (v->flags & VAR_EXPORT) env_dirty = 1;
+    if (slot == slot_IFS) ifs_update(value, n);
+    return 0;
+}
+
+void var_set_int(int slot, long value) {
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%ld", value);
+    if (var_set(slot, num, n) == 0) {
+        vars[slot].ival = value;
+        vars[slot].flags |= VAR_INTVALID;
+    }
+}
+
+int var_unset(int slot) {
+    var_t *v = &vars[slot];
+    if (v->flags & VAR_READONLY) {
+        fprintf(stderr, "ByteShell: %s: readonly variable\n", v->name);
+        return -1;
+    }
+    if (journal_gen && v->gen != journal_gen) var_journal_save(slot);
+    if (v->flags & VAR_EXPORT) env_dirty = 1;
+    free(v->value);
+    v->value = NULL;
+    v->len = v->cap = 0;
+    array_free(v->arr);
+    v->arr = NULL;
+    assoc_free(v->map);
+    v->map = NULL;
+    v->flags &= ~(VAR_INTVALID | VAR_EXPORT);
+    if (slot == slot_IFS) ifs_update(" \t\n", 3);
+    return 0;
+}
+
+const char* var_value(int slot, size_t *len) {
+    if (state_recording) state_note_env(vars[slot].name);
+    if (vars[slot].arr) return array_get(vars[slot].arr, 0, len);
+    if (vars[slot].map) return assoc_get(vars[slot].map, "0", 1, len);
+    if (len) *len = vars[slot].len;
+    return vars[slot].value;
+}
+
+// The variable as an array, converting a scalar into element 0
+array_t* var_array(int slot) {
+    var_t *v = &vars[slot];
+    if (v->map) {
+        fprintf(stderr, "ByteShell: %s: cannot convert associative to indexed array\n", v->name);
+        return NULL;
+    }
+    if (v->arr) {
+        if (journal_gen && v->gen != journal_gen) var_journal_save(slot);
+        return v->arr;
+    }
+    if (v->flags & VAR_READONLY) {
+        fprintf(stderr, "ByteShell: %s: readonly variable\n", v->name);
+        return NULL;
+    }
+    if (journal_gen && v->gen != journal_gen) var_journal_save(slot);
+    array_t *a = array_new();
+    if (v->value) array_set(a, 0, v->value, v->len);
+    free(v->value);
+    v->value = NULL;
+    v->len = v->cap = 0;
+    v->flags &= ~VAR_INTVALID;
+    if (v->flags & VAR_EXPORT) env_dirty = 1;
+    v->arr = a;
+    return a;
+}
+
+// The variable as an associative array, converting a scalar into key "0"
+assoc_t* var_assoc(int slot) {
+    var_t *v = &vars[slot];
+    if (v->arr) {
+        fprintf(stderr, "ByteShell: %s: cannot convert indexed to associative array\n", v->name);
+        return NULL;
+    }
+    if (v->map) {
+        if (journal_gen && v->gen != journal_gen) var_journal_save(slot);
+        return v->map;
+    }
+    if (v->flags & VAR_READONLY) {
+        fprintf(stderr, "ByteShell: %s: readonly variable\n", v->name);
+        return NULL;
+    }
+    if (journal_gen && v->gen != journal_gen) var_journal_save(slot);
+    assoc_t *m = assoc_new();
+    if (v->value) assoc_set(m, "0", 1, v->value, v->len);
+    free(v->value);
+    v->value = NULL;
+    v->len = v->cap = 0;
+    v->flags &= ~VAR_INTVALID;
+    if (v->flags & VAR_EXPORT) env_dirty = 1;
+    v->map = m;
+    return m;
+}
+
+// getenv() replacement that reads the shell's own variable table
+char* var_getenv(const char *name) {
+    if (state_recording) state_note_env(name);
+    int slot = strmap_get(&var_index, name, strlen(name));
+    return slot >= 0 ? vars[slot].value : NULL;
+}
+
+void var_setenv(const char *name, const char *value) {
+    int slot = var_slot(name, strlen(name));
+    var_set(slot, value, strlen(value));
+}
+
+void var_export(int slot) {
+    if (journal_gen && vars[slot].gen != journal_gen) var_journal_save(slot);
+    vars[slot].flags |= VAR_EXPORT;
+    env_dirty = 1;
+}
+
+// Environment for exec'd commands, rebuilt only after exported variables change
+char** var_environ(void) {
+    if (!env_dirty && env_cache) return env_cache;
+    if (env_cache) {
+        for (char **e = env_cache; *e; e++) free(*e);
+        free(env_cache);
+    }
+    int n = 0;
+    for (int i = 0; i < var_count; i++) {
+        if ((vars[i].flags & VAR_EXPORT) && vars[i].value) n++;
+    }
+    env_cache = malloc((n + 1) * sizeof(char *));
+    n = 0;
+    for (int i = 0; i < var_count; i++) {
+        var_t *v = &vars[i];
+        if (!(v->flags & VAR_EXPORT) || !v->value) continue;
+        size_t nlen = strlen(v->name);
+        char *e = malloc(nlen + v->len + 2);
+        memcpy(e, v->name, nlen);
+        e[nlen] = '=';
+        memcpy(e + nlen + 1, v->value, v->len + 1);
+        env_cache[n++] = e;
+    }
+    env_cache[n] = NULL;
+    env_dirty = 0;
+    return env_cache;
+}
+
+// Load the inherited environment into the variable table
+void var_import_environ(void) {
+    slot_IFS = var_slot("IFS", 3);
+    ifs_update(" \t\n", 3);
+    for (char **e = environ; *e; e++) {
+        char *eq = strchr(*e, '=');
+        if (!eq || eq == *e) continue;
+        int slot = var_slot(*e, eq - *e);
+        var_set(slot, eq + 1, strlen(eq + 1));
+        var_export(slot);
+    }
+}
+
+// Save a variable so it can be restored later (locals, prefix assignments)
+void var_save(int slot) {
+    GROW(var_saves, var_save_count, var_save_cap);
+    var_save_t *s = &var_saves[var_save_count++];
+    s->slot = slot;
+    s->value = vars[slot].value ? strdup(vars[slot].value) : NULL;
+    s->len = vars[slot].len;
+    s->flags = vars[slot].flags & ~VAR_INTVALID;
+    s->arr = vars[slot].arr ? array_copy(vars[slot].arr) : NULL;
+    s->map = vars[slot].map ? assoc_copy(vars[slot].map) : NULL;
+}
+
+// Restore saved variables down to base
+void var_restore(int base) {
+    while (var_save_count > base) {
+        var_save_t *s = &var_saves[--var_save_count];
+        var_t *v = &vars[s->slot];
+        v->flags &= ~VAR_READONLY;
+        var_unset(s->slot);
+        if (s->arr) v->arr = s->arr;
+        else if (s->map) v->map = s->map;
+        else if (s->value) var_set(s->slot, s->value, s->len);
+        v->flags = s->flags;
+        env_dirty = 1;
+        free(s->value);
+    }
+}
+
+void var_journal_save(int slot) {
+    GROW(var_journal, var_journal_count, var_journal_cap);
+    var_save_t *s = &var_journal[var_journal_count++];
+    s->slot = slot;
+    s->value = vars[slot].value ? strdup(vars[slot].value) : NULL;
+    s->len = vars[slot].len;
+    s->flags = vars[slot].flags & ~VAR_INTVALID;
+    s->gen = vars[slot].gen;
+    s->arr = vars[slot].arr ? array_copy(vars[slot].arr) : NULL;
+    s->map = vars[slot].map ? assoc_copy(vars[slot].map) : NULL;
+    vars[slot].gen = journal_gen;
+}
+
+// Undo journaled variable changes down to base
+void var_journal_restore(int base) {
+    unsigned gen = journal_gen;
+    journal_gen = 0;
+    while (var_journal_count > base) {
+        var_save_t *s = &var_journal[--var_journal_count];
+        var_t *v = &vars[s->slot];
+        v->flags &= ~VAR_READONLY;
+        var_unset(s->slot);
+        if (s->arr) v->arr = s->arr;
+        else if (s->map) v->map = s->map;
+        else if (s->value) var_set(s->slot, s->value, s->len);
+        v->flags = s->flags;
+        v->gen = s->gen;
+        free(s->value);
+        env_dirty = 1;
+    }
+    journal_gen = gen;
+}
+
+// Replace the positional parameters with a private copy of argv[0..argc)
+posargs_t posargs_make(char **argv, int argc) {
+    size_t size = (argc + 1) * sizeof(char *);
+    for (int i = 0; i < argc; i++) size += strlen(argv[i]) + 1;
+    posargs_t p;
+    p.base = malloc(size);
+    p.argv = p.base;
+    p.argc = argc;
+    char *strs = (char *)(p.base + argc + 1);
+    for (int i = 0; i < argc; i++) {
+        size_t n = strlen(argv[i]) + 1;
+        memcpy(strs, argv[i], n);
+        p.argv[i] = strs;
+        strs += n;
+    }
+    p.argv[argc] = NULL;
+    return p;
+}
+
+const char* posarg(long n) {
+    if (n == 0) return shell_name;
+    if (n < 0 || n > posargs.argc) return NULL;
+    return posargs.argv[n - 1];
+}
+
+// Aliases, expanded by the lexer; unalias leaves a hole so indexes stay valid
+typedef struct {
+    char *name;
+    char *value;      // NULL once removed
+    size_t len;
+    unsigned gen;
+} alias_t;
+
+alias_t *aliases = NULL;
+int alias_count = 0;
+int alias_cap = 0;
+strmap_t alias_index;
+
+// Old alias values, kept while an in-process subshell runs
+typedef struct {
+    int alias;
+    char *value;
+    unsigned gen;
+} alias_save_t;
+
+alias_save_t *alias_journal = NULL;
+int alias_journal_count = 0;
+int alias_journal_cap = 0;
+
+void alias_journal_save(int ai) {
+    if (!journal_gen || aliases[ai].gen == journal_gen) return;
+    GROW(alias_journal, alias_journal_count, alias_journal_cap);
+    alias_save_t *s = &alias_journal[alias_journal_count++];
+    s->alias = ai;
+    s->value = aliases[ai].value ? strdup(aliases[ai].value) : NULL;
+    s->gen = aliases[ai].gen;
+    aliases[ai].gen = journal_gen;
+}
+
+void alias_journal_restore(int base) {
+    while (alias_journal_count > base) {
+        alias_save_t *s = &alias_journal[--alias_journal_count];
+        alias_t *a = &aliases[s->alias];
+        free(a->value);
+        a->value = s->value;
+        a->len = s->value ? strlen(s->value) : 0;
+        a->gen = s->gen;
+    }
+}
+
+int alias_lookup(const char *name, size_t n) {
+    if (!alias_count) return -1;
+    int ai = strmap_get(&alias_index, name, n);
+    return ai >= 0 && aliases[ai].value ? ai : -1;
+}
+
+void alias_define(const char *name, size_t n, const char *value) {
+    int ai = strmap_get(&alias_index, name, n);
+    if (ai < 0) {
+        GROW(aliases, alias_count, alias_cap);
+        ai = alias_count++;
+        aliases[ai].name = malloc(n + 1);
+        memcpy(aliases[ai].name, name, n);
+        aliases[ai].name[n] = '\0';
+        aliases[ai].value = NULL;
+        aliases[ai].gen = 0;
+        strmap_put(&alias_index, name, n, ai);
+    }
+    alias_journal_save(ai);
+    free(aliases[ai].value);
+    aliases[ai].value = strdup(value);
+    aliases[ai].len = strlen(value);
+}
+
+int alias_remove(const char *name) {
+    int ai = alias_lookup(name, strlen(name));
+    if (ai < 0) return -1;
+    alias_journal_save(ai);
+    free(aliases[ai].value);
+    aliases[ai].value = NULL;
+    return 0;
+}
+
+// Lexer tokens
+enum {
+    T_EOF, T_NEWLINE, T_WORD, T_IO_NUMBER, T_SEMI, T_AMP, T_PIPE, T_AND_IF, T_OR_IF,
+    T_DSEMI, T_SEMIAND, T_LPAREN, T_RPAREN, T_LESS, T_GREAT, T_DGREAT, T_LESSAND,
+    T_GREATAND, T_LESSGREAT, T_CLOBBER, T_ANDGREAT, T_ANDDGREAT, T_DLPAREN, T_DLESS, T_DLESSDASH,
+    T_TLESS
+};
+
+// Redirection kinds
+enum { R_IN, R_OUT, R_APPEND, R_RW, R_DUPIN, R_DUPOUT, R_BOTH, R_BOTH_APPEND, R_HEREDOC, R_HERESTR };
+
+// Word parts
+enum { WP_LIT, WP_PARAM, WP_ARITH, WP_ARITH_DYN, WP_TILDE, WP_CMDSUB, WP_PROCSUB };
+
+// Parameter targets: named variable, positional $N, or special $? $# $@ $* $$ $! $-
+enum { PT_VAR, PT_POS, PT_SPECIAL, PT_ELEM, PT_ARRAY };
+
+// Parameter operators
+enum {
+    PARAM_PLAIN, PARAM_LENGTH, PARAM_DEFAULT, PARAM_ASSIGN, PARAM_ALT, PARAM_ERROR,
+    PARAM_TRIM_PREFIX, PARAM_TRIM_PREFIX_LONG, PARAM_TRIM_SUFFIX, PARAM_TRIM_SUFFIX_LONG,
+    PARAM_SUBST, PARAM_SUBST_ALL, PARAM_SUBST_PREFIX, PARAM_SUBST_SUFFIX, PARAM_SUBSTR, PARAM_KEYS
+};
+
+// Arithmetic AST node kinds
+enum { AN_NUM, AN_VAR, AN_PARAM, AN_UNARY, AN_BINARY, AN_ASSIGN, AN_INCDEC, AN_TERNARY, AN_COMMA };
+
+typedef struct anode {
+    int kind;
+    int op;             // operator token for unary/binary/assign, or inc/dec flags
+    long num;
+    const char *name;   // variable name
+    size_t nlen;
+    const char *sub;    // name[sub] array element
+    size_t slen;
+    int ptype;          // for AN_PARAM
+    struct anode *a, *b, *c;
+} anode_t;
+
+typedef struct word word_t;
+
+typedef struct wpart {
+    int type;
+    int quoted;
+    const char *text;   // literal text, variable name or tilde user
+    size_t len;
+    int ptype;
+    long num;           // positional index or special character
+    int op;
+    int colon;          // ${v:-w} vs ${v-w}
+    word_t *arg1;
+    word_t *arg2;
+    anode_t *arith;     // WP_ARITH, or substring offset
+    anode_t *arith2;    // substring length
+    node_t *body;       // WP_CMDSUB/WP_PROCSUB command list
+    word_t *index;      // PT_ELEM subscript
+    struct wpart *next;
+} wpart_t;
+
+#define WF_MAYGLOB 1     // unquoted text could contain glob characters
+#define WF_EXPANDS 2     // contains expansions
+
+struct word {
+    wpart_t *parts;
+    int flags;
+};
+
+typedef struct redir {
+    int type;
+    int fd;
+    word_t *target;         // file name, or the body of a here-document
+    struct redir *next;
+    const char *delim;      // here-document delimiter, until the body is read
+    size_t dlen;
+    int strip_tabs;         // <<-
+    struct redir *doc_next; // here-documents waiting for the end of the line
+} redir_t;
+
+typedef struct assign {
+    const char *name;
+    size_t nlen;
+    int append;
+    word_t *value;
+    word_t *index;          // name[index]=value
+    int compound;           // name=(elems...)
+    word_t **elems;
+    word_t **keys;          // [key]=value elements; NULL entries are plain words
+    int nelems;
+    struct assign *next;
+} assign_t;
+
+typedef struct case_item {
+    word_t **pats;
+    int npats;
+    node_t *body;
+    int fallthrough;
+    struct case_item *next;
+} case_item_t;
+
+// Command AST node kinds
+enum {
+    N_SIMPLE, N_LIST, N_PIPE, N_AND, N_OR, N_NOT, N_BG, N_IF, N_WHILE, N_UNTIL,
+    N_FOR, N_ARITH_FOR, N_CASE, N_FUNC, N_GROUP, N_ARITH, N_SUBSHELL
+};
+
+struct node {
+    int type;
+    node_t *a, *b, *c;      // children (condition/then/else, body, list members)
+    node_t *next;           // next member of a list or pipeline
+    word_t **words;
+    int nwords;
+    assign_t *assigns;
+    assign_t *post;         // name=(...) arguments of declare, assigned after it runs
+    redir_t *redirs;
+    const char *name;       // loop variable or function name
+    size_t nlen;
+    case_item_t *items;
+    anode_t *arith[3];
+    int line;
+};
+
+typedef struct {
+    const char *src;
+    size_t len;
+    size_t pos;
+    int tok;
+    const char *text;       // raw token text for words
+    size_t tlen;
+    int peeked;
+    int line;
+    int incomplete;         // input ended inside a construct
+    int error;
+    int arith_dynamic;      // arithmetic needs runtime expansion
+    const char *name;
+    arena_t *arena;
+    int aliases;            // expand aliases in command position
+    int alias_next;         // an alias ending in a blank was just consumed
+    int alias_depth;
+    redir_t *docs;          // here-documents whose bodies start after the next newline
+    redir_t **docs_tail;
+    struct {
+        const char *src;
+        size_t len;
+        size_t pos;
+        int alias;
+    } alias_stack[ALIAS_DEPTH_MAX];   // input suspended while alias text is read
+} parser_t;
+
+void parse_error(parser_t *p, const char *msg) {
+    if (p->error || p->incomplete) return;
+    p->error = 1;
+    if (p->name) fprintf(stderr, "ByteShell: %s: line %d: %s\n", p->name, p->line, msg);
+    else fprintf(stderr, "ByteShell: %s\n", msg);
+}
+
+void* parse_alloc(parser_t *p, size_t n) {
+    void *mem = arena_alloc(p->arena, n);
+    memset(mem, 0, n);
+    return mem;
+}
+
+// Skip a single-quoted string starting after the quote
+size_t lex_skip_squote(parser_t *p, size_t i) {
+    while (i < p->len && p->src[i] != '\'') i++;
+    if (i >= p->len) {
+        p->incomplete = 1;
+        return p->len;
+    }
+    return i + 1;
+}
+
+size_t lex_skip_dquote(parser_t *p, size_t i);
+size_t lex_skip_parens(parser_t *p, size_t i);
+size_t lex_skip_braces(parser_t *p, size_t i);
+
+// Skip $(...), ${...} or a backquoted command starting at the '$' or '`'
+size_t lex_skip_dollar(parser_t *p, size_t i) {
+    const char *s = p->src;
+    if (s[i] == '`') {
+        for (i++; i < p->len && s[i] != '`'; i++) {
+            if (s[i] == '\\') i++;
+        }
+        if (i >= p->len) {
+            p->incomplete = 1;
+            return p->len;
+        }
+        return i + 1;
+    }
+    if (i + 1 < p->len && s[i + 1] == '(') return lex_skip_parens(p, i + 2);
+    if (i + 1 < p->len && s[i + 1] == '{') return lex_skip_braces(p, i + 2);
+    return i + 1;
+}
+
+size_t lex_skip_dquote(parser_t *p, size_t i) {
+    const char *s = p->src;
+    while (i < p->len && s[i] != '"') {
+        if (s[i] == '\\') i += 2;
+        else if (s[i] == '$' || s[i] == '`') i = lex_skip_dollar(p, i);
+        else i++;
+    }
+    if (i >= p->len) {
+        p->incomplete = 1;
+        return p->len;
+    }
+    return i + 1;
+}
+
+// Skip to the ')' matching an already consumed '('
+size_t lex_skip_parens(parser_t *p, size_t i) {
+    const char *s = p->src;
+    int depth = 1;
+    while (i < p->len) {
+        char c = s[i];
+        if (c == '\\') i += 2;
+        else if (c == '\'') i = lex_skip_squote(p, i + 1);
+        else if (c == '"') i = lex_skip_dquote(p, i + 1);
+        else if (c == '`' || (c == '$' && i + 1 < p->len && s[i + 1] == '{')) i = lex_skip_dollar(p, i);
+        else {
+            if (c == '(') depth++;
+            else if (c == ')' && --depth == 0) return i + 1;
+            i++;
+        }
+    }
+    p->incomplete = 1;
+    return p->len;
+}
+
+// Skip to the '}' matching an already consumed '{'
+size_t lex_skip_braces(parser_t *p, size_t i) {
+    const char *s = p->src;
+    int depth = 1;
+    while (i < p->len) {
+        char c = s[i];
+        if (c == '\\') i += 2;
+        else if (c == '\'') i = lex_skip_squote(p, i + 1);
+        else if (c == '"') i = lex_skip_dquote(p, i + 1);
+        else if (c == '`' || (c == '$' && i + 1 < p->len && s[i + 1] == '(')) i = lex_skip_dollar(p, i);
+        else {
+            if (c == '{') depth++;
+            else if (c == '}' && --depth == 0) return i + 1;
+            i++;
+        }
+    }
+    p->incomplete = 1;
+    return p->len;
+}
+
+size_t assignment_name_len(const char *s, size_t n);
+
+// Scan a word; stops at the first unquoted metacharacter
+size_t lex_scan_word(parser_t *p, size_t i) {
+    const char *s = p->src;
+    size_t start = i;
+    while (i < p->len) {
+        char c = s[i];
+        if (c == '(' && i > start && s[i - 1] == '=' && assignment_name_len(s + start, i - start)) {
+            // name=( elements ) is one word
+            for (size_t k = start; k < i; k++) {
+                if (s[k] == '[') goto plain;
+            }
+            size_t close = lex_skip_parens(p, i + 1);
+            for (size_t k = i; k < close && k < p->len; k++) {
+                if (s[k] == '\n') p->line++;
+            }
+            i = close;
+            continue;
+        }
+    plain:
+        if ((c == '<' || c == '>') && i + 1 < p->len && s[i + 1] == '(') {
+            i = lex_skip_parens(p, i + 2);
+            continue;
+        }
+        if (strchr(" \t\n;&|()<>", c)) break;
+        if (c == '\\') {
+            if (i + 1 >= p->len) {
+                p->incomplete = 1;
+                i++;
+                break;
+            }
+            if (s[i + 1] == '\n') p->line++;
+            i += 2;
+        } else if (c == '\'') {
+            i = lex_skip_squote(p, i + 1);
+        } else if (c == '"') {
+            i = lex_skip_dquote(p, i + 1);
+        } else if (c == '$' || c == '`') {
+            i = lex_skip_dollar(p, i);
+        } else {
+            i++;
+        }
+    }
+    return i > p->len ? p->len : i;
+}
+
+word_t* parse_word(parser_t *p, const char *s, size_t n, int quoted);
+
+// Read the bodies of pending here-documents, which start at p->pos
+void lex_heredocs(parser_t *p) {
+    const char *s = p->src;
+    size_t i = p->pos;
+    for (redir_t *r = p->docs; r; r = r->doc_next) {
+        strbuf_t body = {0};
+        int found = 0;
+        while (i < p->len) {
+            size_t start = i;
+            const char *nl = memchr(s + i, '\n', p->len - i);
+            size_t end = nl ? (size_t)(nl - s) : p->len;
+            i = nl ? end + 1 : end;
+            p->line++;
+            if (r->strip_tabs) {
+                while (start < end && s[start] == '\t') start++;
+            }
+            if (end - start == r->dlen && memcmp(s + start, r->delim, r->dlen) == 0) {
+                found = 1;
+                break;
+            }
+            sb_append(&body, s + start, end - start);
+            sb_putc(&body, '\n');
+        }
+        if (!found) {
+            free(body.data);
+            p->incomplete = 1;
+            p->pos = p->len;
+            return;
+        }
+        if (r->target) {
+            // Unquoted delimiter: expand like double quotes, but '"' stays literal
+            strbuf_t text = {0};
+            for (size_t k = 0; k < body.len; k++) {
+                if (body.data[k] == '\\' && k + 1 < body.len) {
+                    if (body.data[k + 1] == '"') sb_putc(&text, '\\');
+                    sb_putc(&text, body.data[k++]);
+                }
+                sb_putc(&text, body.data[k]);
+            }
+            r->target = parse_word(p, text.data ? text.data : "", text.len, 1);
+            free(text.data);
+        } else {
+            wpart_t *part = parse_alloc(p, sizeof(wpart_t));
+            part->type = WP_LIT;
+            part->quoted = 1;
+            part->text = arena_strndup(p->arena, body.data ? body.data : "", body.len);
+            part->len = body.len;
+            r->target = parse_alloc(p, sizeof(word_t));
+            r->target->parts = part;
+        }
+        free(body.data);
+    }
+    p->docs = NULL;
+    p->pos = i;
+}
+
+// Read the next token
+int lex_next(parser_t *p) {
+    const char *s = p->src;
+    size_t i = p->pos;
+
+    if (p->peeked) {
+        p->peeked = 0;
+        return p->tok;
+    }
+    while (i < p->len || p->alias_depth) {
+        if (i >= p->len) {
+            // End of an alias value: resume the text it replaced
+            int ai = p->alias_stack[--p->alias_depth].alias;
+            s = p->src = p->alias_stack[p->alias_depth].src;
+            p->len = p->alias_stack[p->alias_depth].len;
+            i = p->alias_stack[p->alias_depth].pos;
+            if (aliases[ai].len && isblank((unsigned char)aliases[ai].value[aliases[ai].len - 1])) {
+                p->alias_next = 1;
+            }
+        } else if (s[i] == ' ' || s[i] == '\t') {
+            i++;
+        } else if (s[i] == '\\' && i + 1 < p->len && s[i + 1] == '\n') {
+            i += 2;
+            p->line++;
+        } else if (s[i] == '#') {
+            while (i < p->len && s[i] != '\n') i++;
+        } else {
+            break;
+        }
+    }
+    p->text = s + i;
+    p->tlen = 1;
+    if (i >= p->len) {
+        p->pos = i;
+        return p->tok = T_EOF;
+    }
+
+    char c = s[i], n1 = i + 1 < p->len ? s[i + 1] : '\0', n2 = i + 2 < p->len ? s[i + 2] : '\0';
+    int tok = -1, len = 1;
+    switch (c) {
+    case '\n': tok = T_NEWLINE; p->line++; break;
+    case ';':
+        if (n1 == ';') tok = T_DSEMI, len = 2;
+        else if (n1 == '&') tok = T_SEMIAND, len = 2;
+        else tok = T_SEMI;
+        break;
+    case '&':
+        if (n1 == '&') tok = T_AND_IF, len = 2;
+        else if (n1 == '>' && n2 == '>') tok = T_ANDDGREAT, len = 3;
+        else if (n1 == '>') tok = T_ANDGREAT, len = 2;
+        else tok = T_AMP;
+        break;
+    case '|': tok = n1 == '|' ? (len = 2, T_OR_IF) : T_PIPE; break;
+    case '(': tok = n1 == '(' ? (len = 2, T_DLPAREN) : T_LPAREN; break;
+    case ')': tok = T_RPAREN; break;
+    case '<':
+        if (n1 == '(') break;
+        if (n1 == '<' && n2 == '<') tok = T_TLESS, len = 3;
+        else if (n1 == '<' && n2 == '-') tok = T_DLESSDASH, len = 3;
+        else if (n1 == '<') tok = T_DLESS, len = 2;
+        else if (n1 == '&') tok = T_LESSAND, len = 2;
+        else if (n1 == '>') tok = T_LESSGREAT, len = 2;
+        else tok = T_LESS;
+        break;
+    case '>':
+        if (n1 == '(') break;
+        if (n1 == '>') tok = T_DGREAT, len = 2;
+        else if (n1 == '&') tok = T_GREATAND, len = 2;
+        else if (n1 == '|') tok = T_CLOBBER, len = 2;
+        else tok = T_GREAT;
+        break;
+    }
+    if (tok >= 0) {
+        p->tlen = len;
+        p->pos = i + len;
+        if (tok == T_NEWLINE && p->docs && !p->alias_depth) lex_heredocs(p);
+        return p->tok = tok;
+    }
+
+    size_t end = lex_scan_word(p, i);
+    p->tlen = end - i;
+    p->pos = end;
+    tok = T_WORD;
+    if (end < p->len && (s[end] == '<' || s[end] == '>')) {
+        size_t k = i;
+        while (k < end && isdigit((unsigned char)s[k])) k++;
+        if (k == end) tok = T_IO_NUMBER;
+    }
+    return p->tok = tok;
+}
+
+int lex_peek(parser_t *p) {
+    if (!p->peeked) {
+        lex_next(p);
+        p->peeked = 1;
+    }
+    return p->tok;
+}
+
+// Replace a peeked word that names an alias with the alias text. The rest of
+// the input is suspended, not copied, and an alias is not expanded inside itself
+void alias_expand(parser_t *p) {
+    while (p->aliases && lex_peek(p) == T_WORD && p->alias_depth < ALIAS_DEPTH_MAX) {
+        int ai = alias_lookup(p->text, p->tlen);
+        if (ai < 0) return;
+        for (int d = 0; d < p->alias_depth; d++) {
+            if (p->alias_stack[d].alias == ai) return;
+        }
+        p->alias_stack[p->alias_depth].src = p->src;
+        p->alias_stack[p->alias_depth].len = p->len;
+        p->alias_stack[p->alias_depth].pos = p->pos;
+        p->alias_stack[p->alias_depth].alias = ai;
+        p->alias_depth++;
+        p->src = aliases[ai].value;
+        p->len = aliases[ai].len;
+        p->pos = 0;
+        p->peeked = 0;
+        p->alias_next = 0;
+    }
+}
+
+// Is the peeked token the given reserved word?
+int tok_is(parser_t *p, const char *word) {
+    return lex_peek(p) == T_WORD && p->tlen == strlen(word) && strncmp(p->text, word, p->tlen) == 0;
+}
+
+const char* tok_name(parser_t *p) {
+    static char buf[64];
+    if (p->tok == T_EOF) return "end of file";
+    if (p->tok == T_NEWLINE) return "newline";
+    snprintf(buf, sizeof(buf), "'%.*s'", (int)(p->tlen > 40 ? 40 : p->tlen), p->text);
+    return buf;
+}
+
+void parse_unexpected(parser_t *p) {
+    char msg[128];
+    if (p->tok == T_EOF) {
+        p->incomplete = 1;
+        return;
+    }
+    snprintf(msg, sizeof(msg), "syntax error near unexpected token %s", tok_name(p));
+    parse_error(p, msg);
+}
+
+// Consume an expected reserved word
+int expect_word(parser_t *p, const char *word) {
+    if (tok_is(p, word)) {
+        lex_next(p);
+        return 1;
+    }
+    parse_unexpected(p);
+    return 0;
+}
+
+void skip_newlines(parser_t *p) {
+    while (lex_peek(p) == T_NEWLINE) lex_next(p);
+}
+
+int is_name_start(int c) {
+    return isalpha(c) || c == '_';
+}
+
+int is_name_char(int c) {
+    return isalnum(c) || c == '_';
+}
+
+// Arithmetic expression parser over raw text
+typedef struct {
+    parser_t *p;
+    const char *s;
+    const char *end;
+    int depth;
+} arith_parser_t;
+
+anode_t* arith_parse_expr(arith_parser_t *ap, int min_prec);
+
+void arith_skip_space(arith_parser_t *ap) {
+    while (ap->s < ap->end && isspace((unsigned char)*ap->s)) ap->s++;
+}
+
+anode_t* arith_node(arith_parser_t *ap, int kind) {
+    anode_t *n = parse_alloc(ap->p, sizeof(anode_t));
+    n->kind = kind;
+    return n;
+}
+
+// Parse an integer constant: decimal, 0x hex, 0 octal or base#digits
+long arith_parse_number(const char **sp, const char *end) {
+    const char *s = *sp;
+    long base = 10, v = 0;
+
+    if (s + 1 < end && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        s += 2;
+    } else if (s < end && s[0] == '0') {
+        base = 8;
+    } else {
+        const char *h = s;
+        long b = 0;
+        while (h < end && isdigit((unsigned char)*h)) b = b * 10 + (*h++ - '0');
+        if (h < end && *h == '#' && b >= 2 && b <= 64) {
+            base = b;
+            s = h + 1;
+        }
+    }
+    while (s < end) {
+        int c = (unsigned char)*s, d;
+        if (isdigit(c)) d = c - '0';
+        else if (islower(c)) d = c - 'a' + 10;
+        else if (isupper(c)) d = c - 'A' + (base > 36 ? 36 : 10);
+        else if (c == '@') d = 62;
+        else if (c == '_') d = 63;
+        else break;
+        if (d >= base) break;
+        v = v * base + d;
+        s++;
+    }
+    *sp = s;
+    return v;
+}
+
+// Two-character and one-character arithmetic operators; assignment forms end in '='
+const char *arith_ops[] = {
+    "<<=", ">>=", "**", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++", "--",
+    "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", NULL
+};
+
+// Binary operator precedence (higher binds tighter); 0 if not binary
+int arith_prec(const char *op, size_t n) {
+    if (n == 2 && strncmp(op, "||", 2) == 0) return 3;
+    if (n == 2 && strncmp(op, "&&", 2) == 0) return 4;
+    if (n == 1 && *op == '|') return 5;
+    if (n == 1 && *op == '^') return 6;
+    if (n == 1 && *op == '&') return 7;
+    if (n == 2 && (strncmp(op, "==", 2) == 0 || strncmp(op, "!=", 2) == 0)) return 8;
+    if ((n == 1 && (*op == '<' || *op == '>')) || (n == 2 && (strncmp(op, "<=", 2) == 0 || strncmp(op, ">=", 2) == 0))) return 9;
+    if (n == 2 && (strncmp(op, "<<", 2) == 0 || strncmp(op, ">>", 2) == 0)) return 10;
+    if (n == 1 && (*op == '+' || *op == '-')) return 11;
+    if (n == 1 && (*op == '*' || *op == '/' || *op == '%')) return 12;
+    if (n == 2 && strncmp(op, "**", 2) == 0) return 13;
+    return 0;
+}
+
+// Encode an operator as a small integer: first char, plus 256 * second char
+int arith_opcode(const char *op, size_t n) {
+    return (unsigned char)op[0] | (n > 1 ? (unsigned char)op[1] << 8 : 0);
+}
+
+size_t arith_op_len(arith_parser_t *ap) {
+    for (int i = 0; arith_ops[i]; i++) {
+        size_t n = strlen(arith_ops[i]);
+        if ((size_t)(ap->end - ap->s) >= n && strncmp(ap->s, arith_ops[i], n) == 0) return n;
+    }
+    return 1;
+}
+
+// Primary: number, variable, $param, parenthesized expression, unary operators
+anode_t* arith_parse_unary(arith_parser_t *ap) {
+    arith_skip_space(ap);
+    if (ap->s >= ap->end) {
+        parse_error(ap->p, "arithmetic syntax error: operand expected");
+        return NULL;
+    }
+    if (++ap->depth > ARITH_STACK_MAX / 2) {
+        parse_error(ap->p, "arithmetic expression too complex");
+        return NULL;
+    }
+    char c = *ap->s;
+    anode_t *n = NULL;
+
+    if ((c == '+' || c == '-') && ap->s + 1 < ap->end && ap->s[1] == c) {
+        ap->s += 2;
+        n = arith_parse_unary(ap);
+        if (!n) return NULL;
+        if (n->kind != AN_VAR) {
+            parse_error(ap->p, "arithmetic syntax error: ++/-- needs a variable");
+            return NULL;
+        }
+        n->kind = AN_INCDEC;
+        n->op = (c == '+' ? 1 : -1) * 2;   // even means prefix
+    } else if (c == '+' || c == '-' || c == '!' || c == '~') {
+        ap->s++;
+        n = arith_node(ap, AN_UNARY);
+        n->op = c;
+        n->a = arith_parse_unary(ap);
+        if (!n->a) return NULL;
+    } else if (c == '(') {
+        ap->s++;
+        n = arith_parse_expr(ap, 0);
+        if (!n) return NULL;
+        arith_skip_space(ap);
+        if (ap->s >= ap->end || *ap->s != ')') {
+            parse_error(ap->p, "arithmetic syntax error: missing ')'");
+            return NULL;
+        }
+        ap->s++;
+    } else if (isdigit((unsigned char)c)) {
+        n = arith_node(ap, AN_NUM);
+        n->num = arith_parse_number(&ap->s, ap->end);
+        if (ap->s < ap->end && is_name_char((unsigned char)*ap->s)) {
+            parse_error(ap->p, "arithmetic syntax error: invalid number");
+            return NULL;
+        }
+    } else if (is_name_start((unsigned char)c) || (c == '$' && ap->s + 1 < ap->end)) {
+        const char *name = ap->s;
+        int braced = 0;
+        if (c == '$') {
+            name++;
+            if (*name == '(' || *name == '`') {
+                ap->p->arith_dynamic = 1;
+                return NULL;
+            }
+            if (*name == '{') {
+                braced = 1;
+                name++;
+            }
+        }
+        const char *q = name;
+        n = arith_node(ap, AN_VAR);
+        if (q < ap->end && is_name_start((unsigned char)*q)) {
+            while (q < ap->end && is_name_char((unsigned char)*q)) q++;
+        } else if (c == '$' && q < ap->end && isdigit((unsigned char)*q)) {
+            n->kind = AN_PARAM;
+            n->ptype = PT_POS;
+            while (q < ap->end && isdigit((unsigned char)*q)) {
+                n->num = n->num * 10 + (*q++ - '0');
+                if (!braced) break;
+            }
+        } else if (c == '$' && q < ap->end && strchr("?#$!", *q)) {
+            n->kind = AN_PARAM;
+            n->ptype = PT_SPECIAL;
+            n->num = *q++;
+        } else {
+            ap->p->arith_dynamic = 1;
+            return NULL;
+        }
+        if (braced) {
+            if (q >= ap->end || *q != '}') {
+                ap->p->arith_dynamic = 1;
+                return NULL;
+            }
+        }
+        n->name = name;
+        n->nlen = q - name;
+        if (c != '$' && q < ap->end && *q == '[') {
+            size_t close = subscript_end(q, ap->end - q, 0);
+            if (!close) {
+                parse_error(ap->p, "arithmetic syntax error: missing ']'");
+                return NULL;
+            }
+            if (memchr(q, '$', close) || memchr(q, '`', close)) {
+                ap->p->arith_dynamic = 1;
+                return NULL;
+            }
+            n->sub = q + 1;
+            n->slen = close - 2;
+            q += close;
+        }
+        ap->s = q + braced;
+        // Postfix ++/--
+        arith_skip_space(ap);
+        if (n->kind == AN_VAR && ap->s + 1 < ap->end && (ap->s[0] == '+' || ap->s[0] == '-') && ap->s[1] == ap->s[0]) {
+            n->kind = AN_INCDEC;
+            n->op = ap->s[0] == '+' ? 1 : -1;   // odd means postfix
+            ap->s += 2;
+        }
+    } else {
+        parse_error(ap->p, "arithmetic syntax error: operand expected");
+        return NULL;
+    }
+    ap->depth--;
+    return n;
+}
+
+// Precedence climbing over binary, ternary, assignment and comma operators
+anode_t* arith_parse_expr(arith_parser_t *ap, int min_prec) {
+    anode_t *lhs = arith_parse_unary(ap);
+    if (!lhs) return NULL;
+
+    while (1) {
+        arith_skip_space(ap);
+        if (ap->s >= ap->end || *ap->s == ')' || *ap->s == ':') return lhs;
+        size_t n = arith_op_len(ap);
+        const char *op = ap->s;
+
+        if (*op == ',' && min_prec <= 0) {
+            ap->s++;
+            anode_t *c = arith_node(ap, AN_COMMA);
+            c->a = lhs;
+            c->b = arith_parse_expr(ap, 1);
+            if (!c->b) return NULL;
+            lhs = c;
+            continue;
+        }
+        if (*op == ',') return lhs;
+        // Assignment: =, +=, -=, ... (right associative, lowest after comma)
+        if ((n == 1 && *op == '=') || (n >= 2 && op[n - 1] == '=' && strncmp(op, "==", 2) != 0 &&
+                                       strncmp(op, "!=", 2) != 0 && strncmp(op, "<=", 2) != 0 && strncmp(op, ">=", 2) != 0)) {
+            if (min_prec > 1) return lhs;
+            if (lhs->kind != AN_VAR) {
+                parse_error(ap->p, "arithmetic syntax error: assignment to non-variable");
+                return NULL;
+            }
+            ap->s += n;
+            anode_t *a = arith_node(ap, AN_ASSIGN);
+            a->name = lhs->name;
+            a->nlen = lhs->nlen;
+            a->sub = lhs->sub;
+            a->slen = lhs->slen;
+            a->op = n == 1 ? 0 : arith_opcode(op, n - 1);
+            a->a = arith_parse_expr(ap, 1);
+            if (!a->a) return NULL;
+            lhs = a;
+            continue;
+        }
+        if (*op == '?') {
+            if (min_prec > 2) return lhs;
+            ap->s++;
+            anode_t *t = arith_node(ap, AN_TERNARY);
+            t->a = lhs;
+            t->b = arith_parse_expr(ap, 1);
+            if (!t->b) return NULL;
+            arith_skip_space(ap);
+            if (ap->s >= ap->end || *ap->s != ':') {
+                parse_error(ap->p, "arithmetic syntax error: ':' expected");
+                return NULL;
+            }
+            ap->s++;
+            t->c = arith_parse_expr(ap, 2);
+            if (!t->c) return NULL;
+            lhs = t;
+            continue;
+        }
+        int prec = arith_prec(op, n);
+        if (!prec) {
+            if (!ap->p->arith_dynamic) parse_error(ap->p, "arithmetic syntax error: invalid operator");
+            return NULL;
+        }
+        if (prec < min_prec) return lhs;
+        ap->s += n;
+        anode_t *b = arith_node(ap, AN_BINARY);
+        b->op = arith_opcode(op, n);
+        b->a = lhs;
+        b->b = arith_parse_expr(ap, prec == 13 ? prec : prec + 1);
+        if (!b->b) return NULL;
+        lhs = b;
+    }
+}
+
+// Parse a whole arithmetic expression; empty text evaluates to 0
+anode_t* arith_parse(parser_t *p, const char *s, size_t n) {
+    arith_parser_t ap = {p, s, s + n, 0};
+    arith_skip_space(&ap);
+    if (ap.s >= ap.end) {
+        anode_t *zero = arith_node(&ap, AN_NUM);
+        return zero;
+    }
+    anode_t *e = arith_parse_expr(&ap, 0);
+    if (!e) return NULL;
+    arith_skip_space(&ap);
+    if (ap.s < ap.end) {
+        if (*ap.s == '$' || *ap.s == '`') p->arith_dynamic = 1;
+        else parse_error(p, "arithmetic syntax error: unexpected token");
+        return NULL;
+    }
+    return e;
+}
+
+// Word parsing: turn raw word text into literal and expansion parts
+typedef struct {
+    parser_t *p;
+    word_t *w;
+    wpart_t **tail;
+    strbuf_t lit;
+    int lit_quoted;
+} wbuild_t;
+
+void wb_flush(wbuild_t *wb) {
+    if (!wb->lit.data || wb->lit_quoted < 0) return;
+    wpart_t *part = parse_alloc(wb->p, sizeof(wpart_t));
+    part->type = WP_LIT;
+    part->quoted = wb->lit_quoted;
+    part->text = arena_strndup(wb->p->arena, wb->lit.data, wb->lit.len);
+    part->len = wb->lit.len;
+    if (!part->quoted && strpbrk(part->text, "*?[")) wb->w->flags |= WF_MAYGLOB;
+    *wb->tail = part;
+    wb->tail = &part->next;
+    wb->lit.len = 0;
+    wb->lit_quoted = -1;
+}
+
+void wb_lit(wbuild_t *wb, const char *s, size_t n, int quoted) {
+    if (wb->lit_quoted != quoted) wb_flush(wb);
+    wb->lit_quoted = quoted;
+    sb_append(&wb->lit, s, n);
+}
+
+void wb_part(wbuild_t *wb, wpart_t *part) {
+    // The empty literal that marks an opening quote is redundant before a quoted
+    // expansion, and would turn a quoted "$@" with no parameters into one field
+    if (part->quoted && wb->lit_quoted == 1 && !wb->lit.len) wb->lit_quoted = -1;
+    wb_flush(wb);
+    *wb->tail = part;
+    wb->tail = &part->next;
+    wb->w->flags |= WF_EXPANDS;
+    if (!part->quoted && part->type != WP_ARITH && part->type != WP_ARITH_DYN && part->type != WP_PROCSUB) {
+        wb->w->flags |= WF_MAYGLOB;
+    }
+}
+
+void parse_word_parts(wbuild_t *wb, const char *s, size_t n, int quoted);
+word_t* parse_word(parser_t *p, const char *s, size_t n, int quoted);
+
+// Find the end of a double-quoted section starting after the quote
+size_t word_skip_dquote(parser_t *p, const char *s, size_t n, size_t i) {
+    parser_t sub = *p;
+    sub.src = s;
+    sub.len = n;
+    sub.incomplete = 0;
+    size_t end = lex_skip_dquote(&sub, i);
+    return sub.incomplete ? n : end - 1;
+}
+
+// Parse the inside of ${...}
+wpart_t* parse_braced_param(parser_t *p, const char *s, size_t n, int quoted) {
+    wpart_t *part = parse_alloc(p, sizeof(wpart_t));
+    const char *end = s + n, *q = s;
+    part->type = WP_PARAM;
+    part->quoted = quoted;
+
+    if (n > 1 && s[0] == '#' && (is_name_char((unsigned char)s[1]) || strchr("@*#?", s[1]))) {
+        part->op = PARAM_LENGTH;
+        q++;
+    } else if (n > 1 && s[0] == '!' && is_name_start((unsigned char)s[1])) {
+        part->op = PARAM_KEYS;
+        q++;
+    }
+    const char *name = q;
+    if (q < end && is_name_start((unsigned char)*q)) {
+        while (q < end && is_name_char((unsigned char)*q)) q++;
+        part->ptype = PT_VAR;
+    } else if (q < end && isdigit((unsigned char)*q)) {
+        while (q < end && isdigit((unsigned char)*q)) part->num = part->num * 10 + (*q++ - '0');
+        part->ptype = part->num == 0 && q - name == 1 ? PT_SPECIAL : PT_POS;
+        if (part->ptype == PT_SPECIAL) part->num = '0';
+    } else if (q < end && strchr("?#@*$!-", *q)) {
+        part->ptype = PT_SPECIAL;
+        part->num = *q++;
+    } else {
+        parse_error(p, "bad substitution");
+        return NULL;
+    }
+    part->text = arena_strndup(p->arena, name, q - name);
+    part->len = q - name;
+    if (part->ptype == PT_VAR && q < end && *q == '[') {
+        size_t close = subscript_end(q, end - q, 0);
+        if (!close) {
+            parse_error(p, "bad substitution");
+            return NULL;
+        }
+        if (close == 3 && (q[1] == '@' || q[1] == '*')) {
+            part->ptype = PT_ARRAY;
+            part->num = q[1];
+        } else {
+            part->ptype = PT_ELEM;
+            part->index = parse_word(p, q + 1, close - 2, 0);
+        }
+        q += close;
+    }
+    if (part->op == PARAM_KEYS && (part->ptype != PT_ARRAY || q != end)) {
+        parse_error(p, "bad substitution");
+        return NULL;
+    }
+
+    if (q == end) return part;
+    if (part->op == PARAM_LENGTH) {
+        parse_error(p, "bad substitution");
+        return NULL;
+    }
+
+    char c = *q;
+    if ((c == ':' && q + 1 < end && strchr("-=+?", q[1])) || strchr("-=+?", c)) {
+        if (c == ':') {
+            part->colon = 1;
+            c = *++q;
+        }
+        part->op = c == '-' ? PARAM_DEFAULT : c == '=' ? PARAM_ASSIGN : c == '+' ? PARAM_ALT : PARAM_ERROR;
+        q++;
+        part->arg1 = parse_word(p, q, end - q, quoted);
+    } else if (c == ':') {
+        const char *colon2 = find_unquoted(q + 1, end, ':');
+        part->op = PARAM_SUBSTR;
+        part->arith = arith_parse(p, q + 1, (colon2 ? colon2 : end) - (q + 1));
+        if (colon2) part->arith2 = arith_parse(p, colon2 + 1, end - colon2 - 1);
+        if (!part->arith || (colon2 && !part->arith2)) {
+            if (p->arith_dynamic) parse_error(p, "bad substitution: substring offsets must be plain arithmetic");
+            return NULL;
+        }
+    } else if (c == '#' || c == '%') {
+        int longest = q + 1 < end && q[1] == c;
+        part->op = c == '#' ? (longest ? PARAM_TRIM_PREFIX_LONG : PARAM_TRIM_PREFIX)
+                            : (longest ? PARAM_TRIM_SUFFIX_LONG : PARAM_TRIM_SUFFIX);
+        q += 1 + longest;
+        part->arg1 = parse_word(p, q, end - q, 0);
+    } else if (c == '/') {
+        q++;
+        part->op = PARAM_SUBST;
+        if (q < end && *q == '/') part->op = PARAM_SUBST_ALL, q++;
+        else if (q < end && *q == '#') part->op = PARAM_SUBST_PREFIX, q++;
+        else if (q < end && *q == '%') part->op = PARAM_SUBST_SUFFIX, q++;
+        const char *slash = find_unquoted(q, end, '/');
+        part->arg1 = parse_word(p, q, (slash ? slash : end) - q, 0);
+        if (slash) part->arg2 = parse_word(p, slash + 1, end - slash - 1, quoted);
+    } else {
+        parse_error(p, "bad substitution");
+        return NULL;
+    }
+    return part;
+}
+
+node_t* parse_program(parser_t *p);
+
+// Parse the command list of $(...) or `...` held in s[0..n); op is '<' or '>'
+// for process substitution
+void parse_cmdsub(wbuild_t *wb, const char *s, size_t n, int quoted, int op) {
+    parser_t *p = wb->p;
+    parser_t sub = {0};
+    sub.src = s;
+    sub.len = n;
+    sub.line = p->line;
+    sub.name = p->name;
+    sub.arena = p->arena;
+    sub.aliases = p->aliases;
+    node_t *body = parse_program(&sub);
+    if (!body) {
+        if (sub.incomplete) parse_error(p, "unterminated command substitution");
+        p->error = 1;
+        return;
+    }
+    wpart_t *part = parse_alloc(p, sizeof(wpart_t));
+    part->type = op ? WP_PROCSUB : WP_CMDSUB;
+    part->quoted = quoted;
+    part->op = op;
+    part->body = body;
+    wb_part(wb, part);
+}
+
+// Parse a '$' expansion at s[i]; returns the index after it
+size_t parse_dollar(wbuild_t *wb, const char *s, size_t n, size_t i, int quoted) {
+    parser_t *p = wb->p;
+    size_t j = i + 1;
+
+    if (j + 1 < n && s[j] == '(' && s[j + 1] == '(') {
+        // $(( arithmetic ))
+        parser_t sub = *p;
+        sub.src = s;
+        sub.len = n;
+        sub.incomplete = 0;
+        size_t close = lex_skip_parens(&sub, j + 1);
+        if (!sub.incomplete && (close < j + 4 || s[close - 2] != ')')) {
+            // $( (subshell) ...) is a command substitution
+            parse_cmdsub(wb, s + j + 1, close - j - 2, quoted, 0);
+            return close;
+        }
+        if (sub.incomplete) {
+            parse_error(p, "unterminated arithmetic expansion");
+            return n;
+        }
+        wpart_t *part = parse_alloc(p, sizeof(wpart_t));
+        part->type = WP_ARITH;
+        part->quoted = quoted;
+        p->arith_dynamic = 0;
+        part->arith = arith_parse(p, s + j + 2, close - 2 - (j + 2));
+        if (!part->arith) {
+            if (!p->arith_dynamic) return n;
+            p->arith_dynamic = 0;
+            part->type = WP_ARITH_DYN;
+            part->arg1 = parse_word(p, s + j + 2, close - 2 - (j + 2), 1);
+        }
+        wb_part(wb, part);
+        return close;
+    }
+    if (j < n && s[j] == '(') {
+        parser_t sub = *p;
+        sub.src = s;
+        sub.len = n;
+        sub.incomplete = 0;
+        size_t close = lex_skip_parens(&sub, j + 1);
+        if (sub.incomplete) {
+            parse_error(p, "unterminated command substitution");
+            return n;
+        }
+        parse_cmdsub(wb, s + j + 1, close - j - 2, quoted, 0);
+        return close;
+    }
+    if (j < n && s[j] == '{') {
+        parser_t sub = *p;
+        sub.src = s;
+        sub.len = n;
+        sub.incomplete = 0;
+        size_t close = lex_skip_braces(&sub, j + 1);
+        if (sub.incomplete) {
+            parse_error(p, "bad substitution: missing '}'");
+            return n;
+        }
+        wpart_t *part = parse_braced_param(p, s + j + 1, close - j - 2, quoted);
+        if (part) wb_part(wb, part);
+        return close;
+    }
+
+    wpart_t *part = parse_alloc(p, sizeof(wpart_t));
+    part->type = WP_PARAM;
+    part->quoted = quoted;
+    if (j < n && is_name_start((unsigned char)s[j])) {
+        size_t k = j;
+        while (k < n && is_name_char((unsigned char)s[k])) k++;
+        part->ptype = PT_VAR;
+        part->text = arena_strndup(p->arena, s + j, k - j);
+        part->len = k - j;
+        wb_part(wb, part);
+        return k;
+    }
+    if (j < n && isdigit((unsigned char)s[j])) {
+        part->ptype = s[j] == '0' ? PT_SPECIAL : PT_POS;
+        part->num = s[j] == '0' ? '0' : s[j] - '0';
+        wb_part(wb, part);
+        return j + 1;
+    }
+    if (j < n && strchr("?#@*$!-", s[j])) {
+        part->ptype = PT_SPECIAL;
+        part->num = s[j];
+        wb_part(wb, part);
+        return j + 1;
+    }
+    wb_lit(wb, "$", 1, quoted);
+    return j;
+}
+
+void parse_word_parts(wbuild_t *wb, const char *s, size_t n, int quoted) {
+    size_t i = 0;
+    while (i < n && !wb->p->error) {
+        char c = s[i];
+        if (c == '\'' && !quoted) {
+            const char *q = memchr(s + i + 1, '\'', n - i - 1);
+            size_t close = q ? (size_t)(q - s) : n;
+            wb_lit(wb, s + i + 1, close - i - 1, 1);
+            i = close + 1;
+        } else if (c == '"' && !quoted) {
+            size_t close = word_skip_dquote(wb->p, s, n, i + 1);
+            wb_lit(wb, "", 0, 1);
+            parse_word_parts(wb, s + i + 1, close - i - 1, 1);
+            i = close + 1;
+        } else if (c == '\\' && i + 1 < n) {
+            char nc = s[i + 1];
+            if (nc == '\n') {
+                i += 2;
+            } else if (!quoted || strchr("$`\"\\", nc)) {
+                wb_lit(wb, &nc, 1, 1);
+                i += 2;
+            } else {
+                wb_lit(wb, "\\", 1, 1);
+                i++;
+            }
+        } else if (c == '$') {
+            i = parse_dollar(wb, s, n, i, quoted);
+        } else if ((c == '<' || c == '>') && !quoted && i + 1 < n && s[i + 1] == '(') {
+            parser_t sub = *wb->p;
+            sub.src = s;
+            sub.len = n;
+            sub.incomplete = 0;
+            size_t close = lex_skip_parens(&sub, i + 2);
+            if (sub.incomplete) {
+                parse_error(wb->p, "unterminated process substitution");
+                return;
+            }
+            parse_cmdsub(wb, s + i + 2, close - i - 3, 0, c);
+            i = close;
+        } else if (c == '`') {
+            // Backquotes: \\, \` and \$ lose their backslash before parsing
+            strbuf_t text = {0};
+            size_t k = i + 1;
+            for (; k < n && s[k] != '`'; k++) {
+                if (s[k] == '\\' && k + 1 < n && (s[k + 1] == '\\' || s[k + 1] == '`' || s[k + 1] == '$' ||
+                                                 (quoted && s[k + 1] == '"'))) {
+                    k++;
+                }
+                sb_putc(&text, s[k]);
+            }
+            if (k >= n) {
+                free(text.data);
+                parse_error(wb->p, "unterminated command substitution");
+                return;
+            }
+            char *body = arena_strndup(wb->p->arena, text.data ? text.data : "", text.len);
+            free(text.data);
+            parse_cmdsub(wb, body, strlen(body), quoted, 0);
+            i = k + 1;
+        } else {
+            wb_lit(wb, &c, 1, quoted);
+            i++;
+        }
+    }
+}
+
+word_t* parse_word(parser_t *p, const char *s, size_t n, int quoted) {
+    wbuild_t wb = {p, NULL, NULL, {0}, -1};
+    wb.w = parse_alloc(p, sizeof(word_t));
+    wb.tail = &wb.w->parts;
+
+    // Leading unquoted ~ or ~user up to the first slash
+    if (!quoted && n > 0 && s[0] == '~') {
+        size_t k = 1;
+        while (k < n && s[k] != '/' && (is_name_char((unsigned char)s[k]) || s[k] == '-' || s[k] == '.')) k++;
+        if (k == n || s[k] == '/') {
+            wpart_t *part = parse_alloc(p, sizeof(wpart_t));
+            part->type = WP_TILDE;
+            part->text = arena_strndup(p->arena, s + 1, k - 1);
+            part->len = k - 1;
+            *wb.tail = part;
+            wb.tail = &part->next;
+            wb.w->flags |= WF_EXPANDS;
+            s += k;
+            n -= k;
+        }
+    }
+    parse_word_parts(&wb, s, n, quoted);
+    wb_flush(&wb);
+    free(wb.lit.data);
+    return wb.w;
+}
+
+// Is raw word text a NAME=value, NAME[sub]=value or NAME+=value assignment?
+// Returns the length of the part before '=' or '+='
+size_t assignment_name_len(const char *s, size_t n) {
+    size_t i = 0;
+    if (n == 0 || !is_name_start((unsigned char)s[0])) return 0;
+    while (i < n && is_name_char((unsigned char)s[i])) i++;
+    if (i < n && s[i] == '[' && !(i = subscript_end(s, n, i))) return 0;
+    if (i < n && s[i] == '=') return i;
+    if (i + 1 < n && s[i] == '+' && s[i + 1] == '=') return i;
+    return 0;
+}
+
+node_t* parse_list(parser_t *p);
+node_t* parse_command(parser_t *p);
+
+node_t* new_node(parser_t *p, int type) {
+    node_t *n = parse_alloc(p, sizeof(node_t));
+    n->type = type;
+    n->line = p->line;
+    return n;
+}
+
+int is_redirect_tok(int tok) {
+    return tok == T_LESS || tok == T_GREAT || tok == T_DGREAT || tok == T_LESSAND || tok == T_GREATAND ||
+           tok == T_LESSGREAT || tok == T_CLOBBER || tok == T_ANDGREAT || tok == T_ANDDGREAT ||
+           tok == T_DLESS || tok == T_DLESSDASH || tok == T_TLESS;
+}
+
+// Parse one redirection (optionally preceded by an IO number)
+redir_t* parse_redirect(parser_t *p) {
+    redir_t *r = parse_alloc(p, sizeof(redir_t));
+    int tok = lex_next(p);
+    r->fd = -1;
+    if (tok == T_IO_NUMBER) {
+        r->fd = atoi(p->text);
+        tok = lex_next(p);
+    }
+    switch (tok) {
+    case T_LESS: r->type = R_IN; break;
+    case T_GREAT: case T_CLOBBER: r->type = R_OUT; break;
+    case T_DGREAT: r->type = R_APPEND; break;
+    case T_LESSGREAT: r->type = R_RW; break;
+    case T_LESSAND: r->type = R_DUPIN; break;
+    case T_GREATAND: r->type = R_DUPOUT; break;
+    case T_ANDGREAT: r->type = R_BOTH; break;
+    case T_ANDDGREAT: r->type = R_BOTH_APPEND; break;
+    case T_DLESS: case T_DLESSDASH: r->type = R_HEREDOC; break;
+    case T_TLESS: r->type = R_HERESTR; break;
+    default:
+        parse_unexpected(p);
+        return NULL;
+    }
+    if (r->fd < 0) r->fd = (r->type == R_IN || r->type == R_RW || r->type == R_DUPIN || r->type >= R_HEREDOC) ? 0 : 1;
+    if (r->type == R_HEREDOC) r->strip_tabs = tok == T_DLESSDASH;
+    if (lex_next(p) != T_WORD) {
+        parse_unexpected(p);
+        return NULL;
+    }
+    if (r->type == R_HEREDOC) {
+        // The body is read when the lexer reaches the end of this line; quoting
+        // any part of the delimiter turns off expansion in the body
+        strbuf_t delim = {0};
+        int quoted = 0;
+        for (size_t i = 0; i < p->tlen; i++) {
+            char c = p->text[i];
+            if (c == '\'' || c == '"') {
+                quoted = 1;
+            } else if (c == '\\' && i + 1 < p->tlen) {
+                quoted = 1;
+                sb_putc(&delim, p->text[++i]);
+            } else {
+                sb_putc(&delim, c);
+            }
+        }
+        r->delim = arena_strndup(p->arena, delim.data ? delim.data : "", delim.len);
+        r->dlen = delim.len;
+        free(delim.data);
+        r->target = quoted ? NULL : (word_t *)1;
+        if (!p->docs) p->docs_tail = &p->docs;
+        *p->docs_tail = r;
+        p->docs_tail = &r->doc_next;
+        return r;
+    }
+    r->target = parse_word(p, p->text, p->tlen, 0);
+    return r;
+}
+
+// Trailing redirections after a compound command
+int parse_redirects(parser_t *p, redir_t **tail) {
+    while (!p->error && !p->incomplete) {
+        int tok = lex_peek(p);
+        if (tok != T_IO_NUMBER && !is_redirect_tok(tok)) break;
+        redir_t *r = parse_redirect(p);
+        if (!r) return 0;
+        *tail = r;
+        tail = &r->next;
+    }
+    return !p->error && !p->incomplete;
+}
+
+// Read the raw text of (( ... )) after the opening parens were consumed
+int parse_arith_text(parser_t *p, const char **text, size_t *len) {
+    size_t close = lex_skip_parens(p, p->pos);
+    if (p->incomplete) return 0;
+    if (close >= p->len || p->src[close] != ')') {
+        parse_error(p, "syntax error: expected '))'");
+        return 0;
+    }
+    *text = p->src + p->pos;
+    *len = close - 1 - p->pos;
+    p->pos = close + 1;
+    return 1;
+}
+
+// The elements of name=( ... ): words, or [key]=value pairs
+int parse_array_elems(parser_t *p, assign_t *a, const char *s, size_t n) {
+    parser_t sub = {0};
+    sub.src = s;
+    sub.len = n;
+    sub.line = p->line;
+    sub.name = p->name;
+    sub.arena = p->arena;
+    word_t *elems[MAX_ARGS * 4], *keys[MAX_ARGS * 4];
+    a->compound = 1;
+    while (1) {
+        int tok = lex_next(&sub);
+        if (tok == T_NEWLINE) continue;
+        if (tok == T_EOF) break;
+        if (tok != T_WORD) {
+            parse_error(p, "syntax error in array assignment");
+            return 0;
+        }
+        if (a->nelems >= (int)(sizeof(elems) / sizeof(elems[0]))) {
+            parse_error(p, "too many array elements");
+            return 0;
+        }
+        size_t close = sub.text[0] == '[' ? subscript_end(sub.text, sub.tlen, 0) : 0;
+        if (close && close < sub.tlen && sub.text[close] == '=') {
+            keys[a->nelems] = parse_word(p, sub.text + 1, close - 2, 0);
+            elems[a->nelems++] = parse_word(p, sub.text + close + 1, sub.tlen - close - 1, 0);
+        } else {
+            keys[a->nelems] = NULL;
+            elems[a->nelems++] = parse_word(p, sub.text, sub.tlen, 0);
+        }
+    }
+    if (sub.error || sub.incomplete || p->error) {
+        if (!p->error) parse_error(p, "syntax error in array assignment");
+        return 0;
+    }
+    a->elems = parse_alloc(p, a->nelems * sizeof(word_t *) + 1);
+    a->keys = parse_alloc(p, a->nelems * sizeof(word_t *) + 1);
+    memcpy(a->elems, elems, a->nelems * sizeof(word_t *));
+    memcpy(a->keys, keys, a->nelems * sizeof(word_t *));
+    return 1;
+}
+
+node_t* parse_simple(parser_t *p) {
+    node_t *n = new_node(p, N_SIMPLE);
+    word_t *words[MAX_ARGS * 4];
+    assign_t **atail = &n->assigns, **ptail = &n->post;
+    redir_t **rtail = &n->redirs;
+    int declaring = 0;
+
+    while (!p->error && !p->incomplete) {
+        int tok = lex_peek(p);
+        if (tok == T_IO_NUMBER || is_redirect_tok(tok)) {
+            redir_t *r = parse_redirect(p);
+            if (!r) return NULL;
+            *rtail = r;
+            rtail = &r->next;
+            continue;
+        }
+        if (tok != T_WORD) break;
+        if (p->alias_next) {
+            p->alias_next = 0;
+            alias_expand(p);
+            continue;
+        }
+        lex_next(p);
+        if (n->nwords >= (int)(sizeof(words) / sizeof(words[0]))) {
+            parse_error(p, "too many arguments");
+            return NULL;
+        }
+        size_t nlen = n->nwords == 0 || declaring ? assignment_name_len(p->text, p->tlen) : 0;
+        if (nlen && n->nwords) {
+            size_t vstart = nlen + 1 + (p->text[nlen] == '+');
+            if (memchr(p->text, '[', nlen) || vstart >= p->tlen || p->text[vstart] != '(' || p->text[p->tlen - 1] != ')') nlen = 0;
+        }
+        if (nlen) {
+            assign_t *a = parse_alloc(p, sizeof(assign_t));
+            a->append = p->text[nlen] == '+';
+            size_t vstart = nlen + 1 + a->append;
+            const char *sub = memchr(p->text, '[', nlen);
+            if (sub) {
+                a->index = parse_word(p, sub + 1, p->text + nlen - sub - 2, 0);
+                nlen = sub - p->text;
+            }
+            a->name = arena_strndup(p->arena, p->text, nlen);
+            a->nlen = nlen;
+            if (!sub && vstart < p->tlen && p->text[vstart] == '(' && p->text[p->tlen - 1] == ')') {
+                if (!parse_array_elems(p, a, p->text + vstart + 1, p->tlen - vstart - 2)) return NULL;
+            } else {
+                a->value = parse_word(p, p->text + vstart, p->tlen - vstart, 0);
+            }
+            if (n->nwords) {
+                // declare sees only the name; the array is assigned once it has run
+                words[n->nwords++] = parse_word(p, a->name, a->nlen, 0);
+                *ptail = a;
+                ptail = &a->next;
+                continue;
+            }
+            *atail = a;
+            atail = &a->next;
+            continue;
+        }
+        if (!n->nwords) {
+            declaring = (p->tlen == 7 && (memcmp(p->text, "declare", 7) == 0 || memcmp(p->text, "typeset", 7) == 0)) ||
+                        (p->tlen == 5 && memcmp(p->text, "local", 5) == 0);
+        }
+        words[n->nwords++] = parse_word(p, p->text, p->tlen, 0);
+    }
+    if (p->error || p->incomplete) return NULL;
+    if (n->nwords) {
+        n->words = parse_alloc(p, n->nwords * sizeof(word_t *));
+        memcpy(n->words, words, n->nwords * sizeof(word_t *));
+    }
+    if (!n->nwords && !n->assigns && !n->redirs) {
+        lex_peek(p);
+        parse_unexpected(p);
+        return NULL;
+    }
+    return n;
+}
+
+// Compound list up to a closing reserved word: "do ... done", "then ... fi"
+node_t* parse_compound_list(parser_t *p, const char *closer) {
+    node_t *body = parse_list(p);
+    if (!body) return NULL;
+    if (closer && !expect_word(p, closer)) return NULL;
+    return body;
+}
+
+node_t* parse_if(parser_t *p) {
+    node_t *n = new_node(p, N_IF);
+    if (!(n->a = parse_compound_list(p, "then"))) return NULL;
+    if (!(n->b = parse_list(p))) return NULL;
+    if (tok_is(p, "elif")) {
+        lex_next(p);
+        n->c = parse_if(p);
+        return n->c ? n : NULL;
+    }
+    if (tok_is(p, "else")) {
+        lex_next(p);
+        if (!(n->c = parse_list(p))) return NULL;
+    }
+    return expect_word(p, "fi") ? n : NULL;
+}
+
+node_t* parse_while(parser_t *p, int type) {
+    node_t *n = new_node(p, type);
+    if (!(n->a = parse_compound_list(p, "do"))) return NULL;
+    if (!(n->b = parse_compound_list(p, "done"))) return NULL;
+    return n;
+}
+
+node_t* parse_for(parser_t *p) {
+    node_t *n = new_node(p, N_FOR);
+    int tok = lex_next(p);
+
+    if (tok == T_DLPAREN) {
+        // for (( init; cond; step ))
+        const char *text;
+        size_t len;
+        if (!parse_arith_text(p, &text, &len)) return NULL;
+        n->type = N_ARITH_FOR;
+        for (int k = 0; k < 3; k++) {
+            const char *semi = k < 2 ? memchr(text, ';', len) : NULL;
+            size_t part = semi ? (size_t)(semi - text) : len;
+            if (k < 2 && !semi) {
+                parse_error(p, "syntax error: expected ';' in for (( ))");
+                return NULL;
+            }
+            const char *t = text;
+            while (t < text + part && isspace((unsigned char)*t)) t++;
+            if (t < text + part) {
+                n->arith[k] = arith_parse(p, text, part);
+                if (!n->arith[k]) {
+                    if (p->arith_dynamic) parse_error(p, "for (( )) expressions must be plain arithmetic");
+                    return NULL;
+                }
+            }
+            text += part + 1;
+            len -= part + 1;
+        }
+        if (lex_peek(p) == T_SEMI) lex_next(p);
+        skip_newlines(p);
+        if (!expect_word(p, "do")) return NULL;
+        n->b = parse_compound_list(p, "done");
+        return n->b ? n : NULL;
+    }
+    if (tok != T_WORD || !is_name_start((unsigned char)p->text[0]) || assignment_name_len(p->text, p->tlen)) {
+        parse_unexpected(p);
+        return NULL;
+    }
+    n->name = arena_strndup(p->arena, p->text, p->tlen);
+    n->nlen = p->tlen;
+    skip_newlines(p);
+    if (tok_is(p, "in")) {
+        word_t *words[MAX_ARGS * 4];
+        lex_next(p);
+        n->nwords = 0;
+        while (lex_peek(p) == T_WORD) {
+            lex_next(p);
+            if (n->nwords >= (int)(sizeof(words) / sizeof(words[0]))) {
+                parse_error(p, "too many words in for list");
+                return NULL;
+            }
+            words[n->nwords++] = parse_word(p, p->text, p->tlen, 0);
+        }
+        n->words = parse_alloc(p, (n->nwords + 1) * sizeof(word_t *));
+        memcpy(n->words, words, n->nwords * sizeof(word_t *));
+        n->c = n;   // marks an explicit word list, even an empty one
+        tok = lex_peek(p);
+        if (tok != T_SEMI && tok != T_NEWLINE) {
+            parse_unexpected(p);
+            return NULL;
+        }
+        lex_next(p);
+    } else if (lex_peek(p) == T_SEMI) {
+        lex_next(p);
+    }
+    skip_newlines(p);
+    if (!expect_word(p, "do")) return NULL;
+    n->b = parse_compound_list(p, "done");
+    return n->b ? n : NULL;
+}
+
+node_t* parse_case(parser_t *p) {
+    node_t *n = new_node(p, N_CASE);
+    case_item_t **tail = &n->items;
+
+    if (lex_next(p) != T_WORD) {
+        parse_unexpected(p);
+        return NULL;
+    }
+    n->words = parse_alloc(p, sizeof(word_t *));
+    n->words[0] = parse_word(p, p->text, p->tlen, 0);
+    n->nwords = 1;
+    skip_newlines(p);
+    if (!expect_word(p, "in")) return NULL;
+
+    while (1) {
+        skip_newlines(p);
+        if (tok_is(p, "esac")) {
+            lex_next(p);
+            return n;
+        }
+        case_item_t *item = parse_alloc(p, sizeof(case_item_t));
+        word_t *pats[64];
+        if (lex_peek(p) == T_LPAREN) lex_next(p);
+        while (1) {
+            if (lex_next(p) != T_WORD) {
+                parse_unexpected(p);
+                return NULL;
+            }
+            if (item->npats < 64) pats[item->npats++] = parse_word(p, p->text, p->tlen, 0);
+            int tok = lex_next(p);
+            if (tok == T_RPAREN) break;
+            if (tok != T_PIPE) {
+                parse_unexpected(p);
+                return NULL;
+            }
+        }
+        item->pats = parse_alloc(p, item->npats * sizeof(word_t *));
+        memcpy(item->pats, pats, item->npats * sizeof(word_t *));
+        if (!(item->body = parse_list(p))) return NULL;
+        *tail = item;
+        tail = &item->next;
+
+        int tok = lex_peek(p);
+        if (tok == T_DSEMI || tok == T_SEMIAND) {
+            item->fallthrough = tok == T_SEMIAND;
+            lex_next(p);
+        } else if (!tok_is(p, "esac")) {
+            parse_unexpected(p);
+            return NULL;
+        }
+    }
+}
+
+// Function body: any compound command plus its redirections
+node_t* parse_function_body(parser_t *p, const char *name, size_t nlen) {
+    node_t *n = new_node(p, N_FUNC);
+    n->name = arena_strndup(p->arena, name, nlen);
+    n->nlen = nlen;
+    skip_newlines(p);
+    n->a = parse_command(p);
+    if (!n->a) return NULL;
+    if (n->a->type == N_SIMPLE) {
+        parse_error(p, "syntax error: function body must be a compound command");
+        return NULL;
+    }
+    return n;
+}
+
+node_t* parse_command(parser_t *p) {
+    alias_expand(p);
+    p->alias_next = 0;
+    int tok = lex_peek(p);
+    node_t *n = NULL;
+
+    if (tok == T_DLPAREN) {
+        lex_next(p);
+        const char *text;
+        size_t len;
+        if (!parse_arith_text(p, &text, &len)) return NULL;
+        n = new_node(p, N_ARITH);
+        p->arith_dynamic = 0;
+        n->arith[0] = arith_parse(p, text, len);
+        if (!n->arith[0]) {
+            if (!p->arith_dynamic) return NULL;
+            // Expanded at runtime, like $(( )) with $var or ${...} inside
+            p->arith_dynamic = 0;
+            n->words = parse_alloc(p, sizeof(word_t *));
+            n->words[0] = parse_word(p, text, len, 1);
+            n->nwords = 1;
+        }
+    } else if (tok == T_LPAREN) {
+        lex_next(p);
+        n = new_node(p, N_SUBSHELL);
+        if (!(n->a = parse_list(p))) return NULL;
+        if (lex_next(p) != T_RPAREN) {
+            parse_unexpected(p);
+            return NULL;
+        }
+    } else if (tok == T_WORD) {
+        if (tok_is(p, "{")) {
+            lex_next(p);
+            n = new_node(p, N_GROUP);
+            if (!(n->a = parse_compound_list(p, "}"))) return NULL;
+        } else if (tok_is(p, "if")) {
+            lex_next(p);
+            n = parse_if(p);
+        } else if (tok_is(p, "while") || tok_is(p, "until")) {
+            int type = tok_is(p, "while") ? N_WHILE : N_UNTIL;
+            lex_next(p);
+            n = parse_while(p, type);
+        } else if (tok_is(p, "for")) {
+            lex_next(p);
+            n = parse_for(p);
+        } else if (tok_is(p, "case")) {
+            lex_next(p);
+            n = parse_case(p);
+        } else if (tok_is(p, "function")) {
+            lex_next(p);
+            if (lex_next(p) != T_WORD) {
+                parse_unexpected(p);
+                return NULL;
+            }
+            const char *name = p->text;
+            size_t nlen = p->tlen;
+            if (lex_peek(p) == T_LPAREN) {
+                lex_next(p);
+                if (lex_next(p) != T_RPAREN) {
+                    parse_unexpected(p);
+                    return NULL;
+                }
+            }
+            return parse_function_body(p, name, nlen);
+        } else if (tok_is(p, "then") || tok_is(p, "else") || tok_is(p, "elif") || tok_is(p, "fi") ||
+                   tok_is(p, "do") || tok_is(p, "done") || tok_is(p, "esac") || tok_is(p, "}") || tok_is(p, "in")) {
+            parse_unexpected(p);
+            return NULL;
+        } else {
+            // name() compound-command defines a function. The ( is looked
+            // for in the text right after the name instead of lexing ahead,
+            // which could run off the end of an alias and lose its place
+            const char *name = p->text;
+            size_t nlen = p->tlen, i = p->pos;
+            while (i < p->len && (p->src[i] == ' ' || p->src[i] == '\t')) i++;
+            if (i < p->len && p->src[i] == '(' && (i + 1 >= p->len || p->src[i + 1] != '(')) {
+                lex_next(p);
+                lex_next(p);
+                if (lex_next(p) != T_RPAREN) {
+                    parse_unexpected(p);
+                    return NULL;
+                }
+                return parse_function_body(p, name, nlen);
+            }
+            return parse_simple(p);
+        }
+        if (!n) return NULL;
+    } else {
+        return parse_simple(p);
+    }
+    if (!parse_redirects(p, &n->redirs)) return NULL;
+    return n;
+}
+
+node_t* parse_pipeline(parser_t *p) {
+    int negate = 0;
+    if (tok_is(p, "!")) {
+        lex_next(p);
+        negate = 1;
+    }
+    node_t *first = parse_command(p);
+    if (!first) return NULL;
+    node_t *n = first;
+    if (lex_peek(p) == T_PIPE) {
+        node_t **tail = &first->next;
+        n = new_node(p, N_PIPE);
+        n->a = first;
+        n->nwords = 1;
+        while (lex_peek(p) == T_PIPE) {
+            lex_next(p);
+            skip_newlines(p);
+            node_t *stage = parse_command(p);
+            if (!stage) return NULL;
+            *tail = stage;
+            tail = &stage->next;
+            n->nwords++;
+        }
+    }
+    if (negate) {
+        node_t *not = new_node(p, N_NOT);
+        not->a = n;
+        n = not;
+    }
+    return n;
+}
+
+node_t* parse_and_or(parser_t *p) {
+    node_t *lhs = parse_pipeline(p);
+    while (lhs) {
+        int tok = lex_peek(p);
+        if (tok != T_AND_IF && tok != T_OR_IF) break;
+        lex_next(p);
+        skip_newlines(p);
+        node_t *n = new_node(p, tok == T_AND_IF ? N_AND : N_OR);
+        n->a = lhs;
+        n->b = parse_pipeline(p);
+        if (!n->b) return NULL;
+        lhs = n;
+    }
+    return lhs;
+}
+
+int at_list_end(parser_t *p) {
+    int tok = lex_peek(p);
+    if (tok == T_EOF || tok == T_RPAREN || tok == T_DSEMI || tok == T_SEMIAND) return 1;
+    return tok_is(p, "then") || tok_is(p, "else") || tok_is(p, "elif") || tok_is(p, "fi") ||
+           tok_is(p, "do") || tok_is(p, "done") || tok_is(p, "esac") || tok_is(p, "}");
+}
+
+// A list of and-or commands separated by ';', '&' or newlines
+node_t* parse_list(parser_t *p) {
+    node_t *list = new_node(p, N_LIST);
+    node_t **tail = &list->a;
+
+    while (1) {
+        skip_newlines(p);
+        if (p->error || p->incomplete || at_list_end(p)) break;
+        node_t *n = parse_and_or(p);
+        if (!n) return NULL;
+        int tok = lex_peek(p);
+        if (tok == T_AMP) {
+            node_t *bg = new_node(p, N_BG);
+            bg->a = n;
+            n = bg;
+        }
+        *tail = n;
+        tail = &n->next;
+        if (tok == T_AMP || tok == T_SEMI || tok == T_NEWLINE) lex_next(p);
+        else break;
+    }
+    if (p->error || p->incomplete) return NULL;
+    return list;
+}
+
+// Whole program: a list that must consume all input
+node_t* parse_program(parser_t *p) {
+    node_t *list = parse_list(p);
+    if (!list) return NULL;
+    if (lex_peek(p) != T_EOF) {
+        parse_unexpected(p);
+        return NULL;
+    }
+    return list;
+}
+
+// Bytecode: a flat array of 32-bit words plus a string pool and a table of
+// variable names. Operands are pool offsets and name indexes, never pointers,
+// so a chunk can be written out and mapped back in unchanged.
+enum {
+    OP_END,             // leave the current region
+    OP_JMP,             // target
+    OP_JMP_FALSE,       // target: jump if status != 0
+    OP_JMP_TRUE,        // target: jump if status == 0
+    OP_NOT,
+    OP_STATUS,          // value
+    OP_CMD_BEGIN,
+    OP_CMD_END,
+    OP_WORD_LIT,        // str: push a literal argument
+    OP_WBEGIN,          // mode flags
+    OP_WLIT,            // str len quoted
+    OP_WVAR,            // name quoted
+    OP_WELEM,           // name quoted; preceded by the subscript word
+    OP_WARRAY,          // name '@'/'*' quoted
+    OP_WPOS,            // index quoted
+    OP_WSPECIAL,        // char quoted
+    OP_WPARAM,          // ptype target op flags next arg1 arg2
+    OP_WARITH,          // quoted next; arithmetic code follows
+    OP_WARITH_DYN,      // quoted; preceded by the expression text word
+    OP_WTILDE,          // str
+    OP_WCMDSUB,         // quoted next fork; body region follows
+    OP_WPROCSUB,        // op next; body region follows
+    OP_WEND,
+    OP_SETVAR,          // name append
+    OP_ASSIGN_PUSH,     // name append
+    OP_SETELEM,         // name append; preceded by subscript and value words
+    OP_ARRAY_BEGIN,     // name append
+    OP_ARRAY_ADD,       // elements pushed since OP_ARRAY_BEGIN
+    OP_ARRAY_KEY,       // preceded by key and value words
+    OP_ARRAY_END,
+    OP_REDIR_PUSH,      // type fd
+    OP_EXEC,            // builtin flags
+    OP_REDIR_APPLY,     // skip target on failure
+    OP_REDIR_END,
+    OP_SUBSHELL,        // next fork flags; body region follows
+    OP_PIPELINE,        // count flags stage... end
+    OP_BG,              // end
+    OP_LOOP_ENTER,      // break-target continue-target
+    OP_LOOP_SAVE,
+    OP_LOOP_LEAVE,
+    OP_FOR_INIT,
+    OP_FOR_ARGS,
+    OP_FOR_NEXT,        // name exit
+    OP_CASE_PUSH,
+    OP_CASE_TEST,       // target
+    OP_CASE_POP,
+    OP_DEFUN,           // name body end
+    OP_ARITH_CMD,       // next; arithmetic code follows
+    OP_ARITH_DYN_CMD,   // preceded by the expression text word
+
+    // Arithmetic ops, run by arith_run until A_END
+    A_NUM,              // low high
+    A_VAR,              // name
+    A_PARAM,            // ptype value
+    A_ASSIGN,           // name op
+    A_INCDEC,           // name flags
+    A_ELEM,             // name subscript
+    A_ELEM_ASSIGN,      // name subscript op
+    A_ELEM_INCDEC,      // name subscript flags
+    A_UNARY,            // op
+    A_BINARY,           // op
+    A_JZ,               // target
+    A_JNZ,              // target
+    A_JMP,              // target
+    A_BOOL,
+    A_POP,
+    A_END
+};
+
+// OP_WBEGIN modes and flags
+#define WM_FIELDS 0      // split and glob into separate arguments
+#define WM_STRING 1      // a single string, no splitting or globbing
+#define WM_PATTERN 2     // a single string with quoted glob characters escaped
+#define WM_MODE_MASK 3
+#define WM_MAYGLOB 4
+
+// OP_EXEC flags
+#define EXF_COND 1       // status is tested, so errexit does not apply
+#define EXF_TAIL 2       // last command of its region
+
+struct chunk {
+    uint32_t *code;
+    uint32_t ncode;
+    uint32_t code_cap;
+    char *strs;
+    uint32_t strs_len;
+    uint32_t strs_cap;
+    uint32_t *names;        // pool offsets of variable names
+    uint32_t nnames;
+    uint32_t names_cap;
+    int *slots;             // names[i] resolved to a variable slot at load time
+    int refs;
+    void *map;              // code, names and strings point into a mapped cache file
+    size_t map_len;
+    int image;              // ... or into the state image, which stays mapped
+};
+
+typedef struct {
+    chunk_t *ch;
+    strmap_t strs;
+    strmap_t names;
+} compiler_t;
+
+#define CSTR(ch, off) ((ch)->strs + (off))
+#define CSLOT(ch, idx) ((ch)->slots[idx])
+
+uint32_t emit(compiler_t *cc, uint32_t word) {
+    chunk_t *ch = cc->ch;
+    GROW(ch->code, ch->ncode, ch->code_cap);
+    ch->code[ch->ncode] = word;
+    return ch->ncode++;
+}
+
+void patch(compiler_t *cc, uint32_t at) {
+    cc->ch->code[at] = cc->ch->ncode;
+}
+
+// Intern a string in the pool; returns its offset
+uint32_t cc_str(compiler_t *cc, const char *s, size_t n) {
+    chunk_t *ch = cc->ch;
+    int off = strmap_get(&cc->strs, s, n);
+    if (off >= 0) return off;
+    while (ch->strs_len + n + 1 > ch->strs_cap) {
+        ch->strs_cap = ch->strs_cap ? ch->strs_cap * 2 : 256;
+        ch->strs = realloc(ch->strs, ch->strs_cap);
+    }
+    off = ch->strs_len;
+    memcpy(ch->strs + off, s, n);
+    ch->strs[off + n] = '\0';
+    ch->strs_len += n + 1;
+    strmap_put(&cc->strs, s, n, off);
+    return off;
+}
+
+// Intern a variable name; returns its index in the chunk's name table
+uint32_t cc_name(compiler_t *cc, const char *s, size_t n) {
+    chunk_t *ch = cc->ch;
+    int idx = strmap_get(&cc->names, s, n);
+    if (idx >= 0) return idx;
+    GROW(ch->names, ch->nnames, ch->names_cap);
+    ch->names[ch->nnames] = cc_str(cc, s, n);
+    strmap_put(&cc->names, s, n, ch->nnames);
+    return ch->nnames++;
+}
+
+int builtin_find(const char *name);
+void compile_node(compiler_t *cc, node_t *n, int flags);
+void compile_list(compiler_t *cc, node_t *list, int flags);
+uint32_t compile_region(compiler_t *cc, node_t *n, int flags);
+int node_needs_fork(node_t *n);
+
+// Arithmetic operators are encoded the same way the parser stores them
+void compile_arith(compiler_t *cc, anode_t *a) {
+    uint32_t j1, j2;
+    switch (a->kind) {
+    case AN_NUM:
+        emit(cc, A_NUM);
+        emit(cc, (uint32_t)((uint64_t)a->num & 0xffffffffu));
+        emit(cc, (uint32_t)((uint64_t)a->num >> 32));
+        break;
+    case AN_VAR:
+        emit(cc, a->sub ? A_ELEM : A_VAR);
+        emit(cc, cc_name(cc, a->name, a->nlen));
+        if (a->sub) emit(cc, cc_str(cc, a->sub, a->slen));
+        break;
+    case AN_PARAM:
+        emit(cc, A_PARAM);
+        emit(cc, a->ptype);
+        emit(cc, a->num);
+        break;
+    case AN_UNARY:
+        compile_arith(cc, a->a);
+        emit(cc, A_UNARY);
+        emit(cc, a->op);
+        break;
+    case AN_BINARY:
+        if (a->op == ('&' | '&' << 8) || a->op == ('|' | '|' << 8)) {
+            // Short-circuit: a && b -> a; JZ f; b; BOOL; JMP e; f: 0; e:
+            int is_and = a->op == ('&' | '&' << 8);
+            compile_arith(cc, a->a);
+            emit(cc, is_and ? A_JZ : A_JNZ);
+            j1 = emit(cc, 0);
+            compile_arith(cc, a->b);
+            emit(cc, A_BOOL);
+            emit(cc, A_JMP);
+            j2 = emit(cc, 0);
+            patch(cc, j1);
+            emit(cc, A_NUM);
+            emit(cc, is_and ? 0 : 1);
+            emit(cc, 0);
+            patch(cc, j2);
+            break;
+        }
+        compile_arith(cc, a->a);
+        compile_arith(cc, a->b);
+        emit(cc, A_BINARY);
+        emit(cc, a->op);
+        break;
+    case AN_ASSIGN:
+        compile_arith(cc, a->a);
+        emit(cc, a->sub ? A_ELEM_ASSIGN : A_ASSIGN);
+        emit(cc, cc_name(cc, a->name, a->nlen));
+        if (a->sub) emit(cc, cc_str(cc, a->sub, a->slen));
+        emit(cc, a->op);
+        break;
+    case AN_INCDEC:
+        emit(cc, a->sub ? A_ELEM_INCDEC : A_INCDEC);
+        emit(cc, cc_name(cc, a->name, a->nlen));
+        if (a->sub) emit(cc, cc_str(cc, a->sub, a->slen));
+        emit(cc, (uint32_t)a->op);
+        break;
+    case AN_TERNARY:
+        compile_arith(cc, a->a);
+        emit(cc, A_JZ);
+        j1 = emit(cc, 0);
+        compile_arith(cc, a->b);
+        emit(cc, A_JMP);
+        j2 = emit(cc, 0);
+        patch(cc, j1);
+        compile_arith(cc, a->c);
+        patch(cc, j2);
+        break;
+    case AN_COMMA:
+        compile_arith(cc, a->a);
+        emit(cc, A_POP);
+        compile_arith(cc, a->b);
+        break;
+    }
+}
+
+// Arithmetic region terminated by A_END
+void compile_arith_region(compiler_t *cc, anode_t *a) {
+    compile_arith(cc, a);
+    emit(cc, A_END);
+}
+
+void compile_word(compiler_t *cc, word_t *w, int mode);
+
+// Sub-word used as an operator argument; returns its offset
+uint32_t compile_subword(compiler_t *cc, word_t *w, int mode) {
+    uint32_t at = cc->ch->ncode;
+    compile_word(cc, w, mode);
+    emit(cc, OP_END);
+    return at;
+}
+
+void compile_part(compiler_t *cc, wpart_t *part) {
+    uint32_t skip;
+    switch (part->type) {
+    case WP_LIT:
+        emit(cc, OP_WLIT);
+        emit(cc, cc_str(cc, part->text, part->len));
+        emit(cc, part->len);
+        emit(cc, part->quoted);
+        break;
+    case WP_TILDE:
+        emit(cc, OP_WTILDE);
+        emit(cc, cc_str(cc, part->text, part->len));
+        break;
+    case WP_ARITH:
+        emit(cc, OP_WARITH);
+        emit(cc, part->quoted);
+        skip = emit(cc, 0);
+        compile_arith_region(cc, part->arith);
+        patch(cc, skip);
+        break;
+    case WP_ARITH_DYN:
+        compile_word(cc, part->arg1, WM_STRING);
+        emit(cc, OP_WARITH_DYN);
+        emit(cc, part->quoted);
+        break;
+    case WP_CMDSUB:
+        emit(cc, OP_WCMDSUB);
+        emit(cc, part->quoted);
+        skip = emit(cc, 0);
+        emit(cc, node_needs_fork(part->body));
+        compile_region(cc, part->body, EXF_TAIL);
+        patch(cc, skip);
+        break;
+    case WP_PROCSUB:
+        emit(cc, OP_WPROCSUB);
+        emit(cc, part->op);
+        skip = emit(cc, 0);
+        compile_region(cc, part->body, EXF_TAIL);
+        patch(cc, skip);
+        break;
+    case WP_PARAM: {
+        int named = part->ptype == PT_VAR || part->ptype == PT_ELEM || part->ptype == PT_ARRAY;
+        uint32_t target = named ? cc_name(cc, part->text, part->len) : (uint32_t)part->num;
+        if (part->ptype == PT_ELEM) compile_word(cc, part->index, WM_STRING);
+        if (part->op == PARAM_PLAIN && part->ptype == PT_ELEM) {
+            emit(cc, OP_WELEM);
+            emit(cc, target);
+            emit(cc, part->quoted);
+            break;
+        }
+        if (part->op == PARAM_PLAIN && part->ptype == PT_ARRAY) {
+            emit(cc, OP_WARRAY);
+            emit(cc, target);
+            emit(cc, part->num);
+            emit(cc, part->quoted);
+            break;
+        }
+        if (part->op == PARAM_PLAIN) {
+            emit(cc, part->ptype == PT_VAR ? OP_WVAR : part->ptype == PT_POS ? OP_WPOS : OP_WSPECIAL);
+            emit(cc, target);
+            emit(cc, part->quoted);
+            break;
+        }
+        emit(cc, OP_WPARAM);
+        emit(cc, part->ptype);
+        emit(cc, target);
+        emit(cc, part->op | part->colon << 8 | (part->ptype == PT_ARRAY ? part->num << 16 : 0));
+        emit(cc, part->quoted);
+        skip = emit(cc, 0);
+        uint32_t a1 = emit(cc, 0);
+        uint32_t a2 = emit(cc, 0);
+        int pattern_arg = part->op >= PARAM_TRIM_PREFIX && part->op <= PARAM_SUBST_SUFFIX;
+        if (part->op == PARAM_SUBSTR) {
+            cc->ch->code[a1] = cc->ch->ncode;
+            compile_arith_region(cc, part->arith);
+            if (part->arith2) {
+                cc->ch->code[a2] = cc->ch->ncode;
+                compile_arith_region(cc, part->arith2);
+            }
+        } else {
+            if (part->arg1) {
+                uint32_t off = compile_subword(cc, part->arg1, pattern_arg ? WM_PATTERN : WM_STRING);
+                cc->ch->code[a1] = off;
+            }
+            if (part->arg2) {
+                uint32_t off = compile_subword(cc, part->arg2, WM_STRING);
+                cc->ch->code[a2] = off;
+            }
+        }
+        patch(cc, skip);
+        break;
+    }
+    }
+}
+
+// A word pushes its expansion onto the argument stack
+void compile_word(compiler_t *cc, word_t *w, int mode) {
+    wpart_t *part = w->parts;
+
+    if (!part) {
+        if (mode == WM_FIELDS) {
+            // An unquoted empty word (e.g. from x=) still needs a value
+            emit(cc, OP_WBEGIN);
+            emit(cc, mode);
+            emit(cc, OP_WEND);
+        } else {
+            emit(cc, OP_WORD_LIT);
+            emit(cc, cc_str(cc, "", 0));
+        }
+        return;
+    }
+    // Fast path: a lone literal that needs no splitting, globbing or escaping
+    if (!part->next && part->type == WP_LIT &&
+        ((mode == WM_FIELDS && (part->quoted || !(w->flags & WF_MAYGLOB))) ||
+         mode == WM_STRING || (mode == WM_PATTERN && (!part->quoted || !strpbrk(part->text, "*?[]\\"))))) {
+        emit(cc, OP_WORD_LIT);
+        emit(cc, cc_str(cc, part->text, part->len));
+        return;
+    }
+    emit(cc, OP_WBEGIN);
+    emit(cc, mode | (w->flags & WF_MAYGLOB ? WM_MAYGLOB : 0));
+    for (; part; part = part->next) compile_part(cc, part);
+    emit(cc, OP_WEND);
+}
+
+void compile_redirs(compiler_t *cc, redir_t *r) {
+    for (; r; r = r->next) {
+        compile_word(cc, r->target, WM_STRING);
+        emit(cc, OP_REDIR_PUSH);
+        emit(cc, r->type);
+        emit(cc, r->fd);
+    }
+}
+
+// name[i]=v and name=(...) always assign for good, even before a command
+int compile_array_assign(compiler_t *cc, assign_t *a) {
+    uint32_t name = cc_name(cc, a->name, a->nlen);
+    if (a->index) {
+        compile_word(cc, a->index, WM_STRING);
+        compile_word(cc, a->value, WM_STRING);
+        emit(cc, OP_SETELEM);
+        emit(cc, name);
+        emit(cc, a->append);
+        return 1;
+    }
+    if (!a->compound) return 0;
+    emit(cc, OP_ARRAY_BEGIN);
+    emit(cc, name);
+    emit(cc, a->append);
+    for (int i = 0; i < a->nelems; i++) {
+        if (a->keys[i]) {
+            compile_word(cc, a->keys[i], WM_STRING);
+            compile_word(cc, a->elems[i], WM_STRING);
+            emit(cc, OP_ARRAY_KEY);
+        } else {
+            compile_word(cc, a->elems[i], WM_FIELDS);
+            emit(cc, OP_ARRAY_ADD);
+        }
+    }
+    emit(cc, OP_ARRAY_END);
+    return 1;
+}
+
+void compile_simple(compiler_t *cc, node_t *n, int flags) {
+    emit(cc, OP_CMD_BEGIN);
+    if (!n->nwords && !n->redirs) {
+        // Pure assignment: no command frame beyond the argument scratch space
+        emit(cc, OP_STATUS);
+        emit(cc, 0);
+        for (assign_t *a = n->assigns; a; a = a->next) {
+            if (compile_array_assign(cc, a)) continue;
+            compile_word(cc, a->value, WM_STRING);
+            emit(cc, OP_SETVAR);
+            emit(cc, cc_name(cc, a->name, a->nlen));
+            emit(cc, a->append);
+        }
+        emit(cc, OP_CMD_END);
+        return;
+    }
+    for (assign_t *a = n->assigns; a; a = a->next) {
+        if (compile_array_assign(cc, a)) continue;
+        compile_word(cc, a->value, WM_STRING);
+        emit(cc, OP_ASSIGN_PUSH);
+        emit(cc, cc_name(cc, a->name, a->nlen));
+        emit(cc, a->append);
+    }
+    for (int i = 0; i < n->nwords; i++) compile_word(cc, n->words[i], WM_FIELDS);
+    compile_redirs(cc, n->redirs);
+
+    // Pre-resolve a literal builtin name so the VM can call it directly
+    int builtin = -1;
+    if (n->nwords && !n->words[0]->parts->next && n->words[0]->parts->type == WP_LIT) {
+        builtin = builtin_find(n->words[0]->parts->text);
+    }
+    emit(cc, OP_EXEC);
+    emit(cc, (uint32_t)builtin);
+    emit(cc, n->post ? flags & ~EXF_TAIL : flags);
+    if (n->post) {
+        emit(cc, OP_JMP_FALSE);
+        uint32_t skip = emit(cc, 0);
+        emit(cc, OP_CMD_BEGIN);
+        for (assign_t *a = n->post; a; a = a->next) compile_array_assign(cc, a);
+        emit(cc, OP_CMD_END);
+        patch(cc, skip);
+    }
+}
+
+// Wrap a compound command's body in its redirections
+void compile_redirected(compiler_t *cc, node_t *n, int flags) {
+    emit(cc, OP_CMD_BEGIN);
+    compile_redirs(cc, n->redirs);
+    emit(cc, OP_REDIR_APPLY);
+    uint32_t skip = emit(cc, 0);
+    redir_t *saved = n->redirs;
+    n->redirs = NULL;
+    compile_node(cc, n, flags & ~EXF_TAIL);
+    n->redirs = saved;
+    emit(cc, OP_REDIR_END);
+    patch(cc, skip);
+}
+
+// Region run by a forked child (pipeline stage, background job) or a function
+// Does a command list need a real child process when run as a subshell?
+// exec replaces the process, and background jobs would outlive the capture
+int word_is(word_t *w, const char *text) {
+    wpart_t *part = w->parts;
+    return part && !part->next && part->type == WP_LIT && !part->quoted && strcmp(part->text, text) == 0;
+}
+
+int node_needs_fork(node_t *n) {
+    for (; n; n = n->next) {
+        if (n->type == N_BG) return 1;
+        if (n->type == N_SIMPLE && n->nwords && word_is(n->words[0], "exec")) return 1;
+        if (node_needs_fork(n->a) || node_needs_fork(n->b) || node_needs_fork(n->c)) return 1;
+        for (case_item_t *it = n->items; it; it = it->next) {
+            if (node_needs_fork(it->body)) return 1;
+        }
+    }
+    return 0;
+}
+
+uint32_t compile_region(compiler_t *cc, node_t *n, int flags) {
+    uint32_t at = cc->ch->ncode;
+    compile_node(cc, n, flags);
+    emit(cc, OP_END);
+    return at;
+}
+
+void compile_node(compiler_t *cc, node_t *n, int flags) {
+    uint32_t j1, j2, top;
+
+    if (n->redirs && n->type != N_SIMPLE) {
+        compile_redirected(cc, n, flags);
+        return;
+    }
+    switch (n->type) {
+    case N_SIMPLE:
+        compile_simple(cc, n, flags);
+        break;
+    case N_LIST:
+    case N_GROUP:
+        compile_list(cc, n->a, flags);
+        break;
+    case N_SUBSHELL:
+        emit(cc, OP_SUBSHELL);
+        j1 = emit(cc, 0);
+        emit(cc, node_needs_fork(n->a));
+        emit(cc, flags);
+        compile_region(cc, n->a, EXF_TAIL);
+        patch(cc, j1);
+        break;
+    case N_AND:
+    case N_OR:
+        compile_node(cc, n->a, (flags | EXF_COND) & ~EXF_TAIL);
+        emit(cc, n->type == N_AND ? OP_JMP_FALSE : OP_JMP_TRUE);
+        j1 = emit(cc, 0);
+        compile_node(cc, n->b, flags);
+        patch(cc, j1);
+        break;
+    case N_NOT:
+        compile_node(cc, n->a, (flags | EXF_COND) & ~EXF_TAIL);
+        emit(cc, OP_NOT);
+        break;
+    case N_PIPE: {
+        emit(cc, OP_PIPELINE);
+        emit(cc, n->nwords);
+        emit(cc, flags);
+        uint32_t table = cc->ch->ncode;
+        for (int i = 0; i <= n->nwords; i++) emit(cc, 0);
+        int i = 0;
+        for (node_t *stage = n->a; stage; stage = stage->next, i++) {
+            uint32_t at = compile_region(cc, stage, EXF_TAIL);
+            cc->ch->code[table + i] = at;
+        }
+        patch(cc, table + n->nwords);
+        break;
+    }
+    case N_BG:
+        emit(cc, OP_BG);
+        j1 = emit(cc, 0);
+        compile_region(cc, n->a, EXF_TAIL);
+        patch(cc, j1);
+        break;
+    case N_IF:
+        compile_list(cc, n->a->a, (flags | EXF_COND) & ~EXF_TAIL);
+        emit(cc, OP_JMP_FALSE);
+        j1 = emit(cc, 0);
+        compile_list(cc, n->b->a, flags);
+        emit(cc, OP_JMP);
+        j2 = emit(cc, 0);
+        patch(cc, j1);
+        if (n->c) {
+            compile_node(cc, n->c, flags);
+        } else {
+            emit(cc, OP_STATUS);
+            emit(cc, 0);
+        }
+        patch(cc, j2);
+        break;
+    case N_WHILE:
+    case N_UNTIL:
+        emit(cc, OP_LOOP_ENTER);
+        j1 = emit(cc, 0);
+        j2 = emit(cc, 0);
+        top = cc->ch->ncode;
+        cc->ch->code[j2] = top;
+        compile_list(cc, n->a->a, (flags | EXF_COND) & ~EXF_TAIL);
+        emit(cc, n->type == N_WHILE ? OP_JMP_FALSE : OP_JMP_TRUE);
+        {
+            uint32_t exit_at = emit(cc, 0);
+            compile_list(cc, n->b->a, flags & ~EXF_TAIL);
+            emit(cc, OP_LOOP_SAVE);
+            emit(cc, OP_JMP);
+            emit(cc, top);
+            patch(cc, exit_at);
+        }
+        patch(cc, j1);
+        emit(cc, OP_LOOP_LEAVE);
+        break;
+    case N_FOR:
+        emit(cc, OP_LOOP_ENTER);
+        j1 = emit(cc, 0);
+        j2 = emit(cc, 0);
+        if (n->c) {
+            emit(cc, OP_CMD_BEGIN);
+            for (int i = 0; i < n->nwords; i++) compile_word(cc, n->words[i], WM_FIELDS);
+            emit(cc, OP_FOR_INIT);
+        } else {
+            emit(cc, OP_FOR_ARGS);
+        }
+        top = cc->ch->ncode;
+        cc->ch->code[j2] = top;
+        emit(cc, OP_FOR_NEXT);
+        emit(cc, cc_name(cc, n->name, n->nlen));
+        {
+            uint32_t exit_at = emit(cc, 0);
+            compile_list(cc, n->b->a, flags & ~EXF_TAIL);
+            emit(cc, OP_LOOP_SAVE);
+            emit(cc, OP_JMP);
+            emit(cc, top);
+            patch(cc, exit_at);
+        }
+        patch(cc, j1);
+        emit(cc, OP_LOOP_LEAVE);
+        break;
+    case N_ARITH_FOR: {
+        emit(cc, OP_LOOP_ENTER);
+        j1 = emit(cc, 0);
+        j2 = emit(cc, 0);
+        if (n->arith[0]) {
+            emit(cc, OP_ARITH_CMD);
+            uint32_t skip = emit(cc, 0);
+            compile_arith_region(cc, n->arith[0]);
+            patch(cc, skip);
+        }
+        top = cc->ch->ncode;
+        uint32_t exit_at = 0;
+        if (n->arith[1]) {
+            emit(cc, OP_ARITH_CMD);
+            uint32_t skip = emit(cc, 0);
+            compile_arith_region(cc, n->arith[1]);
+            patch(cc, skip);
+            emit(cc, OP_JMP_FALSE);
+            exit_at = emit(cc, 0);
+        }
+        compile_list(cc, n->b->a, flags & ~EXF_TAIL);
+        emit(cc, OP_LOOP_SAVE);
+        cc->ch->code[j2] = cc->ch->ncode;
+        if (n->arith[2]) {
+            emit(cc, OP_ARITH_CMD);
+            uint32_t skip = emit(cc, 0);
+            compile_arith_region(cc, n->arith[2]);
+            patch(cc, skip);
+        }
+        emit(cc, OP_JMP);
+        emit(cc, top);
+        if (exit_at) patch(cc, exit_at);
+        patch(cc, j1);
+        emit(cc, OP_LOOP_LEAVE);
+        break;
+    }
+    case N_CASE: {
+        uint32_t ends[256];
+        int nends = 0;
+        uint32_t fall = 0;
+        emit(cc, OP_CMD_BEGIN);
+        compile_word(cc, n->words[0], WM_STRING);
+        emit(cc, OP_CASE_PUSH);
+        emit(cc, OP_STATUS);
+        emit(cc, 0);
+        for (case_item_t *item = n->items; item; item = item->next) {
+            uint32_t hits[64];
+            for (int i = 0; i < item->npats; i++) {
+                emit(cc, OP_CMD_BEGIN);
+                compile_word(cc, item->pats[i], WM_PATTERN);
+                emit(cc, OP_CASE_TEST);
+                hits[i] = emit(cc, 0);
+            }
+            emit(cc, OP_JMP);
+            uint32_t next = emit(cc, 0);
+            for (int i = 0; i < item->npats; i++) patch(cc, hits[i]);
+            if (fall) patch(cc, fall);
+            fall = 0;
+            compile_list(cc, item->body->a, flags);
+            emit(cc, OP_JMP);
+            if (item->fallthrough) fall = emit(cc, 0);
+            else if (nends < 256) ends[nends++] = emit(cc, 0);
+            patch(cc, next);
+        }
+        if (fall) patch(cc, fall);
+        for (int i = 0; i < nends; i++) patch(cc, ends[i]);
+        emit(cc, OP_CASE_POP);
+        break;
+    }
+    case N_FUNC: {
+        emit(cc, OP_DEFUN);
+        emit(cc, cc_str(cc, n->name, n->nlen));
+        uint32_t body = emit(cc, 0);
+        uint32_t end = emit(cc, 0);
+        uint32_t at = compile_region(cc, n->a, 0);
+        cc->ch->code[body] = at;
+        patch(cc, end);
+        break;
+    }
+    case N_ARITH: {
+        if (!n->arith[0]) {
+            emit(cc, OP_CMD_BEGIN);
+            compile_word(cc, n->words[0], WM_STRING);
+            emit(cc, OP_ARITH_DYN_CMD);
+            emit(cc, OP_CMD_END);
+            break;
+        }
+        emit(cc, OP_ARITH_CMD);
+        uint32_t skip = emit(cc, 0);
+        compile_arith_region(cc, n->arith[0]);
+        patch(cc, skip);
+        break;
+    }
+    }
+}
+
+// Only the last command of a list inherits the tail position
+void compile_list(compiler_t *cc, node_t *n, int flags) {
+    if (!n) {
+        emit(cc, OP_STATUS);
+        emit(cc, 0);
+        return;
+    }
+    for (; n; n = n->next) {
+        compile_node(cc, n, n->next ? flags & ~EXF_TAIL : flags);
+    }
+}
+
+chunk_t* chunk_new(void) {
+    chunk_t *ch = calloc(1, sizeof(chunk_t));
+    ch->refs = 1;
+    return ch;
+}
+
+// Map the chunk's variable names to this process's variable slots
+void chunk_link(chunk_t *ch) {
+    ch->slots = malloc((ch->nnames + 1) * sizeof(int));
+    for (uint32_t i = 0; i < ch->nnames; i++) {
+        const char *name = CSTR(ch, ch->names[i]);
+        ch->slots[i] = var_slot(name, strlen(name));
+    }
+}
+
+void chunk_unref(chunk_t *ch) {
+    if (!ch || --ch->refs > 0) return;
+    if (ch->map) {
+        munmap(ch->map, ch->map_len);
+    } else if (!ch->image) {
+        free(ch->code);
+        free(ch->strs);
+        free(ch->names);
+    }
+    free(ch->slots);
+    free(ch);
+}
+
+// Parse and compile source text; *incomplete is set when more input is needed
+chunk_t* compile_text(const char *text, size_t len, const char *name, int *incomplete) {
+    arena_t arena = {0};
+    parser_t p = {0};
+    p.src = text;
+    p.len = len;
+    p.line = 1;
+    p.name = name;
+    p.arena = &arena;
+    // Only typed commands see aliases, so compiled script files never depend on them
+    p.aliases = interactive && !name;
+
+    node_t *prog = parse_program(&p);
+    startup_mark("parse");
+    if (incomplete) *incomplete = p.incomplete;
+    if (!prog) {
+        if (p.incomplete && !incomplete) {
+            p.incomplete = 0;
+            parse_error(&p, "syntax error: unexpected end of file");
+        }
+        arena_free(&arena);
+        return NULL;
+    }
+
+    compiler_t cc = {0};
+    cc.ch = chunk_new();
+    compile_list(&cc, prog->a, EXF_TAIL);
+    emit(&cc, OP_END);
+    strmap_clear(&cc.strs);
+    strmap_clear(&cc.names);
+    arena_free(&arena);
+    chunk_link(cc.ch);
+    startup_mark("codegen");
+    return cc.ch;
+}
+
+// Shell functions point at a body region inside a (shared) chunk
+typedef struct {
+    char *name;
+    chunk_t *chunk;     // NULL once unset or while an autoload stub
+    uint32_t body;
+    int autoload;       // body is loaded from FPATH on first call
+    unsigned gen;
+} func_t;
+
+func_t *funcs = NULL;
+int func_count = 0;
+int func_cap = 0;
+strmap_t func_index;
+
+// Previous definitions, kept while an in-process subshell runs
+typedef struct {
+    int func;
+    chunk_t *chunk;     // holds the reference the entry had
+    uint32_t body;
+    int autoload;
+    unsigned gen;
+} func_save_t;
+
+func_save_t *func_journal = NULL;
+int func_journal_count = 0;
+int func_journal_cap = 0;
+
+void func_journal_save(int fi) {
+    if (!journal_gen || funcs[fi].gen == journal_gen) return;
+    GROW(func_journal, func_journal_count, func_journal_cap);
+    func_save_t *s = &func_journal[func_journal_count++];
+    s->func = fi;
+    s->chunk = funcs[fi].chunk;
+    if (s->chunk) s->chunk->refs++;
+    s->body = funcs[fi].body;
+    s->autoload = funcs[fi].autoload;
+    s->gen = funcs[fi].gen;
+    funcs[fi].gen = journal_gen;
+}
+
+void func_journal_restore(int base) {
+    while (func_journal_count > base) {
+        func_save_t *s = &func_journal[--func_journal_count];
+        func_t *f = &funcs[s->func];
+        chunk_unref(f->chunk);
+        f->chunk = s->chunk;
+        f->body = s->body;
+        f->autoload = s->autoload;
+        f->gen = s->gen;
+        int bi = builtin_find(f->name);
+        if (bi >= 0) builtin_shadowed[bi] = f->chunk || f->autoload;
+    }
+}
+
+int func_lookup(const char *name) {
+    if (!func_count) return -1;
+    int fi = strmap_get(&func_index, name, strlen(name));
+    return fi >= 0 && (funcs[fi].chunk || funcs[fi].autoload) ? fi : -1;
+}
+
+// Get or create the table entry for a function name
+int func_entry(const char *name) {
+    size_t n = strlen(name);
+    int fi = strmap_get(&func_index, name, n);
+    if (fi < 0) {
+        GROW(funcs, func_count, func_cap);
+        fi = func_count++;
+        funcs[fi].name = strdup(name);
+        funcs[fi].chunk = NULL;
+        funcs[fi].autoload = 0;
+        funcs[fi].gen = 0;
+        strmap_put(&func_index, name, n, fi);
+    }
+    func_journal_save(fi);
+    int bi = builtin_find(name);
+    if (bi >= 0) builtin_shadowed[bi] = 1;
+    return fi;
+}
+
+void func_define(const char *name, chunk_t *ch, uint32_t body) {
+    int fi = func_entry(name);
+    ch->refs++;
+    chunk_unref(funcs[fi].chunk);
+    funcs[fi].chunk = ch;
+    funcs[fi].body = body;
+    funcs[fi].autoload = 0;
+}
+
+// Register a stub; nothing is read until the function is first called
+void func_autoload(const char *name) {
+    int fi = func_entry(name);
+    if (!funcs[fi].chunk) funcs[fi].autoload = 1;
+}
+
+// Find name in FPATH and compile it. A file holding just the definition of
+// the function is run to define it; otherwise the whole file is the body.
+// Returns 0, or the status to fail the call with
+int func_resolve(int fi) {
+    const char *fpath = var_getenv("FPATH");
+    const char *name = funcs[fi].name;
+    char file[PATH_MAX];
+    int status;
+
+    while (fpath && *fpath) {
+        const char *colon = strchr(fpath, ':');
+        size_t n = colon ? (size_t)(colon - fpath) : strlen(fpath);
+        if (n && snprintf(file, sizeof(file), "%.*s/%s", (int)n, fpath, name) < (int)sizeof(file) &&
+            access(file, R_OK) == 0) {
+            chunk_t *ch = compile_file(file, &status);
+            if (!ch) return status;
+            const uint32_t *code = ch->code;
+            if (ch->ncode > 4 && code[0] == OP_DEFUN && code[code[3]] == OP_END &&
+                strcmp(CSTR(ch, code[1]), name) == 0) {
+                func_define(name, ch, code[2]);
+            } else {
+                func_define(name, ch, 0);
+            }
+            chunk_unref(ch);
+            return 0;
+        }
+        fpath = colon ? colon + 1 : NULL;
+    }
+    fprintf(stderr, "ByteShell: %s: function definition file not found\n", name);
+    return 127;
+}
+
+void func_undefine(const char *name) {
+    int fi = func_lookup(name);
+    if (fi < 0) return;
+    func_journal_save(fi);
+    chunk_unref(funcs[fi].chunk);
+    funcs[fi].chunk = NULL;
+    funcs[fi].autoload = 0;
+    int bi = builtin_find(name);
+    if (bi >= 0) builtin_shadowed[bi] = 0;
+}
+
+// Pending prefix assignments and redirections of the command being built
+typedef struct {
+    int slot;
+    const char *value;
+    int append;
+} pending_assign_t;
+
+typedef struct {
+    int type;
+    int fd;
+    const char *target;
+} pending_redir_t;
+
+typedef struct {
+    int arg_base;
+    int assign_base;
+    int redir_base;
+    int subst_status;   // status of the last $(...) in the command, or -1
+    int procsub_base;   // process substitution pipes opened for the command
+    arena_mark_t mark;
+} cmd_frame_t;
+
+// Control frames: loops, case subjects and redirected compound commands
+enum { FRAME_LOOP, FRAME_CASE, FRAME_REDIR };
+
+typedef struct {
+    int type;
+    uint32_t brk;
+    uint32_t cont;
+    int saved_status;
+    char **items;       // for-loop word list (one allocation)
+    int nitems;
+    int next;
+    char *subject;      // case word
+    int fd_base;        // saved descriptors for FRAME_REDIR
+} vm_frame_t;
+
+typedef struct {
+    int fd;
+    int saved;          // -1 if fd was closed before the redirection
+} saved_fd_t;
+
+// Field builder for one word being expanded
+typedef struct {
+    strbuf_t buf;
+    strbuf_t pat;       // escaped mirror of buf used as the glob pattern
+    int mode;
+    int started;        // a field exists, even if empty
+    int glob;           // unquoted glob characters seen
+    int mayglob;
+    int after_delim;
+    int nonws_delim;
+} fieldb_t;
+
+enum { UNWIND_NONE, UNWIND_BREAK, UNWIND_CONTINUE, UNWIND_RETURN, UNWIND_INTR, UNWIND_EXIT };
+
+typedef struct {
+    int slot;
+    int append;
+    int arg_base;
+    long next;              // index for the next plain element
+    array_t *arr;           // the new value, or the variable itself when appending
+    assoc_t *map;           // likewise, for an associative array
+    const char *key;        // key waiting for its value in a key-value list
+} abuild_t;
+
+struct {
+    char **args;
+    int nargs;
+    int args_cap;
+    arena_t arena;
+    cmd_frame_t *cmds;
+    int ncmds;
+    int cmds_cap;
+    pending_assign_t *assigns;
+    int nassigns;
+    int assigns_cap;
+    pending_redir_t *redirs;
+    int nredirs;
+    int redirs_cap;
+    vm_frame_t *frames;
+    int nframes;
+    int frames_cap;
+    saved_fd_t *fds;
+    int nfds;
+    int fds_cap;
+    fieldb_t **fbs;
+    int fb_depth;
+    int fb_cap;
+    int unwind;
+    int unwind_count;
+    int ret_status;
+    int func_depth;
+    int loop_base;          // the first frame of the running function: its loops start here
+    int source_depth;
+    int in_child;
+    chunk_t *exec_chunk;    // code whose last command may replace this process: the script, or a child's region
+    int keep_redirs;        // set by exec without a command
+    abuild_t *abuilds;      // name=( ... ) assignments being built
+    int nabuilds;
+    int abuilds_cap;
+} vm;
+
+pid_t shell_pid;
+int arith_error = 0;
+
+// A directory on the pushd stack, held open with O_PATH so returning to it
+// is an fchdir instead of a walk down its path
+typedef struct {
+    char *path;
+    int fd;
+} dir_entry_t;
+
+dir_entry_t *dir_stack = NULL;      // saved directories, top of the stack last
+int dir_count = 0;
+int dir_cap = 0;
+dir_entry_t dir_cwd = {NULL, -1};   // the working directory, stack entry 0
+
+void dir_stack_clear(void);
+void dir_entry_set(dir_entry_t *e, const char *path, int fd);
+void dir_changed(const char *cwd);
+int dir_open(const char *path);
+
+// In-process subshell: what to put back when it ends. Variables, functions
+// and aliases are journaled as they change; the rest is copied on entry
+typedef struct {
+    unsigned prev_gen;
+    int var_base;
+    int func_base;
+    int alias_base;
+    posargs_t posargs;
+    int opts[6];
+    int cwd_fd;             // opened on the first cd inside the subshell
+    dir_entry_t *dirs;      // copy of the directory stack taken on its first change
+    int ndirs;              // -1 while the stack is untouched
+} subshell_t;
+
+subshell_t *subshells = NULL;
+int subshell_depth = 0;
+int subshell_cap = 0;
+unsigned journal_counter = 0;
+
+// Command substitution output goes to one reusable memfd per nesting level.
+// Children never write into it directly but through a pipe the shell drains;
+// one that was handed to a child anyway is not reused
+int *capture_fds = NULL;
+int capture_depth = 0;
+int capture_cap = 0;
+int capture_shared = 0;    // a child of this level holds its memfd
+
+// Process substitutions: the shell's end of each pipe stays open until the
+// command that named it finishes; the producers are reaped without blocking
+typedef struct {
+    int fd;
+    pid_t pid;
+} procsub_t;
+
+procsub_t *procsubs = NULL;
+int procsub_count = 0;
+int procsub_cap = 0;
+pid_t *procsub_pids = NULL;     // closed but not yet reaped
+int procsub_npids = 0;
+int procsub_pids_cap = 0;
+
+void procsub_reap(void) {
+    for (int i = 0; i < procsub_npids; i++) {
+        int status;
+        pid_t r = waitpid(procsub_pids[i], &status, WNOHANG);
+        if (r == procsub_pids[i] || (r < 0 && errno == ECHILD)) procsub_pids[i--] = procsub_pids[--procsub_npids];
+    }
+}
+
+void procsub_close(int base) {
+    for (int i = base; i < procsub_count; i++) {
+        close(procsubs[i].fd);
+        GROW(procsub_pids, procsub_npids, procsub_pids_cap);
+        procsub_pids[procsub_npids++] = procsubs[i].pid;
+    }
+    procsub_count = base;
+    procsub_reap();
+}
+
+void shell_exit(int status);
+
+void vm_push_ref(const char *s) {
+    GROW(vm.args, vm.nargs, vm.args_cap);
+    vm.args[vm.nargs++] = (char *)s;
+}
+
+void vm_push_arg(const char *s, size_t n) {
+    vm_push_ref(arena_strndup(&vm.arena, s, n));
+}
+
+char* vm_pop_arg(void) {
+    return vm.args[--vm.nargs];
+}
+
+void vm_cmd_begin(void) {
+    GROW(vm.cmds, vm.ncmds, vm.cmds_cap);
+    cmd_frame_t *cf = &vm.cmds[vm.ncmds++];
+    cf->arg_base = vm.nargs;
+    cf->assign_base = vm.nassigns;
+    cf->redir_base = vm.nredirs;
+    cf->subst_status = -1;
+    cf->procsub_base = procsub_count;
+    cf->mark = arena_mark(&vm.arena);
+}
+
+void vm_cmd_end(void) {
+    cmd_frame_t *cf = &vm.cmds[--vm.ncmds];
+    if (procsub_count > cf->procsub_base) procsub_close(cf->procsub_base);
+    vm.nargs = cf->arg_base;
+    vm.nassigns = cf->assign_base;
+    vm.nredirs = cf->redir_base;
+    arena_release(&vm.arena, cf->mark);
+}
+
+// Report an expansion failure: interactive shells abandon the line, scripts exit
+void vm_expand_failed(void) {
+    expand_error = 0;
+    last_status = 1;
+    if (!interactive || subshell_depth) {
+        shell_exit(1);
+        return;
+    }
+    vm.unwind = UNWIND_INTR;
+}
+
+// Arithmetic evaluation
+long arith_eval_string(const char *s);
+int arith_depth = 0;
+
+long arith_binop(int op, long a, long b) {
+    switch (op) {
+    case '+': return (long)((unsigned long)a + (unsigned long)b);
+    case '-': return (long)((unsigned long)a - (unsigned long)b);
+    case '*': return (long)((unsigned long)a * (unsigned long)b);
+    case '/':
+    case '%':
+        if (b == 0) {
+            if (!arith_error) fprintf(stderr, "ByteShell: division by 0\n");
+            arith_error = 1;
+            return 0;
+        }
+        if (b == -1) return op == '/' ? (long)(0 - (unsigned long)a) : 0;
+        return op == '/' ? a / b : a % b;
+    case '*' | '*' << 8: {
+        long r = 1;
+        if (b < 0) {
+            if (!arith_error) fprintf(stderr, "ByteShell: exponent less than 0\n");
+            arith_error = 1;
+            return 0;
+        }
+        while (b-- > 0) r = (long)((unsigned long)r * (unsigned long)a);
+        return r;
+    }
+    case '<' | '<' << 8: return (long)((unsigned long)a << (b & 63));
+    case '>' | '>' << 8: return a >> (b & 63);
+    case '<': return a < b;
+    case '>': return a > b;
+    case '<' | '=' << 8: return a <= b;
+    case '>' | '=' << 8: return a >= b;
+    case '=' | '=' << 8: return a == b;
+    case '!' | '=' << 8: return a != b;
+    case '&': return a & b;
+    case '^': return a ^ b;
+    case '|': return a | b;
+    }
+    return 0;
+}
+
+// Integer value of a string: a number, or an expression evaluated recursively
+long arith_value_of(const char *s, int *cacheable) {
+    const char *p = s, *end;
+    int neg = 0;
+    *cacheable = 0;
+    if (!s) return 0;
+    while (isspace((unsigned char)*p)) p++;
+    if (!*p) return 0;
+    if (*p == '-' || *p == '+') neg = *p++ == '-';
+    end = p + strlen(p);
+    if (isdigit((unsigned char)*p)) {
+        const char *q = p;
+        long v = arith_parse_number(&q, end);
+        while (isspace((unsigned char)*q)) q++;
+        if (!*q) {
+            *cacheable = 1;
+            return neg ? -v : v;
+        }
+    }
+    if (arith_depth > 32) {
+        if (!arith_error) fprintf(stderr, "ByteShell: %s: expression recursion level exceeded\n", s);
+        arith_error = 1;
+        return 0;
+    }
+    arith_depth++;
+    long v = arith_eval_string(s);
+    arith_depth--;
+    return v;
+}
+
+long var_arith_value(int slot) {
+    var_t *v = &vars[slot];
+    if (v->arr || v->map) {
+        int cacheable;
+        return arith_value_of(var_value(slot, NULL), &cacheable);
+    }
+    if (v->flags & VAR_INTVALID) return v->ival;
+    if (!v->value) {
+        if (opt_nounset) {
+            fprintf(stderr, "ByteShell: %s: unbound variable\n", v->name);
+            arith_error = 1;
+        }
+        return 0;
+    }
+    int cacheable;
+    long r = arith_value_of(v->value, &cacheable);
+    if (cacheable) {
+        v->ival = r;
+        v->flags |= VAR_INTVALID;
+    }
+    return r;
+}
+
+const char* special_value(int c, char *buf, size_t size);
+int elem_get(int slot, const char *sub, const char **v, size_t *len);
+int elem_set(int slot, const char *sub, const char *v, int append);
+
+long elem_arith_value(int slot, const char *sub) {
+    const char *v;
+    int cacheable;
+    if (elem_get(slot, sub, &v, NULL) < 0) {
+        arith_error = 1;
+        return 0;
+    }
+    return arith_value_of(v, &cacheable);
+}
+
+void elem_set_int(int slot, const char *sub, long value) {
+    char num[32];
+    snprintf(num, sizeof(num), "%ld", value);
+    if (elem_set(slot, sub, num, 0) < 0) arith_error = 1;
+}
+
+long arith_run(chunk_t *ch, uint32_t pc) {
+    long st[ARITH_STACK_MAX];
+    int sp = 0;
+    const uint32_t *code = ch->code;
+    int cacheable;
+
+    while (1) {
+        if (sp >= ARITH_STACK_MAX - 1) {
+            fprintf(stderr, "ByteShell: arithmetic expression too complex\n");
+            arith_error = 1;
+            return 0;
+        }
+        switch (code[pc]) {
+        case A_NUM:
+            st[sp++] = (long)((uint64_t)code[pc + 1] | (uint64_t)code[pc + 2] << 32);
+            pc += 3;
+            break;
+        case A_VAR:
+            st[sp++] = var_arith_value(CSLOT(ch, code[pc + 1]));
+            pc += 2;
+            break;
+        case A_PARAM: {
+            char buf[32];
+            const char *v = code[pc + 1] == PT_POS ? posarg(code[pc + 2]) : special_value(code[pc + 2], buf, sizeof(buf));
+            st[sp++] = arith_value_of(v, &cacheable);
+            pc += 3;
+            break;
+        }
+        case A_ASSIGN: {
+            int slot = CSLOT(ch, code[pc + 1]);
+            long v = st[sp - 1];
+            if (code[pc + 2]) v = arith_binop(code[pc + 2], var_arith_value(slot), v);
+            var_set_int(slot, v);
+            st[sp - 1] = v;
+            pc += 3;
+            break;
+        }
+        case A_INCDEC: {
+            int slot = CSLOT(ch, code[pc + 1]);
+            int flags = (int32_t)code[pc + 2];
+            long old = var_arith_value(slot);
+            long v = old + (flags > 0 ? 1 : -1);
+            var_set_int(slot, v);
+            st[sp++] = (flags & 1) ? old : v;
+            pc += 3;
+            break;
+        }
+        case A_ELEM:
+            st[sp++] = elem_arith_value(CSLOT(ch, code[pc + 1]), CSTR(ch, code[pc + 2]));
+            pc += 3;
+            break;
+        case A_ELEM_ASSIGN: {
+            int slot = CSLOT(ch, code[pc + 1]);
+            const char *sub = CSTR(ch, code[pc + 2]);
+            long v = st[sp - 1];
+            if (code[pc + 3]) v = arith_binop(code[pc + 3], elem_arith_value(slot, sub), v);
+            elem_set_int(slot, sub, v);
+            st[sp - 1] = v;
+            pc += 4;
+            break;
+        }
+        case A_ELEM_INCDEC: {
+            int slot = CSLOT(ch, code[pc + 1]);
+            const char *sub = CSTR(ch, code[pc + 2]);
+            int flags = (int32_t)code[pc + 3];
+            long old = elem_arith_value(slot, sub);
+            long v = old + (flags > 0 ? 1 : -1);
+            elem_set_int(slot, sub, v);
+            st[sp++] = (flags & 1) ? old : v;
+            pc += 4;
+            break;
+        }
+        case A_UNARY: {
+            long a = st[sp - 1];
+            switch (code[pc + 1]) {
+            case '-': a = (long)(0 - (unsigned long)a); break;
+            case '!': a = !a; break;
+            case '~': a = ~a; break;
+            }
+            st[sp - 1] = a;
+            pc += 2;
+            break;
+        }
+        case A_BINARY:
+            sp--;
+            st[sp - 1] = arith_binop(code[pc + 1], st[sp - 1], st[sp]);
+            pc += 2;
+            break;
+        case A_JZ:
+            pc = st[--sp] == 0 ? code[pc + 1] : pc + 2;
+            break;
+        case A_JNZ:
+            pc = st[--sp] != 0 ? code[pc + 1] : pc + 2;
+            break;
+        case A_JMP:
+            pc = code[pc + 1];
+            break;
+        case A_BOOL:
+            st[sp - 1] = st[sp - 1] != 0;
+            pc++;
+            break;
+        case A_POP:
+            sp--;
+            pc++;
+            break;
+        default:
+            return sp ? st[sp - 1] : 0;
+        }
+    }
+}
+
+// Compiled forms of arithmetic text that only exists at runtime
+strmap_t arith_cache_index;
+chunk_t **arith_cache = NULL;
+int arith_cache_count = 0;
+int arith_cache_cap = 0;
+
+long arith_eval_string(const char *s) {
+    size_t n = strlen(s);
+    int ci = strmap_get(&arith_cache_index, s, n);
+
+    if (ci < 0) {
+        arena_t arena = {0};
+        parser_t p = {0};
+        p.src = s;
+        p.len = n;
+        p.line = 1;
+        p.arena = &arena;
+        anode_t *a = arith_parse(&p, s, n);
+        if (!a) {
+            if (!p.error) fprintf(stderr, "ByteShell: %s: arithmetic syntax error\n", s);
+            arena_free(&arena);
+            arith_error = 1;
+            return 0;
+        }
+        compiler_t cc = {0};
+        cc.ch = chunk_new();
+        compile_arith_region(&cc, a);
+        strmap_clear(&cc.strs);
+        strmap_clear(&cc.names);
+        arena_free(&arena);
+        chunk_link(cc.ch);
+        if (arith_cache_count >= 256) {
+            for (int i = 0; i < arith_cache_count; i++) chunk_unref(arith_cache[i]);
+            arith_cache_count = 0;
+            strmap_clear(&arith_cache_index);
+        }
+        GROW(arith_cache, arith_cache_count, arith_cache_cap);
+        ci = arith_cache_count++;
+        arith_cache[ci] = cc.ch;
+        strmap_put(&arith_cache_index, s, n, ci);
+    }
+    chunk_t *ch = arith_cache[ci];
+    ch->refs++;
+    long v = arith_run(ch, 0);
+    chunk_unref(ch);
+    return v;
+}
+
+// Field builder
+fieldb_t* fb_acquire(int flags) {
+    if (vm.fb_depth >= vm.fb_cap) {
+        int old = vm.fb_cap;
+        GROW(vm.fbs, vm.fb_depth, vm.fb_cap);
+        memset(vm.fbs + old, 0, (vm.fb_cap - old) * sizeof(fieldb_t *));
+    }
+    if (!vm.fbs[vm.fb_depth]) vm.fbs[vm.fb_depth] = calloc(1, sizeof(fieldb_t));
+    fieldb_t *fb = vm.fbs[vm.fb_depth++];
+    fb->buf.len = 0;
+    fb->pat.len = 0;
+    sb_reserve(&fb->buf, 0);
+    fb->mode = flags & WM_MODE_MASK;
+    fb->mayglob = (flags & WM_MAYGLOB) && fb->mode == WM_FIELDS && !opt_noglob;
+    fb->started = fb->glob = fb->after_delim = fb->nonws_delim = 0;
+    return fb;
+}
+
+// Glob characters that need escaping in pattern text
+int is_glob_char(char c) {
+    return c == '*' || c == '?' || c == '[' || c == ']' || c == '\\';
+}
+
+void sb_append_escaped(strbuf_t *sb, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (is_glob_char(s[i])) sb_putc(sb, '\\');
+        sb_putc(sb, s[i]);
+    }
+}
+
+// Text that keeps its meaning literally (quoted) or is unquoted literal word text
+void fb_text(fieldb_t *fb, const char *s, size_t n, int quoted) {
+    fb->started = 1;
+    fb->after_delim = fb->nonws_delim = 0;
+    if (quoted && fb->mode == WM_PATTERN) {
+        sb_append_escaped(&fb->buf, s, n);
+        return;
+    }
+    sb_append(&fb->buf, s, n);
+    if (fb->mayglob) {
+        if (quoted) {
+            sb_append_escaped(&fb->pat, s, n);
+        } else {
+            sb_append(&fb->pat, s, n);
+            if (!fb->glob) {
+                for (size_t i = 0; i < n; i++) {
+                    if (s[i] == '*' || s[i] == '?' || s[i] == '[') fb->glob = 1;
+                }
+            }
+        }
+    }
+}
+
+void fb_push_field(fieldb_t *fb) {
+    if (fb->glob && fb->mayglob && pattern_has_wildcard(fb->pat.data, fb->pat.len)) {
+        glob_t g;
+        if (glob(fb->pat.data, 0, NULL, &g) == 0) {
+            for (size_t i = 0; i < g.gl_pathc; i++) vm_push_arg(g.gl_pathv[i], strlen(g.gl_pathv[i]));
+            globfree(&g);
+            goto reset;
+        }
+    }
+    vm_push_arg(fb->buf.data, fb->buf.len);
+reset:
+    fb->buf.len = 0;
+    fb->buf.data[0] = '\0';
+    fb->pat.len = 0;
+    fb->started = fb->glob = 0;
+}
+
+// Result of an expansion: quoted results stay whole, unquoted ones are split on IFS
+void fb_value(fieldb_t *fb, const char *s, size_t n, int quoted) {
+    if (quoted || fb->mode != WM_FIELDS) {
+        fb_text(fb, s, n, quoted);
+        return;
+    }
+    size_t run = 0;
+    for (size_t i = 0; i <= n; i++) {
+        int t = i < n ? ifs_table[(unsigned char)s[i]] : 0;
+        if (i < n && !t) continue;
+        if (i > run) fb_text(fb, s + run, i - run, 0);
+        run = i + 1;
+        if (i == n) break;
+        if (t == 1) {
+            if (fb->started) {
+                fb_push_field(fb);
+                fb->after_delim = 1;
+                fb->nonws_delim = 0;
+            }
+        } else if (fb->started) {
+            fb_push_field(fb);
+            fb->after_delim = fb->nonws_delim = 1;
+        } else if (fb->after_delim && !fb->nonws_delim) {
+            fb->nonws_delim = 1;
+        } else {
+            vm_push_arg("", 0);
+            fb->after_delim = fb->nonws_delim = 1;
+        }
+    }
+}
+
+void fb_finish(fieldb_t *fb) {
+    if (fb->mode != WM_FIELDS || fb->started) fb_push_field(fb);
+    vm.fb_depth--;
+}
+
+const char* special_value(int c, char *buf, size_t size) {
+    switch (c) {
+    case '?': snprintf(buf, size, "%d", last_status); return buf;
+    case '#': snprintf(buf, size, "%d", posargs.argc); return buf;
+    case '$': snprintf(buf, size, "%d", (int)shell_pid); return buf;
+    case '!':
+        if (!last_bg_pid) return "";
+        snprintf(buf, size, "%d", (int)last_bg_pid);
+        return buf;
+    case '0': return shell_name;
+    case '-': {
+        char *p = buf;
+        if (opt_errexit) *p++ = 'e';
+        if (opt_noglob) *p++ = 'f';
+        if (interactive) *p++ = 'i';
+        if (opt_nounset) *p++ = 'u';
+        if (opt_xtrace) *p++ = 'x';
+        *p = '\0';
+        return buf;
+    }
+    }
+    return NULL;
+}
+
+// Element pointers for "${a[@]}"; valid until the array changes
+char** array_items(const array_t *a, int *n) {
+    char **items = arena_alloc(&vm.arena, (a->nset + 1) * sizeof(char *));
+    int k = 0;
+    for (size_t i = 0; i < a->count; i++) {
+        if (a->off[i] != ARRAY_HOLE) items[k++] = a->data + a->off[i];
+    }
+    items[k] = NULL;
+    *n = k;
+    return items;
+}
+
+// Evaluate an array subscript; negative indices count from the end
+long array_index(const char *s, const array_t *a) {
+    char *end;
+    long i = strtol(s, &end, 10);
+    if (!*s || *end) {
+        i = arith_eval_string(s);
+        if (arith_error) {
+            arith_error = 0;
+            return -1;
+        }
+    }
+    if (i < 0 && a) i += a->count;
+    if (i < 0 || i >= ARRAY_MAX_INDEX) {
+        fprintf(stderr, "ByteShell: %s: bad array subscript\n", s);
+        return -1;
+    }
+    return i;
+}
+
+// "$@"-style expansion of a list: quoted '@' keeps one field per item
+void expand_list(fieldb_t *fb, char **items, int n, int c, int quoted) {
+    if (fb->mode != WM_FIELDS || (quoted && c == '*')) {
+        char sep = ' ';
+        size_t sep_len = 1;
+        if (c == '*' && slot_IFS >= 0) {
+            size_t ilen;
+            const char *ifs = var_value(slot_IFS, &ilen);
+            if (ifs) {
+                sep = ifs[0];
+                sep_len = ilen ? 1 : 0;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (i) fb_text(fb, &sep, sep_len, quoted);
+            fb_value(fb, items[i], strlen(items[i]), quoted);
+        }
+        if (!n && quoted) fb_text(fb, "", 0, 1);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (i && fb->started) fb_push_field(fb);
+        fb_value(fb, items[i], strlen(items[i]), quoted);
+    }
+}
+
+// $@ and $*: quoted "$@" keeps one field per parameter
+void expand_positionals(fieldb_t *fb, int c, int quoted) {
+    expand_list(fb, posargs.argv, posargs.argc, c, quoted);
+}
+
+// name[sub]: associative arrays use the subscript as a key, indexed arrays
+// evaluate it; returns -1 for a bad subscript
+int elem_get(int slot, const char *sub, const char **v, size_t *len) {
+    var_t *var = &vars[slot];
+    if (var->map) {
+        *v = assoc_get(var->map, sub, strlen(sub), len);
+        return 0;
+    }
+    long i = array_index(sub, var->arr);
+    if (i < 0) return -1;
+    if (var->arr) *v = array_get(var->arr, i, len);
+    else *v = i > 0 ? NULL : var_value(slot, len);
+    return 0;
+}
+
+int elem_set(int slot, const char *sub, const char *v, int append) {
+    size_t old;
+    const char *cur = NULL;
+    if (vars[slot].map) {
+        assoc_t *m = var_assoc(slot);
+        if (!m) return -1;
+        if (!*sub) {
+            fprintf(stderr, "ByteShell: %s: bad array subscript\n", vars[slot].name);
+            return -1;
+        }
+        if (append) cur = assoc_get(m, sub, strlen(sub), &old);
+        if (cur) {
+            char *joined = arena_alloc(&vm.arena, old + strlen(v) + 1);
+            memcpy(joined, cur, old);
+            strcpy(joined + old, v);
+            v = joined;
+        }
+        assoc_set(m, sub, strlen(sub), v, strlen(v));
+        return 0;
+    }
+    array_t *a = var_array(slot);
+    long i = a ? array_index(sub, a) : -1;
+    if (i < 0) return -1;
+    if (append) cur = array_get(a, i, &old);
+    if (cur) {
+        char *joined = arena_alloc(&vm.arena, old + strlen(v) + 1);
+        memcpy(joined, cur, old);
+        strcpy(joined + old, v);
+        v = joined;
+    }
+    array_set(a, i, v, strlen(v));
+    return 0;
+}
+
+// Values of an array variable in order
+char** var_items(int slot, int *n) {
+    if (state_recording) state_note_env(vars[slot].name);
+    if (vars[slot].arr) return array_items(vars[slot].arr, n);
+    if (vars[slot].map) return array_items(vars[slot].map->vals, n);
+    char **items = arena_alloc(&vm.arena, 2 * sizeof(char *));
+    items[0] = vars[slot].value;
+    items[1] = NULL;
+    *n = items[0] != NULL;
+    return items;
+}
+
+// ${name[@]}; a scalar is a one-element array
+void expand_array(fieldb_t *fb, int slot, int c, int quoted) {
+    int n;
+    char **items = var_items(slot, &n);
+    expand_list(fb, items, n, c, quoted);
+}
+
+// ${name[i]}; the subscript was expanded onto the argument stack
+const char* elem_value(int slot, size_t *len) {
+    const char *v;
+    if (elem_get(slot, vm_pop_arg(), &v, len) < 0) {
+        expand_error = 1;
+        return NULL;
+    }
+    return v;
+}
+
+uint32_t expand_word(chunk_t *ch, uint32_t pc);
+
+// Expand an operator argument word and return it as a single string
+const char* expand_sub(chunk_t *ch, uint32_t off) {
+    if (!off) return "";
+    expand_word(ch, off);
+    return vm_pop_arg();
+}
+
+// Value of a parameter for operators; NULL if unset
+const char* param_value(chunk_t *ch, int ptype, uint32_t target, char *buf, size_t size) {
+    if (ptype == PT_VAR) return var_value(CSLOT(ch, target), NULL);
+    if (ptype == PT_POS) return posarg(target);
+    if (ptype == PT_ELEM) return elem_value(CSLOT(ch, target), NULL);
+    if (ptype == PT_ARRAY || target == '@' || target == '*') {
+        char **items = posargs.argv;
+        int n = posargs.argc;
+        if (ptype == PT_ARRAY) items = var_items(CSLOT(ch, target), &n);
+        strbuf_t joined = {0};
+        sb_reserve(&joined, 0);
+        for (int i = 0; i < n; i++) {
+            if (i) sb_putc(&joined, ' ');
+            sb_append(&joined, items[i], strlen(items[i]));
+        }
+        char *s = arena_strndup(&vm.arena, joined.data, joined.len);
+        free(joined.data);
+        return n ? s : NULL;
+    }
+    return special_value(target, buf, size);
+}
+
+// Apply a trim or substitution operator to one value, appending the result
+void param_transform(int op, pattern_t *pat, const char *ptext, const char *rep, const char *v, size_t vlen,
+                     strbuf_t *out) {
+    sb_reserve(out, vlen);
+    if (op >= PARAM_TRIM_PREFIX && op <= PARAM_TRIM_SUFFIX_LONG) {
+        int suffix = op >= PARAM_TRIM_SUFFIX;
+        int longest = op == PARAM_TRIM_PREFIX_LONG || op == PARAM_TRIM_SUFFIX_LONG;
+        size_t cut = 0;
+        for (size_t i = 0; i <= vlen; i++) {
+            size_t k = longest ? vlen - i : i;
+            if (k < pat->minlen) {
+                if (longest) break;
+                continue;
+            }
+            if (pattern_match(pat, suffix ? v + vlen - k : v, k)) {
+                cut = k;
+                break;
+            }
+            if (!pat->has_star && !longest && k > pat->minlen) break;
+        }
+        sb_append(out, suffix ? v : v + cut, vlen - cut);
+        return;
+    }
+
+    // Substitution
+    size_t rlen = strlen(rep);
+    if (!*ptext) {
+        sb_append(out, v, vlen);
+    } else if (op == PARAM_SUBST_PREFIX) {
+        long m = pattern_longest(pat, v, vlen, 0);
+        if (m >= 0) {
+            sb_append(out, rep, rlen);
+            sb_append(out, v + m, vlen - m);
+        } else {
+            sb_append(out, v, vlen);
+        }
+    } else if (op == PARAM_SUBST_SUFFIX) {
+        size_t i = 0;
+        while (i <= vlen && !pattern_match(pat, v + i, vlen - i)) i++;
+        sb_append(out, v, i <= vlen ? i : vlen);
+        if (i <= vlen) sb_append(out, rep, rlen);
+    } else {
+        size_t i = 0, copied = 0;
+        while (i < vlen) {
+            long m = pattern_longest(pat, v + i, vlen - i, 1);
+            if (m < 0) {
+                i++;
+                continue;
+            }
+            sb_append(out, v + copied, i - copied);
+            sb_append(out, rep, rlen);
+            i += m;
+            copied = i;
+            if (op != PARAM_SUBST_ALL) break;
+        }
+        sb_append(out, v + copied, vlen - copied);
+    }
+}
+
+// ${a[@]:off:len} and ${@:off:len}: elements from index off, parameters
+// from position off counting $0 as 0, at most len of them
+char** param_slice(chunk_t *ch, int ptype, uint32_t target, char **items, int n, long off, long len, int *count) {
+    char **sel = arena_alloc(&vm.arena, (n + 2) * sizeof(char *));
+    int k = 0;
+    array_t *a = ptype == PT_ARRAY ? vars[CSLOT(ch, target)].arr : NULL;
+    if (a) {
+        if (off < 0) off += a->count;
+        for (long i = off; off >= 0 && i < (long)a->count && k < len; i++) {
+            if (a->off[i] != ARRAY_HOLE) sel[k++] = a->data + a->off[i];
+        }
+    } else if (ptype == PT_ARRAY) {
+        if (off < 0) off += n;
+        for (long i = off; off >= 0 && i < n && k < len; i++) sel[k++] = items[i];
+    } else {
+        if (off < 0) off += n + 1;
+        for (long i = off; off >= 0 && i <= n && k < len; i++) sel[k++] = i ? items[i - 1] : shell_name;
+    }
+    sel[k] = NULL;
+    *count = k;
+    return sel;
+}
+
+// ${name<op>...}; operates on (ptr, len) views of the value. ${a[@]...} and
+// $@ with an operator apply it to each element or parameter in turn
+uint32_t expand_param_op(chunk_t *ch, uint32_t pc, fieldb_t *fb) {
+    const uint32_t *code = ch->code;
+    int ptype = code[pc + 1];
+    uint32_t target = code[pc + 2];
+    int op = code[pc + 3] & 0xff, colon = code[pc + 3] >> 8 & 1;
+    int quoted = code[pc + 4];
+    uint32_t next = code[pc + 5], a1 = code[pc + 6], a2 = code[pc + 7];
+    char buf[64];
+    if (ptype == PT_ARRAY && vars[CSLOT(ch, target)].map) {
+        assoc_t *m = vars[CSLOT(ch, target)].map;
+        if (op == PARAM_LENGTH) {
+            fb_value(fb, buf, snprintf(buf, sizeof(buf), "%zu", m->keys->nset), 1);
+            return next;
+        }
+        if (op == PARAM_KEYS) {
+            int n;
+            char **keys = array_items(m->keys, &n);
+            expand_list(fb, keys, n, '@', quoted);
+            return next;
+        }
+    }
+    if (ptype == PT_ARRAY && (op == PARAM_KEYS || op == PARAM_LENGTH)) {
+        array_t *a = vars[CSLOT(ch, target)].arr;
+        const char *scalar = vars[CSLOT(ch, target)].value;
+        if (op == PARAM_LENGTH) {
+            size_t len = a ? a->nset : scalar != NULL;
+            fb_value(fb, buf, snprintf(buf, sizeof(buf), "%zu", len), 1);
+            return next;
+        }
+        int first = 1;
+        for (size_t i = 0; a ? i < a->count : (scalar && i == 0); i++) {
+            if (a && a->off[i] == ARRAY_HOLE) continue;
+            if (!first && fb->mode == WM_FIELDS && fb->started) fb_push_field(fb);
+            else if (!first) fb_text(fb, " ", 1, quoted);
+            fb_value(fb, buf, snprintf(buf, sizeof(buf), "%zu", i), quoted);
+            first = 0;
+        }
+        return next;
+    }
+    const char *v = param_value(ch, ptype, target, buf, sizeof(buf));
+    size_t vlen = v ? strlen(v) : 0;
+    char **items = NULL;
+    int n = 0, c = target;
+    if (ptype == PT_ARRAY) {
+        items = var_items(CSLOT(ch, target), &n);
+        c = code[pc + 3] >> 16;
+    } else if (ptype == PT_SPECIAL && (target == '@' || target == '*')) {
+        items = posargs.argv;
+        n = posargs.argc;
+    }
+
+    if (op == PARAM_LENGTH) {
+        size_t len = (ptype == PT_SPECIAL && (target == '@' || target == '*')) ? (size_t)posargs.argc : vlen;
+        if (!v && opt_nounset && ptype == PT_VAR) goto unbound;
+        int n = snprintf(buf, sizeof(buf), "%zu", len);
+        fb_value(fb, buf, n, 1);
+        return next;
+    }
+    if (op >= PARAM_DEFAULT && op <= PARAM_ERROR) {
+        int is_set = v && (!colon || vlen > 0);
+        if (op == PARAM_ALT) {
+            if (is_set) {
+                const char *w = expand_sub(ch, a1);
+                fb_value(fb, w, strlen(w), quoted);
+            }
+        } else if (is_set && items) {
+            expand_list(fb, items, n, c, quoted);
+        } else if (is_set) {
+            fb_value(fb, v, vlen, quoted);
+        } else if (op == PARAM_DEFAULT) {
+            const char *w = expand_sub(ch, a1);
+            fb_value(fb, w, strlen(w), quoted);
+        } else if (op == PARAM_ASSIGN) {
+            const char *w = expand_sub(ch, a1);
+            if (ptype != PT_VAR) {
+                fprintf(stderr, "ByteShell: $%s: cannot assign in this way\n", buf);
+                expand_error = 1;
+                return next;
+            }
+            var_set(CSLOT(ch, target), w, strlen(w));
+            fb_value(fb, w, strlen(w), quoted);
+        } else {
+            const char *w = expand_sub(ch, a1);
+            const char *name = ptype == PT_VAR ? CSTR(ch, ch->names[target]) : "parameter";
+            fprintf(stderr, "ByteShell: %s: %s\n", name, *w ? w : "parameter null or not set");
+            expand_error = 1;
+        }
+        return next;
+    }
+    if (!v) {
+        if (opt_nounset && ptype == PT_VAR) goto unbound;
+        v = "";
+    }
+
+    if (op == PARAM_SUBSTR && items) {
+        long off = arith_run(ch, a1);
+        long len = a2 ? arith_run(ch, a2) : LONG_MAX;
+        if (len < 0) {
+            fprintf(stderr, "ByteShell: substring expression < 0\n");
+            expand_error = 1;
+            return next;
+        }
+        int k;
+        char **sel = param_slice(ch, ptype, target, items, n, off, len, &k);
+        expand_list(fb, sel, k, c, quoted);
+        return next;
+    }
+    if (op == PARAM_SUBSTR) {
+        long off = arith_run(ch, a1);
+        long len = a2 ? arith_run(ch, a2) : (long)vlen;
+        if (off < 0) off += vlen;
+        if (off < 0 || off > (long)vlen) return next;
+        if (len < 0) len += vlen - off;
+        if (len < 0) {
+            fprintf(stderr, "ByteShell: substring expression < 0\n");
+            expand_error = 1;
+            return next;
+        }
+        if (len > (long)vlen - off) len = vlen - off;
+        fb_value(fb, v + off, len, quoted);
+        return next;
+    }
+
+    const char *ptext = expand_sub(ch, a1);
+    pattern_t *pat = pattern_get(ptext, strlen(ptext));
+    const char *rep = op >= PARAM_SUBST ? expand_sub(ch, a2) : "";
+    strbuf_t out = {0};
+    if (items) {
+        // Each element or parameter is trimmed or substituted on its own
+        char **done = arena_alloc(&vm.arena, (n + 1) * sizeof(char *));
+        for (int i = 0; i < n; i++) {
+            out.len = 0;
+            param_transform(op, pat, ptext, rep, items[i], strlen(items[i]), &out);
+            done[i] = arena_strndup(&vm.arena, out.data ? out.data : "", out.len);
+        }
+        done[n] = NULL;
+        expand_list(fb, done, n, c, quoted);
+    } else {
+        param_transform(op, pat, ptext, rep, v, vlen, &out);
+        fb_value(fb, out.data ? out.data : "", out.len, quoted);
+    }
+    free(out.data);
+    return next;
+
+unbound:
+    fprintf(stderr, "ByteShell: %s: unbound variable\n", CSTR(ch, ch->names[target]));
+    expand_error = 1;
+    return next;
+}
+
+// Expand the word at pc (OP_WORD_LIT or OP_WBEGIN..OP_WEND) onto the argument stack
+uint32_t expand_cmdsub(chunk_t *ch, uint32_t pc, fieldb_t *fb);
+int procsub_open(chunk_t *ch, uint32_t body, int op);
+
+uint32_t expand_word(chunk_t *ch, uint32_t pc) {
+    const uint32_t *code = ch->code;
+    char buf[64];
+
+    if (code[pc] == OP_WORD_LIT) {
+        vm_push_ref(CSTR(ch, code[pc + 1]));
+        return pc + 2;
+    }
+    fieldb_t *fb = fb_acquire(code[pc + 1]);
+    pc += 2;
+    while (1) {
+        switch (code[pc]) {
+        case OP_WLIT:
+            fb_text(fb, CSTR(ch, code[pc + 1]), code[pc + 2], code[pc + 3]);
+            pc += 4;
+            break;
+        case OP_WVAR: {
+            size_t n;
+            int slot = CSLOT(ch, code[pc + 1]);
+            const char *v = var_value(slot, &n);
+            if (v) {
+                fb_value(fb, v, n, code[pc + 2]);
+            } else if (opt_nounset) {
+                fprintf(stderr, "ByteShell: %s: unbound variable\n", vars[slot].name);
+                expand_error = 1;
+            } else if (code[pc + 2]) {
+                fb_text(fb, "", 0, 1);
+            }
+            pc += 3;
+            break;
+        }
+        case OP_WELEM: {
+            size_t n;
+            const char *v = elem_value(CSLOT(ch, code[pc + 1]), &n);
+            if (v) fb_value(fb, v, n, code[pc + 2]);
+            else if (code[pc + 2]) fb_text(fb, "", 0, 1);
+            pc += 3;
+            break;
+        }
+        case OP_WARRAY:
+            expand_array(fb, CSLOT(ch, code[pc + 1]), code[pc + 2], code[pc + 3]);
+            pc += 4;
+            break;
+        case OP_WPOS: {
+            const char *v = posarg(code[pc + 1]);
+            if (v) fb_value(fb, v, strlen(v), code[pc + 2]);
+            else if (code[pc + 2]) fb_text(fb, "", 0, 1);
+            pc += 3;
+            break;
+        }
+        case OP_WSPECIAL: {
+            int c = code[pc + 1];
+            if (c == '@' || c == '*') {
+                expand_positionals(fb, c, code[pc + 2]);
+            } else {
+                const char *v = special_value(c, buf, sizeof(buf));
+                fb_value(fb, v, strlen(v), code[pc + 2]);
+            }
+            pc += 3;
+            break;
+        }
+        case OP_WPARAM:
+            pc = expand_param_op(ch, pc, fb);
+            break;
+        case OP_WARITH: {
+            long v = arith_run(ch, pc + 3);
+            if (arith_error) {
+                arith_error = 0;
+                expand_error = 1;
+            }
+            fb_value(fb, buf, snprintf(buf, sizeof(buf), "%ld", v), code[pc + 1]);
+            pc = code[pc + 2];
+            break;
+        }
+        case OP_WORD_LIT:
+        case OP_WBEGIN:
+            pc = expand_word(ch, pc);
+            break;
+        case OP_WARITH_DYN: {
+            long v = arith_eval_string(vm_pop_arg());
+            if (arith_error) {
+                arith_error = 0;
+                expand_error = 1;
+            }
+            fb_value(fb, buf, snprintf(buf, sizeof(buf), "%ld", v), code[pc + 1]);
+            pc += 2;
+            break;
+        }
+        case OP_WCMDSUB:
+            pc = expand_cmdsub(ch, pc, fb);
+            break;
+        case OP_WPROCSUB: {
+            int fd = procsub_open(ch, pc + 3, code[pc + 1]);
+            if (fd < 0) {
+                expand_error = 1;
+            } else {
+                fb_value(fb, buf, snprintf(buf, sizeof(buf), "/dev/fd/%d", fd), 1);
+            }
+            pc = code[pc + 2];
+            break;
+        }
+        case OP_WTILDE: {
+            const char *user = CSTR(ch, code[pc + 1]);
+            const char *home = NULL;
+            if (!*user) {
+                home = var_getenv("HOME");
+            } else {
+                struct passwd *pw = getpwnam(user);
+                if (pw) home = pw->pw_dir;
+            }
+            if (home) {
+                fb_text(fb, home, strlen(home), 1);
+            } else {
+                fb_text(fb, "~", 1, 1);
+                fb_text(fb, user, strlen(user), 1);
+            }
+            pc += 2;
+            break;
+        }
+        default:  // OP_WEND
+            fb_finish(fb);
+            return pc + 1;
+        }
+    }
+}
+
+// Redirections
+// Buffered standard input for the read builtin. Regular files are read in
+// blocks and the offset is moved back before anything else can read them;
+// pipes are peeked with tee(2) and only the bytes handed out are consumed
+typedef struct {
+    int active;
+    int pipe;
+    char *data;
+    size_t cap;
+    size_t len;
+    size_t pos;         // bytes handed out
+    size_t drained;     // bytes already consumed from a pipe
+} inbuf_t;
+
+inbuf_t inbuf;
+int peek_fds[2] = {-1, -1};
+
+// Consume from the pipe what was handed out but is still in it
+int inbuf_drain(void) {
+    static char junk[4096];
+    while (inbuf.drained < inbuf.pos) {
+        size_t want = inbuf.pos - inbuf.drained;
+        ssize_t n = read(STDIN_FILENO, junk, want < sizeof(junk) ? want : sizeof(junk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        inbuf.drained += n;
+    }
+    return 0;
+}
+
+// Give back what was read ahead, so children and redirections see the
+// input exactly where the shell stopped
+void read_sync(void) {
+    if (!inbuf.active) return;
+    if (inbuf.pipe) inbuf_drain();
+    else if (inbuf.len > inbuf.pos) lseek(STDIN_FILENO, (off_t)inbuf.pos - (off_t)inbuf.len, SEEK_CUR);
+    inbuf.active = 0;
+    inbuf.len = inbuf.pos = inbuf.drained = 0;
+}
+
+// Refill the buffer; returns bytes available, 0 at end of input, or -1 if
+// standard input cannot be read ahead (terminals, sockets)
+ssize_t inbuf_fill(void) {
+    if (!inbuf.active) {
+        struct stat st;
+        if (fstat(STDIN_FILENO, &st) < 0) return -1;
+        if (S_ISREG(st.st_mode) && lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0) {
+            inbuf.pipe = 0;
+        } else if (S_ISFIFO(st.st_mode)) {
+            if (peek_fds[0] < 0) {
+                int fds[2];
+                if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+                peek_fds[0] = fcntl(fds[0], F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+                peek_fds[1] = fcntl(fds[1], F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+                close(fds[0]);
+                close(fds[1]);
+            }
+            inbuf.pipe = 1;
+        } else {
+            return -1;
+        }
+        if (!inbuf.data) {
+            inbuf.cap = 65536;
+            inbuf.data = malloc(inbuf.cap);
+        }
+        inbuf.active = 1;
+    }
+    ssize_t n;
+    if (inbuf.pipe) {
+        if (inbuf_drain() < 0) return -1;
+        while ((n = tee(STDIN_FILENO, peek_fds[1], inbuf.cap, 0)) < 0 && errno == EINTR) {}
+        if (n < 0) {
+            inbuf.active = 0;
+            return errno == EINVAL ? -1 : 0;
+        }
+        size_t got = 0;
+        while (got < (size_t)n) {
+            ssize_t r = read(peek_fds[0], inbuf.data + got, n - got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got += r;
+        }
+    } else {
+        while ((n = read(STDIN_FILENO, inbuf.data, inbuf.cap)) < 0 && errno == EINTR) {}
+        if (n < 0) n = 0;
+    }
+    inbuf.len = n;
+    inbuf.pos = inbuf.drained = 0;
+    return n;
+}
+
+// Next byte of standard input, or -1 at end of input
+int inbuf_getc(void) {
+    if (inbuf.pos < inbuf.len) return (unsigned char)inbuf.data[inbuf.pos++];
+    ssize_t n = inbuf_fill();
+    if (n > 0) return (unsigned char)inbuf.data[inbuf.pos++];
+    if (n == 0) return -1;
+    unsigned char c;
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR) {
+        if (interrupted) return -1;
+    }
+    return n == 1 ? c : -1;
+}
+
+// Hand out standard input up to delim, splitting with memchr over whole
+// blocks; calls fn for each piece, with more set unless the delimiter
+// follows it. Returns 1 if delim was seen, 0 at the end
+int inbuf_getline(int delim, void (*fn)(const char *s, size_t n, int more, void *ctx), void *ctx) {
+    while (1) {
+        if (inbuf.pos >= inbuf.len) {
+            ssize_t n = inbuf_fill();
+            if (n < 0) {
+                // Cannot read ahead: one byte at a time
+                int c = inbuf_getc();
+                if (c < 0) return 0;
+                if (c == delim) return 1;
+                char ch = c;
+                fn(&ch, 1, 1, ctx);
+                continue;
+            }
+            if (n == 0) return 0;
+        }
+        const char *start = inbuf.data + inbuf.pos;
+        const char *nl = memchr(start, delim, inbuf.len - inbuf.pos);
+        size_t take = nl ? (size_t)(nl - start) : inbuf.len - inbuf.pos;
+        fn(start, take, nl == NULL, ctx);
+        inbuf.pos += take + (nl != NULL);
+        if (nl) return 1;
+    }
+}
+
+int redir_open(int type, const char *target) {
+    int flags;
+    switch (type) {
+    case R_IN: flags = O_RDONLY; break;
+    case R_APPEND: case R_BOTH_APPEND: flags = O_WRONLY | O_CREAT | O_APPEND; break;
+    case R_RW: flags = O_RDWR | O_CREAT; break;
+    default: flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+    }
+    int fd = open(target, flags | O_CLOEXEC, 0666);
+    if (fd < 0) fprintf(stderr, "ByteShell: %s: %s\n", target, strerror(errno));
+    return fd;
+}
+
+void redir_save(int fd) {
+    GROW(vm.fds, vm.nfds, vm.fds_cap);
+    vm.fds[vm.nfds].fd = fd;
+    vm.fds[vm.nfds].saved = fcntl(fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+    vm.nfds++;
+}
+
+// Move newfd onto fd, optionally saving fd's previous target first
+int redir_install(int newfd, int fd, int save) {
+    if (fd == STDIN_FILENO) read_sync();
+    if (save) redir_save(fd);
+    if (newfd == fd) {
+        fcntl(fd, F_SETFD, 0);
+        return 0;
+    }
+    if (newfd < 0) {
+        close(fd);
+        return 0;
+    }
+    if (dup2(newfd, fd) < 0) {
+        fprintf(stderr, "ByteShell: %d: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Write everything, retrying short writes; returns -1 on error
+int write_all(int fd, const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// A readable descriptor holding text: a pipe when it fits in the pipe buffer,
+// otherwise a sealed memfd, so here-documents never touch the disk
+int heredoc_open(const char *s, size_t n, int newline) {
+    size_t total = n + newline;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+        int size = fcntl(fds[1], F_GETPIPE_SZ);
+        if (size > 0 && total <= (size_t)size) {
+            if (write_all(fds[1], s, n) == 0 && (!newline || write_all(fds[1], "\n", 1) == 0)) {
+                close(fds[1]);
+                return fds[0];
+            }
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+    int fd = memfd_create("byteshell-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || write_all(fd, s, n) < 0 || (newline && write_all(fd, "\n", 1) < 0)) {
+        fprintf(stderr, "ByteShell: here-document: %s\n", strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Apply redirections; with save the previous descriptors can be restored
+int redir_apply(pending_redir_t *r, int n, int save) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < n; i++) {
+        int type = r[i].type, fd = r[i].fd;
+        const char *t = r[i].target;
+
+        if (type == R_DUPIN || type == R_DUPOUT) {
+            if (strcmp(t, "-") == 0) {
+                redir_install(-1, fd, save);
+                continue;
+            }
+            char *end;
+            long src = strtol(t, &end, 10);
+            if (*t && !*end) {
+                if (fcntl(src, F_GETFD) < 0) {
+                    fprintf(stderr, "ByteShell: %s: bad file descriptor\n", t);
+                    return -1;
+                }
+                if (redir_install(src, fd, save) < 0) return -1;
+                continue;
+            }
+            if (type == R_DUPIN) {
+                fprintf(stderr, "ByteShell: %s: ambiguous redirect\n", t);
+                return -1;
+            }
+            type = R_BOTH;
+        }
+        int newfd = type >= R_HEREDOC ? heredoc_open(t, strlen(t), type == R_HERESTR) : redir_open(type, t);
+        if (newfd < 0) return -1;
+        if (newfd == fd || (newfd <= 2 && (type == R_BOTH || type == R_BOTH_APPEND))) {
+            // The target was closed and open() reused it; move the file aside
+            // so the target's closed state is what gets saved
+            int moved = fcntl(newfd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+            close(newfd);
+            if (moved < 0) return -1;
+            newfd = moved;
+        }
+        if (type == R_BOTH || type == R_BOTH_APPEND) {
+            if (redir_install(newfd, 1, save) < 0 || redir_install(newfd, 2, save) < 0) {
+                close(newfd);
+                return -1;
+            }
+        } else if (redir_install(newfd, fd, save) < 0) {
+            close(newfd);
+            return -1;
+        }
+        close(newfd);
+    }
+    return 0;
+}
+
+// Make the redirections since base permanent by dropping the saved descriptors
+void redir_keep(int base) {
+    while (vm.nfds > base) {
+        saved_fd_t *s = &vm.fds[--vm.nfds];
+        if (s->saved >= 0) close(s->saved);
+    }
+    vm.keep_redirs = 0;
+}
+
+void redir_restore(int base) {
+    fflush(stdout);
+    fflush(stderr);
+    while (vm.nfds > base) {
+        saved_fd_t *s = &vm.fds[--vm.nfds];
+        if (s->fd == STDIN_FILENO) read_sync();
+        if (s->saved >= 0) {
+            dup2(s->saved, s->fd);
+            close(s->saved);
+        } else {
+            close(s->fd);
+        }
+    }
+}
+
+void frame_pop(void) {
+    vm_frame_t *f = &vm.frames[--vm.nframes];
+    if (f->type == FRAME_REDIR) redir_restore(f->fd_base);
+    free(f->items);
+    free(f->subject);
+}
+
+vm_frame_t* frame_push(int type) {
+    GROW(vm.frames, vm.nframes, vm.frames_cap);
+    vm_frame_t *f = &vm.frames[vm.nframes++];
+    memset(f, 0, sizeof(*f));
+    f->type = type;
+    return f;
+}
+
+// Copy a list of strings into one allocation owned by a loop frame
+char** copy_strings(char **src, int n) {
+    size_t size = (n + 1) * sizeof(char *);
+    for (int i = 0; i < n; i++) size += strlen(src[i]) + 1;
+    char **items = malloc(size);
+    char *p = (char *)(items + n + 1);
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(src[i]) + 1;
+        memcpy(p, src[i], len);
+        items[i] = p;
+        p += len;
+    }
+    items[n] = NULL;
+    return items;
+}
+
+// Child side of fork: default signals, no interactive behavior
+void child_init(void) {
+    vm.in_child = 1;
+    interactive = 0;
+    inbuf.active = 0;
+    job_count = 0;
+    // A child is a copy already; nothing it does needs undoing, and the
+    // directories held to undo it with are let go
+    for (int i = 0; i < subshell_depth; i++) {
+        if (subshells[i].cwd_fd >= 0) close(subshells[i].cwd_fd);
+        for (int k = 0; k < subshells[i].ndirs; k++) close(subshells[i].dirs[k].fd);
+    }
+    subshell_depth = 0;
+    journal_gen = 0;
+    for (int i = 0; i < capture_cap; i++) {
+        if (capture_fds[i] >= 0) close(capture_fds[i]);
+        capture_fds[i] = -1;
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    path_watch_close();
+}
+
+void child_exit(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status & 0xff);
+}
+
+// Exit the shell, or only the innermost in-process subshell
+void shell_exit(int status) {
+    if (subshell_depth) {
+        vm.unwind = UNWIND_EXIT;
+        vm.ret_status = status & 0xff;
+        return;
+    }
+    fflush(stdout);
+    if (vm.in_child) child_exit(status);
+    exit(status & 0xff);
+}
+
+int wait_for(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return 127;
+    }
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) {
+        if (WTERMSIG(status) == SIGINT && interactive) interrupted = 1;
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+void job_add(pid_t pid) {
+    GROW(jobs, job_count, job_cap);
+    jobs[job_count++] = pid;
+}
+
+// Reap finished background jobs without blocking
+void reap_jobs(void) {
+    procsub_reap();
+    for (int i = 0; i < job_count; i++) {
+        int status;
+        if (waitpid(jobs[i], &status, WNOHANG) == jobs[i]) {
+            if (interactive) fprintf(stderr, "[%d] Done %d\n", i + 1, (int)jobs[i]);
+            jobs[i--] = jobs[--job_count];
+        }
+    }
+}
+
+int call_function(int fi, int argc, char **argv) {
+    if (vm.func_depth >= MAX_FUNC_DEPTH) {
+        fprintf(stderr, "ByteShell: %s: maximum function nesting level exceeded\n", argv[0]);
+        return 1;
+    }
+    if (!funcs[fi].chunk) {
+        int status = func_resolve(fi);
+        if (status) return status;
+    }
+    chunk_t *ch = funcs[fi].chunk;
+    uint32_t body = funcs[fi].body;
+    posargs_t saved_args = posargs;
+    int saved_locals = local_frame_base;
+
+    ch->refs++;
+    posargs = posargs_make(argv + 1, argc - 1);
+    local_frame_base = var_save_count;
+    int saved_loop_base = vm.loop_base;
+    vm.loop_base = vm.nframes;
+    vm.func_depth++;
+    int status = vm_exec(ch, body);
+    vm.func_depth--;
+    vm.loop_base = saved_loop_base;
+    if (vm.unwind == UNWIND_RETURN) {
+        status = vm.ret_status;
+        vm.unwind = UNWIND_NONE;
+    } else if (vm.unwind == UNWIND_BREAK || vm.unwind == UNWIND_CONTINUE) {
+        vm.unwind = UNWIND_NONE;
+    }
+    var_restore(local_frame_base);
+    local_frame_base = saved_locals;
+    free(posargs.base);
+    posargs = saved_args;
+    chunk_unref(ch);
+    return status;
+}
+
+void subshell_enter(void) {
+    GROW(subshells, subshell_depth, subshell_cap);
+    subshell_t *s = &subshells[subshell_depth++];
+    s->prev_gen = journal_gen;
+    journal_gen = ++journal_counter;
+    s->var_base = var_journal_count;
+    s->func_base = func_journal_count;
+    s->alias_base = alias_journal_count;
+    s->posargs = posargs;
+    s->opts[0] = opt_errexit;
+    s->opts[1] = opt_noglob;
+    s->opts[2] = opt_nounset;
+    s->opts[3] = opt_xtrace;
+    s->opts[4] = opt_pipefail;
+    s->opts[5] = opt_prefetch;
+    s->cwd_fd = -1;
+    s->ndirs = -1;
+}
+
+// Undo the innermost subshell; returns its exit status
+int subshell_leave(int status) {
+    subshell_t *s = &subshells[--subshell_depth];
+    if (vm.unwind == UNWIND_EXIT || vm.unwind == UNWIND_RETURN) status = vm.ret_status;
+    if (vm.unwind != UNWIND_INTR) vm.unwind = UNWIND_NONE;
+    var_journal_restore(s->var_base);
+    func_journal_restore(s->func_base);
+    alias_journal_restore(s->alias_base);
+    if (posargs.base != s->posargs.base) free(posargs.base);
+    posargs = s->posargs;
+    opt_errexit = s->opts[0];
+    opt_noglob = s->opts[1];
+    opt_nounset = s->opts[2];
+    opt_xtrace = s->opts[3];
+    opt_pipefail = s->opts[4];
+    opt_prefetch = s->opts[5];
+    if (s->cwd_fd >= 0) {
+        if (fchdir(s->cwd_fd) < 0) perror("ByteShell: cd");
+        close(s->cwd_fd);
+    }
+    if (s->ndirs >= 0) {
+        dir_stack_clear();
+        free(dir_stack);
+        dir_stack = s->dirs;
+        dir_count = dir_cap = s->ndirs;
+    }
+    journal_gen = s->prev_gen;
+    last_status = status;
+    return status;
+}
+
+// Remember the working directory before the first cd of a subshell
+void subshell_save_cwd(void) {
+    if (subshell_depth && subshells[subshell_depth - 1].cwd_fd < 0) {
+        subshells[subshell_depth - 1].cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+}
+
+// Copy the directory stack before a subshell's first pushd or popd
+void subshell_save_dirs(void) {
+    if (!subshell_depth || subshells[subshell_depth - 1].ndirs >= 0) return;
+    subshell_t *s = &subshells[subshell_depth - 1];
+    s->dirs = dir_count ? malloc(dir_count * sizeof(dir_entry_t)) : NULL;
+    for (int i = 0; i < dir_count; i++) {
+        s->dirs[i].path = strdup(dir_stack[i].path);
+        s->dirs[i].fd = fcntl(dir_stack[i].fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+    }
+    s->ndirs = dir_count;
+}
+
+void xtrace_print(char **argv, int argc) {
+    fprintf(stderr, "+");
+    for (int i = 0; i < argc; i++) fprintf(stderr, " %s", argv[i]);
+    fprintf(stderr, "\n");
+}
+
+// Run the simple command collected in the top command frame
+void vm_run_command(int builtin, int flags) {
+    cmd_frame_t *cf = &vm.cmds[vm.ncmds - 1];
+    int argc = vm.nargs - cf->arg_base;
+
+    if (expand_error) {
+        vm_cmd_end();
+        vm_expand_failed();
+        return;
+    }
+    // A private argv: nested commands may grow the argument stack
+    char **argv = arena_alloc(&vm.arena, (argc + 1) * sizeof(char *));
+    memcpy(argv, vm.args + cf->arg_base, argc * sizeof(char *));
+    argv[argc] = NULL;
+    pending_redir_t *redirs = vm.redirs + cf->redir_base;
+    int nredirs = vm.nredirs - cf->redir_base;
+    int status;
+
+    if (argc == 0) {
+        // Redirections only, plus assignments that stick
+        int fd_base = vm.nfds;
+        status = redir_apply(redirs, nredirs, 1) < 0 ? 1 : cf->subst_status < 0 ? 0 : cf->subst_status;
+        redir_restore(fd_base);
+        for (int i = cf->assign_base; i < vm.nassigns && !status; i++) {
+            pending_assign_t *a = &vm.assigns[i];
+            if (var_set(a->slot, a->value, strlen(a->value)) < 0) status = 1;
+        }
+        last_status = status;
+        vm_cmd_end();
+        return;
+    }
+    if (opt_xtrace) xtrace_print(argv, argc);
+
+    int bi = (builtin >= 0 && !builtin_shadowed[builtin]) ? builtin : -1;
+    int fi = bi < 0 ? func_lookup(argv[0]) : -1;
+    if (bi < 0 && fi < 0) bi = builtin_find(argv[0]);
+
+    if (bi >= 0 || fi >= 0) {
+        int fd_base = vm.nfds, save_base = var_save_count;
+        int prefixed = vm.nassigns > cf->assign_base;
+        if (redir_apply(redirs, nredirs, 1) < 0) {
+            status = 1;
+        } else {
+            for (int i = cf->assign_base; i < vm.nassigns; i++) {
+                pending_assign_t *a = &vm.assigns[i];
+                var_save(a->slot);
+                var_set(a->slot, a->value, strlen(a->value));
+                if (fi >= 0) var_export(a->slot);
+            }
+            status = fi >= 0 ? call_function(fi, argc, argv) : builtins[bi].func(argv);
+            fflush(stdout);
+        }
+        // Builtins such as local save variables of their own; keep those
+        if (prefixed) var_restore(save_base);
+        if (vm.keep_redirs) redir_keep(fd_base);
+        redir_restore(fd_base);
+    } else {
+        status = execute_command(argv, flags & EXF_TAIL);
+    }
+    last_status = status;
+    vm_cmd_end();
+    if (status && opt_errexit && !(flags & EXF_COND) && !vm.unwind) shell_exit(status);
+    if (interrupted && interactive) vm.unwind = UNWIND_INTR;
+}
+
+// Is stdout the capture file of the innermost in-process substitution?
+int capture_on_stdout(void) {
+    struct stat a, b;
+    if (!capture_depth || capture_fds[capture_depth - 1] < 0) return 0;
+    return fstat(STDOUT_FILENO, &a) == 0 && fstat(capture_fds[capture_depth - 1], &b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Before forking a child whose output is captured: a pipe to give it in
+// place of the capture file, or fds set to -1 if none is needed. Anything
+// it leaves running in the background then writes into the pipe, which
+// capture_drain reads to the end as a forked substitution would
+void capture_pipe(int fds[2]) {
+    fds[0] = fds[1] = -1;
+    if (capture_on_stdout() && pipe2(fds, O_CLOEXEC) < 0) {
+        fds[0] = fds[1] = -1;
+        capture_shared = 1;
+    }
+}
+
+// Copy the capture pipe into the capture file until every writer has gone
+void capture_drain(int fds[2]) {
+    char buf[8192];
+    ssize_t n;
+    if (fds[0] < 0) return;
+    close(fds[1]);
+    while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR && !interrupted) continue;
+            break;
+        }
+        for (ssize_t done = 0, w; done < n; done += w) {
+            w = write(STDOUT_FILENO, buf + done, n - done);
+            if (w < 0 && errno == EINTR) w = 0;
+            else if (w < 0) break;
+        }
+    }
+    close(fds[0]);
+}
+
+// In the child: put the capture pipe on stdout
+void capture_pipe_child(int fds[2]) {
+    if (fds[0] < 0) return;
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Run an N-stage pipeline, one forked child per stage
+int run_pipeline(chunk_t *ch, const uint32_t *stages, int n) {
+    pid_t *pids = malloc(n * sizeof(pid_t));
+    int prev = -1, started = 0, status = 0, failed = 0, cap[2];
+
+    fflush(stdout);
+    fflush(stderr);
+    read_sync();
+    capture_pipe(cap);
+    for (int i = 0; i < n; i++) {
+        int fds[2] = {-1, -1};
+        if (i < n - 1 && pipe(fds) < 0) {
+            perror("pipe");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            child_init();
+            if (prev >= 0) {
+                dup2(prev, 0);
+                close(prev);
+            }
+            if (fds[1] >= 0) {
+                dup2(fds[1], 1);
+                close(fds[1]);
+                close(fds[0]);
+            }
+            if (i == n - 1) capture_pipe_child(cap);
+            else if (cap[0] >= 0) close(cap[0]), close(cap[1]);
+            vm.exec_chunk = ch;
+            child_exit(vm_exec(ch, stages[i]));
+        }
+        if (prev >= 0) close(prev);
+        if (fds[1] >= 0) close(fds[1]);
+        prev = fds[0];
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        pids[started++] = pid;
+    }
+    if (prev >= 0) close(prev);
+    capture_drain(cap);
+    for (int i = 0; i < started; i++) {
+        int s = wait_for(pids[i]);
+        if (i == n - 1) status = s;
+        if (s) failed = s;
+    }
+    free(pids);
+    if (started < n) return 1;
+    return opt_pipefail && failed ? failed : status;
+}
+
+// The capture file for the current nesting level, or -1 if memfds are unavailable
+int capture_fd(void) {
+    if (capture_depth >= capture_cap) {
+        int old = capture_cap;
+        GROW(capture_fds, capture_depth, capture_cap);
+        for (int i = old; i < capture_cap; i++) capture_fds[i] = -1;
+    }
+    if (capture_fds[capture_depth] < 0) {
+        int fd = memfd_create("byteshell-capture", MFD_CLOEXEC);
+        if (fd < 0) return -1;
+        capture_fds[capture_depth] = fcntl(fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+        close(fd);
+    }
+    return capture_fds[capture_depth];
+}
+
+// Run the body in-process with stdout on the capture file; returns its status
+int capture_in_process(chunk_t *ch, uint32_t body, int fd, strbuf_t *out) {
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+    dup2(fd, STDOUT_FILENO);
+    int outer_shared = capture_shared;
+    capture_shared = 0;
+    capture_depth++;
+    subshell_enter();
+    int status = subshell_leave(vm_exec(ch, body));
+    fflush(stdout);
+    capture_depth--;
+    int shared = capture_shared;
+    capture_shared = outer_shared;
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    } else {
+        close(STDOUT_FILENO);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        sb_reserve(out, st.st_size + 1);
+        ssize_t n;
+        while (out->len < (size_t)st.st_size &&
+               (n = pread(fd, out->data + out->len, st.st_size - out->len, out->len)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            out->len += n;
+        }
+    }
+    if (shared || ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        // A capture file a background child may still write to, or one
+        // we cannot reset, must not leak into the next one
+        close(fd);
+        capture_fds[capture_depth] = -1;
+    }
+    return status;
+}
+
+// Run the body in a forked child and read its output through a pipe
+int capture_forked(chunk_t *ch, uint32_t body, strbuf_t *out) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    read_sync();
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_init();
+        dup2(fds[1], STDOUT_FILENO);
+        vm.exec_chunk = ch;
+        child_exit(vm_exec(ch, body));
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        return 1;
+    }
+    ssize_t n;
+    sb_reserve(out, 65536);
+    while ((n = read(fds[0], out->data + out->len, out->cap - out->len - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        out->len += n;
+        sb_reserve(out, 65536);
+    }
+    close(fds[0]);
+    return wait_for(pid);
+}
+
+// Start <(...) or >(...) and return the shell's end of its pipe. The producers
+// run concurrently, so diff <(sort a) <(sort b) sorts both files in parallel
+int procsub_open(chunk_t *ch, uint32_t body, int op) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    int mine = op == '<' ? fds[0] : fds[1], theirs = op == '<' ? fds[1] : fds[0];
+    fflush(stdout);
+    fflush(stderr);
+    read_sync();
+    if (op == '>' && capture_on_stdout()) capture_shared = 1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_init();
+        dup2(theirs, op == '<' ? STDOUT_FILENO : STDIN_FILENO);
+        vm.exec_chunk = ch;
+        child_exit(vm_exec(ch, body));
+    }
+    close(theirs);
+    if (pid < 0) {
+        perror("fork");
+        close(mine);
+        return -1;
+    }
+    // Inherited by the command that opens /dev/fd/N, out of the way of 3>file
+    int fd = fcntl(mine, F_DUPFD, SAVED_FD_BASE);
+    close(mine);
+    if (fd < 0) {
+        perror("ByteShell: process substitution");
+        return -1;
+    }
+    GROW(procsubs, procsub_count, procsub_cap);
+    procsubs[procsub_count].fd = fd;
+    procsubs[procsub_count].pid = pid;
+    procsub_count++;
+    last_bg_pid = pid;
+    return fd;
+}
+
+// Expand $(...): capture the body's output, drop NULs and trailing newlines
+uint32_t expand_cmdsub(chunk_t *ch, uint32_t pc, fieldb_t *fb) {
+    const uint32_t *code = ch->code;
+    int quoted = code[pc + 1];
+    uint32_t next = code[pc + 2];
+    strbuf_t out = {0};
+    int fd = code[pc + 3] ? -1 : capture_fd();
+    int status = fd >= 0 ? capture_in_process(ch, pc + 4, fd, &out) : capture_forked(ch, pc + 4, &out);
+
+    size_t len = 0;
+    for (size_t i = 0; i < out.len; i++) {
+        if (out.data[i]) out.data[len++] = out.data[i];
+    }
+    while (len > 0 && out.data[len - 1] == '\n') len--;
+    fb_value(fb, out.data ? out.data : "", len, quoted);
+    free(out.data);
+    last_status = status;
+    if (vm.ncmds) vm.cmds[vm.ncmds - 1].subst_status = status;
+    return next;
+}
+
+// Handle break/continue after a command; returns 0 if the unwind must propagate
+int vm_loop_unwind(int frame_base, uint32_t *pc) {
+    int target = -1, count = vm.unwind_count;
+    for (int i = vm.nframes - 1; i >= frame_base; i--) {
+        if (vm.frames[i].type != FRAME_LOOP) continue;
+        target = i;
+        if (--count == 0) break;
+    }
+    if (target < 0) return 0;
+    while (vm.nframes > target + 1) frame_pop();
+    vm_frame_t *f = &vm.frames[target];
+    if (vm.unwind == UNWIND_BREAK) {
+        f->saved_status = 0;
+        *pc = f->brk;
+    } else {
+        *pc = f->cont;
+    }
+    vm.unwind = UNWIND_NONE;
+    last_status = 0;
+    return 1;
+}
+
+// The dispatch loop: run code from pc until OP_END or an unwind
+int vm_exec(chunk_t *ch, uint32_t pc) {
+    const uint32_t *code = ch->code;
+    int frame_base = vm.nframes, cmd_base = vm.ncmds;
+
+    while (1) {
+        switch (code[pc]) {
+        case OP_END:
+            goto out;
+        case OP_JMP:
+            if (code[pc + 1] <= pc && interrupted && interactive) {
+                vm.unwind = UNWIND_INTR;
+                goto out;
+            }
+            pc = code[pc + 1];
+            break;
+        case OP_JMP_FALSE:
+            pc = last_status ? code[pc + 1] : pc + 2;
+            break;
+        case OP_JMP_TRUE:
+            pc = last_status ? pc + 2 : code[pc + 1];
+            break;
+        case OP_NOT:
+            last_status = !last_status;
+            pc++;
+            break;
+        case OP_STATUS:
+            last_status = code[pc + 1];
+            pc += 2;
+            break;
+        case OP_CMD_BEGIN:
+            vm_cmd_begin();
+            pc++;
+            break;
+        case OP_CMD_END:
+            vm_cmd_end();
+            if (expand_error) vm_expand_failed();
+            if (vm.unwind) goto out;
+            pc++;
+            break;
+        case OP_WORD_LIT:
+            vm_push_ref(CSTR(ch, code[pc + 1]));
+            pc += 2;
+            break;
+        case OP_WBEGIN:
+            pc = expand_word(ch, pc);
+            break;
+        case OP_SETVAR: {
+            const char *v = vm_pop_arg();
+            int slot = CSLOT(ch, code[pc + 1]);
+            if (expand_error) {
+                pc += 3;
+                break;
+            }
+            size_t old;
+            const char *cur;
+            if (code[pc + 2] && (cur = var_value(slot, &old))) {
+                char *joined = arena_alloc(&vm.arena, old + strlen(v) + 1);
+                memcpy(joined, cur, old);
+                strcpy(joined + old, v);
+                v = joined;
+            }
+            if (var_set(slot, v, strlen(v)) < 0) last_status = 1;
+            pc += 3;
+            break;
+        }
+        case OP_ASSIGN_PUSH: {
+            GROW(vm.assigns, vm.nassigns, vm.assigns_cap);
+            pending_assign_t *a = &vm.assigns[vm.nassigns++];
+            a->slot = CSLOT(ch, code[pc + 1]);
+            a->value = vm_pop_arg();
+            a->append = code[pc + 2];
+            size_t old;
+            const char *cur;
+            if (a->append && (cur = var_value(a->slot, &old))) {
+                char *joined = arena_alloc(&vm.arena, old + strlen(a->value) + 1);
+                memcpy(joined, cur, old);
+                strcpy(joined + old, a->value);
+                a->value = joined;
+            }
+            pc += 3;
+            break;
+        }
+        case OP_SETELEM: {
+            const char *v = vm_pop_arg();
+            const char *sub = vm_pop_arg();
+            int slot = CSLOT(ch, code[pc + 1]);
+            pc += 3;
+            if (expand_error) break;
+            if (elem_set(slot, sub, v, code[pc - 1]) < 0) last_status = 1;
+            break;
+        }
+        case OP_ARRAY_BEGIN: {
+            GROW(vm.abuilds, vm.nabuilds, vm.abuilds_cap);
+            abuild_t *b = &vm.abuilds[vm.nabuilds++];
+            b->slot = CSLOT(ch, code[pc + 1]);
+            b->append = code[pc + 2];
+            b->arg_base = vm.nargs;
+            b->map = NULL;
+            b->arr = NULL;
+            b->key = NULL;
+            if (vars[b->slot].map) {
+                b->map = b->append ? var_assoc(b->slot) : assoc_new();
+                if (!b->map) {
+                    b->map = assoc_new();
+                    b->append = -1;
+                }
+                pc += 3;
+                break;
+            }
+            b->arr = b->append ? var_array(b->slot) : array_new();
+            if (!b->arr) {
+                // Readonly: build into a scratch array and drop it
+                b->arr = array_new();
+                b->append = -1;
+            }
+            b->next = b->arr->count;
+            pc += 3;
+            break;
+        }
+        case OP_ARRAY_ADD: {
+            abuild_t *b = &vm.abuilds[vm.nabuilds - 1];
+            if (b->map) {
+                // Associative arrays take plain words as key-value pairs
+                for (int i = b->arg_base; i < vm.nargs; i++) {
+                    if (!b->key) {
+                        b->key = vm.args[i];
+                        continue;
+                    }
+                    assoc_set(b->map, b->key, strlen(b->key), vm.args[i], strlen(vm.args[i]));
+                    b->key = NULL;
+                }
+                vm.nargs = b->arg_base;
+                pc++;
+                break;
+            }
+            for (int i = b->arg_base; i < vm.nargs; i++) array_set(b->arr, b->next++, vm.args[i], strlen(vm.args[i]));
+            vm.nargs = b->arg_base;
+            pc++;
+            break;
+        }
+        case OP_ARRAY_KEY: {
+            abuild_t *b = &vm.abuilds[vm.nabuilds - 1];
+            const char *v = vm_pop_arg();
+            if (b->map) {
+                const char *key = vm_pop_arg();
+                if (*key) {
+                    assoc_set(b->map, key, strlen(key), v, strlen(v));
+                } else {
+                    fprintf(stderr, "ByteShell: %s: bad array subscript\n", vars[b->slot].name);
+                    expand_error = 1;
+                }
+                pc++;
+                break;
+            }
+            long i = array_index(vm_pop_arg(), b->arr);
+            if (i >= 0) {
+                array_set(b->arr, i, v, strlen(v));
+                b->next = i + 1;
+            } else {
+                expand_error = 1;
+            }
+            pc++;
+            break;
+        }
+        case OP_ARRAY_END: {
+            abuild_t *b = &vm.abuilds[--vm.nabuilds];
+            pc++;
+            if (b->key) assoc_set(b->map, b->key, strlen(b->key), "", 0);
+            if (b->append > 0) break;
+            if (b->append < 0 || expand_error || (vars[b->slot].flags & VAR_READONLY)) {
+                if (!b->append) fprintf(stderr, "ByteShell: %s: readonly variable\n", vars[b->slot].name);
+                array_free(b->arr);
+                assoc_free(b->map);
+                last_status = 1;
+                break;
+            }
+            int flags = vars[b->slot].flags & ~VAR_INTVALID;
+            var_unset(b->slot);
+            vars[b->slot].flags = flags;
+            vars[b->slot].arr = b->arr;
+            vars[b->slot].map = b->map;
+            break;
+        }
+        case OP_REDIR_PUSH: {
+            GROW(vm.redirs, vm.nredirs, vm.redirs_cap);
+            pending_redir_t *r = &vm.redirs[vm.nredirs++];
+            r->target = vm_pop_arg();
+            r->type = code[pc + 1];
+            r->fd = code[pc + 2];
+            pc += 3;
+            break;
+        }
+        case OP_EXEC: {
+            // Sourced and eval'd text ends in tail position too, but only the
+            // chunk this process was started for may replace it
+            int flags = code[pc + 2];
+            if (ch != vm.exec_chunk) flags &= ~EXF_TAIL;
+            vm_run_command((int32_t)code[pc + 1], flags);
+            pc += 3;
+            if (vm.unwind) {
+                if (vm.unwind != UNWIND_BREAK && vm.unwind != UNWIND_CONTINUE) goto out;
+                if (!vm_loop_unwind(frame_base, &pc)) goto out;
+            }
+            break;
+        }
+        case OP_REDIR_APPLY: {
+            cmd_frame_t *cf = &vm.cmds[vm.ncmds - 1];
+            int fd_base = vm.nfds;
+            if (expand_error) {
+                vm_cmd_end();
+                vm_expand_failed();
+                goto out;
+            }
+            if (redir_apply(vm.redirs + cf->redir_base, vm.nredirs - cf->redir_base, 1) < 0) {
+                redir_restore(fd_base);
+                vm_cmd_end();
+                last_status = 1;
+                pc = code[pc + 1];
+                break;
+            }
+            vm_cmd_end();
+            frame_push(FRAME_REDIR)->fd_base = fd_base;
+            pc += 2;
+            break;
+        }
+        case OP_REDIR_END:
+            frame_pop();
+            pc++;
+            break;
+        case OP_SUBSHELL: {
+            int flags = code[pc + 3];
+            // loops around ( ) are out of reach of break and continue inside
+            int saved_loop_base = vm.loop_base;
+            vm.loop_base = vm.nframes;
+            if (code[pc + 2]) {
+                // exec or background jobs inside: a real child
+                int cap[2];
+                fflush(stdout);
+                fflush(stderr);
+                read_sync();
+                capture_pipe(cap);
+                pid_t pid = fork();
+                if (pid == 0) {
+                    child_init();
+                    capture_pipe_child(cap);
+                    vm.exec_chunk = ch;
+                    child_exit(vm_exec(ch, pc + 4));
+                }
+                if (pid < 0) perror("fork");
+                capture_drain(cap);
+                last_status = pid < 0 ? 1 : wait_for(pid);
+            } else {
+                subshell_enter();
+                subshell_leave(vm_exec(ch, pc + 4));
+            }
+            vm.loop_base = saved_loop_base;
+            pc = code[pc + 1];
+            if (last_status && opt_errexit && !(flags & EXF_COND)) shell_exit(last_status);
+            if (interrupted && interactive) vm.unwind = UNWIND_INTR;
+            if (vm.unwind) goto out;
+            break;
+        }
+        case OP_PIPELINE: {
+            int n = code[pc + 1], flags = code[pc + 2];
+            last_status = run_pipeline(ch, code + pc + 3, n);
+            pc = code[pc + 3 + n];
+            if (last_status && opt_errexit && !(flags & EXF_COND)) shell_exit(last_status);
+            if (vm.unwind) goto out;
+            if (interrupted && interactive) {
+                vm.unwind = UNWIND_INTR;
+                goto out;
+            }
+            break;
+        }
+        case OP_BG: {
+            fflush(stdout);
+            fflush(stderr);
+            read_sync();
+            // A job that may outlive the substitution it writes into
+            if (capture_on_stdout()) capture_shared = 1;
+            pid_t pid = fork();
+            if (pid == 0) {
+                child_init();
+                int null = open("/dev/null", O_RDONLY);
+                if (null >= 0) {
+                    dup2(null, 0);
+                    close(null);
+                }
+                vm.exec_chunk = ch;
+                child_exit(vm_exec(ch, pc + 2));
+            }
+            if (pid < 0) {
+                perror("fork");
+                last_status = 1;
+            } else {
+                last_bg_pid = pid;
+                job_add(pid);
+                if (interactive) fprintf(stderr, "[%d] %d\n", job_count, (int)pid);
+                last_status = 0;
+            }
+            pc = code[pc + 1];
+            break;
+        }
+        case OP_LOOP_ENTER: {
+            vm_frame_t *f = frame_push(FRAME_LOOP);
+            f->brk = code[pc + 1];
+            f->cont = code[pc + 2];
+            pc += 3;
+            break;
+        }
+        case OP_LOOP_SAVE:
+            vm.frames[vm.nframes - 1].saved_status = last_status;
+            pc++;
+            break;
+        case OP_LOOP_LEAVE:
+            last_status = vm.frames[vm.nframes - 1].saved_status;
+            frame_pop();
+            pc++;
+            break;
+        case OP_FOR_INIT: {
+            cmd_frame_t *cf = &vm.cmds[vm.ncmds - 1];
+            int n = vm.nargs - cf->arg_base;
+            char **items = copy_strings(vm.args + cf->arg_base, n);
+            vm_cmd_end();
+            if (expand_error) {
+                free(items);
+                vm_expand_failed();
+                goto out;
+            }
+            vm_frame_t *f = &vm.frames[vm.nframes - 1];
+            f->items = items;
+            f->nitems = n;
+            pc++;
+            break;
+        }
+        case OP_FOR_ARGS: {
+            vm_frame_t *f = &vm.frames[vm.nframes - 1];
+            f->items = copy_strings(posargs.argv, posargs.argc);
+            f->nitems = posargs.argc;
+            pc++;
+            break;
+        }
+        case OP_FOR_NEXT: {
+            vm_frame_t *f = &vm.frames[vm.nframes - 1];
+            if (interrupted && interactive) {
+                vm.unwind = UNWIND_INTR;
+                goto out;
+            }
+            if (f->next >= f->nitems) {
+                pc = code[pc + 2];
+                break;
+            }
+            const char *item = f->items[f->next++];
+            var_set(CSLOT(ch, code[pc + 1]), item, strlen(item));
+            pc += 3;
+            break;
+        }
+        case OP_CASE_PUSH: {
+            char *subject = strdup(vm_pop_arg());
+            vm_cmd_end();
+            frame_push(FRAME_CASE)->subject = subject;
+            if (expand_error) {
+                vm_expand_failed();
+                goto out;
+            }
+            pc++;
+            break;
+        }
+        case OP_CASE_TEST: {
+            const char *ptext = vm_pop_arg();
+            const char *subject = vm.frames[vm.nframes - 1].subject;
+            pattern_t *pat = pattern_get(ptext, strlen(ptext));
+            int hit = pattern_match(pat, subject, strlen(subject));
+            vm_cmd_end();
+            if (expand_error) {
+                vm_expand_failed();
+                goto out;
+            }
+            pc = hit ? code[pc + 1] : pc + 2;
+            break;
+        }
+        case OP_CASE_POP:
+            frame_pop();
+            pc++;
+            break;
+        case OP_DEFUN:
+            func_define(CSTR(ch, code[pc + 1]), ch, code[pc + 2]);
+            last_status = 0;
+            pc = code[pc + 3];
+            break;
+        case OP_ARITH_CMD: {
+            long v = arith_run(ch, pc + 2);
+            if (arith_error) {
+                arith_error = 0;
+                last_status = 1;
+            } else {
+                last_status = v ? 0 : 1;
+            }
+            pc = code[pc + 1];
+            break;
+        }
+        case OP_ARITH_DYN_CMD: {
+            const char *text = vm_pop_arg();
+            pc++;
+            if (expand_error) break;
+            long v = arith_eval_string(text);
+            if (arith_error) {
+                arith_error = 0;
+                last_status = 1;
+            } else {
+                last_status = v ? 0 : 1;
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "ByteShell: internal error: bad opcode %u at %u\n", code[pc], pc);
+            last_status = 2;
+            goto out;
+        }
+    }
+out:
+    while (vm.nframes > frame_base) frame_pop();
+    while (vm.ncmds > cmd_base) vm_cmd_end();
+    return last_status;
+}
+
+// Compile and run source text in the current shell
+int run_text(const char *text, size_t len, const char *name) {
+    chunk_t *ch = compile_text(text, len, name, NULL);
+    if (!ch) {
+        last_status = 2;
+        return last_status;
+    }
+    int status = vm_exec(ch, 0);
+    chunk_unref(ch);
+    return status;
+}
+
+// Read a whole file into memory; st receives its attributes when not NULL
+char* read_file(const char *path, size_t *len, struct stat *st) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (st && fstat(fd, st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    strbuf_t sb = {0};
+    sb_reserve(&sb, st && st->st_size > 0 ? st->st_size + 1 : 4096);
+    ssize_t n;
+    while ((n = read(fd, sb.data + sb.len, sb.cap - sb.len - 1)) > 0) {
+        sb.len += n;
+        sb_reserve(&sb, 4096);
+    }
+    close(fd);
+    sb.data[sb.len] = '\0';
+    *len = sb.len;
+    return sb.data;
+}
+
+// Compiled-script cache: one file per script under $XDG_CACHE_HOME/byteshell,
+// named by a hash of the script's absolute path and holding a header, the
+// code, the name table and the string pool, in that order
+typedef struct {
+    uint32_t magic;
+    uint32_t abi;           // opcode set and builtin table the code was built against
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t src_hash;
+    uint64_t hash;          // of the code, names and strings, which run unchecked
+    uint32_t ncode;
+    uint32_t nnames;
+    uint32_t strs_len;
+    uint32_t reserved;
+} cache_header_t;
+
+// 64-bit hash of file contents, eight bytes per step
+uint64_t hash64(const char *s, size_t n) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    for (; i < n; i++) h = (h ^ (unsigned char)s[i]) * 0x100000001b3ull;
+    return h ^ (h >> 29);
+}
+
+// Find needle in hay, optionally ignoring ASCII case. With SSE2 or NEON,
+// 16 positions are tested per step by comparing the needle's first and
+// last bytes, and only positions where both agree are compared in full
+const char* mem_find(const char *hay, size_t n, const char *needle, size_t k, int fold) {
+    if (!k || k > n) return k ? NULL : hay;
+    size_t i = 0;
+#if defined(__SSE2__) || defined(__aarch64__)
+    unsigned char first = needle[0], last = needle[k - 1];
+    // Folding sets bit 5 of letters only in the compare below
+    int fold1 = fold && isalpha(first), fold2 = fold && isalpha(last);
+#ifdef __SSE2__
+    __m128i case1 = _mm_set1_epi8(fold1 ? 0x20 : 0);
+    __m128i case2 = _mm_set1_epi8(fold2 ? 0x20 : 0);
+    __m128i f = _mm_set1_epi8(fold1 ? first | 0x20 : first);
+    __m128i l = _mm_set1_epi8(fold2 ? last | 0x20 : last);
+#else
+    uint8x16_t case1 = vdupq_n_u8(fold1 ? 0x20 : 0);
+    uint8x16_t case2 = vdupq_n_u8(fold2 ? 0x20 : 0);
+    uint8x16_t f = vdupq_n_u8(fold1 ? first | 0x20 : first);
+    uint8x16_t l = vdupq_n_u8(fold2 ? last | 0x20 : last);
+#endif
+    for (; i + k - 1 + 16 <= n; i += 16) {
+#ifdef __SSE2__
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i)), case1);
+        __m128i z = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i + k - 1)), case2);
+        uint64_t mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, f), _mm_cmpeq_epi8(z, l)));
+        const int shift = 0;
+#else
+        uint8x16_t a = vorrq_u8(vld1q_u8((const uint8_t *)hay + i), case1);
+        uint8x16_t z = vorrq_u8(vld1q_u8((const uint8_t *)hay + i + k - 1), case2);
+        uint8x16_t eq = vandq_u8(vceqq_u8(a, f), vceqq_u8(z, l));
+        // NEON has no movemask: narrowing leaves four bits per position
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        mask &= 0x1111111111111111ull;
+        const int shift = 2;
+#endif
+        while (mask) {
+            int bit = __builtin_ctzll(mask) >> shift;
+            const char *at = hay + i + bit;
+            if (fold ? strncasecmp(at, needle, k) == 0 : memcmp(at, needle, k) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    if (!fold) {
+        return memmem(hay + i, n - i, needle, k);
+    }
+    for (; i + k <= n; i++) {
+        if (strncasecmp(hay + i, needle, k) == 0) return hay + i;
+    }
+    return NULL;
+}
+
+// Raised when an instruction's operands change meaning without the opcode set changing
+#define BYTECODE_REVISION 2
+
+// Builtin indexes and opcodes are baked into code, so either changing invalidates it
+uint32_t cache_abi(void) {
+    static uint32_t abi = 0;
+    if (!abi) {
+        strbuf_t sb = {0};
+        char num[32];
+        sb_append(&sb, BYTESHELL_VERSION, strlen(BYTESHELL_VERSION));
+        snprintf(num, sizeof(num), ":%d:%d:%d:%zu", BYTECODE_REVISION, (int)A_END, BUILTIN_COUNT,
+                 sizeof(cache_header_t));
+        sb_append(&sb, num, strlen(num));
+        for (int i = 0; builtins[i].name != NULL; i++) {
+            sb_putc(&sb, ':');
+            sb_append(&sb, builtins[i].name, strlen(builtins[i].name));
+        }
+        abi = hash_bytes(sb.data, sb.len) | 1;
+        free(sb.data);
+    }
+    return abi;
+}
+
+// The cache directory, $XDG_CACHE_HOME/byteshell; with create it is made if needed
+int cache_dir(char *dir, size_t size, int create) {
+    const char *base = var_getenv("XDG_CACHE_HOME");
+    const char *home = var_getenv("HOME");
+
+    if (base && *base) {
+        if (snprintf(dir, size, "%s", base) >= (int)size) return -1;
+    } else if (home && *home) {
+        if (snprintf(dir, size, "%s/.cache", home) >= (int)size) return -1;
+    } else {
+        return -1;
+    }
+    if (create) mkdir(dir, 0700);
+    if (strlen(dir) + sizeof("/byteshell") > size) return -1;
+    strcat(dir, "/byteshell");
+    if (create && mkdir(dir, 0700) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// Cache file for a script; with create the cache directory is made if needed
+int cache_path(const char *path, char *out, size_t size, int create) {
+    char abs[PATH_MAX];
+    char dir[PATH_MAX];
+
+    if (!realpath(path, abs)) return -1;
+    if (cache_dir(dir, sizeof(dir), create) < 0) return -1;
+    if (snprintf(out, size, "%s/%016llx.bsc", dir, (unsigned long long)hash64(abs, strlen(abs))) >= (int)size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Map a cached chunk if it was built from exactly this source text
+chunk_t* cache_load(const char *path, const struct stat *st, const char *text, size_t len) {
+    char file[PATH_MAX];
+    struct stat cst;
+
+    if (cache_path(path, file, sizeof(file), 0) < 0) return NULL;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &cst) < 0 || cst.st_size < (off_t)sizeof(cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const cache_header_t *h = map;
+    size_t need = sizeof(*h) + ((size_t)h->ncode + h->nnames) * sizeof(uint32_t) + h->strs_len;
+    if (h->magic != CACHE_MAGIC || h->abi != cache_abi() || need != (size_t)cst.st_size ||
+        h->dev != (uint64_t)st->st_dev || h->ino != (uint64_t)st->st_ino ||
+        h->mtime_sec != (int64_t)st->st_mtim.tv_sec || h->mtime_nsec != (int64_t)st->st_mtim.tv_nsec ||
+        h->size != (uint64_t)len || h->src_hash != hash64(text, len) ||
+        h->hash != hash64((const char *)(h + 1), cst.st_size - sizeof(*h))) {
+        // A damaged entry is compiled over on this run, not trusted
+        munmap(map, cst.st_size);
+        return NULL;
+    }
+    chunk_t *ch = chunk_new();
+    ch->map = map;
+    ch->map_len = cst.st_size;
+    ch->code = (uint32_t *)(h + 1);
+    ch->ncode = h->ncode;
+    ch->names = ch->code + h->ncode;
+    ch->nnames = h->nnames;
+    ch->strs = (char *)(ch->names + h->nnames);
+    ch->strs_len = h->strs_len;
+    chunk_link(ch);
+    return ch;
+}
+
+// Write a compiled chunk to the cache; the rename makes it appear atomically
+int cache_store(const char *path, const struct stat *st, const char *text, size_t len, chunk_t *ch) {
+    char file[PATH_MAX];
+    char tmp[PATH_MAX + 32];
+    cache_header_t h = {0};
+
+    if (cache_path(path, file, sizeof(file), 1) < 0) return -1;
+    h.magic = CACHE_MAGIC;
+    h.abi = cache_abi();
+    h.dev = st->st_dev;
+    h.ino = st->st_ino;
+    h.mtime_sec = st->st_mtim.tv_sec;
+    h.mtime_nsec = st->st_mtim.tv_nsec;
+    h.size = len;
+    h.src_hash = hash64(text, len);
+    h.ncode = ch->ncode;
+    h.nnames = ch->nnames;
+    h.strs_len = ch->strs_len;
+    strbuf_t sb = {0};
+    sb_append(&sb, (const char *)ch->code, ch->ncode * sizeof(uint32_t));
+    sb_append(&sb, (const char *)ch->names, ch->nnames * sizeof(uint32_t));
+    sb_append(&sb, ch->strs, ch->strs_len);
+    h.hash = hash64(sb.data, sb.len);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    FILE *f = fopen(tmp, "wbe");
+    if (!f) {
+        free(sb.data);
+        return -1;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(sb.data, 1, sb.len, f);
+    free(sb.data);
+    if (fclose(f) != 0 || rename(tmp, file) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Load a script's compiled form from the cache, compiling and caching on a miss
+chunk_t* compile_file(const char *path, int *status) {
+    size_t len;
+    struct stat st;
+    char *text = read_file(path, &len, &st);
+    if (!text) {
+        fprintf(stderr, "ByteShell: %s: %s\n", path, strerror(errno));
+        *status = 127;
+        return NULL;
+    }
+    startup_mark("read");
+    state_note_input(path, &st);
+    chunk_t *ch = cache_load(path, &st, text, len);
+    startup_mark(ch ? "cache hit" : "cache miss");
+    if (!ch) {
+        ch = compile_text(text, len, path, NULL);
+        if (ch && cache_store(path, &st, text, len, ch) == 0) startup_mark("cache store");
+    }
+    free(text);
+    *status = ch ? 0 : 2;
+    return ch;
+}
+
+int run_file(const char *path) {
+    int status;
+    chunk_t *ch = compile_file(path, &status);
+    if (!ch) {
+        last_status = status;
+        return status;
+    }
+    status = vm_exec(ch, 0);
+    chunk_unref(ch);
+    return status;
+}
+
+// Shell-state image: what running ~/.byteshellrc left behind (variables it
+// changed, aliases, options and function bytecode), saved by --save-state
+// and mapped by later interactive shells instead of running the rc again.
+// It is used only while every file the rc read still has the same identity
+// and mtime, and every environment variable it read the same value.
+// Records are padded to 8 bytes so code can be used in place
+#define STATE_MAGIC 0x33495342u  // "BSI3"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t abi;
+    uint64_t size;
+    uint64_t hash;          // of everything after the header
+    uint32_t ninputs;
+    uint32_t nenv;
+    uint32_t nvars;
+    uint32_t naliases;
+    uint32_t nchunks;
+    uint32_t nfuncs;
+    uint32_t opts;
+    uint32_t reserved;
+} state_header_t;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+} state_input_t;
+
+enum { SV_UNSET, SV_SCALAR, SV_ARRAY, SV_ASSOC };
+
+// Files read while the rc runs, as input records, and the environment
+// variables it read with the values the shell inherited
+strbuf_t state_inputs;
+uint32_t state_ninputs = 0;
+strbuf_t state_env;
+uint32_t state_nenv = 0;
+strmap_t state_env_seen;
+
+void state_put(strbuf_t *sb, const void *p, size_t n) {
+    sb_append(sb, p, n);
+    while (sb->len & 7) sb_putc(sb, '\0');
+}
+
+void state_put_u64(strbuf_t *sb, uint64_t v) {
+    state_put(sb, &v, sizeof(v));
+}
+
+void state_put_str(strbuf_t *sb, const char *s, size_t n) {
+    state_put_u64(sb, n);
+    sb_append(sb, s, n);
+    state_put(sb, "", 1);
+}
+
+void state_note_input(const char *path, const struct stat *st) {
+    char abs[PATH_MAX];
+    if (!state_recording) return;
+    if (!realpath(path, abs)) return;
+    state_input_t in = {st->st_dev, st->st_ino, st->st_mtim.tv_sec, st->st_mtim.tv_nsec, st->st_size};
+    state_put(&state_inputs, &in, sizeof(in));
+    state_put_str(&state_inputs, abs, strlen(abs));
+    state_ninputs++;
+}
+
+// What the rc saw of the environment: an image made where $TMUX or
+// $SSH_CONNECTION was unset must not be used where it is set. Variables
+// the rc assigned are checked by state_put_var as well
+void state_note_env(const char *name) {
+    size_t n = strlen(name);
+    if (strmap_get(&state_env_seen, name, n) >= 0) return;
+    strmap_put(&state_env_seen, name, n, 1);
+    const char *env = getenv(name);
+    state_put_str(&state_env, name, n);
+    state_put_u64(&state_env, env != NULL);
+    if (env) state_put_str(&state_env, env, strlen(env));
+    state_nenv++;
+}
+
+int state_path(char *out, size_t size, int create) {
+    char dir[PATH_MAX];
+    if (cache_dir(dir, sizeof(dir), create) < 0) return -1;
+    return snprintf(out, size, "%s/state.bsi", dir) >= (int)size ? -1 : 0;
+}
+
+void state_put_var(strbuf_t *sb, int slot) {
+    var_t *v = &vars[slot];
+    uint64_t kind = v->arr ? SV_ARRAY : v->map ? SV_ASSOC : v->value ? SV_SCALAR : SV_UNSET;
+    const char *env = getenv(v->name);
+    state_put_u64(sb, kind);
+    state_put_u64(sb, v->flags & ~VAR_INTVALID);
+    state_put_str(sb, v->name, strlen(v->name));
+    // What the rc started from: an image made from another environment is
+    // stale, or export PATH=~/bin:$PATH would bring back the old PATH
+    state_put_u64(sb, env != NULL);
+    if (env) state_put_str(sb, env, strlen(env));
+    if (kind == SV_SCALAR) {
+        state_put_str(sb, v->value, v->len);
+    } else if (kind == SV_ARRAY) {
+        state_put_u64(sb, v->arr->nset);
+        for (size_t i = 0; i < v->arr->count; i++) {
+            size_t len;
+            const char *e = array_get(v->arr, i, &len);
+            if (!e) continue;
+            state_put_u64(sb, i);
+            state_put_str(sb, e, len);
+        }
+    } else if (kind == SV_ASSOC) {
+        state_put_u64(sb, v->map->keys->nset);
+        for (size_t i = 0; i < v->map->keys->count; i++) {
+            size_t klen, len = 0;
+            const char *k = array_get(v->map->keys, i, &klen);
+            if (!k) continue;
+            const char *e = array_get(v->map->vals, i, &len);
+            state_put_str(sb, k, klen);
+            state_put_str(sb, e ? e : "", len);
+        }
+    }
+}
+
+// A variable belongs in the image unless it is still exactly as imported
+// from the environment; the next shell imports its own environment first
+int state_var_changed(int slot) {
+    var_t *v = &vars[slot];
+    const char *env = getenv(v->name);
+    if (v->arr || v->map) return 1;
+    if (!v->value) return env != NULL || (v->flags & ~VAR_INTVALID);
+    return !env || (v->flags & ~VAR_INTVALID) != VAR_EXPORT || strcmp(env, v->value) != 0;
+}
+
+// Write the image atomically, the same way as compiled scripts
+int state_save(const char *file) {
+    strbuf_t sb = {0};
+    state_header_t h = {0};
+    chunk_t **chunks = NULL;
+    int nchunks = 0, chunk_cap = 0;
+
+    h.magic = STATE_MAGIC;
+    h.abi = cache_abi();
+    h.ninputs = state_ninputs;
+    h.nenv = state_nenv;
+    h.opts = opt_errexit | opt_noglob << 1 | opt_nounset << 2 | opt_xtrace << 3 | opt_pipefail << 4 |
+             opt_prefetch << 5;
+    state_put(&sb, &h, sizeof(h));
+    if (state_inputs.len) state_put(&sb, state_inputs.data, state_inputs.len);
+    if (state_env.len) state_put(&sb, state_env.data, state_env.len);
+    for (int i = 0; i < var_count; i++) {
+        if (!state_var_changed(i)) continue;
+        state_put_var(&sb, i);
+        h.nvars++;
+    }
+    for (int ai = 0; ai < alias_count; ai++) {
+        if (!aliases[ai].value) continue;
+        state_put_str(&sb, aliases[ai].name, strlen(aliases[ai].name));
+        state_put_str(&sb, aliases[ai].value, aliases[ai].len);
+        h.naliases++;
+    }
+    for (int fi = 0; fi < func_count; fi++) {
+        chunk_t *ch = funcs[fi].chunk;
+        if (!ch) continue;
+        int c = 0;
+        while (c < nchunks && chunks[c] != ch) c++;
+        if (c < nchunks) continue;
+        GROW(chunks, nchunks, chunk_cap);
+        chunks[nchunks++] = ch;
+        state_put_u64(&sb, ch->ncode);
+        state_put_u64(&sb, ch->nnames);
+        state_put_u64(&sb, ch->strs_len);
+        state_put(&sb, ch->code, ch->ncode * sizeof(uint32_t));
+        state_put(&sb, ch->names, ch->nnames * sizeof(uint32_t));
+        state_put(&sb, ch->strs, ch->strs_len);
+    }
+    h.nchunks = nchunks;
+    for (int fi = 0; fi < func_count; fi++) {
+        if (!funcs[fi].chunk && !funcs[fi].autoload) continue;
+        int c = 0;
+        while (funcs[fi].chunk && chunks[c] != funcs[fi].chunk) c++;
+        state_put_str(&sb, funcs[fi].name, strlen(funcs[fi].name));
+        state_put_u64(&sb, funcs[fi].chunk ? (uint64_t)c : UINT64_MAX);
+        state_put_u64(&sb, funcs[fi].body);
+        h.nfuncs++;
+    }
+    free(chunks);
+    h.size = sb.len;
+    h.hash = hash64(sb.data + sizeof(h), sb.len - sizeof(h));
+    memcpy(sb.data, &h, sizeof(h));
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int ok = fd >= 0 && write(fd, sb.data, sb.len) == (ssize_t)sb.len;
+    if (fd >= 0 && close(fd) < 0) ok = 0;
+    if (!ok || rename(tmp, file) < 0) {
+        if (fd >= 0) unlink(tmp);
+        ok = 0;
+    }
+    free(sb.data);
+    return ok ? 0 : -1;
+}
+
+// Bounds-checked cursor over a mapped image
+typedef struct {
+    const char *p;
+    const char *end;
+    int bad;
+} state_reader_t;
+
+const void* state_get(state_reader_t *r, size_t n) {
+    size_t padded = (n + 7) & ~(size_t)7;
+    if (r->bad || padded < n || (size_t)(r->end - r->p) < padded) {
+        r->bad = 1;
+        return NULL;
+    }
+    const void *p = r->p;
+    r->p += padded;
+    return p;
+}
+
+uint64_t state_get_u64(state_reader_t *r) {
+    uint64_t v = 0;
+    const void *p = state_get(r, sizeof(v));
+    if (p) memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+const char* state_get_str(state_reader_t *r, size_t *n) {
+    uint64_t len = state_get_u64(r);
+    if (r->bad || len >= (uint64_t)(r->end - r->p)) {
+        r->bad = 1;
+        return NULL;
+    }
+    const char *s = state_get(r, len + 1);
+    if (!s || s[len] != '\0') {
+        r->bad = 1;
+        return NULL;
+    }
+    *n = len;
+    return s;
+}
+
+// Walk the records after the header. The first pass only checks that the
+// image is well formed and current; the second applies it
+int state_walk(state_reader_t *r, const state_header_t *h, int apply) {
+    chunk_t **chunks = NULL;
+    size_t n, klen;
+
+    for (uint32_t i = 0; i < h->ninputs && !r->bad; i++) {
+        const state_input_t *in = state_get(r, sizeof(state_input_t));
+        const char *path = state_get_str(r, &n);
+        struct stat st;
+        if (r->bad) break;
+        if (!apply && (stat(path, &st) < 0 || (uint64_t)st.st_dev != in->dev ||
+                       (uint64_t)st.st_ino != in->ino || (uint64_t)st.st_size != in->size ||
+                       (int64_t)st.st_mtim.tv_sec != in->mtime_sec ||
+                       (int64_t)st.st_mtim.tv_nsec != in->mtime_nsec)) {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < h->nenv && !r->bad; i++) {
+        const char *name = state_get_str(r, &klen);
+        size_t elen = 0;
+        const char *seen = state_get_u64(r) ? state_get_str(r, &elen) : NULL;
+        if (r->bad) break;
+        const char *env = apply ? NULL : getenv(name);
+        if (!apply && (!env != !seen || (env && (strlen(env) != elen || memcmp(env, seen, elen) != 0)))) return -1;
+    }
+    for (uint32_t i = 0; i < h->nvars && !r->bad; i++) {
+        uint64_t kind = state_get_u64(r);
+        uint64_t flags = state_get_u64(r);
+        const char *name = state_get_str(r, &n);
+        size_t elen = 0;
+        const char *inherited = state_get_u64(r) ? state_get_str(r, &elen) : NULL;
+        if (r->bad || kind > SV_ASSOC) return -1;
+        if (!apply) {
+            const char *env = getenv(name);
+            if (!env != !inherited || (env && (strlen(env) != elen || memcmp(env, inherited, elen) != 0))) return -1;
+        }
+        int slot = apply ? var_slot(name, n) : -1;
+        if (apply) {
+            vars[slot].flags &= ~VAR_READONLY;
+            var_unset(slot);
+        }
+        if (kind == SV_SCALAR) {
+            const char *v = state_get_str(r, &n);
+            if (apply && v) var_set(slot, v, n);
+        } else if (kind == SV_ARRAY || kind == SV_ASSOC) {
+            uint64_t count = state_get_u64(r);
+            if (apply && kind == SV_ARRAY) vars[slot].arr = array_new();
+            if (apply && kind == SV_ASSOC) vars[slot].map = assoc_new();
+            for (uint64_t j = 0; j < count && !r->bad; j++) {
+                uint64_t idx = 0;
+                const char *k = NULL;
+                if (kind == SV_ARRAY) idx = state_get_u64(r);
+                else k = state_get_str(r, &klen);
+                const char *v = state_get_str(r, &n);
+                if (r->bad || idx >= ARRAY_MAX_INDEX) return -1;
+                if (apply && kind == SV_ARRAY) array_set(vars[slot].arr, idx, v, n);
+                if (apply && kind == SV_ASSOC) assoc_set(vars[slot].map, k, klen, v, n);
+            }
+        }
+        if (apply) {
+            vars[slot].flags = flags;
+            env_dirty = 1;
+        }
+    }
+    for (uint32_t i = 0; i < h->naliases && !r->bad; i++) {
+        const char *name = state_get_str(r, &klen);
+        const char *value = state_get_str(r, &n);
+        if (apply && !r->bad) alias_define(name, klen, value);
+    }
+    if (apply) chunks = calloc(h->nchunks + 1, sizeof(chunk_t *));
+    for (uint32_t i = 0; i < h->nchunks && !r->bad; i++) {
+        uint64_t ncode = state_get_u64(r);
+        uint64_t nnames = state_get_u64(r);
+        uint64_t strs_len = state_get_u64(r);
+        if (r->bad || ncode > UINT32_MAX || nnames > UINT32_MAX || strs_len > UINT32_MAX) return -1;
+        const uint32_t *code = state_get(r, ncode * sizeof(uint32_t));
+        const uint32_t *names = state_get(r, nnames * sizeof(uint32_t));
+        const char *strs = state_get(r, strs_len);
+        if (r->bad || !ncode || (strs_len && strs[strs_len - 1] != '\0')) return -1;
+        for (uint64_t j = 0; j < nnames; j++) {
+            if (names[j] >= strs_len) return -1;
+        }
+        if (!apply) continue;
+        chunk_t *ch = chunk_new();
+        ch->image = 1;
+        ch->code = (uint32_t *)code;
+        ch->ncode = ncode;
+        ch->names = (uint32_t *)names;
+        ch->nnames = nnames;
+        ch->strs = (char *)strs;
+        ch->strs_len = strs_len;
+        chunk_link(ch);
+        chunks[i] = ch;
+    }
+    for (uint32_t i = 0; i < h->nfuncs && !r->bad; i++) {
+        const char *name = state_get_str(r, &n);
+        uint64_t c = state_get_u64(r);
+        uint64_t body = state_get_u64(r);
+        if (r->bad || (c != UINT64_MAX && c >= h->nchunks)) return -1;
+        if (!apply) continue;
+        if (c == UINT64_MAX) func_autoload(name);
+        else if (body < chunks[c]->ncode) func_define(name, chunks[c], body);
+    }
+    if (apply) {
+        for (uint32_t i = 0; i < h->nchunks; i++) chunk_unref(chunks[i]);
+        free(chunks);
+        opt_errexit = h->opts & 1;
+        opt_noglob = h->opts >> 1 & 1;
+        opt_nounset = h->opts >> 2 & 1;
+        opt_xtrace = h->opts >> 3 & 1;
+        opt_pipefail = h->opts >> 4 & 1;
+        opt_prefetch = h->opts >> 5 & 1;
+    }
+    return r->bad ? -1 : 0;
+}
+
+// Map the image and apply it if every input is unchanged. The mapping is
+// never released: function bodies run straight out of it
+int state_load(const char *file) {
+    struct stat st;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(state_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const state_header_t *h = map;
+    state_reader_t r = {(const char *)map, (const char *)map + st.st_size, 0};
+    state_get(&r, sizeof(*h));
+    if (h->magic != STATE_MAGIC || h->abi != cache_abi() || h->size != (uint64_t)st.st_size ||
+        h->hash != hash64(r.p, r.end - r.p) || state_walk(&r, h, 0) < 0 || r.p != r.end) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    r.p = (const char *)map;
+    state_get(&r, sizeof(*h));
+    state_walk(&r, h, 1);
+    return 0;
+}
+
+// Interactive startup: use the state image when it is current, otherwise
+// run ~/.byteshellrc, refreshing the image if there is one (or with save,
+// writing it regardless)
+void rc_load(int save) {
+    char rc[PATH_MAX], image[PATH_MAX];
+    const char *home = var_getenv("HOME");
+
+    if (!home || !*home || snprintf(rc, sizeof(rc), "%s/.byteshellrc", home) >= (int)sizeof(rc)) return;
+    int have_image = state_path(image, sizeof(image), save) == 0 && access(image, F_OK) == 0;
+    if (have_image && !save && state_load(image) == 0) {
+        startup_mark("state image");
+        return;
+    }
+    if (access(rc, R_OK) != 0) return;
+    state_recording = have_image || save;
+    run_file(rc);
+    startup_mark("rc");
+    // Saving looks up the cache directory; that is not the rc reading it
+    int record = state_recording;
+    state_recording = 0;
+    if (record && state_save(image) < 0 && save) {
+        fprintf(stderr, "ByteShell: %s: %s\n", image, strerror(errno));
+    }
+    free(state_inputs.data);
+    memset(&state_inputs, 0, sizeof(state_inputs));
+    state_ninputs = 0;
+    free(state_env.data);
+    memset(&state_env, 0, sizeof(state_env));
+    state_nenv = 0;
+    strmap_clear(&state_env_seen);
+}
+
+// Builtin lookup by name, built on first use
+strmap_t builtin_index;
+
+int builtin_find(const char *name) {
+    if (!builtin_index.cap) {
+        for (int i = 0; builtins[i].name != NULL; i++) {
+            if (strmap_get(&builtin_index, builtins[i].name, strlen(builtins[i].name)) < 0) {
+                strmap_put(&builtin_index, builtins[i].name, strlen(builtins[i].name), i);
+            }
+        }
+    }
+    return strmap_get(&builtin_index, name, strlen(name));
+}
+
+// PATH index: the executables of every directory in $PATH, shared by all
+// sessions with the same PATH through a file in the cache directory that
+// each maps read-only. A rebuild writes a new file, renames it into place
+// and then flags the old one stale, so readers notice on their next lookup.
+// One interactive session per index is elected (by holding a lock) to
+// watch the directories with inotify and rebuild when they change; the
+// others only ever read
+#define PATH_INDEX_MAGIC 0x31495042u  // "BPI1"
+#define PATH_INDEX_MAX_AGE (30 * 24 * 3600)  // indexes unused this long are removed
+
+typedef struct {
+    uint32_t magic;
+    volatile uint32_t stale;    // set once a newer index has replaced this file
+    uint64_t gen;               // bumped by every rebuild
+    uint64_t size;
+    uint32_t ndirs;
+    uint32_t cap;               // table slots, a power of two
+    uint32_t strs_len;          // strs starts with $PATH itself
+    uint32_t reserved;
+} path_index_header_t;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;          // all zero when the directory does not exist
+    int64_t mtime_nsec;
+    uint32_t off;               // directory name in strs
+    uint32_t len;
+} path_index_dir_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t name;              // offset in strs, 0 when empty
+    uint32_t dir;
+} path_index_slot_t;
+
+typedef struct {
+    const path_index_header_t *h;
+    const path_index_dir_t *dirs;
+    const path_index_slot_t *slots;
+    const char *strs;
+    char file[PATH_MAX];
+    uint32_t maps;              // bumped on every (re)mapping
+    uint64_t failed;            // hash of a PATH whose index could not be built
+    int watch_fd;               // inotify, in the elected session
+    int lock_fd;
+    uint64_t watched;           // hash of the index file being watched
+    strmap_t missed;            // names found on PATH that the index lacked
+    uint64_t missed_key;        // hash of the PATH they were looked up in
+} path_index_t;
+
+path_index_t path_index = {.watch_fd = -1, .lock_fd = -1};
+
+int path_index_file(const char *path, char *out, size_t size, int create) {
+    char dir[PATH_MAX];
+    if (cache_dir(dir, sizeof(dir), create) < 0) return -1;
+    return snprintf(out, size, "%s/%016llx.bpi", dir,
+                    (unsigned long long)hash64(path, strlen(path))) >= (int)size ? -1 : 0;
+}
+
+// Directory identity as recorded in the index; zero when it cannot be opened
+void path_index_stat(const char *dir, size_t n, path_index_dir_t *d) {
+    char buf[PATH_MAX];
+    struct stat st;
+    memset(d, 0, offsetof(path_index_dir_t, off));
+    snprintf(buf, sizeof(buf), "%.*s", (int)n, dir);
+    if (stat(buf, &st) < 0) return;
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime_sec = st.st_mtim.tv_sec;
+    d->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+// Remove the indexes, with their lock and watch files, of PATHs no session
+// has mapped for PATH_INDEX_MAX_AGE; every PATH ever used leaves a set
+// behind. A lock or watch file whose index is gone ages by its own time,
+// and a set whose watch file a session still holds is left alone
+void path_index_evict(const char *file) {
+    char dir[PATH_MAX], name[PATH_MAX + 16];
+    const char *slash = strrchr(file, '/');
+    if (!slash || snprintf(dir, sizeof(dir), "%.*s", (int)(slash - file), file) >= (int)sizeof(dir)) return;
+    DIR *dp = opendir(dir);
+    if (!dp) return;
+    time_t old = time(NULL) - PATH_INDEX_MAX_AGE;
+    struct dirent *e;
+    while ((e = readdir(dp))) {
+        const char *dot = strchr(e->d_name, '.');
+        struct stat st;
+        if (!dot || dot - e->d_name != 16 || strspn(e->d_name, "0123456789abcdef") != 16) continue;
+        if (strcmp(dot, ".bpi") != 0 && strcmp(dot, ".bpi.lock") != 0 && strcmp(dot, ".bpi.watch") != 0) continue;
+        snprintf(name, sizeof(name), "%.16s.bpi", e->d_name);
+        if (fstatat(dirfd(dp), name, &st, 0) < 0 && fstatat(dirfd(dp), e->d_name, &st, 0) < 0) continue;
+        if (st.st_mtime > old) continue;
+        snprintf(name, sizeof(name), "%.16s.bpi.watch", e->d_name);
+        int fd = openat(dirfd(dp), name, O_RDWR | O_CLOEXEC);
+        int busy = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) < 0;
+        if (fd >= 0) close(fd);
+        if (!busy) unlinkat(dirfd(dp), e->d_name, 0);
+    }
+    closedir(dp);
+}
+
+// Scan every PATH directory and write a fresh index file. The first
+// directory holding a name wins, as in path_lookup
+int path_index_build(const char *path, const char *file) {
+    strbuf_t strs = {0}, dirs = {0}, out = {0};
+    strmap_t seen = {0};
+    uint32_t *names = NULL, *owner = NULL;
+    int count = 0, cap = 0;
+    uint32_t ndirs = 0;
+
+    sb_append(&strs, path, strlen(path) + 1);
+    for (const char *p = path;; ) {
+        const char *colon = strchr(p, ':');
+        size_t n = colon ? (size_t)(colon - p) : strlen(p);
+        path_index_dir_t d;
+        // Record the directory before reading it, so a change made during
+        // the scan still makes the index stale
+        path_index_stat(p, n, &d);
+        d.off = p - path;
+        d.len = n;
+        sb_append(&dirs, (const char *)&d, sizeof(d));
+        char buf[PATH_MAX];
+        snprintf(buf, sizeof(buf), "%.*s", (int)n, p);
+        DIR *dp = d.ino ? opendir(buf) : NULL;
+        struct dirent *e;
+        while (dp && (e = readdir(dp))) {
+            size_t len = strlen(e->d_name);
+            struct stat st;
+            if (e->d_name[0] == '.' && (len == 1 || (len == 2 && e->d_name[1] == '.'))) continue;
+            if (e->d_type == DT_DIR || strmap_get(&seen, e->d_name, len) >= 0) continue;
+            if (faccessat(dirfd(dp), e->d_name, X_OK, 0) < 0 ||
+                fstatat(dirfd(dp), e->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            strmap_put(&seen, e->d_name, len, count);
+            if (count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                names = realloc(names, cap * sizeof(uint32_t));
+                owner = realloc(owner, cap * sizeof(uint32_t));
+            }
+            names[count] = strs.len;
+            owner[count++] = ndirs;
+            sb_append(&strs, e->d_name, len + 1);
+        }
+        if (dp) closedir(dp);
+        ndirs++;
+        if (!colon) break;
+        p = colon + 1;
+    }
+
+    path_index_header_t h = {0};
+    uint32_t tcap = 16;
+    while (tcap < (uint32_t)count * 2) tcap *= 2;
+    path_index_slot_t *table = calloc(tcap, sizeof(path_index_slot_t));
+    for (int i = 0; i < count; i++) {
+        const char *name = strs.data + names[i];
+        uint32_t hv = hash_bytes(name, strlen(name));
+        uint32_t j = hv & (tcap - 1);
+        while (table[j].name) j = (j + 1) & (tcap - 1);
+        table[j].hash = hv;
+        table[j].name = names[i];
+        table[j].dir = owner[i];
+    }
+    h.magic = PATH_INDEX_MAGIC;
+    h.ndirs = ndirs;
+    h.cap = tcap;
+    h.strs_len = strs.len;
+    h.size = sizeof(h) + dirs.len + tcap * sizeof(path_index_slot_t) + strs.len;
+    h.gen = path_index.h && strcmp(path_index.file, file) == 0 ? path_index.h->gen + 1 : 1;
+    sb_append(&out, (const char *)&h, sizeof(h));
+    sb_append(&out, dirs.data, dirs.len);
+    sb_append(&out, (const char *)table, tcap * sizeof(path_index_slot_t));
+    sb_append(&out, strs.data, strs.len);
+    free(table);
+    free(names);
+    free(owner);
+    free(strs.data);
+    free(dirs.data);
+    strmap_clear(&seen);
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    int old = open(file, O_WRONLY | O_CLOEXEC);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int ok = fd >= 0 && write(fd, out.data, out.len) == (ssize_t)out.len;
+    if (fd >= 0 && close(fd) < 0) ok = 0;
+    if (!ok || rename(tmp, file) < 0) {
+        if (fd >= 0) unlink(tmp);
+        ok = 0;
+    }
+    if (ok && old >= 0) {
+        uint32_t one = 1;
+        if (pwrite(old, &one, sizeof(one), offsetof(path_index_header_t, stale)) < 0) ok = 0;
+    }
+    if (old >= 0) close(old);
+    free(out.data);
+    if (ok) path_index_evict(file);
+    return ok ? 0 : -1;
+}
+
+void path_index_unmap(void) {
+    if (!path_index.h) return;
+    munmap((void *)path_index.h, path_index.h->size);
+    path_index.h = NULL;
+}
+
+// Map the index file for path if it is well formed, for exactly this PATH,
+// and (with check) every directory is unchanged since it was built
+int path_index_map(const char *path, const char *file, int check) {
+    struct stat st;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(path_index_header_t)) {
+        close(fd);
+        return -1;
+    }
+    const path_index_header_t *h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) return -1;
+    const path_index_dir_t *dirs = (const path_index_dir_t *)(h + 1);
+    const path_index_slot_t *slots = (const path_index_slot_t *)(dirs + h->ndirs);
+    const char *strs = (const char *)(slots + h->cap);
+    size_t plen = strlen(path);
+    int ok = h->magic == PATH_INDEX_MAGIC && !h->stale && h->size == (uint64_t)st.st_size &&
+             h->ndirs < (1u << 20) && h->cap && !(h->cap & (h->cap - 1)) && h->cap < (1u << 28) &&
+             sizeof(*h) + h->ndirs * sizeof(*dirs) + (uint64_t)h->cap * sizeof(*slots) + h->strs_len == h->size &&
+             h->strs_len > plen && strs[h->strs_len - 1] == '\0' && memcmp(strs, path, plen + 1) == 0;
+    for (uint32_t i = 0; ok && i < h->ndirs; i++) {
+        path_index_dir_t now;
+        if (dirs[i].off + (uint64_t)dirs[i].len > plen) {
+            ok = 0;
+            break;
+        }
+        if (!check) continue;
+        path_index_stat(path + dirs[i].off, dirs[i].len, &now);
+        ok = now.dev == dirs[i].dev && now.ino == dirs[i].ino &&
+             now.mtime_sec == dirs[i].mtime_sec && now.mtime_nsec == dirs[i].mtime_nsec;
+    }
+    uint32_t empty = 0;
+    for (uint32_t i = 0; ok && i < h->cap; i++) {
+        if (slots[i].name >= h->strs_len || (slots[i].name && slots[i].dir >= h->ndirs)) ok = 0;
+        empty += !slots[i].name;
+    }
+    if (!ok || !empty) {
+        munmap((void *)h, st.st_size);
+        return -1;
+    }
+    // The file's time says when a session last used it, for path_index_evict
+    if (st.st_mtime < time(NULL) - 24 * 3600) utimensat(AT_FDCWD, file, NULL, 0);
+    path_index_unmap();
+    path_index.maps++;
+    path_index.h = h;
+    path_index.dirs = dirs;
+    path_index.slots = slots;
+    path_index.strs = strs;
+    snprintf(path_index.file, sizeof(path_index.file), "%s", file);
+    return 0;
+}
+
+// The index for the current PATH, mapping or (re)building it on first use
+// and after another session replaced it. Relative PATH entries depend on
+// the working directory, so such a PATH is never indexed
+const path_index_header_t* path_index_get(void) {
+    const char *path = var_getenv("PATH");
+    char file[PATH_MAX];
+
+    if (!path || !*path) return NULL;
+    for (const char *p = path; p; p = strchr(p, ':') ? strchr(p, ':') + 1 : NULL) {
+        if (*p != '/') return NULL;
+    }
+    if (path_index.h && !path_index.h->stale && strcmp(path_index.strs, path) == 0) return path_index.h;
+    uint64_t key = hash64(path, strlen(path));
+    if (key != path_index.missed_key) {
+        strmap_clear(&path_index.missed);
+        path_index.missed_key = key;
+    }
+    if (key == path_index.failed || path_index_file(path, file, sizeof(file), 1) < 0) return NULL;
+    // A file that replaced ours was built from the directories as they are now
+    if (path_index_map(path, file, !path_index.h || !path_index.h->stale) == 0) return path_index.h;
+    path_index_rebuild(path, file, 0);
+    if (path_index.h && !path_index.h->stale && strcmp(path_index.strs, path) == 0) return path_index.h;
+    path_index.failed = key;
+    return NULL;
+}
+
+// Rebuild under a lock so that sessions racing here scan only once. Without
+// force an index whose directories are unchanged is kept; force is for
+// changes that leave directory times alone, such as chmod +x
+void path_index_rebuild(const char *path, const char *file, int force) {
+    char lock[PATH_MAX + 8];
+    snprintf(lock, sizeof(lock), "%s.lock", file);
+    int fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd >= 0) flock(fd, LOCK_EX);
+    if ((force || path_index_map(path, file, 1) < 0) && path_index_build(path, file) == 0) {
+        path_index_map(path, file, 0);
+    }
+    if (fd >= 0) close(fd);
+}
+
+void path_watch_close(void) {
+    if (path_index.watch_fd >= 0) close(path_index.watch_fd);
+    if (path_index.lock_fd >= 0) close(path_index.lock_fd);
+    path_index.watch_fd = path_index.lock_fd = -1;
+}
+
+// Called before each prompt: become the watcher for the current index if
+// no other session is, and rebuild it when a PATH directory has changed
+void path_index_poll(void) {
+    char lock[PATH_MAX + 8], buf[4096];
+    const path_index_header_t *h = path_index_get();
+    if (!h) {
+        path_watch_close();
+        return;
+    }
+    uint64_t key = hash64(path_index.file, strlen(path_index.file));
+    if (path_index.watch_fd >= 0 && path_index.watched != key) path_watch_close();
+    snprintf(lock, sizeof(lock), "%s.watch", path_index.file);
+    if (path_index.watch_fd < 0) {
+        int fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) return;
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            close(fd);
+            return;
+        }
+        path_index.lock_fd = fd;
+        path_index.watched = key;
+        path_index.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        for (uint32_t i = 0; path_index.watch_fd >= 0 && i < h->ndirs; i++) {
+            const path_index_dir_t *d = &path_index.dirs[i];
+            char dir[PATH_MAX];
+            if (!d->ino) continue;
+            snprintf(dir, sizeof(dir), "%.*s", (int)d->len, path_index.strs + d->off);
+            inotify_add_watch(path_index.watch_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                              IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+        }
+        if (path_index.watch_fd < 0) path_watch_close();
+        return;
+    }
+    int changed = 0;
+    while (read(path_index.watch_fd, buf, sizeof(buf)) > 0) changed = 1;
+    if (changed) {
+        path_index_rebuild(var_getenv("PATH"), path_index.file, 1);
+        // Directories may have been replaced; watch them afresh
+        path_watch_close();
+    }
+}
+
+// Look name up in the index: 0 on a hit, 1 when it is not there, -1 when
+// there is no index to ask
+int path_index_lookup(const char *name, char *buf, size_t size) {
+    const path_index_header_t *h = path_index_get();
+    if (!h) return -1;
+    size_t n = strlen(name);
+    uint32_t hv = hash_bytes(name, n);
+    for (uint32_t j = hv & (h->cap - 1);; j = (j + 1) & (h->cap - 1)) {
+        const path_index_slot_t *s = &path_index.slots[j];
+        if (!s->name) return 1;
+        if (s->hash == hv && strcmp(path_index.strs + s->name, name) == 0) {
+            const path_index_dir_t *d = &path_index.dirs[s->dir];
+            return snprintf(buf, size, "%.*s/%s", (int)d->len, path_index.strs + d->off, name) < (int)size ? 0 : -1;
+        }
+    }
+}
+
+// Command-not-found suggestions: a BK-tree over the builtins and the PATH
+// index, built the first time a command is missing. Children of a node are
+// keyed by their edit distance to it, so by the triangle inequality a query
+// within tol of the name only descends into children at distance d +- tol
+typedef struct {
+    const char *name;
+    uint32_t child;     // first child; node 0 is the root, never a child
+    uint32_t next;      // next sibling
+    uint32_t dist;      // distance to the parent
+} bk_node_t;
+
+bk_node_t *bk_nodes = NULL;
+int bk_count = 0;
+int bk_cap = 0;
+uint32_t bk_maps = UINT32_MAX;  // path_index.maps the tree was built from
+
+#define BK_NAME_MAX 64
+#define BK_SUGGEST 3
+
+// Levenshtein distance; with swaps an exchange of two adjacent characters
+// also counts as one edit (optimal string alignment). Only the plain form
+// is a metric, so the tree is built and searched with that
+int edit_distance(const char *a, size_t n, const char *b, size_t m, int swaps) {
+    int rows[3][BK_NAME_MAX + 1];
+    int *prev2 = rows[0], *prev = rows[1], *row = rows[2];
+    if (n > BK_NAME_MAX) n = BK_NAME_MAX;
+    if (m > BK_NAME_MAX) m = BK_NAME_MAX;
+    for (size_t j = 0; j <= m; j++) prev[j] = j;
+    for (size_t i = 1; i <= n; i++) {
+        row[0] = i;
+        for (size_t j = 1; j <= m; j++) {
+            int best = prev[j - 1] + (a[i - 1] != b[j - 1]);
+            if (prev[j] + 1 < best) best = prev[j] + 1;
+            if (row[j - 1] + 1 < best) best = row[j - 1] + 1;
+            if (swaps && i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] &&
+                prev2[j - 2] + 1 < best) {
+                best = prev2[j - 2] + 1;
+            }
+            row[j] = best;
+        }
+        int *t = prev2;
+        prev2 = prev;
+        prev = row;
+        row = t;
+    }
+    return prev[m];
+}
+
+void bk_insert(const char *name) {
+    size_t n = strlen(name);
+    uint32_t at = 0;
+    if (bk_count) {
+        while (1) {
+            int d = edit_distance(name, n, bk_nodes[at].name, strlen(bk_nodes[at].name), 0);
+            if (d == 0) return;
+            uint32_t c = bk_nodes[at].child, last = 0;
+            while (c && bk_nodes[c].dist != (uint32_t)d) {
+                last = c;
+                c = bk_nodes[c].next;
+            }
+            if (c) {
+                at = c;
+                continue;
+            }
+            GROW(bk_nodes, bk_count, bk_cap);
+            bk_nodes[bk_count] = (bk_node_t){name, 0, 0, d};
+            if (last) bk_nodes[last].next = bk_count;
+            else bk_nodes[at].child = bk_count;
+            bk_count++;
+            return;
+        }
+    }
+    GROW(bk_nodes, bk_count, bk_cap);
+    bk_nodes[bk_count++] = (bk_node_t){name, 0, 0, 0};
+}
+
+void bk_build(void) {
+    const path_index_header_t *h = path_index_get();
+    uint32_t maps = h ? path_index.maps : 0;
+    if (bk_maps == maps) return;
+    bk_count = 0;
+    bk_maps = maps;
+    for (int i = 0; builtins[i].name != NULL; i++) bk_insert(builtins[i].name);
+    for (uint32_t i = 0; h && i < h->cap; i++) {
+        if (path_index.slots[i].name) bk_insert(path_index.strs + path_index.slots[i].name);
+    }
+}
+
+// Up to BK_SUGGEST names within edit distance radius of name whose
+// distance counting swaps is at most tol, closest first
+int bk_suggest(const char *name, int radius, int tol, const char **out) {
+    uint32_t *stack = NULL;
+    int dists[BK_SUGGEST], found = 0, sp = 0, cap = 0;
+    size_t n = strlen(name);
+
+    if (!bk_count) return 0;
+    GROW(stack, sp, cap);
+    stack[sp++] = 0;
+    while (sp) {
+        const bk_node_t *node = &bk_nodes[stack[--sp]];
+        size_t m = strlen(node->name);
+        int d = edit_distance(name, n, node->name, m, 0);
+        int rank = d <= radius ? edit_distance(name, n, node->name, m, 1) : tol + 1;
+        if (rank <= tol) {
+            int k = found < BK_SUGGEST ? found++ : BK_SUGGEST;
+            while (k > 0 && (dists[k - 1] > rank || (dists[k - 1] == rank && strcmp(out[k - 1], node->name) > 0))) {
+                if (k < BK_SUGGEST) {
+                    out[k] = out[k - 1];
+                    dists[k] = dists[k - 1];
+                }
+                k--;
+            }
+            if (k < BK_SUGGEST) {
+                out[k] = node->name;
+                dists[k] = rank;
+            }
+        }
+        for (uint32_t c = node->child; c; c = bk_nodes[c].next) {
+            if ((int)bk_nodes[c].dist >= d - radius && (int)bk_nodes[c].dist <= d + radius) {
+                GROW(stack, sp, cap);
+                stack[sp++] = c;
+            }
+        }
+    }
+    free(stack);
+    return found;
+}
+
+void command_not_found(const char *name) {
+    const char *near[BK_SUGGEST];
+    size_t n = strlen(name);
+    int found = 0;
+
+    // A path is not looked up, so it is missing rather than not found
+    if (strchr(name, '/')) {
+        fprintf(stderr, "ByteShell: %s: %s\n", name, strerror(ENOENT));
+        return;
+    }
+
+    if (interactive && n <= BK_NAME_MAX) {
+        bk_build();
+        // A swap is two plain edits, so search twice as far as we rank
+        found = bk_suggest(name, n <= 3 ? 2 : 4, n <= 3 ? 1 : 2, near);
+    }
+    if (!found) {
+        fprintf(stderr, "ByteShell: command not found: %s\n", name);
+        return;
+    }
+    fprintf(stderr, "ByteShell: command not found: %s (did you mean", name);
+    for (int i = 0; i < found; i++) fprintf(stderr, "%s %s", i ? "," : "", near[i]);
+    fprintf(stderr, "?)\n");
+}
+
+// Resolve a command name through PATH the way execvp does; returns 0, or
+// the errno of the best failure
+int path_lookup(const char *name, char *buf, size_t size) {
+    if (strchr(name, '/')) {
+        snprintf(buf, size, "%s", name);
+        return access(buf, X_OK) == 0 ? 0 : errno;
+    }
+    int indexed = path_index_lookup(name, buf, size);
+    if (indexed == 0 && access(buf, X_OK) == 0) return 0;
+    const char *path = var_getenv("PATH");
+    int err = ENOENT;
+    if (!path) path = "/usr/local/bin:/usr/bin:/bin";
+    while (1) {
+        const char *colon = strchr(path, ':');
+        size_t n = colon ? (size_t)(colon - path) : strlen(path);
+        struct stat st;
+        if (snprintf(buf, size, "%.*s%s%s", (int)n, path, n ? "/" : "", name) < (int)size) {
+            if (access(buf, X_OK) == 0 && stat(buf, &st) == 0 && S_ISREG(st.st_mode)) {
+                // The index missed a command that is there now: rebuild it,
+                // but only once per name, in case the new one misses it too
+                if (indexed >= 0 && strmap_get(&path_index.missed, name, strlen(name)) < 0) {
+                    strmap_put(&path_index.missed, name, strlen(name), 1);
+                    path_index_rebuild(var_getenv("PATH"), path_index.file, 1);
+                }
+                return 0;
+            }
+            if (errno == EACCES) err = EACCES;
+        }
+        if (!colon) return err;
+        path = colon + 1;
+    }
+}
+
+// Does the #! line of a script name this shell, directly or through env?
+int script_is_ours(const char *path) {
+    char buf[256], self[PATH_MAX], found[PATH_MAX];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n < 3 || buf[0] != '#' || buf[1] != '!') return 0;
+    buf[n] = '\0';
+    char *nl = strchr(buf, '\n'), *words[3];
+    int nw = 0;
+    if (!nl) return 0;
+    *nl = '\0';
+    for (char *w = strtok(buf + 2, " \t\r"); w && nw < 3; w = strtok(NULL, " \t\r")) words[nw++] = w;
+    const char *interp = nw == 1 ? words[0] : NULL;
+    if (nw == 2) {
+        const char *base = strrchr(words[0], '/');
+        if (strcmp(base ? base + 1 : words[0], "env") == 0 && path_lookup(words[1], found, sizeof(found)) == 0) interp = found;
+    }
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (!interp || len <= 0) return 0;
+    self[len] = '\0';
+    char *real = realpath(interp, NULL);
+    int ours = real && strcmp(real, self) == 0;
+    free(real);
+    return ours;
+}
+
+// Does a file the kernel would not run look like a program rather than a
+// script? As bash decides it: a NUL byte in the first line of the first block
+int file_is_binary(const char *path) {
+    char buf[512];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    for (ssize_t i = 0; i < n && buf[i] != '\n'; i++) {
+        if (!buf[i]) return 1;
+    }
+    return 0;
+}
+
+// Run a script in this freshly forked child as if it had been exec'd: the
+// interpreter and its compiled-script cache are already warm, and only the
+// environment carries over
+void run_script_here(const char *path, char **args) {
+    int argc = 0;
+    while (args[argc]) argc++;
+    environ = var_environ();
+    for (int i = 0; i < var_count; i++) {
+        vars[i].flags &= ~VAR_READONLY;
+        var_unset(i);
+        vars[i].flags = 0;
+    }
+    var_import_environ();
+    environ = var_environ();
+    for (int fi = 0; fi < func_count; fi++) func_undefine(funcs[fi].name);
+    for (int ai = 0; ai < alias_count; ai++) {
+        free(aliases[ai].value);
+        aliases[ai].value = NULL;
+    }
+    opt_errexit = opt_noglob = opt_nounset = opt_xtrace = opt_pipefail = opt_prefetch = 0;
+    // Nor does a fresh shell hold directories, or have learned transitions
+    // of its own to save on exit
+    dir_stack_clear();
+    dir_entry_set(&dir_cwd, "", -1);
+    prefetch_forget();
+    startup_profile = 0;
+    posargs = posargs_make(args + 1, argc - 1);
+    shell_name = strdup(path);
+    shell_pid = getpid();
+    last_status = 0;
+    last_bg_pid = 0;
+    vm.func_depth = vm.source_depth = 0;
+    local_frame_base = -1;
+    int status;
+    chunk_t *ch = compile_file(path, &status);
+    run_program(ch, status);
+}
+
+// Execute external command; the last command of a child, or of the script
+// itself, replaces the process instead of forking
+int execute_command(char **args, int tail) {
+    pid_t pid = 0;
+
+    read_sync();
+    fflush(stdout);
+    fflush(stderr);
+    // Look the command up here, where the PATH index stays mapped, so a
+    // missing one fails without a fork. Prefix assignments may set PATH,
+    // so those commands are still looked up in the child
+    cmd_frame_t *cf = &vm.cmds[vm.ncmds - 1];
+    char path[PATH_MAX];
+    int err = -1;
+    if (cf->assign_base == vm.nassigns) err = path_lookup(args[0], path, sizeof(path));
+    if (err == ENOENT) {
+        int fd_base = vm.nfds, status = 127;
+        if (redir_apply(vm.redirs + cf->redir_base, vm.nredirs - cf->redir_base, 1) < 0) status = 1;
+        else command_not_found(args[0]);
+        redir_restore(fd_base);
+        return status;
+    }
+    // Subshells that run in-process are not the last command
+    int cap[2] = {-1, -1};
+    if (!(tail && !subshell_depth)) {
+        capture_pipe(cap);
+        pid = fork();
+    }
+    if (pid == 0) {
+        child_init();
+        capture_pipe_child(cap);
+        if (redir_apply(vm.redirs + cf->redir_base, vm.nredirs - cf->redir_base, 0) < 0) _exit(1);
+        for (int i = cf->assign_base; i < vm.nassigns; i++) {
+            pending_assign_t *a = &vm.assigns[i];
+            var_set(a->slot, a->value, strlen(a->value));
+            var_export(a->slot);
+        }
+        environ = var_environ();
+        if (err < 0) err = path_lookup(args[0], path, sizeof(path));
+        if (err == ENOENT) {
+            command_not_found(args[0]);
+            _exit(127);
+        }
+        // Scripts for this shell, and text files without #!, run right here
+        if (!err && script_is_ours(path)) run_script_here(path, args);
+        if (!err) execv(path, args);
+        if (!err && errno == ENOEXEC) {
+            if (file_is_binary(path)) {
+                fprintf(stderr, "ByteShell: %s: cannot execute binary file\n", args[0]);
+                _exit(126);
+            }
+            run_script_here(path, args);
+        }
+        fprintf(stderr, "ByteShell: %s: %s\n", args[0], strerror(err ? err : errno));
+        _exit(126);
+    }
+    capture_drain(cap);
+    if (pid > 0) return wait_for(pid);
+    perror("fork");
+    return 1;
+}
+
+// Predictive prefetch (set -o prefetch): counts of which command followed
+// which, kept in the cache directory across sessions. After a command, and
+// as soon as the next command's name has been typed, the likely binaries
+// and the libraries they load are read ahead into the page cache by a
+// throwaway child, so starting them does not wait on page-ins
+#define PREFETCH_NEXT 2
+#define PREFETCH_RECENT 8
+#define PREFETCH_QUIET 60     // seconds before the same command is read ahead again
+#define PREFETCH_MAX_PAIRS 4096  // beyond this every count is halved and zeros dropped
+
+strmap_t prefetch_counts;     // "prev next" -> times next followed prev
+strmap_t prefetch_added;      // this session's share of those, merged on exit
+int prefetch_loaded = 0;
+char prefetch_prev[64];
+char prefetch_recent[PREFETCH_RECENT][64];
+time_t prefetch_when[PREFETCH_RECENT];
+int prefetch_slot = 0;
+
+int prefetch_file(char *out, size_t size) {
+    char dir[PATH_MAX];
+    if (cache_dir(dir, sizeof(dir), 1) < 0) return -1;
+    return snprintf(out, size, "%s/transitions", dir) >= (int)size ? -1 : 0;
+}
+
+void prefetch_read(strmap_t *m) {
+    char file[PATH_MAX], line[256], key[160];
+    int count;
+    if (prefetch_file(file, sizeof(file)) < 0) return;
+    FILE *f = fopen(file, "re");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        char prev[64], next[64];
+        if (sscanf(line, "%d %63s %63s", &count, prev, next) != 3 || count <= 0) continue;
+        int n = snprintf(key, sizeof(key), "%s %s", prev, next);
+        int have = strmap_get(m, key, n);
+        strmap_put(m, key, n, (have > 0 ? have : 0) + count);
+    }
+    fclose(f);
+}
+
+// Add this session's transitions to whatever other sessions saved meanwhile,
+// under a lock so sessions exiting together do not lose each other's counts
+void prefetch_save(void) {
+    char file[PATH_MAX], tmp[PATH_MAX + 32], lock[PATH_MAX + 8];
+    strmap_t merged = {0};
+    if (!prefetch_added.cap || prefetch_file(file, sizeof(file)) < 0) return;
+    snprintf(lock, sizeof(lock), "%s.lock", file);
+    int lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd >= 0) flock(lock_fd, LOCK_EX);
+    prefetch_read(&merged);
+    for (size_t i = 0; i < prefetch_added.cap; i++) {
+        const char *k = prefetch_added.keys[i];
+        if (!k || k == STRMAP_TOMB) continue;
+        int have = strmap_get(&merged, k, strlen(k));
+        strmap_put(&merged, k, strlen(k), (have > 0 ? have : 0) + prefetch_added.vals[i]);
+    }
+    // Age the counts once there are too many pairs: halving them keeps what
+    // is still followed often and lets the one-offs fall out
+    int shift = 0;
+    for (size_t live = merged.cap; live > PREFETCH_MAX_PAIRS; shift++) {
+        live = 0;
+        for (size_t i = 0; i < merged.cap; i++) {
+            const char *k = merged.keys[i];
+            if (k && k != STRMAP_TOMB && merged.vals[i] >> shift) live++;
+        }
+        if (live <= PREFETCH_MAX_PAIRS) break;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    FILE *f = fopen(tmp, "we");
+    if (f) {
+        for (size_t i = 0; i < merged.cap; i++) {
+            const char *k = merged.keys[i];
+            if (k && k != STRMAP_TOMB && merged.vals[i] >> shift) fprintf(f, "%d %s\n", merged.vals[i] >> shift, k);
+        }
+        if (fclose(f) != 0 || rename(tmp, file) < 0) unlink(tmp);
+    }
+    if (lock_fd >= 0) close(lock_fd);
+    strmap_clear(&merged);
+}
+
+// Read a file ahead; for an ELF object, queue its interpreter and needed
+// libraries as well
+void prefetch_object(const char *path, char (*queue)[PATH_MAX], int *nqueue, int max) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    Elf64_Ehdr eh;
+    if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh.e_ident[EI_CLASS] != ELFCLASS64 || eh.e_phentsize != sizeof(Elf64_Phdr) || eh.e_phnum > 64) {
+        close(fd);
+        return;
+    }
+    Elf64_Phdr ph[64];
+    if (pread(fd, ph, eh.e_phnum * sizeof(Elf64_Phdr), eh.e_phoff) != (ssize_t)(eh.e_phnum * sizeof(Elf64_Phdr))) {
+        close(fd);
+        return;
+    }
+    Elf64_Dyn dyn[256];
+    int ndyn = 0;
+    for (int i = 0; i < eh.e_phnum; i++) {
+        if (ph[i].p_type == PT_INTERP && ph[i].p_filesz < PATH_MAX && *nqueue < max) {
+            ssize_t n = pread(fd, queue[*nqueue], ph[i].p_filesz, ph[i].p_offset);
+            if (n > 0) {
+                queue[*nqueue][n - 1] = '\0';
+                (*nqueue)++;
+            }
+        } else if (ph[i].p_type == PT_DYNAMIC) {
+            size_t n = ph[i].p_filesz < sizeof(dyn) ? ph[i].p_filesz : sizeof(dyn);
+            ssize_t got = pread(fd, dyn, n, ph[i].p_offset);
+            ndyn = got > 0 ? got / sizeof(Elf64_Dyn) : 0;
+        }
+    }
+    // DT_STRTAB is an address; find the file offset through the PT_LOAD holding it
+    uint64_t strtab = 0;
+    for (int i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+        if (dyn[i].d_tag == DT_STRTAB) strtab = dyn[i].d_un.d_ptr;
+    }
+    off_t stroff = -1;
+    for (int i = 0; strtab && i < eh.e_phnum; i++) {
+        if (ph[i].p_type == PT_LOAD && strtab >= ph[i].p_vaddr && strtab < ph[i].p_vaddr + ph[i].p_filesz) {
+            stroff = strtab - ph[i].p_vaddr + ph[i].p_offset;
+        }
+    }
+    static const char *libdirs[] = {
+        "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu", "/lib/aarch64-linux-gnu",
+        "/usr/lib/aarch64-linux-gnu", "/lib64", "/usr/lib64", "/lib", "/usr/lib", "/usr/local/lib",
+        "/data/data/com.termux/files/usr/lib", NULL
+    };
+    for (int i = 0; stroff >= 0 && i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+        char name[256];
+        if (dyn[i].d_tag != DT_NEEDED) continue;
+        ssize_t n = pread(fd, name, sizeof(name) - 1, stroff + dyn[i].d_un.d_val);
+        if (n <= 0) continue;
+        name[n] = '\0';
+        for (int d = 0; libdirs[d] && *nqueue < max; d++) {
+            snprintf(queue[*nqueue], PATH_MAX, "%s/%s", libdirs[d], name);
+            if (access(queue[*nqueue], R_OK) == 0) {
+                (*nqueue)++;
+                break;
+            }
+        }
+    }
+    close(fd);
+}
+
+// Read the given commands ahead in a grandchild, so neither the prompt nor
+// a zombie is left waiting on it
+void prefetch_commands(const char **names, int n) {
+    char paths[PREFETCH_NEXT][PATH_MAX];
+    int npaths = 0;
+    time_t now = time(NULL);
+
+    for (int i = 0; i < n && npaths < PREFETCH_NEXT; i++) {
+        int recent = 0;
+        if (strlen(names[i]) >= sizeof(prefetch_recent[0]) || builtin_find(names[i]) >= 0 ||
+            func_lookup(names[i]) >= 0 || alias_lookup(names[i], strlen(names[i])) >= 0) {
+            continue;
+        }
+        for (int r = 0; r < PREFETCH_RECENT; r++) {
+            if (strcmp(prefetch_recent[r], names[i]) == 0 && now - prefetch_when[r] < PREFETCH_QUIET) recent = 1;
+        }
+        if (recent || path_lookup(names[i], paths[npaths], PATH_MAX) != 0) continue;
+        snprintf(prefetch_recent[prefetch_slot], sizeof(prefetch_recent[0]), "%s", names[i]);
+        prefetch_when[prefetch_slot] = now;
+        prefetch_slot = (prefetch_slot + 1) % PREFETCH_RECENT;
+        npaths++;
+    }
+    if (!npaths) return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            static char queue[64][PATH_MAX];
+            int nqueue = 0;
+            nice(10);
+            for (int i = 0; i < npaths; i++) memcpy(queue[nqueue++], paths[i], PATH_MAX);
+            // Libraries of libraries too, but each file only once
+            for (int i = 0; i < nqueue; i++) {
+                int seen = 0;
+                for (int j = 0; j < i && !seen; j++) seen = strcmp(queue[i], queue[j]) == 0;
+                if (!seen) prefetch_object(queue[i], queue, &nqueue, 64);
+            }
+        }
+        _exit(0);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+// First word of a command line, if it names a command
+size_t prefetch_word(const char *line, const char **word) {
+    while (*line == ' ' || *line == '\t') line++;
+    size_t n = 0;
+    while (line[n] && (isalnum((unsigned char)line[n]) || strchr("._+-/", line[n]))) n++;
+    *word = line;
+    return line[n] && !strchr(" \t;|&", line[n]) ? 0 : n;
+}
+
+void prefetch_load(void) {
+    if (prefetch_loaded) return;
+    prefetch_loaded = 1;
+    prefetch_read(&prefetch_counts);
+    atexit(prefetch_save);
+}
+
+// Drop what this process has learned, so a script run in a forked child
+// does not save the parent's transitions a second time
+void prefetch_forget(void) {
+    strmap_clear(&prefetch_counts);
+    strmap_clear(&prefetch_added);
+    prefetch_prev[0] = '\0';
+}
+
+// The line editor saw the first word of a line completed
+void prefetch_typed(const char *line) {
+    const char *word;
+    char name[64];
+    size_t n = prefetch_word(line, &word);
+    if (!opt_prefetch || !n || n >= sizeof(name)) return;
+    memcpy(name, word, n);
+    name[n] = '\0';
+    const char *names[1] = {name};
+    prefetch_commands(names, 1);
+}
+
+// A command line has run: count the transition into it and read ahead
+// whatever usually comes next
+void prefetch_after(const char *line) {
+    const char *word, *best[PREFETCH_NEXT];
+    char key[160];
+    int counts[PREFETCH_NEXT] = {0}, nbest = 0;
+    size_t n = prefetch_word(line, &word);
+    if (!opt_prefetch || !n || n >= sizeof(prefetch_prev)) return;
+    prefetch_load();
+    char name[64];
+    memcpy(name, word, n);
+    name[n] = '\0';
+    if (*prefetch_prev) {
+        int len = snprintf(key, sizeof(key), "%s %s", prefetch_prev, name);
+        int have = strmap_get(&prefetch_counts, key, len);
+        strmap_put(&prefetch_counts, key, len, (have > 0 ? have : 0) + 1);
+        have = strmap_get(&prefetch_added, key, len);
+        strmap_put(&prefetch_added, key, len, (have > 0 ? have : 0) + 1);
+    }
+    memcpy(prefetch_prev, name, n + 1);
+    for (size_t i = 0; i < prefetch_counts.cap; i++) {
+        const char *k = prefetch_counts.keys[i];
+        if (!k || k == STRMAP_TOMB || strncmp(k, name, n) != 0 || k[n] != ' ') continue;
+        int c = prefetch_counts.vals[i], j = nbest < PREFETCH_NEXT ? nbest++ : PREFETCH_NEXT;
+        while (j > 0 && counts[j - 1] < c) {
+            if (j < PREFETCH_NEXT) {
+                counts[j] = counts[j - 1];
+                best[j] = best[j - 1];
+            }
+            j--;
+        }
+        if (j < PREFETCH_NEXT) {
+            counts[j] = c;
+            best[j] = k + n + 1;
+        }
+    }
+    prefetch_commands(best, nbest);
+}
+
+// Built-in: cd
+int byteshell_cd(char **args) {
+    const char *dir = args[1];
+    char cwd[SHELL_MAX_INPUT];
+
+    if (dir == NULL) {
+        dir = var_getenv("HOME");
+        if (!dir) {
+            fprintf(stderr, "ByteShell: cd: HOME not set\n");
+            return 1;
+        }
+    } else if (strcmp(dir, "-") == 0) {
+        dir = var_getenv("OLDPWD");
+        if (!dir) {
+            fprintf(stderr, "ByteShell: cd: OLDPWD not set\n");
+            return 1;
+        }
+        printf("%s\n", dir);
+    }
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = '\0';
+    subshell_save_cwd();
+    if (chdir(dir) != 0) {
+        fprintf(stderr, "ByteShell: cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    var_setenv("OLDPWD", cwd);
+    if (getcwd(cwd, sizeof(cwd))) {
+        dir_entry_set(&dir_cwd, cwd, dir_open("."));
+        dir_changed(cwd);
+    }
+    return 0;
+}
+
+// Record a move to a new working directory
+void dir_changed(const char *cwd) {
+    var_setenv("PWD", cwd);
+    // Typed cd's feed the z database; scripts moving around do not
+    const char *home = var_getenv("HOME");
+    if (interactive && !vm.in_child && strcmp(cwd, "/") != 0 && (!home || strcmp(cwd, home) != 0)) {
+        zdb_visit(cwd);
+    }
+}
+
+// Hold a directory open for fchdir, above the descriptors redirections use
+int dir_open(const char *path) {
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && fd < SAVED_FD_BASE) {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+        if (high >= 0) {
+            close(fd);
+            fd = high;
+        }
+    }
+    return fd;
+}
+
+void dir_entry_set(dir_entry_t *e, const char *path, int fd) {
+    free(e->path);
+    if (e->fd >= 0) close(e->fd);
+    e->path = strdup(path);
+    e->fd = fd;
+}
+
+void dir_stack_clear(void) {
+    for (int i = 0; i < dir_count; i++) {
+        free(dir_stack[i].path);
+        close(dir_stack[i].fd);
+    }
+    dir_count = 0;
+}
+
+// Make dir_cwd hold ".", reopening it only if the shell has moved since,
+// and return its path. Comparing the held fd with "." costs two stats and
+// no path lookup
+const char* dir_cwd_hold(void) {
+    struct stat held, dot;
+    if (dir_cwd.fd >= 0 && fstat(dir_cwd.fd, &held) == 0 && stat(".", &dot) == 0 &&
+        held.st_dev == dot.st_dev && held.st_ino == dot.st_ino) {
+        return dir_cwd.path;
+    }
+    char cwd[PATH_MAX];
+    int fd = dir_open(".");
+    if (fd < 0) return NULL;
+    if (!getcwd(cwd, sizeof(cwd))) {
+        close(fd);
+        return NULL;
+    }
+    dir_entry_set(&dir_cwd, cwd, fd);
+    return dir_cwd.path;
+}
+
+// Entry i of the stack as dirs numbers it: 0 is the working directory
+dir_entry_t* dir_stack_entry(int i) {
+    return i == 0 ? &dir_cwd : &dir_stack[dir_count - i];
+}
+
+// Parse +N or -N into a stack index; returns -1 if out of range
+int dir_stack_index(const char *builtin, const char *arg) {
+    char *end;
+    long n = strtol(arg + 1, &end, 10);
+    if (!isdigit((unsigned char)arg[1]) || *end || n > dir_count) {
+        fprintf(stderr, "ByteShell: %s: %s: directory stack index out of range\n", builtin, arg);
+        return -1;
+    }
+    return arg[0] == '+' ? (int)n : dir_count - (int)n;
+}
+
+// Make the held entry at stack index i the working directory, rotating
+// the stack so it comes first; with drop set the old working directory is
+// popped instead of kept
+int dir_stack_go(const char *builtin, int i, int drop) {
+    dir_entry_t *e = dir_stack_entry(i);
+    char oldpwd[PATH_MAX];
+    snprintf(oldpwd, sizeof(oldpwd), "%s", dir_cwd.path);
+    subshell_save_cwd();
+    if (fchdir(e->fd) != 0) {
+        fprintf(stderr, "ByteShell: %s: %s: %s\n", builtin, e->path, strerror(errno));
+        return 1;
+    }
+    // Stack order is cwd, top, ..., bottom; rotate left by i
+    int n = dir_count + 1;
+    dir_entry_t *all = malloc(n * sizeof(dir_entry_t));
+    for (int k = 0; k < n; k++) all[k] = *dir_stack_entry((k + i) % n);
+    if (drop) {
+        free(all[n - i].path);
+        close(all[n - i].fd);
+        memmove(all + n - i, all + n - i + 1, (i - 1) * sizeof(dir_entry_t));
+        n--;
+    }
+    dir_count = n - 1;
+    for (int k = 0; k < n; k++) *dir_stack_entry(k) = all[k];
+    free(all);
+    var_setenv("OLDPWD", oldpwd);
+    dir_changed(dir_cwd.path);
+    return 0;
+}
+
+// Write the stack, home abbreviated to ~ unless long is set
+void dirs_print(int vertical, int numbered, int full) {
+    const char *home = var_getenv("HOME");
+    size_t hlen = home ? strlen(home) : 0;
+    for (int i = 0; i <= dir_count; i++) {
+        const char *path = dir_stack_entry(i)->path;
+        if (numbered) printf("%2d  ", i);
+        if (!full && hlen > 1 && strncmp(path, home, hlen) == 0 && (path[hlen] == '/' || !path[hlen])) {
+            printf("~%s", path + hlen);
+        } else {
+            printf("%s", path);
+        }
+        putchar(vertical || i == dir_count ? '\n' : ' ');
+    }
+}
+
+// Built-in: dirs
+int byteshell_dirs(char **args) {
+    int vertical = 0, numbered = 0, full = 0;
+    for (int i = 1; args[i]; i++) {
+        const char *a = args[i];
+        if (a[0] != '-' || !a[1]) {
+            fprintf(stderr, "ByteShell: dirs: %s: invalid argument\n", a);
+            return 1;
+        }
+        for (a++; *a; a++) {
+            switch (*a) {
+            case 'c':
+                subshell_save_dirs();
+                dir_stack_clear();
+                return 0;
+            case 'l': full = 1; break;
+            case 'p': vertical = 1; break;
+            case 'v': vertical = numbered = 1; break;
+            default:
+                fprintf(stderr, "ByteShell: dirs: -%c: invalid option\n", *a);
+                return 1;
+            }
+        }
+    }
+    if (!dir_cwd_hold()) {
+        perror("ByteShell: dirs");
+        return 1;
+    }
+    dirs_print(vertical, numbered, full);
+    return 0;
+}
+
+// Built-in: pushd
+int byteshell_pushd(char **args) {
+    const char *arg = args[1];
+    if (!dir_cwd_hold()) {
+        perror("ByteShell: pushd");
+        return 1;
+    }
+    subshell_save_dirs();
+    if (!arg || ((arg[0] == '+' || arg[0] == '-') && isdigit((unsigned char)arg[1]))) {
+        int i = 1;
+        if (!dir_count) {
+            fprintf(stderr, "ByteShell: pushd: no other directory\n");
+            return 1;
+        }
+        if (arg && (i = dir_stack_index("pushd", arg)) < 0) return 1;
+        if (i == 0) {
+            dirs_print(0, 0, 0);
+            return 0;
+        }
+        if (!arg) {
+            // Plain pushd swaps the top two entries rather than rotating
+            dir_entry_t top = dir_stack[dir_count - 1];
+            subshell_save_cwd();
+            if (fchdir(top.fd) != 0) {
+                fprintf(stderr, "ByteShell: pushd: %s: %s\n", top.path, strerror(errno));
+                return 1;
+            }
+            dir_stack[dir_count - 1] = dir_cwd;
+            dir_cwd = top;
+            var_setenv("OLDPWD", dir_stack[dir_count - 1].path);
+            dir_changed(dir_cwd.path);
+        } else if (dir_stack_go("pushd", i, 0) != 0) {
+            return 1;
+        }
+        dirs_print(0, 0, 0);
+        return 0;
+    }
+
+    int fd = dir_open(arg);
+    char cwd[PATH_MAX];
+    subshell_save_cwd();
+    if (fd < 0 || fchdir(fd) != 0) {
+        fprintf(stderr, "ByteShell: pushd: %s: %s\n", arg, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    if (!getcwd(cwd, sizeof(cwd))) snprintf(cwd, sizeof(cwd), "%s", arg);
+    GROW(dir_stack, dir_count, dir_cap);
+    dir_stack[dir_count++] = dir_cwd;
+    dir_cwd.path = strdup(cwd);
+    dir_cwd.fd = fd;
+    var_setenv("OLDPWD", dir_stack[dir_count - 1].path);
+    dir_changed(cwd);
+    dirs_print(0, 0, 0);
+    return 0;
+}
+
+// Built-in: popd
+int byteshell_popd(char **args) {
+    const char *arg = args[1];
+    int i = 0;
+    if (!dir_cwd_hold()) {
+        perror("ByteShell: popd");
+        return 1;
+    }
+    if (!dir_count) {
+        fprintf(stderr, "ByteShell: popd: directory stack empty\n");
+        return 1;
+    }
+    if (arg && ((arg[0] != '+' && arg[0] != '-') || (i = dir_stack_index("popd", arg)) < 0)) {
+        if (arg[0] != '+' && arg[0] != '-') fprintf(stderr, "ByteShell: popd: %s: invalid argument\n", arg);
+        return 1;
+    }
+    subshell_save_dirs();
+    if (i == 0) {
+        // Drop the working directory and move to the new top
+        if (dir_stack_go("popd", 1, 1) != 0) return 1;
+    } else {
+        dir_entry_t *e = dir_stack_entry(i);
+        free(e->path);
+        close(e->fd);
+        memmove(e, e + 1, (dir_stack + dir_count - (e + 1)) * sizeof(dir_entry_t));
+        dir_count--;
+    }
+    dirs_print(0, 0, 0);
+    return 0;
+}
+
+// Directory jumper: every directory an interactive shell cd's into gets a
+// frecency score, a visit count that halves every ZDB_HALF_LIFE seconds.
+// Records are appended to a mapped file in the cache directory and updated
+// in place under a lock; z scans the whole file with one memmem per
+// keyword rather than testing each path in turn
+#define ZDB_MAGIC 0x315a5342u  // "BSZ1"
+#define ZDB_HALF_LIFE (7 * 24 * 3600.0)
+#define ZDB_MAX_SIZE (8 << 20)  // compact beyond this
+#define ZDB_KEEP 0.05           // least decayed score that survives compaction
+#define ZDB_PICK 8
+
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t end;       // bytes in use, header included
+} zdb_header_t;
+
+typedef struct {
+    double score;       // as of last
+    int64_t last;
+    uint32_t len;       // the path follows, NUL-terminated and padded to 8
+    uint32_t reserved;
+} zdb_rec_t;
+
+typedef struct {
+    int fd;
+    char *map;
+    size_t size;
+} zdb_t;
+
+#define ZDB_REC_SIZE(len) ((sizeof(zdb_rec_t) + (len) + 1 + 7) & ~(size_t)7)
+
+int zdb_file(char *out, size_t size) {
+    char dir[PATH_MAX];
+    if (cache_dir(dir, sizeof(dir), 1) < 0) return -1;
+    return snprintf(out, size, "%s/dirs.bzd", dir) >= (int)size ? -1 : 0;
+}
+
+// score * 2^-(age / half-life), without needing libm
+double zdb_score(const zdb_rec_t *r, time_t now) {
+    double x = (double)(now - r->last) / ZDB_HALF_LIFE, s = r->score;
+    if (x <= 0) return s;
+    if (x > 64) return 0;
+    for (; x >= 1; x -= 1) s *= 0.5;
+    // e^-(x ln 2) for the fraction left, by its series
+    double y = -x * 0.6931471805599453, term = 1, sum = 1;
+    for (int i = 1; i < 10; i++) {
+        term *= y / i;
+        sum += term;
+    }
+    return s * sum;
+}
+
+void zdb_close(zdb_t *z) {
+    if (z->map) munmap(z->map, z->size);
+    if (z->fd >= 0) close(z->fd);
+}
+
+// Map the database; for writing it is locked and created if missing. A
+// file replaced by compaction while we waited for the lock is reopened
+int zdb_open(zdb_t *z, int write) {
+    char file[PATH_MAX];
+    struct stat st;
+    z->fd = -1;
+    z->map = NULL;
+    if (zdb_file(file, sizeof(file)) < 0) return -1;
+    while (1) {
+        z->fd = open(file, write ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0600);
+        if (z->fd < 0) return -1;
+        if (write) flock(z->fd, LOCK_EX);
+        if (fstat(z->fd, &st) < 0) break;
+        if (st.st_nlink) goto opened;
+        close(z->fd);
+    }
+    close(z->fd);
+    return -1;
+opened:
+    if (st.st_size == 0 && write) {
+        zdb_header_t h = {ZDB_MAGIC, 0, sizeof(zdb_header_t)};
+        if (ftruncate(z->fd, 65536) < 0 || pwrite(z->fd, &h, sizeof(h), 0) != sizeof(h)) {
+            close(z->fd);
+            return -1;
+        }
+        st.st_size = 65536;
+    }
+    z->size = st.st_size;
+    z->map = z->size >= sizeof(zdb_header_t) ?
+             mmap(NULL, z->size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, z->fd, 0) : MAP_FAILED;
+    const zdb_header_t *h = (const zdb_header_t *)z->map;
+    if (z->map == MAP_FAILED || h->magic != ZDB_MAGIC || h->end > z->size || h->end < sizeof(*h)) {
+        if (z->map != MAP_FAILED) munmap(z->map, z->size);
+        z->map = NULL;
+        close(z->fd);
+        z->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Bytes in use as far as our mapping goes: a writer may have grown the
+// file and moved the shared end past what this reader mapped
+size_t zdb_end(const zdb_t *z) {
+    uint64_t end = ((const zdb_header_t *)z->map)->end;
+    return end < z->size ? end : z->size;
+}
+
+// Next record, or NULL at the end or at a damaged one
+zdb_rec_t* zdb_next(zdb_t *z, size_t *at) {
+    size_t end = zdb_end(z);
+    if (*at + sizeof(zdb_rec_t) > end) return NULL;
+    zdb_rec_t *r = (zdb_rec_t *)(z->map + *at);
+    if (r->len > PATH_MAX || *at + ZDB_REC_SIZE(r->len) > end) return NULL;
+    *at += ZDB_REC_SIZE(r->len);
+    return r;
+}
+
+// Rewrite the database without the records that have decayed away
+void zdb_compact(zdb_t *z, time_t now) {
+    char file[PATH_MAX], tmp[PATH_MAX + 32];
+    strbuf_t sb = {0};
+    zdb_header_t h = {ZDB_MAGIC, 0, 0};
+    size_t at = sizeof(zdb_header_t);
+    zdb_rec_t *r;
+
+    if (zdb_file(file, sizeof(file)) < 0) return;
+    sb_append(&sb, (const char *)&h, sizeof(h));
+    while ((r = zdb_next(z, &at))) {
+        zdb_rec_t keep = *r;
+        keep.score = zdb_score(r, now);
+        keep.last = now;
+        if (keep.score < ZDB_KEEP) continue;
+        sb_append(&sb, (const char *)&keep, sizeof(keep));
+        sb_append(&sb, (const char *)(r + 1), r->len);
+        sb_putc(&sb, '\0');
+        while (sb.len & 7) sb_putc(&sb, '\0');
+    }
+    h.end = sb.len;
+    memcpy(sb.data, &h, sizeof(h));
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        int ok = write(fd, sb.data, sb.len) == (ssize_t)sb.len && ftruncate(fd, sb.len + 65536) == 0;
+        if (close(fd) < 0 || !ok || rename(tmp, file) < 0) unlink(tmp);
+    }
+    free(sb.data);
+}
+
+// Count a visit to dir
+void zdb_visit(const char *dir) {
+    zdb_t z;
+    size_t len = strlen(dir), at = sizeof(zdb_header_t);
+    time_t now = time(NULL);
+    zdb_rec_t *r;
+
+    if (zdb_open(&z, 1) < 0) return;
+    while ((r = zdb_next(&z, &at))) {
+        if (r->len == len && memcmp(r + 1, dir, len) == 0) {
+            r->score = zdb_score(r, now) + 1;
+            r->last = now;
+            zdb_close(&z);
+            return;
+        }
+    }
+    zdb_header_t *h = (zdb_header_t *)z.map;
+    size_t need = h->end + ZDB_REC_SIZE(len);
+    if (need > z.size) {
+        if (h->end > ZDB_MAX_SIZE) {
+            zdb_compact(&z, now);
+            zdb_close(&z);
+            zdb_visit(dir);
+            return;
+        }
+        size_t size = z.size * 2 > need ? z.size * 2 : need + 65536;
+        munmap(z.map, z.size);
+        z.map = ftruncate(z.fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, z.fd, 0) : MAP_FAILED;
+        if (z.map == MAP_FAILED) {
+            z.map = NULL;
+            zdb_close(&z);
+            return;
+        }
+        z.size = size;
+        h = (zdb_header_t *)z.map;
+    }
+    // Write the record before publishing it through end, for lock-free readers
+    r = (zdb_rec_t *)(z.map + h->end);
+    r->score = 1;
+    r->last = now;
+    r->len = len;
+    r->reserved = 0;
+    memcpy(r + 1, dir, len + 1);
+    __atomic_store_n(&h->end, need, __ATOMIC_RELEASE);
+    zdb_close(&z);
+}
+
+// Do the keywords occur in this path in order? mode 0 matches exactly,
+// 1 ignoring case, 2 as a case-insensitive subsequence (fuzzy)
+int zdb_match(const char *path, char **kw, int nkw, int mode) {
+    const char *p = path;
+    for (int i = 0; i < nkw; i++) {
+        if (mode == 0) {
+            p = strstr(p, kw[i]);
+        } else if (mode == 1) {
+            p = strcasestr(p, kw[i]);
+        } else {
+            for (const char *k = kw[i]; *k && p; k++) {
+                while (*p && tolower((unsigned char)*p) != tolower((unsigned char)*k)) p++;
+                p = *p ? p + 1 : NULL;
+            }
+            if (p) continue;
+        }
+        if (!p) return 0;
+        p += strlen(kw[i]);
+    }
+    return 1;
+}
+
+typedef struct {
+    double score;
+    zdb_rec_t *rec;
+} zdb_hit_t;
+
+int zdb_rec_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+int zdb_hit_cmp(const void *a, const void *b) {
+    double x = ((const zdb_hit_t *)a)->score, y = ((const zdb_hit_t *)b)->score;
+    return (x > y) - (x < y);
+}
+
+// Best-scoring records matching the keywords, best first, leaving out the
+// nskip records in skip. Substring passes search for the first keyword
+// across the whole file at once and only look at the records it turns up in
+int zdb_query(zdb_t *z, char **kw, int nkw, int mode, time_t now, zdb_rec_t **skip, int nskip, zdb_rec_t **out,
+              double *scores, int max) {
+    size_t at = sizeof(zdb_header_t), klen = nkw ? strlen(kw[0]) : 0, end = zdb_end(z);
+    int found = 0;
+    zdb_rec_t *r;
+
+    while (at < end) {
+        if (mode < 2 && klen) {
+            const char *hit = mem_find(z->map + at, end - at, kw[0], klen, mode);
+            if (!hit) break;
+            // Skip to the record the hit falls in
+            while ((r = zdb_next(z, &at)) && z->map + at <= hit) {}
+            if (!r) break;
+        } else if (!(r = zdb_next(z, &at))) {
+            break;
+        }
+        if (!zdb_match((const char *)(r + 1), kw, nkw, mode)) continue;
+        if (nskip && bsearch(&r, skip, nskip, sizeof(*skip), zdb_rec_cmp)) continue;
+        double s = zdb_score(r, now);
+        int k = found < max ? found++ : max;
+        while (k > 0 && scores[k - 1] < s) {
+            if (k < max) {
+                out[k] = out[k - 1];
+                scores[k] = scores[k - 1];
+            }
+            k--;
+        }
+        if (k < max) {
+            out[k] = r;
+            scores[k] = s;
+        }
+    }
+    return found;
+}
+
+// Built-in: z, jump to the most frecent directory matching the keywords
+int byteshell_z(char **args) {
+    int list = 0, i = 1;
+    zdb_t z;
+    time_t now = time(NULL);
+
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-l") != 0) {
+            fprintf(stderr, "ByteShell: z: %s: invalid option\nusage: z [-l] [keyword...]\n", args[i]);
+            return 2;
+        }
+        list = 1;
+    }
+    char **kw = args + i;
+    int nkw = 0;
+    while (kw[nkw]) nkw++;
+    if (!nkw) list = 1;
+    if (zdb_open(&z, 0) < 0) {
+        if (!list) fprintf(stderr, "ByteShell: z: no directories recorded yet\n");
+        return 1;
+    }
+    if (list) {
+        zdb_hit_t *all = NULL;
+        int n = 0, cap = 0;
+        size_t at = sizeof(zdb_header_t);
+        zdb_rec_t *r;
+        while ((r = zdb_next(&z, &at))) {
+            if (nkw && !zdb_match((const char *)(r + 1), kw, nkw, 1)) continue;
+            GROW(all, n, cap);
+            all[n].rec = r;
+            all[n++].score = zdb_score(r, now);
+        }
+        // Lowest first, so the best ends up next to the prompt
+        if (n) qsort(all, n, sizeof(*all), zdb_hit_cmp);
+        for (int a = 0; a < n; a++) printf("%-10.2f %s\n", all[a].score, (const char *)(all[a].rec + 1));
+        free(all);
+        zdb_close(&z);
+        return n ? 0 : 1;
+    }
+    // Directories that have gone away since they were recorded are left
+    // out and the query rerun with twice the picks, until a live one turns
+    // up or nothing else matches
+    char target[PATH_MAX] = "";
+    struct stat st;
+    zdb_rec_t **dead = NULL, **best = NULL;
+    double *scores = NULL;
+    int ndead = 0, deadcap = 0;
+    for (int mode = 0; mode < 3 && !*target; mode++) {
+        int found, pick = ZDB_PICK;
+        do {
+            best = realloc(best, pick * sizeof(*best));
+            scores = realloc(scores, pick * sizeof(*scores));
+            found = zdb_query(&z, kw, nkw, mode, now, dead, ndead, best, scores, pick);
+            for (int k = 0; k < found && !*target; k++) {
+                const char *path = (const char *)(best[k] + 1);
+                if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                    snprintf(target, sizeof(target), "%s", path);
+                } else {
+                    GROW(dead, ndead, deadcap);
+                    dead[ndead++] = best[k];
+                }
+            }
+            if (ndead) qsort(dead, ndead, sizeof(*dead), zdb_rec_cmp);
+            pick *= 2;
+        } while (found && !*target);
+    }
+    free(dead);
+    free(best);
+    free(scores);
+    zdb_close(&z);
+    if (!*target) {
+        fprintf(stderr, "ByteShell: z: no match for");
+        for (int k = 0; k < nkw; k++) fprintf(stderr, " %s", kw[k]);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    char *cd_args[] = {"cd", target, NULL};
+    return byteshell_cd(cd_args);
+}
+
+// Built-in: exit
+int byteshell_exit(char **args) {
+    int status = args[1] ? atoi(args[1]) : last_status;
+    if (interactive && !vm.in_child && !subshell_depth) printf("Goodbye from ByteShell!\n");
+    shell_exit(status);
+    return status;
+}
+
+// Built-in: exec
+int byteshell_exec(char **args) {
+    int i = 1, clear_env = 0;
+    const char *name = NULL;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-c") == 0) {
+            clear_env = 1;
+        } else if (strcmp(args[i], "-a") == 0 && args[i + 1]) {
+            name = args[++i];
+        } else {
+            fprintf(stderr, "ByteShell: exec: %s: invalid option\n", args[i]);
+            return 2;
+        }
+    }
+    if (!args[i]) {
+        // Only redirections: they stay in effect for the rest of the shell
+        vm.keep_redirs = 1;
+        return 0;
+    }
+    // Prefix assignments go to the new program's environment
+    cmd_frame_t *cf = &vm.cmds[vm.ncmds - 1];
+    for (int k = cf->assign_base; k < vm.nassigns; k++) var_export(vm.assigns[k].slot);
+    read_sync();
+    fflush(stdout);
+    fflush(stderr);
+    char *file = args[i];
+    if (name) args[i] = (char *)name;
+    char *empty[] = {NULL}, **saved_environ = environ;
+    environ = clear_env ? empty : var_environ();
+    execvp(file, args + i);
+    int status = errno == ENOENT ? 127 : 126;
+    fprintf(stderr, "ByteShell: exec: %s: %s\n", file, status == 127 ? "not found" : strerror(errno));
+    environ = saved_environ;
+    if (!interactive) shell_exit(status);
+    return status;
+}
+
+// Built-in: help
+int byteshell_help(char **args) {
+    printf("\nByteShell v%s - Commands:\n", BYTESHELL_VERSION);
+    printf("===========================\n");
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        printf("  %-8s - %s\n", builtins[i].name, builtins[i].help);
+    }
+    printf("  Ctrl+C: Cancel current line\n");
+    printf("  Ctrl+D: Exit ByteShell\n\n");
+    return 0;
+}
+
+// Built-in: clear
+int byteshell_clear(char **args) {
+    printf("\033[2J\033[H");
+    return 0;
+}
+
+// Built-in: pwd
+int byteshell_pwd(char **args) {
+    char cwd[SHELL_MAX_INPUT];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+// Write s with echo -e escapes; returns 0 if \c stopped the output
+int echo_escaped(const char *s) {
+    for (; *s; s++) {
+        if (*s != '\\' || !s[1]) {
+            putchar(*s);
+            continue;
+        }
+        switch (*++s) {
+        case 'n': putchar('\n'); break;
+        case 't': putchar('\t'); break;
+        case 'r': putchar('\r'); break;
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'f': putchar('\f'); break;
+        case 'v': putchar('\v'); break;
+        case 'e': putchar(27); break;
+        case '\\': putchar('\\'); break;
+        case 'c': return 0;
+        case '0': {
+            int v = 0;
+            for (int i = 0; i < 3 && s[1] >= '0' && s[1] <= '7'; i++) v = v * 8 + (*++s - '0');
+            putchar(v);
+            break;
+        }
+        default:
+            putchar('\\');
+            putchar(*s);
+        }
+    }
+    return 1;
+}
+
+// Built-in: echo
+int byteshell_echo(char **args) {
+    int newline = 1, escapes = 0, i = 1;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *f = args[i] + 1;
+        if (f[strspn(f, "neE")]) break;
+        for (; *f; f++) {
+            if (*f == 'n') newline = 0;
+            else if (*f == 'e') escapes = 1;
+            else escapes = 0;
+        }
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) fputs(args[i], stdout);
+        else if (!echo_escaped(args[i])) return 0;
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+// Built-in: history
+int byteshell_history(char **args) {
+    printf("\nCommand History:\n");
+    printf("================\n");
+    for (int i = 0; i < history_count; i++) {
+        printf("%4d  %s\n", i + 1, history[i]);
+    }
+    printf("\n");
+    return 0;
+}
+
+// Built-in: true and :
+int byteshell_true(char **args) {
+    return 0;
+}
+
+// Built-in: false
+int byteshell_false(char **args) {
+    return 1;
+}
+
+// test helpers: each returns 1 for true, 0 for false
+int test_integer(const char *s, long *out) {
+    char *end;
+    while (isspace((unsigned char)*s)) s++;
+    errno = 0;
+    *out = strtol(s, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == s || *end || errno) {
+        fprintf(stderr, "ByteShell: test: %s: integer expression expected\n", s);
+        return 0;
+    }
+    return 1;
+}
+
+int test_unary(const char *op, const char *arg) {
+    struct stat st;
+    switch (op[1]) {
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 't': return isatty(atoi(arg));
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0) return 0;
+    switch (op[1]) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    }
+    return 0;
+}
+
+int test_is_unary(const char *op) {
+    return op[0] == '-' && op[1] && !op[2] && strchr("nztrwxhLefdbcpSsugk", op[1]);
+}
+
+// Returns 1, 0, or -1 if op is not a binary operator
+int test_binary(const char *a, const char *op, const char *b) {
+    static const char *int_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+    for (int i = 0; int_ops[i]; i++) {
+        if (strcmp(op, int_ops[i]) != 0) continue;
+        long x, y;
+        if (!test_integer(a, &x) || !test_integer(b, &y)) return -2;
+        switch (i) {
+        case 0: return x == y;
+        case 1: return x != y;
+        case 2: return x < y;
+        case 3: return x <= y;
+        case 4: return x > y;
+        default: return x >= y;
+        }
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (op[1] == 'n') return ha && (!hb || sa.st_mtime > sb.st_mtime);
+        return hb && (!ha || sa.st_mtime < sb.st_mtime);
+    }
+    return -1;
+}
+
+// Recursive descent over -o, -a, !, ( ) and primaries; -2 means syntax error
+int test_expr(char **av, int *i, int n);
+
+int test_primary(char **av, int *i, int n) {
+    if (*i >= n) return -2;
+    const char *a = av[*i];
+    if (strcmp(a, "!") == 0) {
+        (*i)++;
+        int r = test_primary(av, i, n);
+        return r < 0 ? r : !r;
+    }
+    if (strcmp(a, "(") == 0 && *i + 1 < n) {
+        (*i)++;
+        int r = test_expr(av, i, n);
+        if (*i >= n || strcmp(av[*i], ")") != 0) return -2;
+        (*i)++;
+        return r;
+    }
+    if (*i + 2 < n) {
+        int r = test_binary(a, av[*i + 1], av[*i + 2]);
+        if (r != -1) {
+            *i += 3;
+            return r;
+        }
+    }
+    if (test_is_unary(a) && *i + 1 < n) {
+        *i += 2;
+        return test_unary(a, av[*i - 1]);
+    }
+    (*i)++;
+    return *a != '\0';
+}
+
+int test_and(char **av, int *i, int n) {
+    int r = test_primary(av, i, n);
+    while (r >= 0 && *i < n && strcmp(av[*i], "-a") == 0) {
+        (*i)++;
+        int r2 = test_primary(av, i, n);
+        if (r2 < 0) return r2;
+        r = r && r2;
+    }
+    return r;
+}
+
+int test_expr(char **av, int *i, int n) {
+    int r = test_and(av, i, n);
+    while (r >= 0 && *i < n && strcmp(av[*i], "-o") == 0) {
+        (*i)++;
+        int r2 = test_and(av, i, n);
+        if (r2 < 0) return r2;
+        r = r || r2;
+    }
+    return r;
+}
+
+// Built-in: test and [
+int byteshell_test(char **args) {
+    int n = 0, i = 0, r;
+    while (args[n]) n++;
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[n - 1], "]") != 0) {
+            fprintf(stderr, "ByteShell: [: missing ]\n");
+            return 2;
+        }
+        n--;
+    }
+    char **av = args + 1;
+    n--;
+    // POSIX rules by argument count take precedence over the grammar
+    switch (n) {
+    case 0:
+        return 1;
+    case 1:
+        return av[0][0] ? 0 : 1;
+    case 2:
+        if (strcmp(av[0], "!") == 0) return av[1][0] ? 1 : 0;
+        if (test_is_unary(av[0])) return test_unary(av[0], av[1]) ? 0 : 1;
+        break;
+    case 3:
+        r = test_binary(av[0], av[1], av[2]);
+        if (r == -2) return 2;
+        if (r >= 0) return r ? 0 : 1;
+        if (strcmp(av[0], "!") == 0) {
+            i = 1;
+            r = test_expr(av, &i, n);
+            return r < 0 ? 2 : (r ? 1 : 0);
+        }
+        break;
+    }
+    r = test_expr(av, &i, n);
+    if (r == -2 || i < n) {
+        if (r != -2 || i < n) fprintf(stderr, "ByteShell: test: syntax error\n");
+        return 2;
+    }
+    return r ? 0 : 1;
+}
+
+// Is s a valid variable name (of length n)?
+int valid_name(const char *s, size_t n) {
+    if (n == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_')) return 0;
+    for (size_t i = 1; i < n; i++) {
+        if (!(isalnum((unsigned char)s[i]) || s[i] == '_')) return 0;
+    }
+    return 1;
+}
+
+// Built-in: export
+int byteshell_export(char **args) {
+    int status = 0, i = 1;
+    if (args[1] && strcmp(args[1], "-p") == 0) i++;
+    if (!args[i]) {
+        for (int s = 0; s < var_count; s++) {
+            if (!(vars[s].flags & VAR_EXPORT)) continue;
+            if (vars[s].value) printf("export %s=\"%s\"\n", vars[s].name, vars[s].value);
+            else printf("export %s\n", vars[s].name);
+        }
+        return 0;
+    }
+    for (; args[i]; i++) {
+        const char *eq = strchr(args[i], '=');
+        size_t n = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!valid_name(args[i], n)) {
+            fprintf(stderr, "ByteShell: export: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        int slot = var_slot(args[i], n);
+        if (eq && var_set(slot, eq + 1, strlen(eq + 1)) < 0) {
+            status = 1;
+            continue;
+        }
+        var_export(slot);
+    }
+    return status;
+}
+
+// Built-in: unset
+int byteshell_unset(char **args) {
+    int funcs_only = 0, vars_only = 0, status = 0, i = 1;
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-f") == 0) funcs_only = 1;
+        else if (strcmp(args[i], "-v") == 0) vars_only = 1;
+        else if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            fprintf(stderr, "ByteShell: unset: %s: invalid option\n", args[i]);
+            return 2;
+        }
+    }
+    for (; args[i]; i++) {
+        const char *sub = strchr(args[i], '[');
+        size_t alen = strlen(args[i]);
+        if (!funcs_only && sub && alen > 2 && args[i][alen - 1] == ']') {
+            // unset 'name[i]'
+            int slot = strmap_get(&var_index, args[i], sub - args[i]);
+            if (slot < 0 || (!vars[slot].arr && !vars[slot].map && !vars[slot].value)) continue;
+            char *index = strndup(sub + 1, args[i] + alen - 1 - (sub + 1));
+            if (vars[slot].map) {
+                assoc_t *m = var_assoc(slot);
+                if (m) assoc_del(m, index, strlen(index));
+                else status = 1;
+                free(index);
+                continue;
+            }
+            array_t *a = var_array(slot);
+            long k = a ? array_index(index, a) : -1;
+            if (k >= 0) array_unset(a, k);
+            else status = 1;
+            free(index);
+            continue;
+        }
+        if (!funcs_only) {
+            int slot = strmap_get(&var_index, args[i], strlen(args[i]));
+            if (slot >= 0) {
+                if (var_unset(slot) < 0) status = 1;
+                continue;
+            }
+            if (vars_only) continue;
+        }
+        func_undefine(args[i]);
+    }
+    return status;
+}
+
+// Built-in: set
+int byteshell_set(char **args) {
+    int i = 1;
+    if (!args[1]) {
+        for (int s = 0; s < var_count; s++) {
+            if (vars[s].value) printf("%s='%s'\n", vars[s].name, vars[s].value);
+        }
+        return 0;
+    }
+    for (; args[i] && (args[i][0] == '-' || args[i][0] == '+'); i++) {
+        int on = args[i][0] == '-';
+        if (strcmp(args[i], "--") == 0 || strcmp(args[i], "-") == 0) {
+            i++;
+            goto positional;
+        }
+        for (const char *f = args[i] + 1; *f; f++) {
+            switch (*f) {
+            case 'e': opt_errexit = on; break;
+            case 'f': opt_noglob = on; break;
+            case 'u': opt_nounset = on; break;
+            case 'x': opt_xtrace = on; break;
+            case 'o':
+                if (!args[i + 1]) {
+                    printf("errexit\t%s\nnoglob\t%s\nnounset\t%s\nxtrace\t%s\npipefail\t%s\nprefetch\t%s\n",
+                           opt_errexit ? "on" : "off", opt_noglob ? "on" : "off",
+                           opt_nounset ? "on" : "off", opt_xtrace ? "on" : "off",
+                           opt_pipefail ? "on" : "off", opt_prefetch ? "on" : "off");
+                    return 0;
+                }
+                i++;
+                if (strcmp(args[i], "errexit") == 0) opt_errexit = on;
+                else if (strcmp(args[i], "noglob") == 0) opt_noglob = on;
+                else if (strcmp(args[i], "nounset") == 0) opt_nounset = on;
+                else if (strcmp(args[i], "xtrace") == 0) opt_xtrace = on;
+                else if (strcmp(args[i], "pipefail") == 0) opt_pipefail = on;
+                else if (strcmp(args[i], "prefetch") == 0) opt_prefetch = on;
+                else {
+                    fprintf(stderr, "ByteShell: set: %s: invalid option name\n", args[i]);
+                    return 2;
+                }
+                goto next;
+            default:
+                fprintf(stderr, "ByteShell: set: %c%c: invalid option\n", args[i][0], *f);
+                return 2;
+            }
+        }
+next:;
+    }
+    if (!args[i]) return 0;
+positional: {
+        int n = 0;
+        while (args[i + n]) n++;
+        if (!subshell_depth || posargs.base != subshells[subshell_depth - 1].posargs.base) free(posargs.base);
+        posargs = posargs_make(args + i, n);
+    }
+    return 0;
+}
+
+// Built-in: shift
+int byteshell_shift(char **args) {
+    int n = args[1] ? atoi(args[1]) : 1;
+    if (n < 0 || n > posargs.argc) {
+        fprintf(stderr, "ByteShell: shift: %s: shift count out of range\n", args[1] ? args[1] : "1");
+        return 1;
+    }
+    posargs.argv += n;
+    posargs.argc -= n;
+    return 0;
+}
+
+// Save a variable for the running function unless this call already did;
+// returns 1 if it was saved now
+int var_make_local(int slot) {
+    for (int s = local_frame_base; s < var_save_count; s++) {
+        if (var_saves[s].slot == slot) return 0;
+    }
+    var_save(slot);
+    return 1;
+}
+
+// Print a string in double quotes the way declare -p shows values
+void print_dquoted(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (strchr("\"\\$`", *s)) putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+void declare_print(int slot) {
+    var_t *v = &vars[slot];
+    char attrs[8], *a = attrs;
+    if (v->arr) *a++ = 'a';
+    if (v->map) *a++ = 'A';
+    if (v->flags & VAR_READONLY) *a++ = 'r';
+    if (v->flags & VAR_EXPORT) *a++ = 'x';
+    if (a == attrs) *a++ = '-';
+    *a = '\0';
+    printf("declare -%s %s", attrs, v->name);
+    if (v->arr) {
+        int first = 1;
+        printf("=(");
+        for (size_t i = 0; i < v->arr->count; i++) {
+            if (v->arr->off[i] == ARRAY_HOLE) continue;
+            printf(first ? "[%zu]=" : " [%zu]=", i);
+            print_dquoted(v->arr->data + v->arr->off[i]);
+            first = 0;
+        }
+        putchar(')');
+    } else if (v->map) {
+        printf("=(");
+        for (size_t e = 0; e < v->map->keys->count; e++) {
+            if (v->map->keys->off[e] == ARRAY_HOLE) continue;
+            printf("[%s]=", v->map->keys->data + v->map->keys->off[e]);
+            print_dquoted(v->map->vals->data + v->map->vals->off[e]);
+            putchar(' ');
+        }
+        putchar(')');
+    } else if (v->value) {
+        putchar('=');
+        print_dquoted(v->value);
+    }
+    putchar('\n');
+}
+
+// declare, typeset and local; inside a function every name becomes local
+int declare_vars(char **args, int local) {
+    int kind = 0, flags = 0, print = 0, status = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *f = args[i] + 1; *f; f++) {
+            switch (*f) {
+            case 'a': case 'A': kind = *f; break;
+            case 'r': flags |= VAR_READONLY; break;
+            case 'x': flags |= VAR_EXPORT; break;
+            case 'p': print = 1; break;
+            default:
+                fprintf(stderr, "ByteShell: %s: -%c: invalid option\n", args[0], *f);
+                return 2;
+            }
+        }
+    }
+    if (!args[i]) {
+        for (int slot = 0; slot < var_count; slot++) {
+            var_t *v = &vars[slot];
+            if (!v->value && !v->arr && !v->map) continue;
+            if ((kind == 'a' && !v->arr) || (kind == 'A' && !v->map) || (v->flags & flags) != flags) continue;
+            declare_print(slot);
+        }
+        return 0;
+    }
+    for (; args[i]; i++) {
+        const char *eq = strchr(args[i], '=');
+        size_t n = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!valid_name(args[i], n)) {
+            fprintf(stderr, "ByteShell: %s: `%s': not a valid identifier\n", args[0], args[i]);
+            status = 1;
+            continue;
+        }
+        if (print) {
+            int slot = strmap_get(&var_index, args[i], n);
+            if (slot >= 0 && (vars[slot].value || vars[slot].arr || vars[slot].map)) {
+                declare_print(slot);
+            } else {
+                fprintf(stderr, "ByteShell: %s: %s: not found\n", args[0], args[i]);
+                status = 1;
+            }
+            continue;
+        }
+        int slot = var_slot(args[i], n);
+        if (local && var_make_local(slot) && kind) var_unset(slot);
+        if ((kind == 'A' && !var_assoc(slot)) || (kind == 'a' && !var_array(slot))) {
+            status = 1;
+            continue;
+        }
+        if (eq && var_set(slot, eq + 1, strlen(eq + 1)) < 0) {
+            status = 1;
+            continue;
+        }
+        if (flags & VAR_EXPORT) var_export(slot);
+        if (flags & VAR_READONLY) {
+            if (journal_gen && vars[slot].gen != journal_gen) var_journal_save(slot);
+            vars[slot].flags |= VAR_READONLY;
+        }
+    }
+    return status;
+}
+
+// Built-in: local
+int byteshell_local(char **args) {
+    if (local_frame_base < 0) {
+        fprintf(stderr, "ByteShell: local: can only be used in a function\n");
+        return 1;
+    }
+    return declare_vars(args, 1);
+}
+
+// Built-in: declare, typeset
+int byteshell_declare(char **args) {
+    return declare_vars(args, local_frame_base >= 0);
+}
+
+// Built-in: return
+int byteshell_return(char **args) {
+    if (!vm.func_depth && !vm.source_depth) {
+        fprintf(stderr, "ByteShell: return: can only `return' from a function or sourced script\n");
+        return 1;
+    }
+    vm.ret_status = args[1] ? atoi(args[1]) & 0xff : last_status;
+    vm.unwind = UNWIND_RETURN;
+    return vm.ret_status;
+}
+
+// break and continue share the loop count argument. Outside a loop of the
+// running function they only complain, as in bash
+int loop_control(char **args, int kind) {
+    int n = args[1] ? atoi(args[1]) : 1;
+    if (n < 1) {
+        fprintf(stderr, "ByteShell: %s: %s: loop count out of range\n", args[0], args[1]);
+        return 1;
+    }
+    int loops = 0;
+    for (int i = vm.loop_base; i < vm.nframes; i++) loops += vm.frames[i].type == FRAME_LOOP;
+    if (!loops) {
+        fprintf(stderr, "ByteShell: %s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+        return 0;
+    }
+    vm.unwind = kind;
+    vm.unwind_count = n;
+    return 0;
+}
+
+// Built-in: break
+int byteshell_break(char **args) {
+    return loop_control(args, UNWIND_BREAK);
+}
+
+// Built-in: continue
+int byteshell_continue(char **args) {
+    return loop_control(args, UNWIND_CONTINUE);
+}
+
+// Built-in: eval
+int byteshell_eval(char **args) {
+    strbuf_t sb = {0};
+    for (int i = 1; args[i]; i++) {
+        if (i > 1) sb_putc(&sb, ' ');
+        sb_append(&sb, args[i], strlen(args[i]));
+    }
+    if (!sb.len) return 0;
+    int status = run_text(sb.data, sb.len, NULL);
+    free(sb.data);
+    return status;
+}
+
+// Built-in: source and .
+int byteshell_source(char **args) {
+    if (!args[1]) {
+        fprintf(stderr, "ByteShell: %s: filename argument required\n", args[0]);
+        return 2;
+    }
+    posargs_t saved_args = posargs;
+    int has_args = args[2] != NULL;
+    if (has_args) {
+        int n = 0;
+        while (args[2 + n]) n++;
+        posargs = posargs_make(args + 2, n);
+    }
+    vm.source_depth++;
+    int status = run_file(args[1]);
+    vm.source_depth--;
+    if (vm.unwind == UNWIND_RETURN) {
+        status = vm.ret_status;
+        vm.unwind = UNWIND_NONE;
+    }
+    if (has_args) {
+        free(posargs.base);
+        posargs = saved_args;
+    }
+    return status;
+}
+
+// Built-in: wait
+int byteshell_wait(char **args) {
+    int status = 0;
+    if (!args[1]) {
+        while (job_count > 0) wait_for(jobs[--job_count]);
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        pid_t pid = atoi(args[i]);
+        int found = 0;
+        for (int j = 0; j < job_count; j++) {
+            if (jobs[j] == pid) {
+                jobs[j] = jobs[--job_count];
+                found = 1;
+                break;
+            }
+        }
+        status = found ? wait_for(pid) : 127;
+    }
+    return status;
+}
+
+// Built-in: autoload
+int byteshell_autoload(char **args) {
+    int status = 0, i = 1;
+    for (; args[i] && args[i][0] == '-'; i++) {
+        // zsh flags such as -U and -z describe behavior this shell always has
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+    }
+    if (!args[i]) {
+        for (int fi = 0; fi < func_count; fi++) {
+            if (funcs[fi].autoload) printf("autoload %s\n", funcs[fi].name);
+        }
+        return 0;
+    }
+    for (; args[i]; i++) {
+        if (strchr(args[i], '/') || strchr(args[i], '=')) {
+            fprintf(stderr, "ByteShell: autoload: `%s': not a valid function name\n", args[i]);
+            status = 1;
+            continue;
+        }
+        func_autoload(args[i]);
+    }
+    return status;
+}
+
+// Print an alias in a form that can be read back
+void alias_print(int ai) {
+    printf("alias %s='", aliases[ai].name);
+    for (const char *v = aliases[ai].value; *v; v++) {
+        if (*v == '\'') printf("'\\''");
+        else putchar(*v);
+    }
+    printf("'\n");
+}
+
+// Built-in: alias
+int byteshell_alias(char **args) {
+    int status = 0;
+    if (!args[1]) {
+        for (int ai = 0; ai < alias_count; ai++) {
+            if (aliases[ai].value) alias_print(ai);
+        }
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        const char *eq = strchr(args[i], '=');
+        size_t n = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!eq) {
+            int ai = alias_lookup(args[i], n);
+            if (ai >= 0) {
+                alias_print(ai);
+            } else {
+                fprintf(stderr, "ByteShell: alias: %s: not found\n", args[i]);
+                status = 1;
+            }
+            continue;
+        }
+        if (n == 0 || strcspn(args[i], " \t\n'\"\\$`/;&|<>()") < n) {
+            fprintf(stderr, "ByteShell: alias: `%.*s': invalid alias name\n", (int)n, args[i]);
+            status = 1;
+            continue;
+        }
+        alias_define(args[i], n, eq + 1);
+    }
+    return status;
+}
+
+// Built-in: unalias
+int byteshell_unalias(char **args) {
+    int status = 0;
+    if (args[1] && strcmp(args[1], "-a") == 0) {
+        for (int ai = 0; ai < alias_count; ai++) {
+            if (!aliases[ai].value) continue;
+            alias_journal_save(ai);
+            free(aliases[ai].value);
+            aliases[ai].value = NULL;
+        }
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        if (alias_remove(args[i]) < 0) {
+            fprintf(stderr, "ByteShell: unalias: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Built-in: read [-r] [-d delim] [-p prompt] [-a array] [name...]
+int byteshell_read(char **args) {
+    int raw = 0, delim = '\n', i = 1;
+    const char *prompt = NULL, *array = NULL;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 'r') {
+                raw = 1;
+                continue;
+            }
+            if (*o != 'd' && *o != 'p' && *o != 'a') {
+                fprintf(stderr, "ByteShell: read: -%c: invalid option\n", *o);
+                return 2;
+            }
+            const char *arg = o[1] ? o + 1 : args[++i];
+            if (!arg) {
+                fprintf(stderr, "ByteShell: read: -%c: option requires an argument\n", *o);
+                return 2;
+            }
+            if (*o == 'd') delim = (unsigned char)arg[0];
+            else if (*o == 'p') prompt = arg;
+            else array = arg;
+            break;
+        }
+    }
+    for (int k = i; args[k]; k++) {
+        if (!valid_name(args[k], strlen(args[k]))) {
+            fprintf(stderr, "ByteShell: read: `%s': not a valid identifier\n", args[k]);
+            return 2;
+        }
+    }
+    if (array && !valid_name(array, strlen(array))) {
+        fprintf(stderr, "ByteShell: read: `%s': not a valid identifier\n", array);
+        return 2;
+    }
+    if (prompt && isatty(STDIN_FILENO)) {
+        fputs(prompt, stderr);
+        fflush(stderr);
+    }
+
+    // Collect the line; mask marks backslash-escaped bytes, which never split
+    strbuf_t line = {0}, mask = {0};
+    int eof = 0, c;
+    while (1) {
+        c = inbuf_getc();
+        if (c < 0) {
+            eof = 1;
+            break;
+        }
+        if (c == '\\' && !raw) {
+            c = inbuf_getc();
+            if (c < 0) {
+                eof = 1;
+                break;
+            }
+            if (c == '\n') continue;
+            sb_putc(&line, c);
+            sb_putc(&mask, 1);
+            continue;
+        }
+        if (c == delim) break;
+        sb_putc(&line, c);
+        sb_putc(&mask, 0);
+    }
+    const char *s = line.data ? line.data : "";
+    const char *q = mask.data;
+    size_t n = line.len, pos = 0;
+
+#define IFS_AT(k) (!q[k] ? ifs_table[(unsigned char)s[k]] : 0)
+    if (array) {
+        // Every field becomes an element
+        array_t *a = array_new();
+        while (1) {
+            while (pos < n && IFS_AT(pos) == 1) pos++;
+            if (pos >= n) break;
+            size_t start = pos;
+            while (pos < n && !IFS_AT(pos)) pos++;
+            array_push(a, s + start, pos - start);
+            while (pos < n && IFS_AT(pos) == 1) pos++;
+            if (pos < n && IFS_AT(pos) == 2) pos++;
+        }
+        int slot = var_slot(array, strlen(array));
+        if (var_unset(slot) == 0) vars[slot].arr = a;
+        else array_free(a), eof = 1;
+    } else if (!args[i]) {
+        var_set(var_slot("REPLY", 5), s, n);
+    }
+    for (; args[i]; i++) {
+        while (pos < n && IFS_AT(pos) == 1) pos++;
+        size_t start = pos, end;
+        if (!args[i + 1]) {
+            // The last name takes the rest, minus trailing IFS whitespace
+            end = n;
+            while (end > start && IFS_AT(end - 1) == 1) end--;
+            pos = n;
+        } else {
+            while (pos < n && !IFS_AT(pos)) pos++;
+            end = pos;
+            while (pos < n && IFS_AT(pos) == 1) pos++;
+            if (pos < n && IFS_AT(pos) == 2) pos++;
+        }
+        if (var_set(var_slot(args[i], strlen(args[i])), s + start, end - start) < 0) eof = 1;
+    }
+#undef IFS_AT
+    free(line.data);
+    free(mask.data);
+    if (interrupted && interactive) return 130;
+    return eof;
+}
+
+typedef struct {
+    strbuf_t line;
+    const char *direct;     // the whole line, still in the input buffer
+    size_t dlen;
+} mapfile_ctx_t;
+
+void mapfile_piece(const char *s, size_t n, int more, void *ctx) {
+    mapfile_ctx_t *m = ctx;
+    if (!more && m->line.len == 0) {
+        m->direct = s;
+        m->dlen = n;
+        return;
+    }
+    sb_append(&m->line, s, n);
+}
+
+// Built-in: mapfile [-t] [-n count] [-s count] [-d delim] [array]
+int byteshell_mapfile(char **args) {
+    int trim = 0, delim = '\n', i = 1;
+    long max = 0, skip = 0;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 't') {
+                trim = 1;
+                continue;
+            }
+            if (*o != 'n' && *o != 's' && *o != 'd') {
+                fprintf(stderr, "ByteShell: %s: -%c: invalid option\n", args[0], *o);
+                return 2;
+            }
+            const char *arg = o[1] ? o + 1 : args[++i];
+            if (!arg) {
+                fprintf(stderr, "ByteShell: %s: -%c: option requires an argument\n", args[0], *o);
+                return 2;
+            }
+            if (*o == 'd') delim = (unsigned char)arg[0];
+            else if (*o == 'n') max = atol(arg);
+            else skip = atol(arg);
+            break;
+        }
+    }
+    const char *name = args[i] ? args[i] : "MAPFILE";
+    if (!valid_name(name, strlen(name))) {
+        fprintf(stderr, "ByteShell: %s: `%s': not a valid identifier\n", args[0], name);
+        return 2;
+    }
+
+    array_t *a = array_new();
+    mapfile_ctx_t m = {{0}, NULL, 0};
+    long lines = 0;
+    while (!max || (long)a->count < max) {
+        m.line.len = 0;
+        m.direct = NULL;
+        int found = inbuf_getline(delim, mapfile_piece, &m);
+        if (!found && !m.direct && m.line.len == 0) break;
+        if (lines++ < skip) continue;
+        if (m.direct) {
+            // Without -t the delimiter is kept; it is still in the buffer
+            array_push(a, m.direct, m.dlen + (found && !trim));
+        } else {
+            if (found && !trim) sb_putc(&m.line, delim);
+            array_push(a, m.line.data ? m.line.data : "", m.line.len);
+        }
+        if (!found || (interrupted && interactive)) break;
+    }
+    free(m.line.data);
+    int slot = var_slot(name, strlen(name));
+    if (var_unset(slot) < 0) {
+        array_free(a);
+        return 1;
+    }
+    vars[slot].arr = a;
+    return interrupted && interactive ? 130 : 0;
+}
+
+// cat copies inside the kernel where the descriptors allow it, trying each
+// way in turn until one is accepted: copy_file_range between regular
+// files, sendfile out of a regular file, splice when either side is a pipe,
+// and finally read and write through a buffer
+#define CAT_CHUNK (1 << 30)
+#define CAT_BUF_SIZE (128 << 10)
+
+enum { CAT_RANGE, CAT_SENDFILE, CAT_SPLICE, CAT_RW };
+
+// Copy in to out until the end of in. Returns 0, or -1 with errno set and
+// *wfail set if writing failed rather than reading
+int cat_copy(int in, int out, const struct stat *ost, int *wfail) {
+    static char *buf;
+    struct stat ist;
+    int mode = CAT_RW;
+    *wfail = 0;
+    if (fstat(in, &ist) == 0) {
+        if (S_ISREG(ist.st_mode)) mode = S_ISREG(ost->st_mode) ? CAT_RANGE : CAT_SENDFILE;
+        else if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost->st_mode)) mode = CAT_SPLICE;
+    }
+    int moved = 0;  // bytes went through the current mode, so do not give it up
+    while (1) {
+        ssize_t n;
+        switch (mode) {
+        case CAT_RANGE: n = copy_file_range(in, NULL, out, NULL, CAT_CHUNK, 0); break;
+        case CAT_SENDFILE: n = sendfile(out, in, NULL, CAT_CHUNK); break;
+        case CAT_SPLICE: n = splice(in, NULL, out, NULL, CAT_BUF_SIZE * 8, SPLICE_F_MOVE); break;
+        default:
+            if (!buf) buf = malloc(CAT_BUF_SIZE);
+            n = read(in, buf, CAT_BUF_SIZE);
+            for (ssize_t done = 0; n > 0 && done < n;) {
+                ssize_t w = write(out, buf + done, n - done);
+                if (w < 0 && errno == EINTR && !interrupted) continue;
+                if (w < 0) {
+                    *wfail = 1;
+                    return -1;
+                }
+                done += w;
+            }
+        }
+        if (n == 0) return 0;
+        if (n > 0) {
+            moved = 1;
+            if (interrupted && interactive) return 0;
+            continue;
+        }
+        if (errno == EINTR) {
+            if (interrupted) return 0;
+            continue;
+        }
+        if (mode != CAT_RW && !moved &&
+            (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF)) {
+            // This pair of descriptors cannot do it; sendfile only reads
+            // regular files, and splice needs a pipe on one side
+            mode = mode == CAT_RANGE ? CAT_SENDFILE
+                 : mode == CAT_SENDFILE && (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost->st_mode)) ? CAT_SPLICE
+                 : CAT_RW;
+            continue;
+        }
+        // Only the buffered copy reads and writes separately; for the rest
+        // a broken or full output is the usual failure
+        *wfail = mode != CAT_RW && (errno == EPIPE || errno == ENOSPC || errno == EDQUOT);
+        return -1;
+    }
+}
+
+// Built-in: cat
+int byteshell_cat(char **args) {
+    int i = 1, status = 0;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-u") != 0) {
+            // Numbering, squeezing and showing nonprinting characters are
+            // left to the system's cat
+            return execute_command(args, 0);
+        }
+    }
+    fflush(stdout);
+    struct stat ost;
+    if (fstat(STDOUT_FILENO, &ost) < 0) {
+        perror("ByteShell: cat");
+        return 1;
+    }
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[i] ? args + i : stdin_only;
+    for (; *files; files++) {
+        int in = STDIN_FILENO, wfail;
+        if (strcmp(*files, "-") == 0) {
+            read_sync();
+        } else if ((in = open(*files, O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "ByteShell: cat: %s: %s\n", *files, strerror(errno));
+            status = 1;
+            continue;
+        }
+        // Appending a file to itself would keep reading what was just
+        // written and never reach the end
+        struct stat ist;
+        if (fstat(in, &ist) == 0 && S_ISREG(ist.st_mode) && ist.st_size > 0 &&
+            ist.st_dev == ost.st_dev && ist.st_ino == ost.st_ino) {
+            fprintf(stderr, "ByteShell: cat: %s: input file is output file\n", *files);
+            status = 1;
+            if (in != STDIN_FILENO) close(in);
+            continue;
+        }
+        int r = cat_copy(in, STDOUT_FILENO, &ost, &wfail);
+        if (r < 0 && !wfail) {
+            fprintf(stderr, "ByteShell: cat: %s: %s\n", *files, strerror(errno));
+            status = 1;
+        } else if (r < 0) {
+            if (errno != EPIPE) fprintf(stderr, "ByteShell: cat: write error: %s\n", strerror(errno));
+            status = 1;
+        }
+        if (in != STDIN_FILENO) close(in);
+        if (wfail || (interrupted && interactive)) break;
+    }
+    return interrupted && interactive ? 130 : status;
+}
+
+// How the locale reads bytes as characters: 1 for UTF-8, 0 for the C
+// locale's one byte each, -1 for anything else
+int locale_ctype(void) {
+    const char *names[] = {"LC_ALL", "LC_CTYPE", "LANG"};
+    for (int k = 0; k < 3; k++) {
+        const char *v = var_getenv(names[k]);
+        if (!v || !*v) continue;
+        if (strcmp(v, "C") == 0 || strcmp(v, "POSIX") == 0) return 0;
+        const char *dot = strchr(v, '.');
+        if (dot && (strncasecmp(dot + 1, "UTF-8", 5) == 0 || strncasecmp(dot + 1, "UTF8", 4) == 0)) return 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Per-file work spread over threads, for wc and grep: workers take inputs
+// in turn while the caller waits for each in order and prints its result,
+// so output comes out as if the inputs were handled one after another.
+// fn is told which worker it runs on, from 0, for state kept per thread
+#define FILE_POOL_MAX_THREADS 16
+
+typedef struct {
+    void (*fn)(void *ctx, int k, int worker);
+    void *ctx;
+    int n;
+    int next;                   // the next input a worker takes
+    int ids;                    // workers numbered so far
+    char *done;                 // per input, set once fn has returned
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t tids[FILE_POOL_MAX_THREADS];
+    int threads;
+} file_pool_t;
+
+void* file_pool_worker(void *arg) {
+    file_pool_t *pool = arg;
+    int k, id = __atomic_fetch_add(&pool->ids, 1, __ATOMIC_RELAXED);
+    while ((k = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->n) {
+        pool->fn(pool->ctx, k, id);
+        pthread_mutex_lock(&pool->lock);
+        pool->done[k] = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Start workers on n inputs, one per CPU up to max; with a single CPU or
+// input (or no threads to be had) none are started and file_pool_wait
+// runs each input itself
+void file_pool_start(file_pool_t *pool, int n, int max, void (*fn)(void *, int, int), void *ctx) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = ncpu < n ? (int)ncpu : n;
+    if (want > max) want = max;
+    if (want > FILE_POOL_MAX_THREADS) want = FILE_POOL_MAX_THREADS;
+    memset(pool, 0, sizeof(*pool));
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->n = n;
+    pool->done = calloc(n ? n : 1, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    while (want > 1 && pool->threads < want &&
+           pthread_create(&pool->tids[pool->threads], NULL, file_pool_worker, pool) == 0) {
+        pool->threads++;
+    }
+}
+
+// Block until input k is done
+void file_pool_wait(file_pool_t *pool, int k) {
+    if (!pool->threads) {
+        pool->fn(pool->ctx, k, 0);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->done[k]) pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Stop handing out inputs, wait for the workers and free the pool
+void file_pool_finish(file_pool_t *pool) {
+    __atomic_store_n(&pool->next, pool->n, __ATOMIC_RELAXED);
+    while (pool->threads) pthread_join(pool->tids[--pool->threads], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->done);
+}
+
+// wc counts as a UTF-8 locale does: characters are the bytes that do not
+// continue a sequence, words are runs of printable characters between
+// spaces, and control characters other than spaces neither start nor end
+// a word. In the C locale characters are bytes, and bytes above 0x7f are
+// not printable. Invalid UTF-8 is not decoded, so on binary input the
+// character and word counts can differ from coreutils'. Other locales are
+// left to the system's wc. Input is read through a buffer that stays in
+// cache, 64 bytes at a time with SSE2 or NEON. Several files are counted
+// at once, one per thread, and printed in order as each finishes
+#define WC_BUF_SIZE (128 << 10)
+#define WC_PARALLEL_MIN (1 << 20)   // less input than this is counted on one thread
+
+enum { WC_LINES = 1, WC_WORDS = 2, WC_CHARS = 4, WC_BYTES = 8, WC_C_LOCALE = 16 };
+
+typedef struct {
+    uint64_t lines, words, chars, bytes;
+    int in_word;        // the last byte that was not a control was printable
+} wc_counts_t;
+
+void wc_count_bytes(wc_counts_t *c, const unsigned char *p, size_t n, int what) {
+    int utf8 = !(what & WC_C_LOCALE);
+    for (size_t i = 0; i < n; i++) {
+        unsigned char ch = p[i];
+        c->lines += ch == '\n';
+        c->chars += utf8 && (ch & 0xc0) != 0x80;
+        if (ch == ' ' || (ch >= '\t' && ch <= '\r')) {
+            c->in_word = 0;
+        } else if (ch > ' ' && ch != 0x7f && (utf8 || ch < 0x80)) {
+            c->words += !c->in_word;
+            c->in_word = 1;
+        }
+    }
+}
+
+// Words in a 64-byte block from the masks of its spaces and its controls
+void wc_count_words(wc_counts_t *c, const unsigned char *p, uint64_t spaces, uint64_t ctrls, int what) {
+    if (ctrls & ~spaces) {
+        // Controls are rare in text; let the byte loop sort them out
+        wc_counts_t w = {0, 0, 0, 0, c->in_word};
+        wc_count_bytes(&w, p, 64, what);
+        c->words += w.words;
+        c->in_word = w.in_word;
+        return;
+    }
+    uint64_t printable = ~spaces;
+    c->words += __builtin_popcountll(printable & ~(printable << 1 | (uint64_t)c->in_word));
+    c->in_word = printable >> 63;
+}
+
+#if !defined(__SSE2__) && defined(__aarch64__)
+// Bit i set for each byte i of the four vectors that is all ones
+uint64_t wc_neon_mask(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d) {
+    const uint8x16_t bit = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t ab = vpaddq_u8(vandq_u8(a, bit), vandq_u8(b, bit));
+    uint8x16_t cd = vpaddq_u8(vandq_u8(c, bit), vandq_u8(d, bit));
+    ab = vpaddq_u8(ab, cd);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(vpaddq_u8(ab, ab)), 0);
+}
+#endif
+
+void wc_count(wc_counts_t *c, const unsigned char *p, size_t n, int what) {
+    size_t i = 0;
+    c->bytes += n;
+    if (what & WC_C_LOCALE) {
+        // Characters are bytes
+        c->chars += n;
+        what &= ~WC_CHARS;
+    }
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n'), space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    const __m128i del = _mm_set1_epi8(0x7f), ctrl_max = _mm_set1_epi8(0x1f);
+    const __m128i cont = _mm_set1_epi8((char)0xbf);
+    while (i + 64 <= n) {
+        // Per-byte counts of newlines and characters, summed before the
+        // 8-bit lanes can overflow
+        __m128i lines = _mm_setzero_si128(), chars = _mm_setzero_si128();
+        size_t stop = i + 63 * 64 < n ? i + 63 * 64 : n;
+        for (; i + 64 <= stop; i += 64) {
+            uint64_t spaces = 0, ctrls = 0;
+            for (int k = 0; k < 4; k++) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + i + 16 * k));
+                lines = _mm_sub_epi8(lines, _mm_cmpeq_epi8(v, nl));
+                // Signed, only 0x80-0xbf fall at or below 0xbf
+                if (what & WC_CHARS) chars = _mm_sub_epi8(chars, _mm_cmpgt_epi8(v, cont));
+                if (!(what & WC_WORDS)) continue;
+                __m128i t = _mm_sub_epi8(v, tab);
+                __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(t, four), t));
+                __m128i ct = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctrl_max), v), _mm_cmpeq_epi8(v, del));
+                spaces |= (uint64_t)(unsigned)_mm_movemask_epi8(sp) << (16 * k);
+                ctrls |= (uint64_t)(unsigned)_mm_movemask_epi8(ct) << (16 * k);
+                // Bytes above 0x7f are not printable in the C locale
+                if (what & WC_C_LOCALE) ctrls |= (uint64_t)(unsigned)_mm_movemask_epi8(v) << (16 * k);
+            }
+            if (what & WC_WORDS) wc_count_words(c, p + i, spaces, ctrls, what);
+        }
+        __m128i zero = _mm_setzero_si128();
+        lines = _mm_sad_epu8(lines, zero);
+        chars = _mm_sad_epu8(chars, zero);
+        c->lines += (uint64_t)_mm_cvtsi128_si32(lines) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(lines, 8));
+        c->chars += (uint64_t)_mm_cvtsi128_si32(chars) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(chars, 8));
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t nl = vdupq_n_u8('\n'), space = vdupq_n_u8(' ');
+    const uint8x16_t tab = vdupq_n_u8('\t'), four = vdupq_n_u8(4);
+    const uint8x16_t del = vdupq_n_u8(0x7f), ctrl_max = vdupq_n_u8(0x1f);
+    const int8x16_t cont = vdupq_n_s8((int8_t)0xbf);
+    while (i + 64 <= n) {
+        // As with SSE2: 8-bit counters, summed before they can overflow
+        uint8x16_t lines = vdupq_n_u8(0), chars = vdupq_n_u8(0);
+        size_t stop = i + 63 * 64 < n ? i + 63 * 64 : n;
+        for (; i + 64 <= stop; i += 64) {
+            uint8x16_t sp[4], ct[4];
+            for (int k = 0; k < 4; k++) {
+                uint8x16_t v = vld1q_u8(p + i + 16 * k);
+                lines = vsubq_u8(lines, vceqq_u8(v, nl));
+                if (what & WC_CHARS) chars = vsubq_u8(chars, vcgtq_s8(vreinterpretq_s8_u8(v), cont));
+                if (!(what & WC_WORDS)) continue;
+                sp[k] = vorrq_u8(vceqq_u8(v, space), vcleq_u8(vsubq_u8(v, tab), four));
+                ct[k] = vorrq_u8(vcleq_u8(v, ctrl_max), vceqq_u8(v, del));
+                // Bytes above 0x7f are not printable in the C locale
+                if (what & WC_C_LOCALE) ct[k] = vorrq_u8(ct[k], vtstq_u8(v, vdupq_n_u8(0x80)));
+            }
+            if (!(what & WC_WORDS)) continue;
+            uint64_t spaces = wc_neon_mask(sp[0], sp[1], sp[2], sp[3]);
+            uint64_t ctrls = wc_neon_mask(ct[0], ct[1], ct[2], ct[3]);
+            wc_count_words(c, p + i, spaces, ctrls, what);
+        }
+        c->lines += vaddlvq_u8(lines);
+        c->chars += vaddlvq_u8(chars);
+    }
+#endif
+    wc_count_bytes(c, p + i, n - i, what);
+}
+
+// Write one line of counts in the columns coreutils uses
+void wc_print(const wc_counts_t *c, int what, int width, const char *name) {
+    const uint64_t vals[] = {c->lines, c->words, c->chars, c->bytes};
+    const char *sep = "";
+    for (int k = 0; k < 4; k++) {
+        if (!(what & (1 << k))) continue;
+        printf("%s%*llu", sep, width, (unsigned long long)vals[k]);
+        sep = " ";
+    }
+    if (name) printf(" %s", name);
+    putchar('\n');
+}
+
+// Count one input; returns 0, or -1 with errno set
+int wc_file(int fd, const struct stat *st, int what, wc_counts_t *c) {
+    memset(c, 0, sizeof(*c));
+    if ((what & ~WC_C_LOCALE) == WC_BYTES && st && S_ISREG(st->st_mode)) {
+        // Sizes alone need no reading
+        off_t at = lseek(fd, 0, SEEK_CUR);
+        if (at >= 0 && at <= st->st_size) {
+            c->bytes = st->st_size - at;
+            lseek(fd, 0, SEEK_END);
+            return 0;
+        }
+    }
+    // Small files get a buffer their size; it is one per thread
+    size_t size = st && S_ISREG(st->st_mode) && st->st_size < WC_BUF_SIZE ? (size_t)st->st_size + 1 : WC_BUF_SIZE;
+    unsigned char *buf = malloc(size);
+    int ret = 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (1) {
+        ssize_t n = read(fd, buf, size);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR && !interrupted) continue;
+            ret = -1;
+            break;
+        }
+        wc_count(c, buf, n, what);
+        if (interrupted && interactive) break;
+    }
+    int err = errno;
+    free(buf);
+    errno = err;
+    return ret;
+}
+
+typedef struct {
+    int *fds;
+    struct stat *st;
+    int *errs;                  // errno from opening each, then from reading it
+    int what;
+    wc_counts_t *counts;
+    char *failed;
+} wc_job_t;
+
+void wc_job(void *ctx, int k, int worker) {
+    wc_job_t *job = ctx;
+    if (job->fds[k] < 0) return;
+    job->failed[k] = wc_file(job->fds[k], job->errs[k] ? NULL : &job->st[k], job->what, &job->counts[k]) < 0;
+    if (job->failed[k]) job->errs[k] = errno;
+}
+
+// Built-in: wc
+int byteshell_wc(char **args) {
+    int what = 0, i = 1, status = 0;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 'l') what |= WC_LINES;
+            else if (*o == 'w') what |= WC_WORDS;
+            else if (*o == 'm') what |= WC_CHARS;
+            else if (*o == 'c') what |= WC_BYTES;
+            else return execute_command(args, 0);  // -L and long options
+        }
+    }
+    if (!what) what = WC_LINES | WC_WORDS | WC_BYTES;
+    int ctype = locale_ctype();
+    if (ctype < 0) return execute_command(args, 0);
+
+    char *stdin_only[] = {NULL, NULL};
+    char **files = args[i] ? args + i : stdin_only;
+    int nfiles = args[i] ? 0 : 1;
+    while (files[nfiles]) nfiles++;
+    int *fds = malloc(nfiles * sizeof(int));
+    struct stat *st = malloc(nfiles * sizeof(struct stat));
+    int *errs = calloc(nfiles, sizeof(int));     // errno from opening each
+
+    // Column width as coreutils works it out: wide enough for the total
+    // size of the regular files, at least 7 if any input is not one, and
+    // no padding for a single count of a single input. Like coreutils,
+    // this looks at what stat says of inputs that cannot be opened
+    int width = 1, min_width = 1, single = nfiles == 1 && __builtin_popcount(what) == 1;
+    uint64_t total_size = 0;
+    for (int k = 0; k < nfiles; k++) {
+        const char *name = files[k];
+        if (!name || strcmp(name, "-") == 0) {
+            read_sync();
+            fds[k] = STDIN_FILENO;
+        } else {
+            fds[k] = open(name, O_RDONLY | O_CLOEXEC);
+        }
+        if (fds[k] < 0 || fstat(fds[k], &st[k]) < 0) {
+            errs[k] = errno;
+            if (fds[k] >= 0 || stat(name, &st[k]) < 0) continue;
+        }
+        if (S_ISREG(st[k].st_mode)) total_size += st[k].st_size;
+        else min_width = 7;
+    }
+    if (!single) {
+        for (; total_size >= 10; total_size /= 10) width++;
+        if (width < min_width) width = min_width;
+    }
+
+    if (!ctype) what |= WC_C_LOCALE;
+
+    fflush(stdout);
+    wc_counts_t total = {0};
+    wc_job_t job = {fds, st, errs, what, calloc(nfiles, sizeof(wc_counts_t)), calloc(nfiles, 1)};
+    file_pool_t pool;
+    // Reading sizes alone, or little input, is not worth a thread
+    int parallel = (what & ~WC_C_LOCALE) != WC_BYTES && total_size >= WC_PARALLEL_MIN;
+    file_pool_start(&pool, nfiles, parallel ? FILE_POOL_MAX_THREADS : 1, wc_job, &job);
+    for (int k = 0; k < nfiles && !(interrupted && interactive); k++) {
+        const char *name = files[k];
+        wc_counts_t *c = &job.counts[k];
+        file_pool_wait(&pool, k);
+        if (fds[k] < 0 || job.failed[k]) {
+            fprintf(stderr, "ByteShell: wc: %s: %s\n", name ? name : "-", strerror(errs[k]));
+            status = 1;
+            if (fds[k] < 0) continue;
+        }
+        wc_print(c, what, width, name);
+        total.lines += c->lines;
+        total.words += c->words;
+        total.chars += c->chars;
+        total.bytes += c->bytes;
+    }
+    file_pool_finish(&pool);
+    if (nfiles > 1) wc_print(&total, what, width, "total");
+    for (int k = 0; k < nfiles; k++) {
+        if (fds[k] > STDIN_FILENO) close(fds[k]);
+    }
+    free(fds);
+    free(st);
+    free(errs);
+    free(job.counts);
+    free(job.failed);
+    return interrupted && interactive ? 130 : status;
+}
+
+// grep: patterns that are plain strings are searched for across the whole
+// input with mem_find, one pass per string. Anything else is parsed into
+// a small program (the glob bracket parser handles [...]) and run as a DFA
+// built lazily, one state per set of program positions, and only on lines
+// holding the longest string every match must contain. Characters are
+// bytes in the C locale and UTF-8 sequences in a UTF-8 one; other locales,
+// and patterns whose non-ASCII characters are more than literal text there,
+// go to the system's grep
+#define RX_MAX_CODE (1 << 16)
+#define RX_MAX_STATES 1024  // the DFA cache is flushed beyond this
+#define RX_STOP (1 << 30)   // on a transition: its target accepts or is dead
+#define GREP_BUF_SIZE (128 << 10)
+
+enum { RXN_SET, RXN_CAT, RXN_ALT, RXN_REP, RXN_BOL, RXN_EOL, RXN_EMPTY };
+
+typedef struct rx_node {
+    int type;
+    int set;            // RXN_SET: index into the sets
+    int min, max;       // RXN_REP; max is -1 when unbounded
+    struct rx_node *a, *b;
+} rx_node_t;
+
+enum { RX_SET, RX_SPLIT, RX_JMP, RX_BOL, RX_EOL, RX_MATCH };
+
+typedef struct {
+    unsigned char op;
+    int x, y;           // RX_SET: x is the set; RX_SPLIT/RX_JMP: targets
+} rx_inst_t;
+
+typedef struct {
+    int *pcs;           // RX_SET, RX_EOL and RX_MATCH instructions, sorted
+    int npcs;
+    int at_start;       // the start state, where ^ still holds
+    int accept;         // a match has been seen
+    int accept_eol;     // a match if the line ends here
+} rx_dstate_t;
+
+typedef struct {
+    arena_t arena;
+    unsigned char (*sets)[32];
+    int nsets;
+    int sets_cap;
+    rx_inst_t *code;
+    int ncode;
+    int code_cap;
+    rx_dstate_t *states;
+    int nstates;
+    // Transitions, a row per state and a column per class of bytes that
+    // no set tells apart. Entries are the target's row offset, RX_STOP
+    // added when it ends the search, or -1 until first taken
+    unsigned char classes[256];
+    int nclasses;
+    int *trans;
+    int *table;         // state ids by hash of their pcs, -1 empty
+    int start;          // -1 until built, and after a flush
+    unsigned flushes;
+    int *seeds;         // closure input and output, instruction count each
+    int *out;
+    int *stack;
+    unsigned *mark;     // instructions visited, stamped with gen
+    unsigned gen;
+} rx_t;
+
+typedef struct {
+    rx_t *rx;
+    const char *p, *end;
+    int ere, fold;
+    int error;          // 1 malformed, 2 needs the system grep
+    const char *why;
+    int bytes;          // C locale: every byte is a character
+} rx_parser_t;
+
+void rx_error(rx_parser_t *ps, const char *why) {
+    if (!ps->error) ps->why = why;
+    ps->error = 1;
+}
+
+int rx_new_set(rx_t *rx) {
+    GROW(rx->sets, rx->nsets, rx->sets_cap);
+    memset(rx->sets[rx->nsets], 0, 32);
+    return rx->nsets++;
+}
+
+void rx_set_add(unsigned char *cls, int c) {
+    cls[c >> 3] |= 1 << (c & 7);
+}
+
+rx_node_t* rx_node(rx_t *rx, int type, rx_node_t *a, rx_node_t *b) {
+    rx_node_t *n = arena_alloc(&rx->arena, sizeof(rx_node_t));
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+rx_node_t* rx_set_node(rx_t *rx, int set) {
+    rx_node_t *n = rx_node(rx, RXN_SET, NULL, NULL);
+    n->set = set;
+    return n;
+}
+
+// A set of bytes from lo to hi
+rx_node_t* rx_range(rx_t *rx, int lo, int hi) {
+    int s = rx_new_set(rx);
+    for (int c = lo; c <= hi; c++) rx_set_add(rx->sets[s], c);
+    return rx_set_node(rx, s);
+}
+
+rx_node_t* rx_rep(rx_t *rx, rx_node_t *a, int min, int max) {
+    rx_node_t *n = rx_node(rx, RXN_REP, a, NULL);
+    n->min = min;
+    n->max = max;
+    return n;
+}
+
+rx_node_t* rx_char(rx_parser_t *ps, int c) {
+    int s = rx_new_set(ps->rx);
+    rx_set_add(ps->rx->sets[s], c);
+    if (ps->fold && isalpha(c)) rx_set_add(ps->rx->sets[s], c ^ 0x20);
+    return rx_set_node(ps->rx, s);
+}
+
+// One character: a byte of the ASCII set or any UTF-8 sequence, the way
+// . and negated brackets match in a UTF-8 locale. In the C locale any
+// byte above 0x7f is a character of its own
+rx_node_t* rx_any_char(rx_parser_t *ps, int ascii) {
+    rx_t *rx = ps->rx;
+    if (ps->bytes) {
+        for (int c = 0x80; c < 256; c++) rx_set_add(rx->sets[ascii], c);
+        return rx_set_node(rx, ascii);
+    }
+    rx_node_t *cont = rx_range(rx, 0x80, 0xbf);
+    rx_node_t *two = rx_node(rx, RXN_CAT, rx_range(rx, 0xc2, 0xdf), cont);
+    rx_node_t *three = rx_node(rx, RXN_CAT, rx_range(rx, 0xe0, 0xef), rx_rep(rx, cont, 2, 2));
+    rx_node_t *four = rx_node(rx, RXN_CAT, rx_range(rx, 0xf0, 0xf4), rx_rep(rx, cont, 3, 3));
+    rx_node_t *multi = rx_node(rx, RXN_ALT, two, rx_node(rx, RXN_ALT, three, four));
+    for (int c = 0x80; c < 256; c++) rx->sets[ascii][c >> 3] &= ~(1 << (c & 7));
+    return rx_node(rx, RXN_ALT, rx_set_node(rx, ascii), multi);
+}
+
+rx_node_t* rx_parse_alt(rx_parser_t *ps, int depth);
+
+// Is the parser at the BRE or ERE spelling of a special character?
+int rx_at(rx_parser_t *ps, char c) {
+    if (ps->ere) return ps->p < ps->end && *ps->p == c;
+    return ps->p + 1 < ps->end && ps->p[0] == '\\' && ps->p[1] == c;
+}
+
+void rx_skip(rx_parser_t *ps) {
+    ps->p += ps->ere ? 1 : 2;
+}
+
+rx_node_t* rx_parse_atom(rx_parser_t *ps, int depth, int first) {
+    rx_t *rx = ps->rx;
+    if (rx_at(ps, '(')) {
+        rx_skip(ps);
+        rx_node_t *n = rx_parse_alt(ps, depth + 1);
+        if (!rx_at(ps, ')')) {
+            rx_error(ps, "unmatched ( or \\(");
+            return n;
+        }
+        rx_skip(ps);
+        return n;
+    }
+    char c = *ps->p++;
+    if (c == '.') {
+        int s = rx_new_set(rx);
+        for (int k = 0; k < 0x80; k++) {
+            if (k != '\n') rx_set_add(rx->sets[s], k);
+        }
+        return rx_any_char(ps, s);
+    }
+    if (c == '^' && (ps->ere || first)) return rx_node(rx, RXN_BOL, NULL, NULL);
+    if (c == '$' && (ps->ere || ps->p == ps->end || rx_at(ps, ')') || rx_at(ps, '|'))) {
+        return rx_node(rx, RXN_EOL, NULL, NULL);
+    }
+    if (c == '[') {
+        int s = rx_new_set(rx);
+        unsigned char *cls = rx->sets[s];
+        const char *next;
+        int bang = ps->p < ps->end && *ps->p == '!';
+        if (bang && ps->p + 1 < ps->end && ps->p[1] == ']') {
+            // [!] is a set of one; the glob parser would read it as negation
+            rx_set_add(cls, '!');
+            next = ps->p + 2;
+        } else if (!(next = pattern_parse_class(ps->p, ps->end, cls))) {
+            rx_error(ps, "unmatched [");
+            return NULL;
+        } else if (bang) {
+            for (int k = 0; k < 32; k++) cls[k] = ~cls[k];
+            rx_set_add(cls, '!');
+        }
+        int negated = *ps->p == '^';
+        ps->p = next;
+        if (ps->fold) {
+            // Fold what the brackets list, before any negation
+            for (int k = 'a'; k <= 'z'; k++) {
+                int in = CLASS_HAS(cls, k) || CLASS_HAS(cls, k ^ 0x20);
+                if (negated) in = !CLASS_HAS(cls, k) || !CLASS_HAS(cls, k ^ 0x20);
+                if (in != negated) {
+                    rx_set_add(cls, k);
+                    rx_set_add(cls, k ^ 0x20);
+                } else {
+                    cls[k >> 3] &= ~(1 << (k & 7));
+                    cls[(k ^ 0x20) >> 3] &= ~(1 << ((k ^ 0x20) & 7));
+                }
+            }
+        }
+        return negated ? rx_any_char(ps, s) : rx_set_node(rx, s);
+    }
+    if (c == '\\') {
+        if (ps->p == ps->end) {
+            rx_error(ps, "trailing backslash");
+            return NULL;
+        }
+        c = *ps->p++;
+        if (c == 'w' || c == 'W' || c == 's' || c == 'S') {
+            // Characters beyond ASCII count as letters and not as spaces,
+            // and in the C locale as neither
+            int s = rx_new_set(rx);
+            for (int k = 0; k < 0x80; k++) {
+                int in = c == 'w' || c == 'W' ? isalnum(k) || k == '_' : isspace(k);
+                if (in == (c == 'w' || c == 's')) rx_set_add(rx->sets[s], k);
+            }
+            int beyond = ps->bytes ? c == 'W' || c == 'S' : c == 'w' || c == 'S';
+            return beyond ? rx_any_char(ps, s) : rx_set_node(rx, s);
+        }
+        // Back-references and word anchors are not done here
+        if (isdigit((unsigned char)c) || strchr("bB<>`'", c)) {
+            ps->error = 2;
+            return NULL;
+        }
+    }
+    return rx_char(ps, (unsigned char)c);
+}
+
+// Parse an interval's "m,n}" after the opening brace; returns 0 if it is
+// not one, so ERE can take the brace literally
+int rx_parse_interval(rx_parser_t *ps, int *min, int *max) {
+    const char *p = ps->p;
+    char *end;
+    if (p >= ps->end || !isdigit((unsigned char)*p)) {
+        if (p < ps->end && *p == ',') *min = 0;
+        else return 0;
+    } else {
+        *min = (int)strtol(p, &end, 10);
+        p = end;
+    }
+    *max = *min;
+    if (p < ps->end && *p == ',') {
+        p++;
+        *max = -1;
+        if (p < ps->end && isdigit((unsigned char)*p)) {
+            *max = (int)strtol(p, &end, 10);
+            p = end;
+        }
+    }
+    if (ps->ere ? p >= ps->end || *p != '}' : p + 1 >= ps->end || p[0] != '\\' || p[1] != '}') return 0;
+    if (*max >= 0 && *max < *min) {
+        rx_error(ps, "invalid interval");
+        return 0;
+    }
+    if (*min > 255 || *max > 255) {
+        ps->error = 2;
+        return 0;
+    }
+    ps->p = p + (ps->ere ? 1 : 2);
+    return 1;
+}
+
+rx_node_t* rx_parse_cat(rx_parser_t *ps, int depth) {
+    rx_node_t *seq = NULL;
+    int first = 1;
+    // An ERE's unmatched ) is an ordinary character
+    while (ps->p < ps->end && !ps->error && !rx_at(ps, '|') && !((depth || !ps->ere) && rx_at(ps, ')'))) {
+        rx_node_t *atom;
+        if (first && *ps->p == '*') {
+            // A leading star is literal in a BRE; GNU grep drops it in an ERE
+            ps->p++;
+            if (ps->ere) continue;
+            atom = rx_char(ps, '*');
+        } else {
+            atom = rx_parse_atom(ps, depth, first);
+        }
+        if (ps->error) return NULL;
+        // So is a star right after a BRE's ^
+        first = atom->type == RXN_BOL && !ps->ere;
+        while (ps->p < ps->end && !first) {
+            int min, max;
+            if (*ps->p == '*') {
+                ps->p++;
+                min = 0, max = -1;
+            } else if (rx_at(ps, '+') || rx_at(ps, '?')) {
+                max = *(ps->p + (ps->ere ? 0 : 1)) == '+' ? -1 : 1;
+                min = max < 0;
+                rx_skip(ps);
+            } else if (rx_at(ps, '{')) {
+                const char *at = ps->p;
+                rx_skip(ps);
+                if (!rx_parse_interval(ps, &min, &max)) {
+                    ps->p = at;
+                    if (!ps->ere) rx_error(ps, "invalid interval");
+                    break;
+                }
+            } else {
+                break;
+            }
+            atom = rx_rep(ps->rx, atom, min, max);
+        }
+        seq = seq ? rx_node(ps->rx, RXN_CAT, seq, atom) : atom;
+    }
+    return seq ? seq : rx_node(ps->rx, RXN_EMPTY, NULL, NULL);
+}
+
+rx_node_t* rx_parse_alt(rx_parser_t *ps, int depth) {
+    rx_node_t *n = rx_parse_cat(ps, depth);
+    while (!ps->error && rx_at(ps, '|')) {
+        rx_skip(ps);
+        n = rx_node(ps->rx, RXN_ALT, n, rx_parse_cat(ps, depth));
+    }
+    return n;
+}
+
+// A string taken literally, as -F does
+rx_node_t* rx_literal(rx_parser_t *ps, const char *s, size_t n) {
+    rx_node_t *seq = NULL;
+    for (size_t i = 0; i < n; i++) {
+        rx_node_t *c = rx_char(ps, (unsigned char)s[i]);
+        seq = seq ? rx_node(ps->rx, RXN_CAT, seq, c) : c;
+    }
+    ps->p = s + n;
+    return seq ? seq : rx_node(ps->rx, RXN_EMPTY, NULL, NULL);
+}
+
+// The byte a set stands for if it holds one byte, or one letter in both
+// cases when folding; -1 otherwise
+int rx_set_char(const unsigned char *cls, int fold) {
+    int c = -1, count = 0;
+    for (int k = 0; k < 32; k++) count += __builtin_popcount(cls[k]);
+    for (int k = 0; k < 256 && c < 0; k++) {
+        if (CLASS_HAS(cls, k)) c = k;
+    }
+    if (count == 1) return c;
+    if (count == 2 && fold && isupper(c) && CLASS_HAS(cls, c ^ 0x20)) return c ^ 0x20;
+    return -1;
+}
+
+// Walk a concatenation in order, keeping the longest run of single
+// characters in best; returns 0 once something other than a character
+// was passed, so the node is not a plain string
+int rx_strings(rx_t *rx, rx_node_t *n, int fold, strbuf_t *run, strbuf_t *best) {
+    if (n->type == RXN_CAT) {
+        int a = rx_strings(rx, n->a, fold, run, best);
+        return rx_strings(rx, n->b, fold, run, best) && a;
+    }
+    int c = n->type == RXN_SET ? rx_set_char(rx->sets[n->set], fold) : -1;
+    if (c >= 0) {
+        sb_putc(run, c);
+        if (run->len > best->len) {
+            best->len = 0;
+            sb_append(best, run->data, run->len);
+        }
+        return 1;
+    }
+    run->len = 0;
+    return n->type == RXN_EMPTY;
+}
+
+int rx_emit_op(rx_t *rx, int op, int x, int y) {
+    GROW(rx->code, rx->ncode, rx->code_cap);
+    rx->code[rx->ncode] = (rx_inst_t){op, x, y};
+    return rx->ncode++;
+}
+
+int rx_emit(rx_t *rx, rx_node_t *n) {
+    if (rx->ncode > RX_MAX_CODE) return -1;
+    switch (n->type) {
+    case RXN_SET: rx_emit_op(rx, RX_SET, n->set, 0); break;
+    case RXN_BOL: rx_emit_op(rx, RX_BOL, 0, 0); break;
+    case RXN_EOL: rx_emit_op(rx, RX_EOL, 0, 0); break;
+    case RXN_EMPTY: break;
+    case RXN_CAT:
+        if (rx_emit(rx, n->a) < 0 || rx_emit(rx, n->b) < 0) return -1;
+        break;
+    case RXN_ALT: {
+        int split = rx_emit_op(rx, RX_SPLIT, 0, 0);
+        if (rx_emit(rx, n->a) < 0) return -1;
+        int jmp = rx_emit_op(rx, RX_JMP, 0, 0);
+        rx->code[split].x = split + 1;
+        rx->code[split].y = rx->ncode;
+        if (rx_emit(rx, n->b) < 0) return -1;
+        rx->code[jmp].x = rx->ncode;
+        break;
+    }
+    case RXN_REP:
+        for (int i = 0; i < n->min; i++) {
+            if (rx_emit(rx, n->a) < 0) return -1;
+        }
+        if (n->max < 0) {
+            int split = rx_emit_op(rx, RX_SPLIT, 0, 0);
+            if (rx_emit(rx, n->a) < 0) return -1;
+            rx_emit_op(rx, RX_JMP, split, 0);
+            rx->code[split].x = split + 1;
+            rx->code[split].y = rx->ncode;
+        }
+        for (int i = n->min; i < n->max; i++) {
+            int split = rx_emit_op(rx, RX_SPLIT, 0, 0);
+            if (rx_emit(rx, n->a) < 0) return -1;
+            rx->code[split].x = split + 1;
+            rx->code[split].y = rx->ncode;
+        }
+        break;
+    }
+    return 0;
+}
+
+int rx_int_cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Follow jumps and splits from the seeds; keeps the instructions that wait
+// for a byte, the end of the line or nothing (RX_MATCH) in out, sorted
+int rx_closure(rx_t *rx, const int *seeds, int nseeds, int at_start, int at_end, int *out) {
+    int nout = 0, sp = 0;
+    if (++rx->gen == 0) {
+        memset(rx->mark, 0, rx->ncode * sizeof(unsigned));
+        rx->gen = 1;
+    }
+    for (int i = nseeds; i-- > 0;) rx->stack[sp++] = seeds[i];
+    while (sp) {
+        int pc = rx->stack[--sp];
+        if (rx->mark[pc] == rx->gen) continue;
+        rx->mark[pc] = rx->gen;
+        rx_inst_t *in = &rx->code[pc];
+        switch (in->op) {
+        case RX_SPLIT:
+            rx->stack[sp++] = in->y;
+            rx->stack[sp++] = in->x;
+            break;
+        case RX_JMP: rx->stack[sp++] = in->x; break;
+        case RX_BOL:
+            if (at_start) rx->stack[sp++] = pc + 1;
+            break;
+        case RX_EOL:
+            if (at_end) rx->stack[sp++] = pc + 1;
+            else out[nout++] = pc;
+            break;
+        default: out[nout++] = pc;
+        }
+    }
+    qsort(out, nout, sizeof(int), rx_int_cmp);
+    return nout;
+}
+
+void rx_flush(rx_t *rx) {
+    for (int i = 0; i < rx->nstates; i++) free(rx->states[i].pcs);
+    rx->nstates = 0;
+    rx->start = -1;
+    rx->flushes++;
+    for (int i = 0; i < 2 * RX_MAX_STATES; i++) rx->table[i] = -1;
+}
+
+// Find or add the state for a sorted instruction set
+int rx_intern(rx_t *rx, const int *pcs, int npcs, int at_start) {
+    uint32_t h = hash_bytes((const char *)pcs, npcs * sizeof(int)) ^ at_start;
+    size_t mask = 2 * RX_MAX_STATES - 1, i = h & mask;
+    for (; rx->table[i] >= 0; i = (i + 1) & mask) {
+        rx_dstate_t *d = &rx->states[rx->table[i]];
+        if (d->npcs == npcs && d->at_start == at_start && memcmp(d->pcs, pcs, npcs * sizeof(int)) == 0) {
+            return rx->table[i];
+        }
+    }
+    if (rx->nstates == RX_MAX_STATES) {
+        rx_flush(rx);
+        return rx_intern(rx, pcs, npcs, at_start);
+    }
+    int id = rx->nstates++;
+    rx_dstate_t *d = &rx->states[id];
+    d->pcs = malloc((npcs ? npcs : 1) * sizeof(int));
+    memcpy(d->pcs, pcs, npcs * sizeof(int));
+    d->npcs = npcs;
+    d->at_start = at_start;
+    d->accept = d->accept_eol = 0;
+    for (int k = 0; k < npcs; k++) {
+        if (rx->code[pcs[k]].op == RX_MATCH) d->accept = 1;
+    }
+    // Does ending the line here let a waiting $ through to a match? The
+    // caller's pcs may be in out, so this closure goes to seeds
+    int ntail = rx_closure(rx, d->pcs, npcs, at_start, 1, rx->seeds);
+    for (int k = 0; k < ntail; k++) {
+        if (rx->code[rx->seeds[k]].op == RX_MATCH) d->accept_eol = 1;
+    }
+    for (int k = 0; k < rx->nclasses; k++) rx->trans[id * rx->nclasses + k] = -1;
+    rx->table[i] = id;
+    return id;
+}
+
+int rx_start_state(rx_t *rx) {
+    int zero = 0;
+    int n = rx_closure(rx, &zero, 1, 1, 0, rx->out);
+    return rx_intern(rx, rx->out, n, 1);
+}
+
+// Compute the transition from state s on byte c. Matching is unanchored,
+// so the program's start is seeded again at every byte
+int rx_step(rx_t *rx, int s, int c) {
+    rx_dstate_t *d = &rx->states[s];
+    int nseeds = 0;
+    for (int k = 0; k < d->npcs; k++) {
+        rx_inst_t *in = &rx->code[d->pcs[k]];
+        if (in->op == RX_SET && CLASS_HAS(rx->sets[in->x], c)) rx->seeds[nseeds++] = d->pcs[k] + 1;
+    }
+    rx->seeds[nseeds++] = 0;
+    int n = rx_closure(rx, rx->seeds, nseeds, 0, 0, rx->out);
+    unsigned flushes = rx->flushes;
+    int next = rx_intern(rx, rx->out, n, 0);
+    // A flush in between took s with it
+    rx_dstate_t *to = &rx->states[next];
+    if (rx->flushes == flushes) {
+        rx->trans[s * rx->nclasses + rx->classes[c]] = next * rx->nclasses + (to->accept || !to->npcs ? RX_STOP : 0);
+    }
+    return next;
+}
+
+// Does the program match anywhere in the line? Known transitions that do
+// not end the search are followed without looking at the states
+int rx_line(rx_t *rx, const unsigned char *s, size_t n) {
+    if (rx->start < 0) rx->start = rx_start_state(rx);
+    if (rx->states[rx->start].accept) return 1;
+    const int *trans = rx->trans;
+    const unsigned char *classes = rx->classes;
+    int ncls = rx->nclasses, row = rx->start * ncls;
+    for (size_t i = 0; i < n; i++) {
+        int next = trans[row + classes[s[i]]];
+        if ((unsigned)next < RX_STOP) {
+            row = next;
+            continue;
+        }
+        int st = next >= 0 ? (next - RX_STOP) / ncls : rx_step(rx, row / ncls, s[i]);
+        // A state with nothing left to run cannot match, as after a
+        // failed ^
+        if (rx->states[st].accept) return 1;
+        if (!rx->states[st].npcs) return 0;
+        row = st * ncls;
+    }
+    return rx->states[row / ncls].accept_eol;
+}
+
+// The DFA cache and the scratch space that fills it. A compiled program
+// is read-only, so threads sharing one each give their copy of the rx_t
+// a cache of its own
+void rx_cache_init(rx_t *rx) {
+    rx->trans = malloc(RX_MAX_STATES * rx->nclasses * sizeof(int));
+    rx->states = malloc(RX_MAX_STATES * sizeof(rx_dstate_t));
+    rx->table = malloc(2 * RX_MAX_STATES * sizeof(int));
+    rx->seeds = malloc((rx->ncode + 1) * sizeof(int));
+    rx->out = malloc((rx->ncode + 1) * sizeof(int));
+    // Each instruction is visited once and pushes at most two more
+    rx->stack = malloc((3 * rx->ncode + 2) * sizeof(int));
+    rx->mark = calloc(rx->ncode, sizeof(unsigned));
+    rx->gen = 0;
+    rx->nstates = 0;
+    rx_flush(rx);
+}
+
+void rx_cache_free(rx_t *rx) {
+    if (rx->table) rx_flush(rx);
+    free(rx->states);
+    free(rx->trans);
+    free(rx->table);
+    free(rx->seeds);
+    free(rx->out);
+    free(rx->stack);
+    free(rx->mark);
+}
+
+// Compile a parsed pattern into rx; returns -1 if it is too big
+int rx_compile(rx_t *rx, rx_node_t *n) {
+    if (rx_emit(rx, n) < 0) return -1;
+    rx_emit_op(rx, RX_MATCH, 0, 0);
+
+    // Split the bytes into classes, one set at a time
+    memset(rx->classes, 0, sizeof(rx->classes));
+    rx->nclasses = 1;
+    for (int pc = 0; pc < rx->ncode; pc++) {
+        if (rx->code[pc].op != RX_SET) continue;
+        int remap[512];
+        memset(remap, -1, sizeof(remap));
+        int n = 0;
+        for (int c = 0; c < 256; c++) {
+            int key = rx->classes[c] * 2 + !!CLASS_HAS(rx->sets[rx->code[pc].x], c);
+            if (remap[key] < 0) remap[key] = n++;
+            rx->classes[c] = remap[key];
+        }
+        rx->nclasses = n;
+    }
+    rx_cache_init(rx);
+    return 0;
+}
+
+void rx_free(rx_t *rx) {
+    rx_cache_free(rx);
+    arena_free(&rx->arena);
+    free(rx->sets);
+    free(rx->code);
+}
+
+typedef struct {
+    int invert, count, list, quiet, number, names, silent, fold;
+    char **strs;        // plain strings, when every pattern is one
+    size_t *lens;
+    const char **hits;  // next place each string occurs, cached per input
+    int nstrs;
+    rx_t rx;            // otherwise the compiled patterns
+    char *req;          // a string every match contains, to look for first
+    size_t reqlen;
+    uint64_t lineno;    // line number at line_at
+    const char *line_at;
+    int binary;
+    int binary_hit;     // a line of a binary input was selected
+    int stop;           // -q or -l have their answer
+    strbuf_t *out;      // with inputs searched in parallel, this one's output
+} grep_t;
+
+// Find the first line at or after pos that matches, as [*ls, *le).
+// Returns 0 if there is none
+int grep_next(grep_t *g, const char *pos, const char *end, const char **ls, const char **le) {
+    const char *hit;
+    if (g->strs) {
+        // Each string is looked for again only once the search passes it
+        hit = end;
+        for (int i = 0; i < g->nstrs; i++) {
+            if (!g->hits[i] || g->hits[i] < pos) {
+                const char *h = mem_find(pos, end - pos, g->strs[i], g->lens[i], g->fold);
+                g->hits[i] = h ? h : end;
+            }
+            if (g->hits[i] < hit) hit = g->hits[i];
+        }
+        if (hit == end) return 0;
+        const char *nl = memrchr(pos, '\n', hit - pos);
+        *ls = nl ? nl + 1 : pos;
+        *le = memchr(hit, '\n', end - hit);
+        if (!*le) *le = end;
+        return 1;
+    }
+    while (pos < end) {
+        const char *from = pos;
+        if (g->req) {
+            hit = mem_find(pos, end - pos, g->req, g->reqlen, g->fold);
+            if (!hit) return 0;
+            const char *nl = memrchr(pos, '\n', hit - pos);
+            from = nl ? nl + 1 : pos;
+        }
+        const char *to = memchr(from, '\n', end - from);
+        if (!to) to = end;
+        if (rx_line(&g->rx, (const unsigned char *)from, to - from)) {
+            *ls = from;
+            *le = to;
+            return 1;
+        }
+        pos = to + 1;
+    }
+    return 0;
+}
+
+void grep_put(grep_t *g, const char *s, size_t n) {
+    if (g->out) sb_append(g->out, s, n);
+    else fwrite(s, 1, n, stdout);
+}
+
+// Write or count one selected line. For a binary input the caller reports
+// the match once the input is done
+void grep_select(grep_t *g, const char *name, const char *s, const char *e, uint64_t *count) {
+    (*count)++;
+    if (g->quiet || g->list) {
+        g->stop = 1;
+        return;
+    }
+    if (g->count) return;
+    if (g->binary) {
+        g->binary_hit = 1;
+        g->stop = 1;
+        return;
+    }
+    if (g->names) {
+        grep_put(g, name, strlen(name));
+        grep_put(g, ":", 1);
+    }
+    if (g->number) {
+        wc_counts_t c = {0};
+        char num[32];
+        wc_count(&c, (const unsigned char *)g->line_at, s - g->line_at, WC_LINES);
+        g->lineno += c.lines;
+        g->line_at = s;
+        grep_put(g, num, snprintf(num, sizeof(num), "%llu:", (unsigned long long)g->lineno));
+    }
+    grep_put(g, s, e - s);
+    grep_put(g, "\n", 1);
+}
+
+// Search the lines in [buf, end)
+void grep_lines(grep_t *g, const char *buf, const char *end, const char *name, uint64_t *count) {
+    const char *pos = buf, *ls, *le;
+    g->line_at = buf;
+    for (int i = 0; i < g->nstrs; i++) g->hits[i] = NULL;
+    while (pos < end && !g->stop) {
+        int found = grep_next(g, pos, end, &ls, &le);
+        if (!found) ls = le = end;
+        if (g->invert) {
+            for (const char *p = pos; p < ls && !g->stop;) {
+                const char *e = memchr(p, '\n', ls - p);
+                if (!e) e = ls;
+                grep_select(g, name, p, e, count);
+                p = e + 1;
+            }
+        } else if (found) {
+            grep_select(g, name, ls, le, count);
+        }
+        if (!found) break;
+        pos = le + 1;
+        if (interrupted && interactive) break;
+    }
+    if (g->number) {
+        wc_counts_t c = {0};
+        wc_count(&c, (const unsigned char *)g->line_at, end - g->line_at, WC_LINES);
+        g->lineno += c.lines;
+    }
+}
+
+// Search one input; returns the number of selected lines, or -1 with
+// errno set
+long grep_fd(grep_t *g, int fd, const char *name) {
+    struct stat st;
+    uint64_t count = 0;
+    g->lineno = 1;
+    g->stop = g->binary_hit = 0;
+    if (fstat(fd, &st) < 0) return -1;
+    if (S_ISDIR(st.st_mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    // Whole lines at a time through a growing buffer. Files are read rather
+    // than mapped: one truncated under a mapping would raise SIGBUS, and grep
+    // runs in the shell itself
+    if (S_ISREG(st.st_mode)) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    strbuf_t sb = {0};
+    size_t keep = 0;
+    int first = 1;
+    sb_reserve(&sb, GREP_BUF_SIZE);
+    while (!g->stop) {
+        ssize_t n = read(fd, sb.data + keep, sb.cap - keep - 1);
+        if (n < 0 && errno == EINTR && !interrupted) continue;
+        if (n < 0) {
+            free(sb.data);
+            return -1;
+        }
+        if (first) g->binary = memchr(sb.data, '\0', n) != NULL;
+        first = 0;
+        sb.len = keep + n;
+        if (n == 0) {
+            if (sb.len) grep_lines(g, sb.data, sb.data + sb.len, name, &count);
+            break;
+        }
+        const char *last = memrchr(sb.data + keep, '\n', n);
+        if (last) {
+            grep_lines(g, sb.data, last + 1, name, &count);
+            keep = sb.data + sb.len - (last + 1);
+            memmove(sb.data, last + 1, keep);
+        } else {
+            keep = sb.len;
+        }
+        if (sb.cap - keep < GREP_BUF_SIZE / 2) sb_reserve(&sb, sb.cap);
+        if (interrupted && interactive) break;
+    }
+    free(sb.data);
+    return count;
+}
+
+// Inputs searched in parallel each get their own output buffer, and each
+// worker its own copy of the grep_t, whose DFA cache and string hits
+// change as it searches
+typedef struct {
+    grep_t *g;
+    grep_t *copies[FILE_POOL_MAX_THREADS];
+    char **files;
+    long *counts;               // selected lines, or -1
+    int *errs;
+    strbuf_t *outs;             // NULL when searching one input at a time
+    char *binary;               // a binary input had a selected line
+} grep_job_t;
+
+void grep_job(void *ctx, int k, int worker) {
+    grep_job_t *job = ctx;
+    grep_t *g = job->g;
+    if (job->outs) {
+        if (!job->copies[worker]) {
+            grep_t *c = malloc(sizeof(grep_t));
+            *c = *g;
+            if (c->strs) c->hits = malloc(c->nstrs * sizeof(char *));
+            else rx_cache_init(&c->rx);
+            job->copies[worker] = c;
+        }
+        g = job->copies[worker];
+        g->out = &job->outs[k];
+    }
+    const char *name = job->files[k];
+    int fd = STDIN_FILENO;
+    if (strcmp(name, "-") == 0) name = "(standard input)";
+    else fd = open(name, O_RDONLY | O_CLOEXEC);
+    job->counts[k] = fd < 0 ? -1 : grep_fd(g, fd, name);
+    if (job->counts[k] < 0) job->errs[k] = errno;
+    job->binary[k] = g->binary_hit;
+    if (fd > STDIN_FILENO) close(fd);
+}
+
+// Built-in: grep
+int byteshell_grep(char **args) {
+    grep_t g = {0};
+    int ere = 0, fixed = 0, whole = 0, with_names = -1, i = 1;
+    char **pats = NULL;
+    int npats = 0, pats_cap = 0;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 'e') {
+                const char *pat = o[1] ? o + 1 : args[++i];
+                if (!pat) {
+                    fprintf(stderr, "ByteShell: grep: -e: option requires an argument\n");
+                    free(pats);
+                    return 2;
+                }
+                GROW(pats, npats, pats_cap);
+                pats[npats++] = (char *)pat;
+                break;
+            }
+            switch (*o) {
+            case 'E': ere = 1, fixed = 0; break;
+            case 'F': fixed = 1; break;
+            case 'G': ere = fixed = 0; break;
+            case 'i': g.fold = 1; break;
+            case 'v': g.invert = 1; break;
+            case 'c': g.count = 1; break;
+            case 'l': g.list = 1; break;
+            case 'n': g.number = 1; break;
+            case 'q': g.quiet = 1; break;
+            case 's': g.silent = 1; break;
+            case 'x': whole = 1; break;
+            case 'h': with_names = 0; break;
+            case 'H': with_names = 1; break;
+            default:
+                // -w, -o, -r, context lines and long options
+                free(pats);
+                return execute_command(args, 0);
+            }
+        }
+    }
+    // Only the C locale and UTF-8 ones are understood here
+    int ctype = locale_ctype();
+    if (ctype < 0) {
+        free(pats);
+        return execute_command(args, 0);
+    }
+    if (!npats) {
+        if (!args[i]) {
+            fprintf(stderr, "ByteShell: grep: usage: grep [-EFGHchilnqsvx] [-e pattern] pattern [file...]\n");
+            return 2;
+        }
+        GROW(pats, npats, pats_cap);
+        pats[npats++] = args[i++];
+    }
+
+    // Every line of every pattern is a pattern of its own. When all of
+    // them are plain strings no program is needed; otherwise a lone
+    // pattern's longest string picks the lines worth running it on
+    rx_parser_t ps = {&g.rx, NULL, NULL, ere, g.fold, 0, NULL, ctype == 0};
+    rx_node_t *all = NULL;
+    strbuf_t run = {0}, best = {0};
+    int nlines = 0, plain = !whole, strs_cap = 0;
+    for (int k = 0; k < npats && !ps.error; k++) {
+        for (const char *p = pats[k];; p++) {
+            const char *nl = strchr(p, '\n');
+            size_t len = nl ? (size_t)(nl - p) : strlen(p);
+            ps.p = p;
+            ps.end = p + len;
+            rx_node_t *n = fixed ? rx_literal(&ps, p, len) : rx_parse_alt(&ps, 0);
+            if (!ps.error && ps.p != ps.end) rx_error(&ps, "unmatched ) or \\)");
+            if (ps.error) break;
+            run.len = best.len = 0;
+            int literal = rx_strings(&g.rx, n, g.fold, &run, &best);
+            if (ctype == 1 && (g.fold || !literal)) {
+                // Outside a literal string the parser sees bytes, not
+                // characters, and -i folds only ASCII
+                for (size_t k = 0; k < len; k++) {
+                    if ((unsigned char)p[k] >= 0x80) ps.error = 2;
+                }
+                if (ps.error) break;
+            }
+            if (literal && plain) {
+                GROW(g.strs, g.nstrs, strs_cap);
+                g.strs[g.nstrs++] = strndup(best.data ? best.data : "", best.len);
+            } else {
+                plain = 0;
+            }
+            if (whole) {
+                rx_node_t *eol = rx_node(&g.rx, RXN_CAT, n, rx_node(&g.rx, RXN_EOL, NULL, NULL));
+                n = rx_node(&g.rx, RXN_CAT, rx_node(&g.rx, RXN_BOL, NULL, NULL), eol);
+            }
+            all = all ? rx_node(&g.rx, RXN_ALT, all, n) : n;
+            nlines++;
+            if (!nl) break;
+            p = nl;
+        }
+    }
+    free(run.data);
+    if (!ps.error && !plain && rx_compile(&g.rx, all) < 0) ps.error = 2;
+    if (ps.error) {
+        for (int k = 0; k < g.nstrs; k++) free(g.strs[k]);
+        free(g.strs);
+        free(best.data);
+        free(pats);
+        rx_free(&g.rx);
+        if (ps.error == 2) return execute_command(args, 0);
+        fprintf(stderr, "ByteShell: grep: %s\n", ps.why);
+        return 2;
+    }
+    if (plain) {
+        g.lens = malloc(g.nstrs * sizeof(size_t));
+        g.hits = malloc(g.nstrs * sizeof(char *));
+        for (int k = 0; k < g.nstrs; k++) g.lens[k] = strlen(g.strs[k]);
+    } else {
+        for (int k = 0; k < g.nstrs; k++) free(g.strs[k]);
+        free(g.strs);
+        g.strs = NULL;
+        g.nstrs = 0;
+        if (nlines == 1 && best.len) {
+            g.req = best.data;
+            g.reqlen = best.len;
+        }
+    }
+
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[i] ? args + i : stdin_only;
+    int nfiles = 0, status = 1, errors = 0;
+    while (files[nfiles]) nfiles++;
+    g.names = with_names >= 0 ? with_names : nfiles > 1;
+    // Several files are searched at once unless -q can stop at the first
+    // match, or one of them is standard input, whose output should not wait
+    int parallel = nfiles > 1 && !g.quiet;
+    for (int k = 0; k < nfiles; k++) {
+        if (strcmp(files[k], "-") == 0) parallel = 0;
+    }
+    grep_job_t job = {&g, {0}, files, calloc(nfiles, sizeof(long)), calloc(nfiles, sizeof(int)),
+                      parallel ? calloc(nfiles, sizeof(strbuf_t)) : NULL, calloc(nfiles, 1)};
+    file_pool_t pool;
+    fflush(stdout);
+    file_pool_start(&pool, nfiles, parallel ? FILE_POOL_MAX_THREADS : 1, grep_job, &job);
+    for (int k = 0; k < nfiles && !(g.quiet && status == 0); k++) {
+        const char *name = files[k];
+        if (strcmp(name, "-") == 0) {
+            read_sync();
+            name = "(standard input)";
+        }
+        file_pool_wait(&pool, k);
+        long n = job.counts[k];
+        if (job.outs) fwrite(job.outs[k].data, 1, job.outs[k].len, stdout);
+        if (job.binary[k]) {
+            fflush(stdout);
+            fprintf(stderr, "ByteShell: grep: %s: binary file matches\n", name);
+        }
+        if (n < 0) {
+            if (!g.silent) fprintf(stderr, "ByteShell: grep: %s: %s\n", name, strerror(job.errs[k]));
+            errors = 1;
+            continue;
+        }
+        if (n > 0) status = 0;
+        if (g.count && !g.quiet) {
+            if (g.names) printf("%s:", name);
+            printf("%ld\n", n);
+        }
+        if (g.list && n > 0 && !g.quiet) printf("%s\n", name);
+        if (interrupted && interactive) break;
+    }
+    file_pool_finish(&pool);
+    for (int w = 0; w < FILE_POOL_MAX_THREADS; w++) {
+        if (!job.copies[w]) continue;
+        if (g.strs) free(job.copies[w]->hits);
+        else rx_cache_free(&job.copies[w]->rx);
+        free(job.copies[w]);
+    }
+    for (int k = 0; job.outs && k < nfiles; k++) free(job.outs[k].data);
+    free(job.outs);
+    free(job.counts);
+    free(job.errs);
+    free(job.binary);
+    for (int k = 0; k < g.nstrs; k++) free(g.strs[k]);
+    free(g.strs);
+    free(g.lens);
+    free(g.hits);
+    free(best.data);
+    free(pats);
+    rx_free(&g.rx);
+    if (interrupted && interactive) return 130;
+    return errors && !(g.quiet && status == 0) ? 2 : status;
+}
+
+// sort: lines are read into one buffer until it and their records reach
+// the memory budget (-S, a quarter of RAM by default). Input that fits is
+// sorted and written straight out; otherwise each full buffer is sorted
+// into a run in a temporary file and the runs are merged, SORT_MERGE_WAY
+// at a time. A buffer is merge-sorted on every CPU: a share per thread,
+// then rounds of pairwise merges, each merge split between the threads.
+// Records carry 16 bytes of their first key, or for -n a number that
+// orders the same way, so most comparisons never look at the line; runs
+// of records that tie on them are sorted again on the next 16 bytes
+#define SORT_MIN_BUDGET (1 << 20)
+#define SORT_MAX_THREADS 16
+#define SORT_PARALLEL_MIN 16384     // fewer lines than this sort on one thread
+#define SORT_MERGE_WAY 16
+#define SORT_READ_SIZE (128 << 10)
+#define SORT_RUN_BUF (256 << 10)
+#define SORT_OUT_BUF (64 << 10)
+#define SORT_BLANK(c) ((c) == ' ' || (c) == '\t')
+#define SORT_FULL SIZE_MAX          // compare records in full, not by prefix
+
+typedef struct {
+    size_t sword, schar;        // first field and character, from 0
+    size_t eword, echar;        // last field, and its last character or 0
+                                // for all of it; eword SIZE_MAX: to the end
+    int numeric, fold, reverse, sblanks, eblanks;
+} sort_key_t;
+
+typedef struct {
+    const char *line;
+    size_t len;
+    const char *kbeg, *kend;    // the first key
+    uint64_t prefix[2];         // orders as the first key does, or ties
+} sort_rec_t;
+
+typedef struct {
+    sort_key_t *keys;
+    int nkeys;
+    int tab;                    // -t, or -1 to split fields at blanks
+    int eol;
+    int unique, reverse;
+    int last_resort;            // compare whole lines when the keys tie
+    size_t skip;                // bytes every first key in a batch starts
+                                // with, left out of the prefixes
+    int reprefix;               // prefixes are compared again once sorted
+    int threads;
+    size_t budget;
+    const char *tmpdir;
+    sort_rec_t *recs, *tmp;
+    size_t recs_cap;
+    strbuf_t obuf;
+    int werr;                   // errno of the first failed write
+} sort_t;
+
+typedef struct {
+    sort_t *s;
+    sort_rec_t *src, *dst;
+    size_t lo, mid, hi;         // a share to sort, or two sorted halves
+    size_t k0, k1;              // the part of their merge to write
+    size_t common;              // bytes the share's first keys start with
+} sort_task_t;
+
+typedef struct {
+    sort_task_t *tasks;
+    size_t n, next;
+    void (*fn)(sort_task_t *);
+} sort_pool_t;
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t at, len, cap;
+    sort_rec_t rec;             // the line at the head of the run
+} sort_run_t;
+
+typedef struct {
+    int neg;
+    const char *ip, *fp;        // integer digits without leading zeros and
+    size_t in, fn;              // decimals without trailing ones
+} sort_num_t;
+
+// Start of a key in a line, as POSIX places it
+const char* sort_key_begin(const sort_t *s, const sort_key_t *k, const char *p, const char *lim) {
+    for (size_t w = k->sword; p < lim && w > 0; w--) {
+        if (s->tab >= 0) {
+            while (p < lim && *p != (char)s->tab) p++;
+            if (p < lim) p++;
+        } else {
+            while (p < lim && SORT_BLANK(*p)) p++;
+            while (p < lim && !SORT_BLANK(*p)) p++;
+        }
+    }
+    if (k->sblanks) {
+        while (p < lim && SORT_BLANK(*p)) p++;
+    }
+    return (size_t)(lim - p) > k->schar ? p + k->schar : lim;
+}
+
+// End of a key in a line
+const char* sort_key_end(const sort_t *s, const sort_key_t *k, const char *p, const char *lim) {
+    if (k->eword == SIZE_MAX) return lim;
+    for (size_t w = k->eword + !k->echar; p < lim && w > 0; w--) {
+        if (s->tab >= 0) {
+            while (p < lim && *p != (char)s->tab) p++;
+            if (p < lim && (w > 1 || k->echar)) p++;
+        } else {
+            while (p < lim && SORT_BLANK(*p)) p++;
+            while (p < lim && !SORT_BLANK(*p)) p++;
+        }
+    }
+    if (k->echar) {
+        if (k->eblanks) {
+            while (p < lim && SORT_BLANK(*p)) p++;
+        }
+        p = (size_t)(lim - p) > k->echar ? p + k->echar : lim;
+    }
+    return p;
+}
+
+// Parse a number as -n reads it: blanks, a minus sign, digits and decimals
+void sort_num_parse(const char *p, const char *e, sort_num_t *n) {
+    while (p < e && SORT_BLANK(*p)) p++;
+    n->neg = p < e && *p == '-';
+    p += n->neg;
+    while (p < e && *p == '0') p++;
+    for (n->ip = p; p < e && isdigit((unsigned char)*p); p++);
+    n->in = p - n->ip;
+    n->fp = p;
+    n->fn = 0;
+    if (p < e && *p == '.') {
+        for (n->fp = ++p; p < e && isdigit((unsigned char)*p); p++);
+        n->fn = p - n->fp;
+        while (n->fn && n->fp[n->fn - 1] == '0') n->fn--;
+    }
+    if (!n->in && !n->fn) n->neg = 0;   // -0 is 0
+}
+
+int sort_num_cmp(const char *ab, const char *ae, const char *bb, const char *be) {
+    sort_num_t a, b;
+    sort_num_parse(ab, ae, &a);
+    sort_num_parse(bb, be, &b);
+    if (a.neg != b.neg) return a.neg ? -1 : 1;
+    int d = a.in != b.in ? (a.in < b.in ? -1 : 1) : memcmp(a.ip, b.ip, a.in);
+    if (!d) {
+        d = memcmp(a.fp, b.fp, a.fn < b.fn ? a.fn : b.fn);
+        if (!d && a.fn != b.fn) d = a.fn < b.fn ? -1 : 1;
+    }
+    return a.neg ? -d : d;
+}
+
+// The sign, the count of integer digits, the first 11 digits and a last
+// bit set if any follow, which order numbers as sort_num_cmp does; when
+// two tie with that bit clear they are equal
+uint64_t sort_num_prefix(const char *p, const char *e) {
+    sort_num_t n;
+    sort_num_parse(p, e, &n);
+    uint64_t v = (uint64_t)0x7fff << 48 | 1;
+    if (n.in < 0x7fff) {
+        v = 0;
+        for (size_t k = 0; k < 11; k++) {
+            int d = k < n.in ? n.ip[k] - '0' : k - n.in < n.fn ? n.fp[k - n.in] - '0' : 0;
+            v = v << 4 | d;
+        }
+        v = (uint64_t)n.in << 48 | v << 4 | (n.in + n.fn > 11);
+    }
+    v |= (uint64_t)1 << 63;
+    return n.neg ? ~v : v;
+}
+
+uint64_t sort_bytes_prefix(const char *p, const char *e, int fold) {
+    uint64_t v = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (e - p >= 8 && !fold) {
+        memcpy(&v, p, 8);
+        return __builtin_bswap64(v);
+    }
+#endif
+    for (int k = 0; k < 8; k++) {
+        unsigned char c = p + k < e ? (unsigned char)p[k] : 0;
+        v = v << 8 | (fold ? toupper(c) : c);
+    }
+    return v;
+}
+
+int sort_key_cmp(const sort_key_t *k, const char *ab, const char *ae, const char *bb, const char *be) {
+    if (k->numeric) return sort_num_cmp(ab, ae, bb, be);
+    size_t an = ae - ab, bn = be - bb, m = an < bn ? an : bn;
+    int d = 0;
+    if (k->fold) {
+        for (size_t i = 0; i < m && !d; i++) d = toupper((unsigned char)ab[i]) - toupper((unsigned char)bb[i]);
+    } else {
+        d = memcmp(ab, bb, m);
+    }
+    return d ? d : an < bn ? -1 : an > bn;
+}
+
+// Find the first key of a record
+void sort_rec_key(const sort_t *s, sort_rec_t *r) {
+    r->kbeg = sort_key_begin(s, s->keys, r->line, r->line + r->len);
+    r->kend = sort_key_end(s, s->keys, r->line, r->line + r->len);
+    if (r->kend < r->kbeg) r->kend = r->kbeg;
+}
+
+// Take a record's prefix from depth bytes into its first key
+void sort_rec_prefix(const sort_t *s, sort_rec_t *r, size_t depth) {
+    const sort_key_t *k = s->keys;
+    const char *p = r->kbeg + depth;
+    if (k->numeric) {
+        r->prefix[0] = sort_num_prefix(r->kbeg, r->kend);
+        r->prefix[1] = 0;
+    } else {
+        r->prefix[0] = sort_bytes_prefix(p, r->kend, k->fold);
+        r->prefix[1] = sort_bytes_prefix(r->kend - p > 8 ? p + 8 : r->kend, r->kend, k->fold);
+    }
+}
+
+void sort_rec_fill(const sort_t *s, sort_rec_t *r) {
+    sort_rec_key(s, r);
+    sort_rec_prefix(s, r, s->skip);
+}
+
+int sort_compare(const sort_t *s, const sort_rec_t *a, const sort_rec_t *b) {
+    const sort_key_t *k = s->keys;
+    int d = 0;
+    if (a->prefix[0] != b->prefix[0]) {
+        d = a->prefix[0] < b->prefix[0] ? -1 : 1;
+        return k->reverse ? -d : d;
+    }
+    if (a->prefix[1] != b->prefix[1]) {
+        d = a->prefix[1] < b->prefix[1] ? -1 : 1;
+        return k->reverse ? -d : d;
+    }
+    // Numbers whose prefixes hold all their digits are equal already; the
+    // complement of a negative one flips that bit along with the sign
+    if (!k->numeric || !((a->prefix[0] >> 63 ^ a->prefix[0]) & 1)) d = sort_key_cmp(k, a->kbeg, a->kend, b->kbeg, b->kend);
+    for (int i = 1; !d && i < s->nkeys; i++) {
+        k = &s->keys[i];
+        const char *ab = sort_key_begin(s, k, a->line, a->line + a->len);
+        const char *ae = sort_key_end(s, k, a->line, a->line + a->len);
+        const char *bb = sort_key_begin(s, k, b->line, b->line + b->len);
+        const char *be = sort_key_end(s, k, b->line, b->line + b->len);
+        d = sort_key_cmp(k, ab, ae < ab ? ab : ae, bb, be < bb ? bb : be);
+    }
+    if (d) return k->reverse ? -d : d;
+    if (!s->last_resort) return 0;
+    d = memcmp(a->line, b->line, a->len < b->len ? a->len : b->len);
+    if (!d) d = a->len < b->len ? -1 : a->len > b->len;
+    return s->reverse ? -d : d;
+}
+
+// Order two records by their prefixes taken at depth and, when those tie
+// on the last bytes of a key, by its length; the first key decides once
+// both have 16 bytes or more left
+int sort_prefix_cmp(const sort_t *s, const sort_rec_t *a, const sort_rec_t *b, size_t depth) {
+    int d;
+    if (a->prefix[0] != b->prefix[0]) {
+        d = a->prefix[0] < b->prefix[0] ? -1 : 1;
+    } else if (a->prefix[1] != b->prefix[1]) {
+        d = a->prefix[1] < b->prefix[1] ? -1 : 1;
+    } else {
+        size_t an = a->kend - a->kbeg - depth, bn = b->kend - b->kbeg - depth;
+        d = (an < 16 ? (int)an : 16) - (bn < 16 ? (int)bn : 16);
+    }
+    return s->keys->reverse ? -d : d;
+}
+
+// Stable merge sort, comparing whole records or, at a depth other than
+// SORT_FULL, only the prefixes; tmp holds n / 2 records
+void sort_msort(const sort_t *s, sort_rec_t *a, sort_rec_t *tmp, size_t n, size_t depth) {
+#define SORT_ORDER(x, y) (depth == SORT_FULL ? sort_compare(s, x, y) : sort_prefix_cmp(s, x, y, depth))
+    if (n <= 12) {
+        for (size_t i = 1; i < n; i++) {
+            sort_rec_t r = a[i];
+            size_t j = i;
+            for (; j > 0 && SORT_ORDER(&a[j - 1], &r) > 0; j--) a[j] = a[j - 1];
+            a[j] = r;
+        }
+        return;
+    }
+    size_t h = n / 2, i = 0, j = h, o = 0;
+    sort_msort(s, a, tmp, h, depth);
+    sort_msort(s, a + h, tmp, n - h, depth);
+    if (SORT_ORDER(&a[h - 1], &a[h]) <= 0) return;
+    memcpy(tmp, a, h * sizeof(sort_rec_t));
+    while (i < h && j < n) a[o++] = SORT_ORDER(&a[j], &tmp[i]) < 0 ? a[j++] : tmp[i++];
+    memcpy(a + o, tmp + i, (h - i) * sizeof(sort_rec_t));
+#undef SORT_ORDER
+}
+
+// Sort by a first key that is not a number 16 bytes at a time: by the
+// prefixes at depth, then each run that ties on them by the next 16
+// bytes, so lines that start alike are read once a level rather than at
+// every comparison. With s->reprefix the prefixes of runs that went
+// deeper are put back, once, at the top where depth is s->skip
+void sort_strings(const sort_t *s, sort_rec_t *a, sort_rec_t *tmp, size_t n, size_t depth) {
+    sort_msort(s, a, tmp, n, depth);
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && sort_prefix_cmp(s, &a[i], &a[j], depth) == 0; j++);
+        if (j - i < 2) continue;
+        if ((size_t)(a[i].kend - a[i].kbeg) - depth >= 16) {
+            for (size_t k = i; k < j; k++) sort_rec_prefix(s, &a[k], depth + 16);
+            sort_strings(s, a + i, tmp, j - i, depth + 16);
+            if (depth != s->skip || !s->reprefix) continue;
+            for (size_t k = i; k < j; k++) sort_rec_prefix(s, &a[k], depth);
+        } else if (s->nkeys > 1 || s->last_resort) {
+            // Equal first keys; the rest decide
+            sort_msort(s, a + i, tmp, j - i, SORT_FULL);
+        }
+    }
+}
+
+// Find the keys of a share of the records, and how much of the first
+// record's key they all start with
+void sort_key_task(sort_task_t *t) {
+    const sort_rec_t *first = &t->src[0];
+    int plain = !t->s->keys->numeric && !t->s->keys->fold;
+    for (size_t i = t->lo; i < t->hi; i++) {
+        sort_rec_t *r = &t->src[i];
+        sort_rec_key(t->s, r);
+        size_t n = r->kend - r->kbeg;
+        if (n < t->common) t->common = n;
+        if (plain && memcmp(r->kbeg, first->kbeg, t->common) != 0) {
+            for (n = 0; r->kbeg[n] == first->kbeg[n]; n++);
+            t->common = n;
+        }
+    }
+}
+
+void sort_share_task(sort_task_t *t) {
+    const sort_t *s = t->s;
+    for (size_t i = t->lo; i < t->hi; i++) sort_rec_prefix(s, &t->src[i], s->skip);
+    if (s->keys->numeric) sort_msort(s, t->src + t->lo, t->dst + t->lo, t->hi - t->lo, SORT_FULL);
+    else sort_strings(s, t->src + t->lo, t->dst + t->lo, t->hi - t->lo, s->skip);
+}
+
+// How many of a come before the k-th record of a and b merged, ties
+// going to a
+size_t sort_corank(const sort_t *s, const sort_rec_t *a, size_t an, const sort_rec_t *b, size_t bn, size_t k) {
+    size_t lo = k > bn ? k - bn : 0, hi = k < an ? k : an;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sort_compare(s, &a[mid], &b[k - mid - 1]) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Write records k0 to k1 of the merge of two sorted halves
+void sort_merge_task(sort_task_t *t) {
+    const sort_rec_t *a = t->src + t->lo, *b = t->src + t->mid;
+    size_t an = t->mid - t->lo, bn = t->hi - t->mid;
+    size_t i = sort_corank(t->s, a, an, b, bn, t->k0), ie = sort_corank(t->s, a, an, b, bn, t->k1);
+    size_t j = t->k0 - i, je = t->k1 - ie;
+    sort_rec_t *o = t->dst + t->lo + t->k0;
+    while (i < ie && j < je) *o++ = sort_compare(t->s, &b[j], &a[i]) < 0 ? b[j++] : a[i++];
+    memcpy(o, a + i, (ie - i) * sizeof(sort_rec_t));
+    memcpy(o + (ie - i), b + j, (je - j) * sizeof(sort_rec_t));
+}
+
+void* sort_worker(void *arg) {
+    sort_pool_t *pool = arg;
+    size_t t;
+    while ((t = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->n) pool->fn(&pool->tasks[t]);
+    return NULL;
+}
+
+// Run tasks on up to s->threads threads, this one included
+void sort_run_tasks(sort_t *s, void (*fn)(sort_task_t *), sort_task_t *tasks, size_t n) {
+    sort_pool_t pool = {tasks, n, 0, fn};
+    pthread_t tids[SORT_MAX_THREADS];
+    int nt = 0;
+    while (nt + 1 < s->threads && (size_t)nt + 1 < n && pthread_create(&tids[nt], NULL, sort_worker, &pool) == 0) nt++;
+    sort_worker(&pool);
+    while (nt > 0) pthread_join(tids[--nt], NULL);
+}
+
+// Sort the first n records; returns s->recs or s->tmp, whichever ends up
+// holding them
+sort_rec_t* sort_records(sort_t *s, size_t n) {
+    sort_task_t tasks[2 * SORT_MAX_THREADS + 1];
+    size_t bounds[SORT_MAX_THREADS + 1];
+    int parts = n < SORT_PARALLEL_MIN ? 1 : s->threads;
+    for (int p = 0; p <= parts; p++) bounds[p] = n * p / parts;
+    sort_rec_key(s, &s->recs[0]);
+    for (int p = 0; p < parts; p++) {
+        tasks[p] = (sort_task_t){s, s->recs, s->tmp, bounds[p], 0, bounds[p + 1], 0, 0, s->recs[0].kend - s->recs[0].kbeg};
+    }
+    sort_run_tasks(s, sort_key_task, tasks, parts);
+    // Log lines that all start with the same date would tie on prefixes
+    // taken from the start of the key
+    s->skip = tasks[0].common;
+    for (int p = 1; p < parts; p++) {
+        if (tasks[p].common < s->skip) s->skip = tasks[p].common;
+    }
+    if (s->keys->numeric || s->keys->fold) s->skip = 0;
+    s->reprefix = parts > 1 || s->unique;
+    sort_run_tasks(s, sort_share_task, tasks, parts);
+    s->skip = 0;
+
+    sort_rec_t *src = s->recs, *dst = s->tmp;
+    while (parts > 1) {
+        int pairs = parts / 2, split = (s->threads + pairs - 1) / pairs;
+        size_t nt = 0;
+        for (int p = 0; p + 1 < parts; p += 2) {
+            size_t lo = bounds[p], mid = bounds[p + 1], hi = bounds[p + 2];
+            for (int q = 0; q < split; q++) {
+                tasks[nt++] = (sort_task_t){s, src, dst, lo, mid, hi, (hi - lo) * q / split, (hi - lo) * (q + 1) / split, 0};
+            }
+        }
+        if (parts % 2) {
+            // The odd share out is merged with nothing
+            size_t lo = bounds[parts - 1], hi = bounds[parts];
+            tasks[nt++] = (sort_task_t){s, src, dst, lo, hi, hi, 0, hi - lo, 0};
+        }
+        sort_run_tasks(s, sort_merge_task, tasks, nt);
+        for (int p = 0; p < parts; p += 2) bounds[p / 2] = bounds[p];
+        parts = (parts + 1) / 2;
+        bounds[parts] = n;
+        sort_rec_t *t = src;
+        src = dst;
+        dst = t;
+    }
+    return src;
+}
+
+// Write out the buffered lines
+void sort_flush(sort_t *s, int fd) {
+    if (s->obuf.len && !s->werr && write_all(fd, s->obuf.data, s->obuf.len) < 0) s->werr = errno;
+    s->obuf.len = 0;
+}
+
+void sort_put(sort_t *s, int fd, const char *p, size_t n) {
+    sb_append(&s->obuf, p, n);
+    sb_putc(&s->obuf, s->eol);
+    if (s->obuf.len >= SORT_OUT_BUF) sort_flush(s, fd);
+}
+
+// Sort the complete lines at the front of text and write them to fd,
+// keeping what follows the last one for the next batch
+void sort_batch(sort_t *s, strbuf_t *text, size_t nlines, int fd) {
+    if (!nlines) return;
+    if (nlines > s->recs_cap) {
+        free(s->recs);
+        free(s->tmp);
+        s->recs_cap = nlines;
+        s->recs = malloc(nlines * sizeof(sort_rec_t));
+        s->tmp = malloc(nlines * sizeof(sort_rec_t));
+        if (!s->recs || !s->tmp) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    char *p = text->data, *end = text->data + text->len;
+    for (size_t i = 0; i < nlines; i++) {
+        char *q = memchr(p, s->eol, end - p);
+        s->recs[i].line = p;
+        s->recs[i].len = q - p;
+        p = q + 1;
+    }
+    sort_rec_t *r = sort_records(s, nlines);
+    for (size_t i = 0; i < nlines; i++) {
+        if (s->unique && i && sort_compare(s, &r[i - 1], &r[i]) == 0) continue;
+        sort_put(s, fd, r[i].line, r[i].len);
+    }
+    sort_flush(s, fd);
+    text->len = end - p;
+    memmove(text->data, p, text->len);
+}
+
+// An unnamed temporary file for a run
+int sort_tempfile(sort_t *s) {
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(s->tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (fd < 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/byteshell-sortXXXXXX", s->tmpdir);
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd >= 0) unlink(path);
+    }
+    return fd;
+}
+
+// Move a run on to its next line; returns 0 at its end, or -1 if it
+// could not be read
+int sort_run_next(sort_t *s, sort_run_t *r) {
+    char *q;
+    while (!(q = memchr(r->buf + r->at, s->eol, r->len - r->at))) {
+        r->len -= r->at;
+        memmove(r->buf, r->buf + r->at, r->len);
+        r->at = 0;
+        if (r->len == r->cap) {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n;   // runs end with a whole line
+        r->len += n;
+    }
+    r->rec.line = r->buf + r->at;
+    r->rec.len = q - r->rec.line;
+    r->at += r->rec.len + 1;
+    sort_rec_fill(s, &r->rec);
+    return 1;
+}
+
+// Whether run a's line goes before run b's; ties keep the input order
+int sort_run_before(const sort_t *s, const sort_run_t *runs, int a, int b) {
+    int d = sort_compare(s, &runs[a].rec, &runs[b].rec);
+    return d < 0 || (d == 0 && a < b);
+}
+
+void sort_heap_down(const sort_t *s, const sort_run_t *runs, int *heap, int n, int i) {
+    while (1) {
+        int c = 2 * i + 1;
+        if (c >= n) return;
+        if (c + 1 < n && sort_run_before(s, runs, heap[c + 1], heap[c])) c++;
+        if (!sort_run_before(s, runs, heap[c], heap[i])) return;
+        int t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+        i = c;
+    }
+}
+
+// Merge sorted runs into fd; returns 0, or the errno of a failed read
+int sort_merge(sort_t *s, int *fds, int n, int fd) {
+    sort_run_t *runs = calloc(n, sizeof(sort_run_t));
+    int *heap = malloc(n * sizeof(int)), nheap = 0, err = 0;
+    strbuf_t last = {0};
+    sort_rec_t prev;
+    for (int k = 0; k < n; k++) {
+        runs[k].fd = fds[k];
+        runs[k].cap = SORT_RUN_BUF;
+        runs[k].buf = malloc(SORT_RUN_BUF);
+        int got = sort_run_next(s, &runs[k]);
+        if (got < 0) err = errno;
+        if (got > 0) heap[nheap++] = k;
+    }
+    for (int i = nheap / 2 - 1; i >= 0; i--) sort_heap_down(s, runs, heap, nheap, i);
+    while (nheap > 0 && !err && !(interrupted && interactive)) {
+        sort_run_t *r = &runs[heap[0]];
+        if (!s->unique || !last.data || sort_compare(s, &prev, &r->rec) != 0) {
+            sort_put(s, fd, r->rec.line, r->rec.len);
+            if (s->unique) {
+                // Keep a copy, the run's buffer moves on
+                last.len = 0;
+                sb_append(&last, r->rec.line, r->rec.len);
+                prev.line = last.data;
+                prev.len = last.len;
+                sort_rec_fill(s, &prev);
+            }
+        }
+        int got = sort_run_next(s, r);
+        if (got < 0) err = errno;
+        if (got <= 0) heap[0] = heap[--nheap];
+        sort_heap_down(s, runs, heap, nheap, 0);
+    }
+    sort_flush(s, fd);
+    for (int k = 0; k < n; k++) free(runs[k].buf);
+    free(runs);
+    free(heap);
+    free(last.data);
+    return err;
+}
+
+// Parse the letters after a -k position; returns where they end, or NULL
+// for orderings left to the system's sort
+const char* sort_key_opts(const char *p, sort_key_t *k, int end) {
+    for (;; p++) {
+        if (*p == 'b') {
+            if (end) k->eblanks = 1;
+            else k->sblanks = 1;
+        } else if (*p == 'f') {
+            k->fold = 1;
+        } else if (*p == 'n') {
+            k->numeric = 1;
+        } else if (*p == 'r') {
+            k->reverse = 1;
+        } else if (*p && strchr("dghiMRV", *p)) {
+            return NULL;
+        } else {
+            return p;
+        }
+    }
+}
+
+// Parse a -k POS1[,POS2] where each is F[.C][OPTS]; returns -1 if it is
+// malformed, -2 if it asks for an ordering left to the system's sort
+int sort_parse_key(const char *p, sort_key_t *k) {
+    char *end;
+    memset(k, 0, sizeof(*k));
+    k->eword = SIZE_MAX;
+    if (!isdigit((unsigned char)*p) || (k->sword = strtoul(p, &end, 10)) == 0) return -1;
+    k->sword--;
+    p = end;
+    if (*p == '.') {
+        if (!isdigit((unsigned char)p[1]) || (k->schar = strtoul(p + 1, &end, 10)) == 0) return -1;
+        k->schar--;
+        p = end;
+    }
+    if (!(p = sort_key_opts(p, k, 0))) return -2;
+    if (*p == ',') {
+        if (!isdigit((unsigned char)p[1]) || (k->eword = strtoul(p + 1, &end, 10)) == 0) return -1;
+        k->eword--;
+        p = end;
+        if (*p == '.') {
+            if (!isdigit((unsigned char)p[1])) return -1;
+            k->echar = strtoul(p + 1, &end, 10);
+            p = end;
+        }
+        if (!(p = sort_key_opts(p, k, 1))) return -2;
+    }
+    return *p ? -1 : 0;
+}
+
+// Parse a -S size: kilobytes, or with a suffix b, K, M, G, T, or % of
+// physical memory; returns 0 if it is not one
+size_t sort_parse_size(const char *p) {
+    const char *units = "bkmgt";
+    char *end;
+    if (!isdigit((unsigned char)*p)) return 0;
+    errno = 0;
+    unsigned long long v = strtoull(p, &end, 10);
+    if (errno) return 0;
+    if (*end == '%' && !end[1]) {
+        return (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) * v / 100;
+    }
+    const char *u = *end ? strchr(units, tolower((unsigned char)*end)) : units + 1;
+    if (!u || (*end && end[1])) return 0;
+    size_t unit = (size_t)1 << (10 * (u - units));
+    return v > SIZE_MAX / unit ? SIZE_MAX : v * unit;
+}
+
+// Whether the locale collates by bytes, as the builtin sorts
+int sort_c_locale(void) {
+    const char *names[] = {"LC_ALL", "LC_COLLATE", "LANG"};
+    for (int k = 0; k < 3; k++) {
+        const char *v = var_getenv(names[k]);
+        if (v && *v) return strcmp(v, "C") == 0 || strcmp(v, "POSIX") == 0 || strncmp(v, "C.", 2) == 0;
+    }
+    return 1;
+}
+
+// Built-in: sort
+int byteshell_sort(char **args) {
+    sort_t s = {0};
+    sort_key_t global = {0};
+    int i = 1, status = 0, stable = 0, keys_cap = 0;
+    const char *outname = NULL;
+    if (!sort_c_locale()) return execute_command(args, 0);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    s.threads = ncpu < 1 ? 1 : ncpu > SORT_MAX_THREADS ? SORT_MAX_THREADS : ncpu;
+    s.tab = -1;
+    s.eol = '\n';
+    s.tmpdir = var_getenv("TMPDIR");
+    if (!s.tmpdir || !*s.tmpdir) s.tmpdir = "/tmp";
+    for (; args[i] && args[i][0] == '-' && args[i][1] && !status; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strncmp(args[i], "--parallel=", 11) == 0) {
+            int n = atoi(args[i] + 11);
+            if (n < 1) {
+                fprintf(stderr, "ByteShell: sort: invalid number of threads: %s\n", args[i] + 11);
+                status = 2;
+            }
+            s.threads = n > SORT_MAX_THREADS ? SORT_MAX_THREADS : n;
+            continue;
+        }
+        for (const char *o = args[i] + 1; *o && !status; o++) {
+            if (strchr("koStT", *o)) {
+                const char *arg = o[1] ? o + 1 : args[++i];
+                if (!arg) {
+                    fprintf(stderr, "ByteShell: sort: -%c: option requires an argument\n", *o);
+                    status = 2;
+                    break;
+                }
+                if (*o == 'k') {
+                    GROW(s.keys, s.nkeys, keys_cap);
+                    int r = sort_parse_key(arg, &s.keys[s.nkeys++]);
+                    if (r == -2) {
+                        free(s.keys);
+                        return execute_command(args, 0);
+                    }
+                    if (r < 0) {
+                        fprintf(stderr, "ByteShell: sort: invalid key: %s\n", arg);
+                        status = 2;
+                    }
+                } else if (*o == 'o') {
+                    outname = arg;
+                } else if (*o == 'S') {
+                    if (!(s.budget = sort_parse_size(arg))) {
+                        fprintf(stderr, "ByteShell: sort: invalid size: %s\n", arg);
+                        status = 2;
+                    }
+                } else if (*o == 't') {
+                    if (strcmp(arg, "\\0") == 0) {
+                        s.tab = '\0';
+                    } else if (!arg[0] || arg[1]) {
+                        fprintf(stderr, "ByteShell: sort: -t: separator must be one character\n");
+                        status = 2;
+                    } else {
+                        s.tab = (unsigned char)arg[0];
+                    }
+                } else {
+                    s.tmpdir = arg;
+                }
+                break;
+            }
+            switch (*o) {
+            case 'b': global.sblanks = global.eblanks = 1; break;
+            case 'f': global.fold = 1; break;
+            case 'n': global.numeric = 1; break;
+            case 'r': global.reverse = 1; break;
+            case 's': stable = 1; break;
+            case 'u': s.unique = 1; break;
+            case 'z': s.eol = '\0'; break;
+            default:
+                // -c, -m, the other orderings and long options
+                free(s.keys);
+                return execute_command(args, 0);
+            }
+        }
+    }
+    if (status) {
+        free(s.keys);
+        return status;
+    }
+
+    // Keys without orderings of their own take the global ones; with no
+    // keys the whole line is the key. When keys tie, lines are compared
+    // as a whole unless that could only repeat the comparison
+    int has_keys = s.nkeys > 0;
+    for (int k = 0; k < s.nkeys; k++) {
+        sort_key_t *key = &s.keys[k];
+        if (key->numeric || key->fold || key->reverse || key->sblanks || key->eblanks) continue;
+        key->numeric = global.numeric;
+        key->fold = global.fold;
+        key->reverse = global.reverse;
+        key->sblanks = global.sblanks;
+        key->eblanks = global.eblanks;
+    }
+    if (!has_keys) {
+        global.eword = SIZE_MAX;
+        GROW(s.keys, s.nkeys, keys_cap);
+        s.keys[s.nkeys++] = global;
+    }
+    s.reverse = global.reverse;
+    s.last_resort = !s.unique && !stable && (has_keys || global.numeric || global.fold || global.sblanks);
+    if (!s.budget) s.budget = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 4;
+    if (s.budget < SORT_MIN_BUDGET) s.budget = SORT_MIN_BUDGET;
+
+    // Read every input before writing, so -o may name one of them
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[i] ? args + i : stdin_only;
+    strbuf_t text = {0};
+    size_t nlines = 0, rec_cost = 2 * sizeof(sort_rec_t);
+    int *runs = NULL, nruns = 0, runs_cap = 0;
+    for (; *files && !status; files++) {
+        const char *name = *files;
+        int fd = STDIN_FILENO;
+        if (strcmp(name, "-") == 0) {
+            read_sync();
+        } else if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "ByteShell: sort: %s: %s\n", name, strerror(errno));
+            status = 2;
+            break;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        while (1) {
+            if (nlines && text.len + nlines * rec_cost >= s.budget) {
+                // Over budget: sort what is here into a run
+                GROW(runs, nruns, runs_cap);
+                if ((runs[nruns] = sort_tempfile(&s)) < 0) {
+                    fprintf(stderr, "ByteShell: sort: %s: %s\n", s.tmpdir, strerror(errno));
+                    status = 2;
+                    break;
+                }
+                sort_batch(&s, &text, nlines, runs[nruns++]);
+                nlines = 0;
+                if (s.werr) break;
+            }
+            sb_reserve(&text, SORT_READ_SIZE);
+            ssize_t n = read(fd, text.data + text.len, SORT_READ_SIZE);
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno == EINTR && !interrupted) continue;
+                fprintf(stderr, "ByteShell: sort: %s: %s\n", name, strerror(errno));
+                status = 2;
+                break;
+            }
+            const char *p = text.data + text.len, *e = p + n;
+            for (; (p = memchr(p, s.eol, e - p)); p++) nlines++;
+            text.len += n;
+            if (interrupted && interactive) break;
+        }
+        if (fd != STDIN_FILENO) close(fd);
+        if (text.len && text.data[text.len - 1] != s.eol) {
+            sb_putc(&text, s.eol);
+            nlines++;
+        }
+        if (s.werr || (interrupted && interactive)) break;
+    }
+
+    int out = STDOUT_FILENO, err = 0;
+    if (!status && nruns && nlines && !s.werr && !(interrupted && interactive)) {
+        GROW(runs, nruns, runs_cap);
+        if ((runs[nruns] = sort_tempfile(&s)) < 0) {
+            fprintf(stderr, "ByteShell: sort: %s: %s\n", s.tmpdir, strerror(errno));
+            status = 2;
+        } else {
+            sort_batch(&s, &text, nlines, runs[nruns++]);
+        }
+    }
+    if (!status && !s.werr && !(interrupted && interactive)) {
+        fflush(stdout);
+        if (outname && (out = open(outname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+            fprintf(stderr, "ByteShell: sort: %s: %s\n", outname, strerror(errno));
+            status = 2;
+        }
+    }
+    if (!status && !s.werr && !(interrupted && interactive)) {
+        if (!nruns) {
+            sort_batch(&s, &text, nlines, out);
+        } else {
+            for (int k = 0; k < nruns; k++) lseek(runs[k], 0, SEEK_SET);
+            while (nruns > SORT_MERGE_WAY && !err && !s.werr && !(interrupted && interactive)) {
+                // Too many to merge at once: merge them in groups
+                int merged = 0;
+                for (int k = 0; k < nruns && !err && !s.werr; k += SORT_MERGE_WAY) {
+                    int m = nruns - k < SORT_MERGE_WAY ? nruns - k : SORT_MERGE_WAY;
+                    int fd = runs[k];
+                    if (m > 1) {
+                        if ((fd = sort_tempfile(&s)) < 0) {
+                            err = errno;
+                            break;
+                        }
+                        err = sort_merge(&s, runs + k, m, fd);
+                        for (int j = k; j < k + m; j++) {
+                            close(runs[j]);
+                            runs[j] = -1;
+                        }
+                        lseek(fd, 0, SEEK_SET);
+                    }
+                    runs[k] = -1;
+                    runs[merged++] = fd;
+                }
+                if (!err && !s.werr) nruns = merged;
+            }
+            if (!err && !s.werr && !(interrupted && interactive)) err = sort_merge(&s, runs, nruns, out);
+        }
+        if (err) {
+            fprintf(stderr, "ByteShell: sort: temporary file: %s\n", strerror(err));
+            status = 2;
+        }
+    }
+    if (s.werr) {
+        if (s.werr != EPIPE) fprintf(stderr, "ByteShell: sort: write error: %s\n", strerror(s.werr));
+        status = 2;
+    }
+    if (out > STDOUT_FILENO) close(out);
+    for (int k = 0; k < nruns; k++) {
+        if (runs[k] >= 0) close(runs[k]);
+    }
+    free(runs);
+    free(text.data);
+    free(s.keys);
+    free(s.recs);
+    free(s.tmp);
+    free(s.obuf.data);
+    return interrupted && interactive ? 130 : status;
+}
+
+// Clean up history
+void cleanup_history() {
+    for (int i = 0; i < history_count; i++) {
+        free(history[i]);
+    }
+}
+
+// Read all of standard input for a non-interactive shell
+char* read_stdin(size_t *len) {
+    strbuf_t sb = {0};
+    ssize_t n;
+    sb_reserve(&sb, 4096);
+    while ((n = read(STDIN_FILENO, sb.data + sb.len, sb.cap - sb.len - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        sb.len += n;
+        sb_reserve(&sb, 4096);
+    }
+    sb.data[sb.len] = '\0';
+    *len = sb.len;
+    return sb.data;
+}
+
+// Interactive loop: read lines until a complete command is available, then run it
+void interactive_loop(void) {
+    strbuf_t text = {0};
+    char *input;
+
+    // Welcome message
+    printf("╔══════════════════════╗\n");
+    printf("║ByteShell v%s on Termux ║\n", BYTESHELL_VERSION);
+    printf("║                         ║\n");
+    printf("║                         ║\n");
+    printf("║                         ║\n");
+    printf("╚══════════════════════╝\n");
+    printf("Type 'help' for commands\n\n");
+    startup_mark("banner");
+    startup_report();
+
+    // Main loop
+    while (1) {
+        reap_jobs();
+        path_index_poll();
+        print_prompt();
+
+        // Read input with history navigation
+        input = read_input_with_history();
+
+        if (!input) {  // Ctrl+D
+            printf("\n");
+            break;
+        }
+
+        // Skip empty
+        if (strlen(input) == 0) {
+            continue;
+        }
+
+        // Keep reading while the input ends inside a construct
+        text.len = 0;
+        sb_append(&text, input, strlen(input));
+        chunk_t *ch;
+        int incomplete;
+        while (!(ch = compile_text(text.data, text.len, NULL, &incomplete)) && incomplete) {
+            printf("> ");
+            fflush(stdout);
+            input = read_input_with_history();
+            if (!input) break;
+            sb_putc(&text, '\n');
+            sb_append(&text, input, strlen(input));
+        }
+        sb_putc(&text, '\0');
+
+        // Add to history
+        add_to_history(text.data);
+        if (!ch) {
+            last_status = 2;
+            continue;
+        }
+
+        // Run with the terminal in its normal mode
+        restore_terminal();
+        interrupted = 0;
+        vm_exec(ch, 0);
+        chunk_unref(ch);
+        prefetch_after(text.data);
+        if (vm.unwind == UNWIND_INTR && interrupted) printf("\n");
+        vm.unwind = UNWIND_NONE;
+        interrupted = 0;
+    }
+    free(text.data);
+}
+
+// Compile a script into the cache without running it
+int precompile(const char *path) {
+    size_t len;
+    struct stat st;
+    int status = 0;
+    char *text = read_file(path, &len, &st);
+    if (!text) {
+        fprintf(stderr, "ByteShell: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    chunk_t *ch = cache_load(path, &st, text, len);
+    if (!ch) {
+        ch = compile_text(text, len, path, NULL);
+        if (!ch) {
+            status = 1;
+        } else if (cache_store(path, &st, text, len, ch) < 0) {
+            fprintf(stderr, "ByteShell: %s: cannot write compiled cache\n", path);
+            status = 1;
+        }
+    }
+    chunk_unref(ch);
+    free(text);
+    return status;
+}
+
+// Run a script or -c program and exit; its last external command replaces
+// the shell rather than forking a child and waiting for it
+void run_program(chunk_t *ch, int status) {
+    if (startup_report()) shell_exit(1);
+    if (!ch) shell_exit(status);
+    vm.exec_chunk = ch;
+    vm_exec(ch, 0);
+    vm.exec_chunk = NULL;
+    chunk_unref(ch);
+    shell_exit(last_status);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strncmp(argv[1], "--startup-profile", 17) == 0 &&
+        (argv[1][17] == '\0' || argv[1][17] == '=')) {
+        // byteshell --startup-profile[=budget_us] [args...]
+        clock_gettime(CLOCK_MONOTONIC, &startup_t0);
+        startup_profile = 1;
+        if (argv[1][17] == '=') {
+            char *end;
+            errno = 0;
+            startup_budget = strtol(argv[1] + 18, &end, 10);
+            if (!isdigit((unsigned char)argv[1][18]) || *end || errno) {
+                fprintf(stderr, "ByteShell: --startup-profile: %s: budget must be a number of microseconds\n",
+                        argv[1] + 18);
+                return 2;
+            }
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    shell_pid = getpid();
+    var_import_environ();
+    startup_mark("environ");
+
+    // Set up signal handler
+    signal(SIGINT, sigint_handler);
+    startup_mark("signals");
+
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0) {
+        // byteshell --compile script... prewarms the compiled-script cache
+        int status = 0;
+        for (int i = 2; i < argc; i++) {
+            if (precompile(argv[i]) != 0) status = 1;
+        }
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "--save-state") == 0) {
+        // byteshell --save-state runs ~/.byteshellrc and keeps the result
+        interactive = 1;
+        rc_load(1);
+        return last_status;
+    }
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        // byteshell -c 'commands' [name [args...]]
+        if (argc > 3) shell_name = argv[3];
+        if (argc > 4) posargs = posargs_make(argv + 4, argc - 4);
+        run_program(compile_text(argv[2], strlen(argv[2]), NULL, NULL), 2);
+    }
+    if (argc > 1) {
+        // byteshell script [args...]
+        int status;
+        shell_name = argv[1];
+        posargs = posargs_make(argv + 2, argc - 2);
+        chunk_t *ch = compile_file(argv[1], &status);
+        run_program(ch, status);
+    }
+    if (!isatty(STDIN_FILENO)) {
+        size_t len;
+        char *text = read_stdin(&len);
+        startup_mark("read");
+        chunk_t *ch = compile_text(text, len, NULL, NULL);
+        free(text);
+        run_program(ch, 2);
+    }
+
+    interactive = 1;
+    rc_load(0);
+    interactive_loop();
+
+    // Cleanup
+    restore_terminal();
+    cleanup_history();
+
+    return last_status;
+}